@@ -0,0 +1,98 @@
+#!/bin/sh
+# time quikr on synthetic data, run by make bench. The data is generated
+# deterministically into BENCH_DATA the first time and reused after that, and
+# the results are written to stdout as tab separated values. These size it:
+#
+#   BENCH_SIZES        reference sequences of each database (100 400 1600)
+#   BENCH_KMERS        kmers counting is timed at (6 7 8 9 10 11 12)
+#   BENCH_READS        reads in the sample (200000)
+#   BENCH_SAMPLES      samples multifasta_to_otu classifies (16)
+#   BENCH_SAMPLE_READS reads in each of them (20000)
+#   BENCH_JOBS         jobs quikr and multifasta_to_otu are timed with (1, 2,
+#                      4 and so on up to the number of CPUs)
+#   BENCH_REPETITIONS  times each benchmark is repeated (3)
+set -e
+
+BENCH_DATA=${BENCH_DATA:-bench_data}
+BENCH_SIZES=${BENCH_SIZES:-"100 400 1600"}
+BENCH_KMERS=${BENCH_KMERS:-"6 7 8 9 10 11 12"}
+BENCH_READS=${BENCH_READS:-200000}
+BENCH_SAMPLES=${BENCH_SAMPLES:-16}
+BENCH_SAMPLE_READS=${BENCH_SAMPLE_READS:-20000}
+BENCH_REPETITIONS=${BENCH_REPETITIONS:-3}
+
+if [ -z "$BENCH_JOBS" ]; then
+	cpus=$(getconf _NPROCESSORS_ONLN 2>/dev/null || echo 1)
+	BENCH_JOBS=1
+	jobs=2
+	while [ $jobs -le $cpus ]; do
+		BENCH_JOBS="$BENCH_JOBS $jobs"
+		jobs=$((jobs * 2))
+	done
+fi
+
+bench="./quikr_bench"
+n="-n $BENCH_REPETITIONS"
+
+mkdir -p "$BENCH_DATA/samples"
+
+# the databases, in each format, all at kmer 6
+largest=0
+for size in $BENCH_SIZES; do
+	reference="$BENCH_DATA/reference_$size"
+	if [ ! -f "$reference.fa" ]; then
+		echo "generating $reference" >&2
+		$bench reference -n $size -s $size -o "$reference.fa"
+		./quikr_train -i "$reference.fa" -k 6 -o "$reference.gz"
+		./quikr_train -i "$reference.fa" -k 6 -b -o "$reference.bin"
+		./quikr_train -i "$reference.fa" -k 6 -m -o "$reference.km"
+		./quikr_train -i "$reference.fa" -k 6 -S -o "$reference.sp"
+	fi
+	if [ $size -gt $largest ]; then
+		largest=$size
+	fi
+done
+database="$BENCH_DATA/reference_$largest"
+
+sample="$BENCH_DATA/sample_$BENCH_READS.fa"
+if [ ! -f "$sample" ]; then
+	echo "generating $sample" >&2
+	$bench sample -i "$database.fa" -n $BENCH_READS -o "$sample" -t "$sample.truth"
+fi
+
+i=0
+while [ $i -lt $BENCH_SAMPLES ]; do
+	file="$BENCH_DATA/samples/sample_${BENCH_SAMPLE_READS}_$i.fa"
+	if [ ! -f "$file" ]; then
+		$bench sample -i "$database.fa" -n $BENCH_SAMPLE_READS -s $((i + 2)) -o "$file"
+	fi
+	i=$((i + 1))
+done
+
+$bench header
+
+for kmer in $BENCH_KMERS; do
+	for jobs in $BENCH_JOBS; do
+		$bench count -i "$sample" -k $kmer -j $jobs $n
+	done
+done
+
+for size in $BENCH_SIZES; do
+	reference="$BENCH_DATA/reference_$size"
+	for format in gz bin km sp; do
+		$bench load -s "$reference.$format" -k 6 $n
+	done
+	for format in bin km sp; do
+		$bench classify -s "$reference.$format" -i "$sample" -k 6 $n
+	done
+done
+
+for jobs in $BENCH_JOBS; do
+	$bench exec -l quikr -k 6 -d $largest -r $BENCH_READS -j $jobs $n -- \
+		./quikr -i "$sample" -s "$database.bin" -k 6 -j $jobs -o /dev/null
+done
+
+for jobs in $BENCH_JOBS; do
+	$bench exec -l multifasta_to_otu -k 6 -d $largest -r $((BENCH_SAMPLES * BENCH_SAMPLE_READS)) -j $jobs $n -- \
+		./multifasta_to_otu -i "$BENCH_DATA/samples" -s "$database.bin" -k 6 -j $jobs -o /dev/null
+done
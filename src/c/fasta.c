@@ -0,0 +1,453 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "fasta.h"
+
+#define FASTA_INCOMPLETE 2
+#define FASTA_CHUNK (1 << 20)
+
+// bgzf blocks are at most 64k, compressed or not
+#define BGZF_MAX_BLOCK 65536
+#define BGZF_BATCH 16
+
+// return the size of the bgzf block at p, or 0 if it isn't one
+static size_t bgzf_block_size(const unsigned char *p, size_t avail) {
+	size_t xlen = 0;
+	size_t i = 0;
+
+	if(avail < 18 || p[0] != 31 || p[1] != 139 || p[2] != 8 || !(p[3] & 4))
+		return 0;
+
+	xlen = p[10] | (p[11] << 8);
+	if(avail < 12 + xlen)
+		return 0;
+
+	// look for the BC subfield with the block size
+	for(i = 12; i + 4 <= 12 + xlen; i += 4 + (p[i + 2] | (p[i + 3] << 8))) {
+		if(p[i] == 'B' && p[i + 1] == 'C' && (p[i + 2] | (p[i + 3] << 8)) == 2 && i + 6 <= 12 + xlen) {
+			size_t size = (p[i + 4] | (p[i + 5] << 8)) + 1;
+			if(size < 12 + xlen + 8 || size > avail)
+				return 0;
+			return size;
+		}
+	}
+
+	return 0;
+}
+
+static int reserve(struct fasta_reader *reader, size_t size) {
+	if(size <= reader->buf_size)
+		return 0;
+
+	size_t buf_size = reader->buf_size ? reader->buf_size : FASTA_CHUNK;
+	while(buf_size < size)
+		buf_size *= 2;
+
+	char *buf = realloc(reader->buf, buf_size);
+	if(buf == NULL)
+		return -1;
+
+	reader->buf = buf;
+	reader->buf_size = buf_size;
+	reader->data = buf;
+	return 0;
+}
+
+// decompress the next batch of bgzf blocks onto the end of our buffer, every
+// block is independent so they are inflated in parallel
+static ssize_t bgzf_fill(struct fasta_reader *reader) {
+	size_t in_offset[BGZF_BATCH * 64];
+	size_t in_size[BGZF_BATCH * 64];
+	size_t out_offset[BGZF_BATCH * 64];
+	size_t out_size[BGZF_BATCH * 64];
+
+	size_t batch = BGZF_BATCH * (reader->threads < 64 ? reader->threads : 64);
+	size_t blocks = 0;
+	size_t total = 0;
+	size_t pos = reader->bgzf_pos;
+	int error = 0;
+	long i = 0;
+
+	while(blocks < batch && pos < reader->bgzf_size) {
+		const unsigned char *p = reader->bgzf + pos;
+		size_t size = bgzf_block_size(p, reader->bgzf_size - pos);
+		if(size == 0)
+			return -1;
+
+		in_offset[blocks] = pos;
+		in_size[blocks] = size;
+		out_offset[blocks] = total;
+		out_size[blocks] = p[size - 4] | (p[size - 3] << 8) | (p[size - 2] << 16) | ((size_t)p[size - 1] << 24);
+		if(out_size[blocks] > BGZF_MAX_BLOCK)
+			return -1;
+
+		total += out_size[blocks];
+		pos += size;
+		blocks++;
+	}
+
+	if(reserve(reader, reader->size + total))
+		return -1;
+
+	unsigned char *out = (unsigned char *)reader->buf + reader->size;
+
+	#pragma omp parallel for num_threads(reader->threads) schedule(dynamic) if(reader->threads > 1) reduction(|:error)
+	for(i = 0; i < (long)blocks; i++) {
+		const unsigned char *p = reader->bgzf + in_offset[i];
+		size_t xlen = p[10] | (p[11] << 8);
+		z_stream strm;
+
+		memset(&strm, 0, sizeof(z_stream));
+		if(inflateInit2(&strm, -15) != Z_OK) {
+			error = 1;
+			continue;
+		}
+
+		strm.next_in = (Bytef *)p + 12 + xlen;
+		strm.avail_in = in_size[i] - 12 - xlen - 8;
+		strm.next_out = out + out_offset[i];
+		strm.avail_out = out_size[i];
+
+		int ret = inflate(&strm, Z_FINISH);
+		if(ret != Z_STREAM_END || strm.avail_out != 0)
+			error = 1;
+		inflateEnd(&strm);
+
+		uint32_t crc = p[in_size[i] - 8] | (p[in_size[i] - 7] << 8) | (p[in_size[i] - 6] << 16) | ((uint32_t)p[in_size[i] - 5] << 24);
+		if(crc32(0L, out + out_offset[i], out_size[i]) != crc)
+			error = 1;
+	}
+
+	if(error)
+		return -1;
+
+	reader->bgzf_pos = pos;
+	reader->size += total;
+	return total;
+}
+
+// make room and read more data, returns how much was read, 0 at the end of
+// the input and -1 on errors
+static ssize_t fill(struct fasta_reader *reader) {
+	ssize_t read = 0;
+
+	if(reader->mapped || reader->eof)
+		return 0;
+
+	// drop what we are done with
+	if(reader->pos > 0) {
+		memmove(reader->buf, reader->buf + reader->pos, reader->size - reader->pos);
+		reader->size -= reader->pos;
+		reader->scan -= reader->pos;
+		reader->pos = 0;
+	}
+
+	if(reader->bgzf != NULL) {
+		if(reader->bgzf_pos == reader->bgzf_size)
+			return 0;
+		return bgzf_fill(reader);
+	}
+
+	if(reserve(reader, reader->size + FASTA_CHUNK))
+		return -1;
+
+	read = gzread(reader->gz, reader->buf + reader->size, reader->buf_size - reader->size);
+	if(read < 0)
+		return -1;
+
+	// a truncated file just looks like the end of the input
+	if(read == 0) {
+		int error = Z_OK;
+		gzerror(reader->gz, &error);
+		if(error != Z_OK)
+			return -1;
+	}
+
+	reader->size += read;
+	return read;
+}
+
+// find the next line that starts with c, from the reader's position
+static int skip_to(struct fasta_reader *reader, char c) {
+	const char *p = reader->data + reader->pos;
+	const char *end = reader->data + reader->size;
+
+	while(p < end && *p != c) {
+		const char *newline = memchr(p, '\n', end - p);
+		p = newline ? newline + 1 : end;
+	}
+
+	reader->pos = p - reader->data;
+	if(reader->scan < reader->pos)
+		reader->scan = reader->pos;
+
+	if(p < end)
+		return 1;
+	return reader->eof ? 0 : FASTA_INCOMPLETE;
+}
+
+static int next_fasta(struct fasta_reader *reader, struct fasta_record *record) {
+	int ret = skip_to(reader, '>');
+	if(ret != 1)
+		return ret;
+
+	const char *start = reader->data + reader->pos;
+	const char *end = reader->data + reader->size;
+	const char *p = start + 1;
+
+	const char *newline = memchr(p, '\n', end - p);
+	if(newline == NULL) {
+		if(!reader->eof)
+			return FASTA_INCOMPLETE;
+		record->header = p;
+		record->header_len = end - p;
+		record->sequence = end;
+		record->sequence_len = 0;
+		reader->pos = reader->scan = reader->size;
+		return 1;
+	}
+
+	// the sequence runs until the next '>' that starts a line
+	const char *sequence = newline + 1;
+	const char *next = NULL;
+	p = reader->data + reader->scan;
+	if(p < sequence)
+		p = sequence;
+	while(p < end && (next = memchr(p, '>', end - p)) != NULL && next[-1] != '\n') {
+		p = next + 1;
+		next = NULL;
+	}
+
+	if(next == NULL) {
+		if(!reader->eof) {
+			reader->scan = reader->size;
+			return FASTA_INCOMPLETE;
+		}
+		next = end;
+	}
+
+	record->header = start + 1;
+	record->header_len = newline - (start + 1);
+	record->sequence = sequence;
+	record->sequence_len = next - sequence;
+
+	reader->pos = reader->scan = next - reader->data;
+	return 1;
+}
+
+// fastq records are four lines, the header, the sequence, the '+' line and
+// the qualities
+static int next_fastq(struct fasta_reader *reader, struct fasta_record *record) {
+	const char *lines[4];
+	size_t lengths[4];
+	int i = 0;
+
+	int ret = skip_to(reader, '@');
+	if(ret != 1)
+		return ret;
+
+	const char *p = reader->data + reader->pos + 1;
+	const char *end = reader->data + reader->size;
+
+	for(i = 0; i < 4; i++) {
+		const char *newline = memchr(p, '\n', end - p);
+		if(newline == NULL) {
+			if(!reader->eof)
+				return FASTA_INCOMPLETE;
+			newline = end;
+		}
+
+		lines[i] = p;
+		lengths[i] = newline - p;
+		p = newline < end ? newline + 1 : end;
+	}
+
+	record->header = lines[0];
+	record->header_len = lengths[0];
+	record->sequence = lines[1];
+	record->sequence_len = lengths[1];
+
+	reader->pos = reader->scan = p - reader->data;
+	return 1;
+}
+
+struct fasta_reader *fasta_open(const char *filename, int threads) {
+	struct stat st;
+	void *map = NULL;
+
+	int fd = open(filename, O_RDONLY);
+	if(fd == -1)
+		return NULL;
+
+	if(fstat(fd, &st) == -1) {
+		close(fd);
+		return NULL;
+	}
+
+	// empty files can't be mapped, but they are valid fasta files
+	if(st.st_size > 0) {
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(map == MAP_FAILED) {
+			int error = errno;
+			close(fd);
+			errno = error;
+			return NULL;
+		}
+		madvise(map, st.st_size, MADV_SEQUENTIAL);
+	}
+
+	struct fasta_reader *reader = calloc(1, sizeof(struct fasta_reader));
+	if(reader == NULL) {
+		if(map != NULL)
+			munmap(map, st.st_size);
+		close(fd);
+		return NULL;
+	}
+
+	reader->map = map;
+	reader->map_size = st.st_size;
+#ifdef _OPENMP
+	if(threads <= 0)
+		threads = omp_get_max_threads();
+#endif
+	reader->threads = threads > 0 ? threads : 1;
+
+	const unsigned char *magic = map;
+	if(st.st_size >= 2 && magic[0] == 31 && magic[1] == 139) {
+		if(bgzf_block_size(magic, st.st_size) != 0) {
+			reader->bgzf = magic;
+			reader->bgzf_size = st.st_size;
+		}
+		else {
+			reader->gz = gzdopen(dup(fd), "r");
+			if(reader->gz == NULL) {
+				fasta_close(reader);
+				close(fd);
+				errno = ENOMEM;
+				return NULL;
+			}
+			gzbuffer(reader->gz, FASTA_CHUNK);
+		}
+	}
+	else {
+		reader->mapped = 1;
+		reader->eof = 1;
+		reader->data = map;
+		reader->size = st.st_size;
+	}
+	close(fd);
+
+	// the first thing in the file tells us if it is fastq
+	while(1) {
+		const char *p = reader->data + reader->pos;
+		while(p < reader->data + reader->size && (*p == '\n' || *p == '\r' || *p == ' '))
+			p++;
+		if(p < reader->data + reader->size) {
+			if(*p == '@')
+				reader->format = FASTQ_FORMAT;
+			break;
+		}
+
+		ssize_t read = fill(reader);
+		if(read < 0) {
+			fasta_close(reader);
+			errno = EIO;
+			return NULL;
+		}
+		if(read == 0)
+			break;
+	}
+
+	return reader;
+}
+
+int fasta_next(struct fasta_reader *reader, struct fasta_record *record) {
+	if(reader->error)
+		return -1;
+
+	while(1) {
+		int ret = 0;
+
+		if(reader->format == FASTQ_FORMAT)
+			ret = next_fastq(reader, record);
+		else
+			ret = next_fasta(reader, record);
+
+		if(ret != FASTA_INCOMPLETE)
+			return ret;
+
+		ssize_t read = fill(reader);
+		if(read < 0) {
+			reader->error = 1;
+			return -1;
+		}
+		if(read == 0)
+			reader->eof = 1;
+	}
+}
+
+void fasta_close(struct fasta_reader *reader) {
+	if(reader->map != NULL)
+		munmap(reader->map, reader->map_size);
+	if(reader->gz != NULL)
+		gzclose(reader->gz);
+	free(reader->buf);
+	free(reader);
+}
+
+// the start of the line after p
+static const char *next_line(const char *p, const char *end) {
+	const char *newline = memchr(p, '\n', end - p);
+	return newline ? newline + 1 : end;
+}
+
+size_t fasta_boundary(const struct fasta_reader *reader, size_t pos) {
+	const char *p = reader->data + pos;
+	const char *end = reader->data + reader->size;
+
+	if(pos >= reader->size)
+		return reader->size;
+
+	// start from the next full line
+	if(pos > 0 && p[-1] != '\n')
+		p = next_line(p, end);
+
+	for(; p < end; p = next_line(p, end)) {
+		if(reader->format == FASTA_FORMAT) {
+			if(*p == '>')
+				break;
+			continue;
+		}
+
+		// qualities can start with '@' as well, but then the line after next is
+		// a sequence and not the '+' line
+		if(*p == '@') {
+			const char *plus = next_line(next_line(p, end), end);
+			if(plus < end && *plus == '+')
+				break;
+		}
+	}
+
+	return p - reader->data;
+}
+
+void fasta_range(const struct fasta_reader *reader, size_t start, size_t end, struct fasta_reader *range) {
+	memset(range, 0, sizeof(struct fasta_reader));
+	range->data = reader->data + start;
+	range->size = end - start;
+	range->format = reader->format;
+	range->threads = 1;
+	range->mapped = 1;
+	range->eof = 1;
+}
@@ -0,0 +1,63 @@
+#include <stddef.h>
+#include <zlib.h>
+
+#define FASTA_FORMAT 0
+#define FASTQ_FORMAT 1
+
+// a fasta or fastq file, plain files are mapped, gzip files are decompressed
+// into a buffer as we go, and bgzip files are decompressed a batch of blocks
+// at a time on several threads
+struct fasta_reader {
+	const char *data;
+	size_t size;
+	size_t pos;
+	// where to keep looking for the end of the record at pos
+	size_t scan;
+	int format;
+	int eof;
+	int error;
+
+	// set if records stay valid until the reader is closed
+	int mapped;
+	void *map;
+	size_t map_size;
+
+	char *buf;
+	size_t buf_size;
+	gzFile gz;
+
+	// bgzf blocks are read straight out of the mapped compressed file
+	const unsigned char *bgzf;
+	size_t bgzf_size;
+	size_t bgzf_pos;
+	int threads;
+};
+
+// a record points into the reader, the sequence still contains the newlines
+// of multiline fasta records. Unless the reader is mapped, the record is only
+// valid until the next call to fasta_next
+struct fasta_record {
+	const char *header;
+	size_t header_len;
+	const char *sequence;
+	size_t sequence_len;
+};
+
+// open filename, which can be fasta or fastq, plain, gzip'd or bgzip'd.
+// threads is how many threads can decompress bgzip blocks, 0 uses the OpenMP
+// default. Returns NULL and sets errno if it can't be opened
+struct fasta_reader *fasta_open(const char *filename, int threads);
+
+// get the next record, returns 0 at the end of the file and -1 if the file
+// could not be decompressed
+int fasta_next(struct fasta_reader *reader, struct fasta_record *record);
+
+void fasta_close(struct fasta_reader *reader);
+
+// the offset of the first record that starts at or after pos in a mapped
+// reader, or the size of the file if there isn't one
+size_t fasta_boundary(const struct fasta_reader *reader, size_t pos);
+
+// set up range to read the records between two boundaries of a mapped reader.
+// range borrows the mapping, so it isn't closed
+void fasta_range(const struct fasta_reader *reader, size_t start, size_t end, struct fasta_reader *range);
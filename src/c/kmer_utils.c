@@ -4,7 +4,14 @@
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "fasta.h"
+#include "kmer_utils.h"
 #include "quikr.h"
+#include "quikr_functions.h"
 
 const unsigned char alpha[256] = 
 {5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,
@@ -23,140 +30,244 @@ const unsigned char alpha[256] =
 unsigned long num_to_index(const char *str, const int kmer, const long error_pos) {
 
 	int i = 0;
-	unsigned long out = 0;
-	unsigned long multiply = 1;
-
-	for(i = kmer - 1; i >= 0; i--){
+	unsigned long long out = 0;
+	const unsigned long long mask = pow_four(kmer) - 1;
 
-		if(str[i] == 5) { 
-			// position += i;
+	for(i = 0; i < kmer; i++) {
+		if(str[i] & ~KMER_BASE_MASK)
 			return error_pos;
-		}
 
-		out += str[i] * multiply;
-		multiply = multiply << 2;
+		out = kmer_roll(out, str[i], mask);
 	}
 
 	return out;
 }
 
-// Strip out any character 'c' from char array 's' into a destination dest (you
-// need to allocate that) and copy only len characters.
-char *strnstrip(const char *s, char *dest, int c, unsigned long long len) {
+// count every kmer of seq into counts (which is 4^kmer + 1 long). The kmer is
+// rolled forward two bits per base instead of being rebuilt at every position.
+// Newlines are skipped so kmers span the lines of multiline records. Anything
+// else besides A, C, G and T restarts the kmer, and every kmer we skip because
+// of it is counted in counts[4^kmer].
+size_t count_kmers(const char *seq, size_t length, unsigned int kmer, unsigned long long *counts) {
 
-	unsigned long long i = 0;
-	unsigned long long j = 0;
+	const unsigned long long width = pow_four(kmer);
+	const unsigned long long mask = width - 1;
 
-	for(i = 0; i < len; i++) {
-		if(s[i] != c) {
-			dest[j] = s[i];
-			j++;
+	unsigned long long mer = 0;
+	size_t valid = 0;
+	size_t bases = 0;
+	size_t i = 0;
+
+	for(i = 0; i < length; i++) {
+		unsigned char base = alpha[(unsigned char)seq[i]];
+
+		if(base & ~KMER_BASE_MASK) {
+			if(seq[i] == '\n')
+				continue;
+			valid = 0;
+		}
+		else {
+			mer = kmer_roll(mer, base, mask);
+			valid++;
 		}
-	}
 
-	dest[j] = '\0';
+		// every base after the first kmer - 1 ends a kmer
+		if(++bases < kmer)
+			continue;
 
-	return dest;
-}
+		if(valid >= kmer)
+			counts[mer]++;
+		else
+			counts[width]++;
+	}
 
+	return bases;
+}
 
-unsigned long long * get_kmer_counts_from_file(const char *fn, const unsigned int kmer) {
+// count the records of a mapped file in chunks on jobs threads, each into its
+// own histogram, and then add them up. Integer counts make this exactly the
+// same as counting serially. Returns -1 if the histograms can't be allocated
+static int read_sample_parallel(struct fasta_reader *reader, struct sample *sample, int jobs) {
+	const unsigned long long width = pow_four(sample->kmer);
+
+	unsigned long long sequences = 0;
+	unsigned long long bases = 0;
+
+	// a few chunks per thread so a slow chunk doesn't hold everyone up
+	long chunks = jobs * 4;
+	long i = 0;
+	int failed = 0;
+
+	size_t *bounds = malloc((chunks + 1) * sizeof(size_t));
+	unsigned long long **histograms = calloc(jobs, sizeof(unsigned long long *));
+	if(bounds == NULL || histograms == NULL) {
+		free(bounds);
+		free(histograms);
+		return -1;
+	}
 
-	char *line = NULL;
-	size_t len = 0;
-	ssize_t read;
+	for(i = 0; i < chunks; i++)
+		bounds[i] = fasta_boundary(reader, reader->size / chunks * i);
+	bounds[chunks] = reader->size;
+
+	#pragma omp parallel num_threads(jobs) reduction(+:sequences, bases) reduction(|:failed)
+	{
+		struct fasta_reader range;
+		struct fasta_record record;
+		int thread = 0;
+#ifdef _OPENMP
+		thread = omp_get_thread_num();
+#endif
+
+		unsigned long long *local = calloc(width + 1, sizeof(unsigned long long));
+		histograms[thread] = local;
+		if(local == NULL)
+			failed = 1;
+
+		#pragma omp for schedule(dynamic)
+		for(i = 0; i < chunks; i++) {
+			if(local == NULL || bounds[i] >= bounds[i + 1])
+				continue;
+
+			fasta_range(reader, bounds[i], bounds[i + 1], &range);
+			while(fasta_next(&range, &record) > 0) {
+				bases += count_kmers(record.sequence, record.sequence_len, sample->kmer, local);
+				sequences++;
+			}
+		}
+	}
 
-	long long i = 0;
-	long long position = 0;
+	long long x = 0;
+	if(failed) {
+		for(i = 0; i < jobs; i++)
+			free(histograms[i]);
+		free(histograms);
+		free(bounds);
+		return -1;
+	}
 
-	FILE * const fh = fopen(fn, "r");
-	if(fh == NULL) {
-		fprintf(stderr, "Error opening %s - %s\n", fn, strerror(errno));
-		exit(EXIT_FAILURE);
+	#pragma omp parallel for num_threads(jobs)
+	for(x = 0; x < (long long)width + 1; x++) {
+		int j = 0;
+		for(j = 0; j < jobs; j++)
+			if(histograms[j] != NULL)
+				sample->counts[x] += histograms[j][x];
 	}
 
-	// width is 4^kmer  
-	// there's a sneaky bitshift to avoid pow dependency
-	const unsigned long width = pow_four(kmer); 
+	sample->sequences = sequences;
+	sample->bases = bases;
+
+	for(i = 0; i < jobs; i++)
+		free(histograms[i]);
+	free(histograms);
+	free(bounds);
+	return 0;
+}
 
-	// malloc our return array
-	unsigned long long * counts = malloc((width+ 1) * sizeof(unsigned long long));
-	memset(counts, 0, width * sizeof(unsigned long long));
-	if(counts == NULL)  {
-		fprintf(stderr, strerror(errno));
-		exit(EXIT_FAILURE);
+int try_read_sample_into(const char *filename, const unsigned int kmer, int jobs, struct sample *sample) {
+	struct fasta_record record;
+	int ret = 0;
+
+	struct fasta_reader *reader = fasta_open(filename, jobs);
+	if(reader == NULL)
+		return -1;
+
+	// width is 4^kmer, plus one for the skipped kmers
+	const unsigned long width = pow_four(kmer);
+
+	if(sample->counts == NULL || sample->kmer != kmer) {
+		free(sample->counts);
+		sample->kmer = 0;
+		sample->counts = malloc((width + 1) * sizeof(unsigned long long));
+		if(sample->counts == NULL) {
+			fasta_close(reader);
+			errno = ENOMEM;
+			return -1;
+		}
+	}
+	memset(sample->counts, 0, (width + 1) * sizeof(unsigned long long));
+
+	sample->kmer = kmer;
+	sample->sequences = 0;
+	sample->bases = 0;
+	sample->skipped = 0;
+
+	// only mapped files can be split up, compressed files are decompressed in
+	// order. Bgzip files still decompress on jobs threads
+	if(jobs > 1 && reader->mapped) {
+		if(read_sample_parallel(reader, sample, jobs) != 0) {
+			fasta_close(reader);
+			errno = ENOMEM;
+			return -1;
+		}
 	}
+	else {
+		// the records point straight into the file, newlines and all
+		while((ret = fasta_next(reader, &record)) > 0) {
+			sample->bases += count_kmers(record.sequence, record.sequence_len, kmer, sample->counts);
+			sample->sequences++;
+		}
 
-	char *str = malloc(4096);
-	if(str == NULL) { 
-		fprintf(stderr, strerror(errno));
-		exit(EXIT_FAILURE);
+		if(ret < 0) {
+			fasta_close(reader);
+			errno = EILSEQ;
+			return -1;
+		}
 	}
 
-	unsigned long long str_size = 4096;
+	sample->skipped = sample->counts[width];
 
-	while ((read = getseq(&line, &len, fh)) != -1) {
+	fasta_close(reader);
 
-		// find our first \n, this should be the end of the header
-		char *start = strchr(line, '\n');	
-		if(start == NULL) 
-			continue;
-		
-		start = start + 1;
+	return 0;
+}
 
-		size_t start_len = strlen(start);
+struct sample *try_read_sample(const char *filename, const unsigned int kmer, int jobs) {
+	struct sample *sample = calloc(1, sizeof(struct sample));
+	if(sample == NULL)
+		return NULL;
 
+	if(try_read_sample_into(filename, kmer, jobs, sample) != 0) {
+		int saved = errno;
+		free_sample(sample);
+		errno = saved;
+		return NULL;
+	}
 
-		// if our current str buffer isn't big enough, realloc
-		if(start_len + 1 > str_size + 1) { 
-			str = realloc(str, start_len + 1);
-			if(str == NULL) { 
-				exit(EXIT_FAILURE);
-				fprintf(stderr, strerror(errno));
-			}
-		}
+	return sample;
+}
 
-		// strip out all other newlines to handle multiline sequences
-		str = strnstrip(start, str, '\n',start_len);
-		ssize_t seq_length = strlen(str);
-		if(seq_length < kmer)
-			continue;
+static void read_sample_error(const char *filename) {
+	if(errno == EILSEQ)
+		fprintf(stderr, "Error reading %s - corrupt compressed file\n", filename);
+	else
+		fprintf(stderr, "Error opening %s - %s\n", filename, strerror(errno));
+	exit(EXIT_FAILURE);
+}
 
-		// relace A, C, G and T with 0, 1, 2, 3 respectively
-		// everything else is 5 
-		for(i = 0; i < seq_length; i++) {
-			str[i] = alpha[(int)str[i]];
-		}
+struct sample *read_sample(const char *filename, const unsigned int kmer, int jobs) {
+	struct sample *sample = try_read_sample(filename, kmer, jobs);
 
-		// loop through our string to process each k-mer
-		for(position = 0; position < (seq_length - kmer + 1); position++) {
-			unsigned long mer = 0;
-			unsigned long multiply = 1;
-
-			// for each char in the k-mer check if it is an error char
-			for(i = position + kmer - 1; i >= position; i--){
-				if(str[i] == 5) { 
-					mer = width;
-					position = i;
-					goto next;
-				}
-				// if it's a newline, we should skip it
-
-				// multiply this char in the mer by the multiply
-				// and bitshift the multiply for the next round
-				mer += str[i] * multiply;
-				multiply = multiply << 2;
-			}
-			// use this point to get mer of our loop
-			next:
-			// bump up the mer value in the counts array
-			counts[mer]++;
-		}
-	} 
+	if(sample == NULL)
+		read_sample_error(filename);
+
+	return sample;
+}
+
+void read_sample_into(const char *filename, const unsigned int kmer, int jobs, struct sample *sample) {
+	if(try_read_sample_into(filename, kmer, jobs, sample) != 0)
+		read_sample_error(filename);
+}
+
+void free_sample(struct sample *sample) {
+	free(sample->counts);
+	free(sample);
+}
 
-	free(line);
-	free(str);
-	fclose(fh);
+unsigned long long * get_kmer_counts_from_file(const char *fn, const unsigned int kmer, int jobs) {
+	struct sample *sample = read_sample(fn, kmer, jobs);
+	unsigned long long *counts = sample->counts;
 
+	free(sample);
 	return counts;
 }
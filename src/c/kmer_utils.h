@@ -1,11 +1,46 @@
+#include <stddef.h>
+
+// bases coded through alpha[] are 0 to 3, anything else has bits outside of
+// this mask
+#define KMER_BASE_MASK 3
+
+// shift the next base into a 2-bit coded kmer
+#define kmer_roll(mer, base, mask) ((((mer) << 2) | (base)) & (mask))
+
+// everything we learn from one pass over a sample
+struct sample {
+	unsigned int kmer;
+	// 4^kmer kmer counts, followed by the skipped kmers
+	unsigned long long *counts;
+	unsigned long long sequences;
+	// bases in the reads, not counting newlines
+	unsigned long long bases;
+	// kmers that had an ambiguous base in them
+	unsigned long long skipped;
+};
+
 // Kmer functions
-void convert_kmer_to_num(char *str, const unsigned long length);
-unsigned long long * get_kmer_counts_from_file(const char *fn, const int kmer);
-unsigned long num_to_index(const char *str, const int kmer, int *position, const long error_pos);
 
-// Utility functions
-char *strnstrip(const char *s, char *dest, int c, int len);
-unsigned long long pow_four(unsigned long long x);
+// read a fasta or fastq file once, counting its kmers and reads on jobs threads
+struct sample *read_sample(const char *filename, const unsigned int kmer, int jobs);
+// the same, but returns NULL with errno set instead of exiting, EILSEQ if a
+// compressed file is corrupt and ENOMEM if the counts can't be allocated
+struct sample *try_read_sample(const char *filename, const unsigned int kmer, int jobs);
+void free_sample(struct sample *sample);
+
+// read_sample and try_read_sample (which returns -1) into a sample that was
+// zeroed or read into before, so a thread reading one sample after another
+// keeps its counts instead of allocating them every time. Free its counts
+// when done
+void read_sample_into(const char *filename, const unsigned int kmer, int jobs, struct sample *sample);
+int try_read_sample_into(const char *filename, const unsigned int kmer, int jobs, struct sample *sample);
+
+// count the kmers in a fasta or fastq file on jobs threads, counts[4^kmer]
+// holds the windows skipped because of ambiguous bases
+unsigned long long * get_kmer_counts_from_file(const char *fn, const unsigned int kmer, int jobs);
+unsigned long num_to_index(const char *str, const int kmer, const long error_pos);
+// count the kmers of one sequence into counts, returns how many bases it had
+size_t count_kmers(const char *seq, size_t length, unsigned int kmer, unsigned long long *counts);
 
 // Variables
-const unsigned char alpha[256]; 
+extern const unsigned char alpha[256]; 
@@ -0,0 +1,369 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nnls.h"
+#include "kmer_utils.h"
+#include "libquikr.h"
+#include "quikr_functions.h"
+#include "quikr.h"
+
+struct quikr_database {
+	char *filename;
+	struct matrix *sensing_matrix;
+	// the gram matrix of the gram and cd solvers, loaded once for one lambda
+	pthread_mutex_t lock;
+	struct gram_matrix *gram;
+};
+
+const char *quikr_strerror(int code) {
+	switch(code) {
+		case QUIKR_OK:
+			return "success";
+		case QUIKR_MAX_ITERATIONS:
+			return "the solver reached the maximum iterations";
+		case QUIKR_ERROR_MEMORY:
+			return "could not allocate enough memory";
+		case QUIKR_ERROR_IO:
+			return "could not read the file";
+		case QUIKR_ERROR_FORMAT:
+			return "corrupt file";
+		case QUIKR_ERROR_KMER:
+			return "the sensing matrix was trained with a different kmer";
+		case QUIKR_ERROR_INVALID:
+			return "invalid parameters";
+	}
+
+	return "unknown error";
+}
+
+void quikr_default_params(struct quikr_params *params) {
+	struct nnls_options options;
+	nnls_default_options(&options);
+
+	params->lambda = 10000;
+	params->rare_percent = 1.0;
+	params->solver = QUIKR_SOLVER_LAWSON_HANSON;
+	params->screen = 0;
+	params->single = 0;
+	params->tolerance = options.tolerance;
+	params->max_iterations = options.max_iterations;
+	params->start = NULL;
+	params->jobs = 1;
+}
+
+int quikr_database_open(const char *filename, unsigned int kmer, struct quikr_database **database, char *error) {
+	struct quikr_database *ret = calloc(1, sizeof(struct quikr_database));
+	if(ret != NULL)
+		ret->filename = strdup(filename);
+
+	if(ret == NULL || ret->filename == NULL) {
+		if(error != NULL)
+			snprintf(error, QUIKR_ERROR_LENGTH, "Could not allocate enough memory - %s", strerror(errno));
+		free(ret);
+		return QUIKR_ERROR_MEMORY;
+	}
+
+	int code = try_load_sensing_matrix(filename, kmer, &ret->sensing_matrix, error);
+	if(code != QUIKR_OK) {
+		free(ret->filename);
+		free(ret);
+		return code;
+	}
+
+	pthread_mutex_init(&ret->lock, NULL);
+
+	*database = ret;
+	return QUIKR_OK;
+}
+
+void quikr_database_close(struct quikr_database *database) {
+	if(database->gram != NULL)
+		free_gram_matrix(database->gram);
+	free_sensing_matrix(database->sensing_matrix);
+	pthread_mutex_destroy(&database->lock);
+	free(database->filename);
+	free(database);
+}
+
+unsigned int quikr_database_kmer(const struct quikr_database *database) {
+	return database->sensing_matrix->kmer;
+}
+
+unsigned long long quikr_database_sequences(const struct quikr_database *database) {
+	return database->sensing_matrix->sequences;
+}
+
+const char *quikr_database_header(const struct quikr_database *database, unsigned long long sequence) {
+	if(sequence >= database->sensing_matrix->sequences)
+		return NULL;
+	return database->sensing_matrix->headers[sequence];
+}
+
+void quikr_database_matrix(const struct quikr_database *database, struct quikr_matrix *matrix) {
+	const struct matrix *sensing_matrix = database->sensing_matrix;
+
+	memset(matrix, 0, sizeof(struct quikr_matrix));
+
+	if(sensing_matrix->sparse != NULL) {
+		matrix->layout = QUIKR_LAYOUT_SPARSE;
+		matrix->values = sensing_matrix->sparse->values;
+		matrix->columns = sensing_matrix->sparse->column;
+		matrix->row_ptr = sensing_matrix->sparse->row_ptr;
+		matrix->nnz = sensing_matrix->sparse->nnz;
+	}
+	else if(sensing_matrix->kmer_major != NULL) {
+		matrix->layout = QUIKR_LAYOUT_KMER_MAJOR;
+		matrix->values = sensing_matrix->kmer_major;
+	}
+	else {
+		matrix->layout = QUIKR_LAYOUT_DENSE;
+		matrix->values = sensing_matrix->matrix;
+	}
+}
+
+int quikr_database_gram(struct quikr_database *database, unsigned long long lambda, int jobs, char *warning) {
+	int code = QUIKR_OK;
+
+	if(warning != NULL)
+		warning[0] = '\0';
+
+	if(lambda == 0 || jobs < 1)
+		return QUIKR_ERROR_INVALID;
+
+	pthread_mutex_lock(&database->lock);
+
+	if(database->gram == NULL) {
+		code = try_load_gram_matrix(database->filename, database->sensing_matrix, lambda, jobs, &database->gram);
+		if(code == QUIKR_OK && database->gram->cache_error != 0 && warning != NULL)
+			snprintf(warning, QUIKR_ERROR_LENGTH, "could not cache the gram matrix in %s - %s", database->gram->cache, strerror(database->gram->cache_error));
+	}
+	else if(database->gram->lambda != lambda) {
+		code = QUIKR_ERROR_INVALID;
+	}
+
+	pthread_mutex_unlock(&database->lock);
+
+	return code;
+}
+
+int quikr_count_file(const char *filename, unsigned int kmer, int jobs, unsigned long long *counts, unsigned long long *sequences, unsigned long long *bases) {
+	struct sample sample;
+
+	if(kmer == 0 || jobs < 1)
+		return QUIKR_ERROR_INVALID;
+
+	// counts is already the right size, so it is only cleared and filled
+	memset(&sample, 0, sizeof(struct sample));
+	sample.kmer = kmer;
+	sample.counts = counts;
+
+	if(try_read_sample_into(filename, kmer, jobs, &sample) != 0) {
+		if(errno == EILSEQ)
+			return QUIKR_ERROR_FORMAT;
+		if(errno == ENOMEM)
+			return QUIKR_ERROR_MEMORY;
+		return QUIKR_ERROR_IO;
+	}
+
+	if(sequences != NULL)
+		*sequences = sample.sequences;
+	if(bases != NULL)
+		*bases = sample.bases;
+
+	return QUIKR_OK;
+}
+
+static int quikr_params_valid(const struct quikr_params *params) {
+	const int gram_solver = params->solver == QUIKR_SOLVER_GRAM || params->solver == QUIKR_SOLVER_CD;
+
+	if(params->lambda == 0 || params->jobs < 1)
+		return 0;
+	if(!(params->rare_percent > 0 && params->rare_percent <= 1.0))
+		return 0;
+	if(params->solver < QUIKR_SOLVER_LAWSON_HANSON || params->solver > QUIKR_SOLVER_CD)
+		return 0;
+	if(params->tolerance <= 0 || params->max_iterations < 1)
+		return 0;
+
+	// the gram matrix is only the same for every sample when we keep every
+	// kmer, and already as small as it gets
+	if(gram_solver && (params->rare_percent != 1.0 || params->single))
+		return 0;
+
+	return 1;
+}
+
+// what the solver's status means to a caller
+static int quikr_solver_code(int status) {
+	if(status == 1)
+		return QUIKR_MAX_ITERATIONS;
+	if(status == 2)
+		return QUIKR_ERROR_MEMORY;
+	if(status == 3)
+		return QUIKR_ERROR_INVALID;
+	return QUIKR_OK;
+}
+
+int quikr_classify(struct quikr_database *database, const unsigned long long *counts, const struct quikr_params *params, double *out, struct quikr_stats *stats) {
+	const struct matrix *sensing_matrix = database->sensing_matrix;
+	const unsigned long long width = pow_four(sensing_matrix->kmer);
+	const unsigned long long sequences = sensing_matrix->sequences;
+	struct gram_matrix *gram = NULL;
+	struct nnls_workspace workspace;
+	struct nnls_options options;
+	unsigned long long rare_value = 0;
+	unsigned long long rare_width = 0;
+	unsigned long long x = 0;
+	unsigned long long y = 0;
+	int code = QUIKR_OK;
+
+	if(!quikr_params_valid(params))
+		return QUIKR_ERROR_INVALID;
+
+	if(params->solver == QUIKR_SOLVER_GRAM || params->solver == QUIKR_SOLVER_CD) {
+		code = quikr_database_gram(database, params->lambda, params->jobs, NULL);
+		if(code != QUIKR_OK)
+			return code;
+		gram = database->gram;
+	}
+
+	// everything this classification needs comes from its own workspace, so
+	// it is freed in one go on every path out
+	nnls_workspace_init(&workspace, 0);
+
+	double *count_matrix = nnls_workspace_alloc(&workspace, width * sizeof(double));
+	double *scratch = nnls_workspace_alloc(&workspace, width * sizeof(double));
+	if(count_matrix == NULL || scratch == NULL) {
+		code = QUIKR_ERROR_MEMORY;
+		goto done;
+	}
+
+	for(x = 0; x < width; x++)
+		count_matrix[x] = (double)counts[x];
+
+	get_rare_value_into(count_matrix, width, params->rare_percent, &rare_value, &rare_width, scratch);
+
+	if(stats != NULL) {
+		memset(stats, 0, sizeof(struct quikr_stats));
+		stats->rare_value = rare_value;
+		stats->rare_width = rare_width;
+	}
+
+	// add a extra space for our zero's array, so we can set the first column to 1's
+	rare_width++;
+
+	double *count_matrix_rare = nnls_workspace_calloc(&workspace, rare_width, sizeof(double));
+	if(count_matrix_rare == NULL) {
+		code = QUIKR_ERROR_MEMORY;
+		goto done;
+	}
+
+	// copy only kmers from our original counts that match our rareness
+	// percentage, after the zero lining up with the row of ones
+	for(x = 0, y = 1; x < width; x++) {
+		if(count_matrix[x] <= rare_value) {
+			count_matrix_rare[y] = count_matrix[x];
+			y++;
+		}
+	}
+
+	normalize_matrix(count_matrix_rare, 1, rare_width);
+
+	count_matrix_rare[0] = 0;
+	for(x = 1; x < rare_width; x++)
+		count_matrix_rare[x] *= params->lambda;
+
+	nnls_default_options(&options);
+	options.solver = params->solver;
+	options.start = params->start;
+	options.tolerance = params->tolerance;
+	options.max_iterations = params->max_iterations;
+	options.jobs = params->jobs;
+	options.workspace = &workspace;
+	options.solution = out;
+	options.screen = params->screen;
+	options.quiet = 1;
+
+	double *solution = NULL;
+
+	if(gram != NULL) {
+		double *atb = nnls_workspace_alloc(&workspace, sequences * sizeof(double));
+		if(atb == NULL) {
+			code = QUIKR_ERROR_MEMORY;
+			goto done;
+		}
+
+		gram_atb(gram, sensing_matrix, count_matrix_rare, atb);
+		solution = nnls_gram(gram->gram, atb, sequences, rare_width, &options);
+	}
+	else if(sensing_matrix->sparse != NULL) {
+		const struct sparse_matrix *sparse = sensing_matrix->sparse;
+		struct sparse_matrix rare;
+
+		rare.row_ptr = nnls_workspace_alloc(&workspace, (sparse->rows + 1) * sizeof(unsigned long long));
+		rare.column = nnls_workspace_alloc(&workspace, (sparse->nnz + sparse->rows) * sizeof(uint32_t));
+		rare.values = nnls_workspace_alloc(&workspace, (sparse->nnz + sparse->rows) * sizeof(double));
+		uint32_t *rare_column = nnls_workspace_alloc(&workspace, sparse->columns * sizeof(uint32_t));
+		if(rare.row_ptr == NULL || rare.column == NULL || rare.values == NULL || rare_column == NULL) {
+			code = QUIKR_ERROR_MEMORY;
+			goto done;
+		}
+
+		gather_sparse_rare_into(sparse, count_matrix, rare_value, rare_width, params->lambda, &rare, rare_column);
+		solution = nnls_sparse(&rare, count_matrix_rare, sequences, rare_width, &options);
+	}
+	else {
+		// the same kmers from our sensing matrix, normalized, times lambda and
+		// with the first column set to 1's
+		double *rare = NULL;
+		float *rare_float = NULL;
+		double *row_sum = NULL;
+
+		if(params->single)
+			rare_float = nnls_workspace_alloc(&workspace, rare_width * sequences * sizeof(float));
+		else
+			rare = nnls_workspace_alloc(&workspace, rare_width * sequences * sizeof(double));
+		if(sensing_matrix->kmer_major != NULL)
+			row_sum = nnls_workspace_alloc(&workspace, sequences * sizeof(double));
+		if((rare == NULL && rare_float == NULL) || (sensing_matrix->kmer_major != NULL && row_sum == NULL)) {
+			code = QUIKR_ERROR_MEMORY;
+			goto done;
+		}
+
+		gather_rare_into(sensing_matrix, count_matrix, rare_value, rare_width, params->lambda, rare, rare_float, row_sum);
+
+		if(params->single) {
+			solution = nnls_dense_float(rare_float, count_matrix_rare, sequences, rare_width, &options);
+		}
+		else if(params->solver == QUIKR_SOLVER_APG || params->screen) {
+			solution = nnls_dense(rare, count_matrix_rare, sequences, rare_width, &options);
+		}
+		else {
+			// householder lawson-hanson, which destroys the A we just gathered
+			memset(out, 0, sequences * sizeof(double));
+			options.status = try_nnls_into(rare, count_matrix_rare, sequences, rare_width, out, params->jobs, &workspace);
+			solution = options.status >= 2 ? NULL : out;
+		}
+	}
+
+	code = quikr_solver_code(options.status);
+	if(solution == NULL)
+		goto done;
+
+	// normalize our solution vector
+	normalize_matrix(out, 1, sequences);
+
+	if(stats != NULL) {
+		stats->iterations = options.iterations;
+		stats->kkt = options.kkt;
+		stats->working = options.working;
+		stats->screened = options.screened;
+	}
+
+done:
+	nnls_workspace_free(&workspace);
+	return code;
+}
@@ -0,0 +1,125 @@
+#ifndef LIBQUIKR_H
+#define LIBQUIKR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// libquikr classifies samples against a sensing matrix trained by quikr_train,
+// like quikr does, from inside another program. Nothing in it exits or prints,
+// every call returns one of these codes, and the errors are negative
+#define QUIKR_OK 0
+// the solver stopped at max_iterations, the solution is where it got to
+#define QUIKR_MAX_ITERATIONS 1
+#define QUIKR_ERROR_MEMORY -1
+// errno says why
+#define QUIKR_ERROR_IO -2
+// the sensing matrix or sample is corrupt or not what it should be
+#define QUIKR_ERROR_FORMAT -3
+// the sensing matrix was trained with a different kmer
+#define QUIKR_ERROR_KMER -4
+#define QUIKR_ERROR_INVALID -5
+
+// room for the messages quikr_database_open writes
+#define QUIKR_ERROR_LENGTH 256
+
+// the solvers, like quikr's --solver
+#define QUIKR_SOLVER_LAWSON_HANSON 0
+#define QUIKR_SOLVER_GRAM 1
+#define QUIKR_SOLVER_APG 2
+#define QUIKR_SOLVER_CD 3
+
+// how a sensing matrix is stored, see struct quikr_matrix
+#define QUIKR_LAYOUT_DENSE 0
+#define QUIKR_LAYOUT_SPARSE 1
+#define QUIKR_LAYOUT_KMER_MAJOR 2
+
+// a sensing matrix as it is stored, which stays valid and mustn't be written
+// to until its database is closed. A dense matrix is sequences * 4^kmer kmer
+// counts by sequence, and a kmer-major one 4^kmer * sequences by kmer. A
+// sparse one has nnz values and their columns, and sequences + 1 row pointers
+// into them
+struct quikr_matrix {
+	int layout;
+	const double *values;
+	const uint32_t *columns;
+	const unsigned long long *row_ptr;
+	unsigned long long nnz;
+};
+
+// a loaded sensing matrix. Once it is open any number of threads can classify
+// against it at once
+struct quikr_database;
+
+// how a sample is classified, see quikr_default_params and quikr(1)
+struct quikr_params {
+	unsigned long long lambda;
+	// keep the kmers counted at most as often as this fraction of them
+	double rare_percent;
+	// one of the QUIKR_SOLVER_*. gram and cd need a rare_percent of 1
+	int solver;
+	// solve against a working set of the sequences, the result is the same
+	int screen;
+	// keep A in single precision, for the lawson-hanson and apg solvers. Sparse
+	// matrices ignore it
+	int single;
+	// where apg and cd stop
+	double tolerance;
+	long long max_iterations;
+	// a previous solution to warm start from, or NULL
+	const double *start;
+	// threads this one classification may use
+	int jobs;
+};
+
+// what a classification found besides the solution, for quikr -v
+struct quikr_stats {
+	// the kmers kept were counted at most rare_value times, and there were
+	// rare_width of them
+	unsigned long long rare_value;
+	unsigned long long rare_width;
+	// set by apg and cd
+	long long iterations;
+	double kkt;
+	// set by screening, the sequences solved for and proven absent
+	long long working;
+	long long screened;
+};
+
+// a message for one of the codes above
+const char *quikr_strerror(int code);
+
+// lambda 10000, a rare percent of 1, lawson-hanson on one thread
+void quikr_default_params(struct quikr_params *params);
+
+// open a sensing matrix, which has to be trained with kmer unless that is 0.
+// If it can't be opened and error isn't NULL, it gets a message of at most
+// QUIKR_ERROR_LENGTH bytes saying why
+int quikr_database_open(const char *filename, unsigned int kmer, struct quikr_database **database, char *error);
+void quikr_database_close(struct quikr_database *database);
+
+unsigned int quikr_database_kmer(const struct quikr_database *database);
+unsigned long long quikr_database_sequences(const struct quikr_database *database);
+// the header of sequence, without the '>'
+const char *quikr_database_header(const struct quikr_database *database, unsigned long long sequence);
+void quikr_database_matrix(const struct quikr_database *database, struct quikr_matrix *matrix);
+
+// compute the gram matrix the gram and cd solvers work on for lambda, on jobs
+// threads, or map it from its cache next to the sensing matrix. Classifying
+// does this on first use otherwise. A database only keeps the gram matrix of
+// one lambda. If the cache can't be written the gram matrix is still used,
+// and warning, unless it is NULL, gets a message of at most
+// QUIKR_ERROR_LENGTH bytes saying so. It is empty otherwise
+int quikr_database_gram(struct quikr_database *database, unsigned long long lambda, int jobs, char *warning);
+
+// count the kmers of a fasta or fastq file, gzip'd or not, on jobs threads
+// into counts, which has room for 4^kmer + 1. The last is the kmers skipped
+// for having an ambiguous base. sequences and bases get how many reads and
+// bases there were, unless they are NULL
+int quikr_count_file(const char *filename, unsigned int kmer, int jobs, unsigned long long *counts, unsigned long long *sequences, unsigned long long *bases);
+
+// classify a sample's 4^kmer kmer counts, with the database's kmer, into
+// out, which has room for one value for each of the database's sequences and
+// gets how much of each is present, summing to one. stats can be NULL
+int quikr_classify(struct quikr_database *database, const unsigned long long *counts, const struct quikr_params *params, double *out, struct quikr_stats *stats);
+
+#endif
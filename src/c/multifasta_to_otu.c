@@ -5,15 +5,20 @@
 #include <getopt.h>
 #include <math.h>
 #include <omp.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
+#include <sys/stat.h>
 
 #include "kmer_utils.h"
 #include "nnls.h"
 #include "quikr.h"
 #include "quikr_functions.h"
+#include "schedule.h"
 
 #ifdef Linux
 #include <sys/sysinfo.h>
@@ -37,6 +42,28 @@ void usage() {
 				 "  remove mers from classification if their values are less than the x percentile of values in the sample (default value is 10000)\n\n"
 				 "-j, --jobs\n"
 				 "  specifies how many jobs to run at once. (default value is the number of CPUs)\n\n"
+				 "-S, --solver\n"
+				 "  the nnls solver, lawson-hanson, gram, apg or cd. gram precomputes the gram matrix of the sensing matrix once for every sample and caches it next to it, and needs a rare percent of 1. apg (accelerated projected gradient) and cd (coordinate descent on the gram matrix, so also needing a rare percent of 1) are iterative and stop at --tolerance. (default value is lawson-hanson)\n\n"
+				 "-x, --screen\n"
+				 "  solve against a working set of the database sequences best matching each sample, adding any others the solution leaves out of balance, and skip the ones a safe bound proves absent. The result is the same.\n\n"
+				 "-F, --float\n"
+				 "  keep the sensing matrix the solver works on in single precision, which halves its memory and bandwidth. The solver still accumulates in double. Only for dense sensing matrices and the lawson-hanson and apg solvers. lawson-hanson then solves the normal equations instead of householder, which is most of the speedup.\n\n"
+				 "-t, --tolerance\n"
+				 "  apg and cd stop once the KKT violation relative to the largest entry of A^T b is this small. (default value is 1e-6)\n\n"
+				 "-m, --max-iterations\n"
+				 "  apg and cd stop after this many iterations. (default value is 10000)\n\n"
+				 "-B, --batch\n"
+				 "  with a rare percent of 1 and a dense sensing matrix, build A once and solve the samples against it in batches, so it is read once per batch instead of once per sample. lawson-hanson then solves the normal equations A^T A x = A^T b rather than A itself with householder transformations, which squares the condition number of A, so it can differ from the default in the last digits.\n\n"
+				 "-w, --warm-start\n"
+				 "  warm start the solver from a quikr solution file, or with previous from the last sample the same thread solved.\n\n"
+				 "-M, --max-memory\n"
+				 "  only start a sample when the memory it may need fits under this many bytes (K, M, G and T suffixes work) with the samples already running. Samples are taken largest first either way. (default is no limit)\n\n"
+				 "-R, --readers\n"
+				 "  read and count samples on this many threads of their own, into a queue the jobs solve from, so reading one sample overlaps solving another. 0 has every job read its own samples. (default value is 0)\n\n"
+				 "-Q, --queue-depth\n"
+				 "  with --readers, how many counted samples can wait for a solver before the readers stop to let them catch up. (default value is the number of jobs)\n\n"
+				 "-H, --huge-pages\n"
+				 "  back the memory every thread keeps for its samples' sensing matrices and solvers with transparent huge pages, where the kernel has them.\n\n"
 				 "-o, --output\n"
 				 "  the OTU table, with NUM_READS_PRESENT for each sample which is compatible with QIIME's convert_biom.py (or a sequence table if not OTU's)\n\n"
 				 "-v, --verbose\n"
@@ -45,6 +72,91 @@ void usage() {
 				 "  print version.\n");
 }
 
+// a size in bytes with an optional K, M, G or T suffix, or 0 if it can't be
+// parsed
+unsigned long long parse_size(const char *value) {
+	char *end = NULL;
+	unsigned long long size = 0;
+
+	errno = 0;
+	size = strtoull(value, &end, 10);
+	if(errno || end == value || value[0] == '-')
+		return 0;
+
+	switch(toupper(*end)) {
+		case 'T':
+			size <<= 10;
+			// fall through
+		case 'G':
+			size <<= 10;
+			// fall through
+		case 'M':
+			size <<= 10;
+			// fall through
+		case 'K':
+			size <<= 10;
+			end++;
+			break;
+		default:
+			break;
+	}
+
+	// allow KB, KiB and so on
+	if(*end != '\0' && strcasecmp(end, "B") != 0 && strcasecmp(end, "iB") != 0)
+		return 0;
+
+	return size;
+}
+
+// sensing matrix bytes in memory, mapped or not
+static unsigned long long sparse_memory(const struct sparse_matrix *sparse) {
+	return sparse->nnz * (sizeof(double) + sizeof(uint32_t)) + (sparse->rows + 1) * sizeof(unsigned long long);
+}
+
+// an upper bound on the bytes a sample needs on top of what every sample
+// shares, for --max-memory. We can't know how many kmers are rare before
+// counting, so A and the counts are sized as if every kmer is. A sample is
+// mapped while it is counted, compressed ones only keep a few buffers
+static unsigned long long sample_memory(const char *filename, unsigned long long size, const struct matrix *sensing_matrix, int shared, int gram, int single, int factor) {
+	const unsigned long long width = pow_four(sensing_matrix->kmer);
+	const unsigned long long sequences = sensing_matrix->sequences;
+	const unsigned long long rare_width = width + 1;
+	unsigned long long memory = 0;
+	unsigned char magic[2] = {0, 0};
+
+	FILE *fh = fopen(filename, "r");
+	if(fh != NULL) {
+		if(fread(magic, 1, 2, fh) != 2)
+			magic[0] = 0;
+		fclose(fh);
+	}
+
+	if(magic[0] == 0x1f && magic[1] == 0x8b)
+		memory += 4 << 20;
+	else
+		memory += size;
+
+	// the sample's counts, count_matrix and count_matrix_rare
+	memory += 3 * rare_width * sizeof(double);
+
+	// the solver's vectors, and the factor of set P when it keeps one
+	memory += 16 * (sequences + rare_width) * sizeof(double);
+	if(factor) {
+		unsigned long long passive = sequences < rare_width ? sequences : rare_width;
+		memory += 2 * passive * passive * sizeof(double);
+	}
+
+	// the sample's own copy of A
+	if(!shared && !gram) {
+		if(sensing_matrix->sparse != NULL)
+			memory += sparse_memory(sensing_matrix->sparse) + sequences * (sizeof(double) + sizeof(uint32_t));
+		else
+			memory += rare_width * sequences * (single ? sizeof(float) : sizeof(double));
+	}
+
+	return memory;
+}
+
 char **get_fasta_files_from_file(char *fn) {
 	char **files;
 	int files_count = 0;
@@ -100,6 +212,27 @@ char **get_fasta_files_from_file(char *fn) {
 	return files;
 }
 
+// fasta and fastq files, which can also be gzip'd or bgzip'd
+int is_sample_file(const char *filename) {
+	const char *extensions[] = { ".fasta", ".fa", ".fna", ".fastq", ".fq", NULL };
+	const char *compressed[] = { "", ".gz", ".bgz", NULL };
+	size_t len = strlen(filename);
+	int i = 0, j = 0;
+
+	for(i = 0; extensions[i] != NULL; i++) {
+		for(j = 0; compressed[j] != NULL; j++) {
+			size_t ext_len = strlen(extensions[i]) + strlen(compressed[j]);
+			if(len <= ext_len)
+				continue;
+			if(strncmp(filename + len - ext_len, extensions[i], strlen(extensions[i])) == 0 &&
+					strcmp(filename + len - strlen(compressed[j]), compressed[j]) == 0)
+				return 1;
+		}
+	}
+
+	return 0;
+}
+
 char **get_fasta_files_from_directory(char *directory) {
 
 	DIR *dh;
@@ -127,13 +260,12 @@ char **get_fasta_files_from_directory(char *directory) {
 		exit(EXIT_FAILURE);
 	}
 
-	headers = malloc(count * sizeof(char *));
+	headers = malloc((count + 1) * sizeof(char *));
 	check_malloc(headers, NULL);
 
 
 	int array_pos = 0;
 	for(i = 0; i < count; i++) {
-		char *ext = NULL;
 		e = readdir(dh);
 
 		if(strcmp(e->d_name, "..") == 0 || strcmp(e->d_name, ".") == 0) {
@@ -141,14 +273,8 @@ char **get_fasta_files_from_directory(char *directory) {
 			continue;
 		}
 
-		ext = strrchr(e->d_name, '.');
-
-		if(str_eq(ext, ".fasta") ||
-				str_eq(ext, ".fa") ||
-				str_eq(ext, ".fna"))
-		{
-
-			char *header = malloc(strlen(directory) + strlen(e->d_name) + 1);
+		if(is_sample_file(e->d_name)) {
+			char *header = malloc(strlen(directory) + strlen(e->d_name) + 2);
 			check_malloc(header, NULL);
 			sprintf(header, "%s/%s", directory, e->d_name);
 			headers[array_pos] = header;
@@ -167,6 +293,285 @@ char **get_fasta_files_from_directory(char *directory) {
 }
 
 
+// everything the threads working on samples share
+struct otu_run {
+	char **filenames;
+	unsigned long long dir_count;
+	struct matrix *sensing_matrix;
+	unsigned int kmer;
+	unsigned long long width;
+	unsigned long long lambda;
+	double rare_percent;
+	int single;
+	int verbose;
+	struct nnls_options *options;
+	double *warm_start;
+	// start every sample from the last one its thread solved
+	int warm_chain;
+	struct gram_matrix *gram;
+	struct sparse_matrix *shared_sparse;
+	// when set samples are only counted into their row of the batch, which
+	// starts at sample order[start]
+	double *batch;
+	size_t start;
+	const size_t *position;
+	unsigned long long *solutions;
+	unsigned long long *sample_sequences;
+	long done;
+	// give a sample's memory back to the system once it is solved, so
+	// --max-memory's budget is what is really allocated
+	int shrink;
+};
+
+// a sample read and counted, waiting to be solved. The buffers are kept for
+// the next sample
+struct counted_sample {
+	size_t sample;
+	double *count_matrix;
+	// normalized times lambda, with a zero on top for the row of ones
+	double *count_matrix_rare;
+	unsigned long long rare_value;
+	unsigned long long rare_width;
+};
+
+static void counted_sample_init(struct counted_sample *counted, unsigned long long width) {
+	memset(counted, 0, sizeof(struct counted_sample));
+
+	counted->count_matrix = malloc(width * sizeof(double));
+	check_malloc(counted->count_matrix, NULL);
+	counted->count_matrix_rare = malloc((width + 1) * sizeof(double));
+	check_malloc(counted->count_matrix_rare, NULL);
+}
+
+static void counted_sample_free(struct counted_sample *counted) {
+	free(counted->count_matrix);
+	free(counted->count_matrix_rare);
+}
+
+// what a thread keeps from one sample to the next, so once it has solved the
+// biggest it doesn't allocate any more, unless there is a --max-memory budget
+// to give the workspace back to
+struct otu_worker {
+	// the sample's A and the solver's working arrays
+	struct nnls_workspace workspace;
+	// the counts of the last sample it read, and what they became
+	struct sample sample;
+	struct counted_sample counted;
+	double *solution;
+	// the solution before, which chained warm starts start from
+	double *previous;
+};
+
+static void otu_worker_init(struct otu_worker *worker, const struct otu_run *run, int huge) {
+	nnls_workspace_init(&worker->workspace, huge);
+	memset(&worker->sample, 0, sizeof(struct sample));
+	counted_sample_init(&worker->counted, run->width);
+
+	worker->solution = malloc(run->sensing_matrix->sequences * sizeof(double));
+	check_malloc(worker->solution, NULL);
+	worker->previous = NULL;
+}
+
+static void otu_worker_free(struct otu_worker *worker) {
+	nnls_workspace_free(&worker->workspace);
+	free(worker->sample.counts);
+	counted_sample_free(&worker->counted);
+	free(worker->solution);
+	free(worker->previous);
+}
+
+// read sample i into counted, and pick its rare kmers, the part that waits on
+// the disk
+static void count_sample(struct otu_run *run, size_t i, struct sample *sample, struct counted_sample *counted) {
+	const unsigned long long width = run->width;
+	double *count_matrix = counted->count_matrix;
+	double *count_matrix_rare = counted->count_matrix_rare;
+	size_t x = 0;
+	size_t y = 0;
+
+	printf("processing %s\n", run->filenames[i]);
+
+	counted->sample = i;
+
+	// read the sample once for both its kmers and its sequence count, and
+	// convert our matrix into doubles
+	read_sample_into(run->filenames[i], run->kmer, 1, sample);
+
+	run->sample_sequences[i] = sample->sequences;
+	printf("%s has %llu sequences\n", run->filenames[i], sample->sequences);
+	if(run->verbose)
+		printf("%s has %llu bases, %llu kmers skipped\n", run->filenames[i], sample->bases, sample->skipped);
+
+	for(x = 0; x < width; x++) {
+		count_matrix[x] = (double)sample->counts[x];
+	}
+
+	// get_rare_value
+	get_rare_value(count_matrix, width, run->rare_percent, &counted->rare_value, &counted->rare_width);
+
+	if(run->verbose)
+		printf("there are %llu values less than %llu\n", counted->rare_width, counted->rare_value);
+
+	// add a extra space for our zero's array, so we can set the first column to 1's
+	unsigned long long rare_width = ++counted->rare_width;
+
+	// copy only kmers from our original counts that match our rareness percentage
+	//
+	// y = 1 because we are offsetting the array by 1, so we can set the first row to all 1's
+	for(x = 0, y = 1;  x < width; x++) {
+		if(count_matrix[x] <= counted->rare_value) {
+			count_matrix_rare[y] = count_matrix[x];
+			y++;
+		}
+	}
+
+	normalize_matrix(count_matrix_rare, 1, rare_width);
+
+	// multiply our kmer counts by lambda
+	for(x = 1; x < rare_width; x++)
+		count_matrix_rare[x] *= run->lambda;
+
+	// count_matrix's first element should be zero
+	count_matrix_rare[0] = 0;
+}
+
+// solve a counted sample with a worker's memory
+static void solve_counted(struct otu_run *run, struct counted_sample *counted, struct otu_worker *worker) {
+	const struct matrix *sensing_matrix = run->sensing_matrix;
+	const unsigned long long sequences = sensing_matrix->sequences;
+	const unsigned long long rare_width = counted->rare_width;
+	double *count_matrix = counted->count_matrix;
+	double *count_matrix_rare = counted->count_matrix_rare;
+	struct nnls_workspace *workspace = &worker->workspace;
+	size_t i = counted->sample;
+
+	double *solution = NULL;
+
+	// the batch is solved together once every sample in it is counted
+	if(run->batch != NULL) {
+		memcpy(&run->batch[(run->position[i] - run->start) * rare_width], count_matrix_rare, rare_width * sizeof(double));
+		return;
+	}
+
+	// the sample's A comes off the workspace too, and goes back with the rest
+	size_t mark = nnls_workspace_mark(workspace);
+
+	struct nnls_options sample_options = *run->options;
+	sample_options.start = run->warm_start;
+	if(worker->previous != NULL)
+		sample_options.start = worker->previous;
+	sample_options.workspace = workspace;
+	sample_options.solution = worker->solution;
+
+	if(run->gram != NULL) {
+		double *atb = nnls_workspace_alloc(workspace, sequences * sizeof(double));
+		check_malloc(atb, NULL);
+
+		gram_atb(run->gram, sensing_matrix, count_matrix_rare, atb);
+		solution = nnls_gram(run->gram->gram, atb, sequences, rare_width, &sample_options);
+	}
+	else if(run->shared_sparse != NULL) {
+		solution = nnls_sparse(run->shared_sparse, count_matrix_rare, sequences, rare_width, &sample_options);
+	}
+	else if(sensing_matrix->sparse != NULL) {
+		// the rare kmers of our sensing matrix, normalized, times lambda and
+		// with one's stacked in the first column
+		const struct sparse_matrix *sparse = sensing_matrix->sparse;
+		struct sparse_matrix sensing_matrix_rare;
+
+		sensing_matrix_rare.row_ptr = nnls_workspace_alloc(workspace, (sparse->rows + 1) * sizeof(unsigned long long));
+		sensing_matrix_rare.column = nnls_workspace_alloc(workspace, (sparse->nnz + sparse->rows) * sizeof(uint32_t));
+		sensing_matrix_rare.values = nnls_workspace_alloc(workspace, (sparse->nnz + sparse->rows) * sizeof(double));
+		uint32_t *rare_column = nnls_workspace_alloc(workspace, sparse->columns * sizeof(uint32_t));
+		check_malloc(sensing_matrix_rare.row_ptr, NULL);
+		check_malloc(sensing_matrix_rare.column, NULL);
+		check_malloc(sensing_matrix_rare.values, NULL);
+		check_malloc(rare_column, NULL);
+
+		gather_sparse_rare_into(sparse, count_matrix, counted->rare_value, rare_width, run->lambda, &sensing_matrix_rare, rare_column);
+
+		solution = nnls_sparse(&sensing_matrix_rare, count_matrix_rare, sequences, rare_width, &sample_options);
+	}
+	else {
+		// the same kmers from our sensing matrix, normalized, times lambda and
+		// with one's stacked in the first column
+		double *scratch = nnls_workspace_alloc(workspace, sequences * sizeof(double));
+		check_malloc(scratch, NULL);
+
+		if(run->single) {
+			float *sensing_matrix_rare = nnls_workspace_alloc(workspace, rare_width * sequences * sizeof(float));
+			check_malloc(sensing_matrix_rare, NULL);
+
+			gather_rare_into(sensing_matrix, count_matrix, counted->rare_value, rare_width, run->lambda, NULL, sensing_matrix_rare, scratch);
+			solution = nnls_dense_float(sensing_matrix_rare, count_matrix_rare, sequences, rare_width, &sample_options);
+		}
+		else {
+			double *sensing_matrix_rare = nnls_workspace_alloc(workspace, rare_width * sequences * sizeof(double));
+			check_malloc(sensing_matrix_rare, NULL);
+
+			gather_rare_into(sensing_matrix, count_matrix, counted->rare_value, rare_width, run->lambda, sensing_matrix_rare, NULL, scratch);
+
+			// householder nnls can't warm start, but the normal equation
+			// and apg solvers can work on the same matrix
+			if(sample_options.start != NULL || sample_options.solver == NNLS_SOLVER_APG || sample_options.screen) {
+				solution = nnls_dense(sensing_matrix_rare, count_matrix_rare, sequences, rare_width, &sample_options);
+			}
+			else {
+				nnls_into(sensing_matrix_rare, count_matrix_rare, sequences, rare_width, worker->solution, 1, workspace);
+				solution = worker->solution;
+			}
+		}
+	}
+
+	nnls_workspace_release(workspace, mark);
+	if(run->shrink)
+		nnls_workspace_shrink(workspace);
+
+	// normalize our solution
+	normalize_matrix(solution, 1, sequences);
+
+	// add the current solution to the solutions array
+	for(unsigned long long z = 0; z < sequences; z++ )  {
+		run->solutions[sequences*i + z] = (unsigned long long)round(solution[z] * run->sample_sequences[i]);
+	}
+
+	run->done++;
+	printf("%ld/%llu samples processed\n", run->done, run->dir_count);
+
+	// the next sample starts from this one, and is solved into the other
+	if(run->warm_chain) {
+		if(worker->previous == NULL) {
+			worker->previous = malloc(sequences * sizeof(double));
+			check_malloc(worker->previous, NULL);
+		}
+		worker->solution = worker->previous;
+		worker->previous = solution;
+	}
+}
+
+struct reader {
+	struct otu_run *run;
+	struct scheduler *scheduler;
+	struct work_queue *queue;
+	// counted samples the solvers are done with
+	struct work_queue *spare;
+	struct sample sample;
+};
+
+// count samples as the scheduler hands them out, for the solvers to take
+static void *reader_thread(void *arg) {
+	struct reader *reader = arg;
+
+	for(size_t i = scheduler_next(reader->scheduler); i != SIZE_MAX; i = scheduler_next(reader->scheduler)) {
+		struct counted_sample *counted = work_queue_pop(reader->spare);
+		count_sample(reader->run, i, &reader->sample, counted);
+		work_queue_push(reader->queue, counted);
+	}
+
+	work_queue_finish(reader->queue);
+	return NULL;
+}
+
 int main(int argc, char **argv) {
 
 	int c;
@@ -187,7 +592,8 @@ int main(int argc, char **argv) {
 	double rare_percent = 1.0;
 
 	unsigned int jobs = 1;
-	long done = 0;
+	int readers = 0;
+	size_t queue_depth = 0;
 
 	unsigned long long dir_count = 0;
 
@@ -199,7 +605,18 @@ int main(int argc, char **argv) {
 		jobs = sysconf (_SC_NPROCESSORS_ONLN);
 	#endif
 
+	int solver = NNLS_SOLVER_LAWSON_HANSON;
+	char *warm_start_filename = NULL;
+
+	struct nnls_options options;
+	nnls_default_options(&options);
+
 	int verbose = 0;
+	int single = 0;
+	unsigned long long max_memory = 0;
+	int huge_pages = 0;
+	// solve dense samples in batches against one shared A, see --batch
+	int batch_solve = 0;
 
 	static struct option long_options[] = {
 		{"input-directory", required_argument, 0, 'i'},
@@ -210,6 +627,17 @@ int main(int argc, char **argv) {
 		{"output", required_argument, 0, 'o'},
 		{"sensing-matrix", required_argument, 0, 's'},
 		{"rare-percent", required_argument, 0, 'r'},
+		{"solver", required_argument, 0, 'S'},
+		{"warm-start", required_argument, 0, 'w'},
+		{"tolerance", required_argument, 0, 't'},
+		{"max-iterations", required_argument, 0, 'm'},
+		{"screen", no_argument, 0, 'x'},
+		{"float", no_argument, 0, 'F'},
+		{"max-memory", required_argument, 0, 'M'},
+		{"readers", required_argument, 0, 'R'},
+		{"queue-depth", required_argument, 0, 'Q'},
+		{"huge-pages", no_argument, 0, 'H'},
+		{"batch", no_argument, 0, 'B'},
 		{"verbose", no_argument, 0, 'v'},
 		{"help", no_argument, 0, 'h'},
 		{"version", no_argument, 0, 'V'},
@@ -219,7 +647,7 @@ int main(int argc, char **argv) {
 	while (1) {
 		int option_index = 0;
 
-		c = getopt_long (argc, argv, "f:k:l:s:i:o:j:r:hvV", long_options, &option_index);
+		c = getopt_long (argc, argv, "f:k:l:s:i:o:j:r:S:w:t:m:M:R:Q:xFHBhvV", long_options, &option_index);
 
 		if (c == -1)
 			break;
@@ -249,6 +677,55 @@ int main(int argc, char **argv) {
 			case 's':
 				sensing_matrix_filename = optarg;
 				break;
+			case 'S':
+				solver = nnls_solver_from_name(optarg);
+				if(solver == -1) {
+					fprintf(stderr, "Error: unknown solver %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'w':
+				warm_start_filename = optarg;
+				break;
+			case 't':
+				options.tolerance = atof(optarg);
+				break;
+			case 'm':
+				options.max_iterations = atoll(optarg);
+				break;
+			case 'x':
+				options.screen = 1;
+				break;
+			case 'F':
+				single = 1;
+				break;
+			case 'M':
+				max_memory = parse_size(optarg);
+				if(max_memory == 0) {
+					fprintf(stderr, "Error: could not parse the memory limit %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'R':
+				readers = atoi(optarg);
+				if(readers < 0) {
+					fprintf(stderr, "Error: readers can't be negative\n");
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'Q':
+				if(atoi(optarg) < 1) {
+					fprintf(stderr, "Error: the queue depth must be positive\n");
+					exit(EXIT_FAILURE);
+				}
+				queue_depth = atoi(optarg);
+				break;
+			case 'H':
+				huge_pages = 1;
+				break;
+			case 'B':
+				batch_solve = 1;
+				break;
 			case 'v':
 				verbose = 1;
 				break;
@@ -290,11 +767,42 @@ int main(int argc, char **argv) {
 		exit(EXIT_FAILURE);
 	}
 
+	// jobs is unsigned, so a negative -j shows up as a huge one
+	if((int)jobs < 1) {
+		fprintf(stderr, "Error: jobs must be at least 1\n");
+		exit(EXIT_FAILURE);
+	}
+
 	if(rare_percent <= 0 || rare_percent > 1.0) {
 		fprintf(stderr, "Error: rare percent must be between 0 and 1\n");
 		exit(EXIT_FAILURE);
 	}
 
+	// the gram matrix is only the same for every sample when we keep every kmer
+	if((solver == NNLS_SOLVER_GRAM || solver == NNLS_SOLVER_CD) && rare_percent != 1.0) {
+		fprintf(stderr, "Error: the gram and cd solvers need a rare percent of 1\n");
+		exit(EXIT_FAILURE);
+	}
+
+	// the gram matrix is already as small as it gets
+	if(single && (solver == NNLS_SOLVER_GRAM || solver == NNLS_SOLVER_CD)) {
+		fprintf(stderr, "Error: --float works with the lawson-hanson and apg solvers\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if(options.tolerance <= 0 || options.max_iterations < 1) {
+		fprintf(stderr, "Error: tolerance and max iterations must be positive\n");
+		exit(EXIT_FAILURE);
+	}
+
+	// by default the readers keep every solver busy with one sample in hand
+	if(queue_depth == 0)
+		queue_depth = jobs;
+
+	// the threads go to the samples, so every solve is serial
+	options.solver = solver;
+	options.jobs = 1;
+
 	if(verbose) {
 		printf("kmer: %u\n", kmer);
 		printf("rare: %lf\n", rare_percent);
@@ -304,6 +812,9 @@ int main(int argc, char **argv) {
 		printf("sensing database: %s\n", sensing_matrix_filename);
 		printf("output: %s\n", output_filename);
 		printf("number of jobs to run at once: %d\n", jobs);
+		if(readers > 0)
+			printf("readers: %d, queue depth: %zu\n", readers, queue_depth);
+		printf("precision: %s\n", single ? "single" : "double");
 	}
 
 	if(access (sensing_matrix_filename, F_OK) == -1) {
@@ -335,7 +846,6 @@ int main(int argc, char **argv) {
 	width = pow(4, kmer);
 
 	struct matrix *sensing_matrix = load_sensing_matrix(sensing_matrix_filename, kmer);
-	double *sensing_matrix_ptr = sensing_matrix->matrix;
 	unsigned long long sequences = sensing_matrix->sequences;
 
 	if(verbose) {
@@ -344,121 +854,265 @@ int main(int argc, char **argv) {
 		printf("sequences: %llu\n", sequences);
 	}
 
+	// a solution to start every sample from, or the previous sample's
+	double *warm_start = NULL;
+	int warm_chain = 0;
+	if(warm_start_filename != NULL) {
+		if(str_eq(warm_start_filename, "previous"))
+			warm_chain = 1;
+		else
+			warm_start = load_solution(warm_start_filename, sequences);
+	}
+
+	// computed once and shared by every sample
+	struct gram_matrix *gram = NULL;
+	if(solver == NNLS_SOLVER_GRAM || solver == NNLS_SOLVER_CD)
+		gram = load_gram_matrix(sensing_matrix_filename, sensing_matrix, lambda, jobs);
+
 	unsigned long long *solutions = malloc(dir_count * sequences * sizeof(unsigned long long));
 	check_malloc(solutions, NULL);
 
-	long long *file_sequence_count = calloc(dir_count, sizeof(long long));
-	check_malloc(file_sequence_count, NULL);
+	unsigned long long *sample_sequences = calloc(dir_count, sizeof(unsigned long long));
+	check_malloc(sample_sequences, NULL);
 
 	#ifdef OMP
 		omp_set_num_threads(jobs);
 	#endif
 
+	// with every kmer kept A is the same for every sample, so build it once and
+	// share it between the threads instead of giving each sample its own copy.
+	// Dense matrices are only shared when asked to be, and then solved in
+	// batches so A is streamed once per batch. A shared A is only read, so
+	// lawson-hanson goes through the normal equations instead of householder,
+	// which is less accurate on an ill conditioned A
+	double *shared_a = NULL;
+	float *shared_a_float = NULL;
+	struct sparse_matrix *shared_sparse = NULL;
+	size_t batch_size = dir_count;
+
+	if(rare_percent == 1.0 && gram == NULL) {
+		unsigned long long rare_width = width + 1;
+
+		if(sensing_matrix->sparse != NULL) {
+			shared_sparse = gather_sparse_rare(sensing_matrix->sparse, NULL, 0, rare_width, lambda);
+		}
+		else if(batch_solve && single) {
+			shared_a_float = gather_dense_rare_float(sensing_matrix, NULL, 0, rare_width, lambda);
 
-		printf("Beginning to process samples\n");
+			batch_size = jobs * 16;
+		}
+		else if(batch_solve) {
+			shared_a = gather_dense_rare(sensing_matrix, NULL, 0, rare_width, lambda);
 
-	#pragma omp parallel for shared(solutions, sensing_matrix_ptr, done)
-	for(size_t i = 0; i < dir_count; i++ ) {
+			// enough samples to keep every thread busy
+			batch_size = jobs * 16;
+		}
+	}
 
-		size_t x = 0;
-		size_t y = 0;
-		size_t z = 0;
+	int batched = shared_a != NULL || shared_a_float != NULL;
 
-		unsigned long long file_sequence_count = 0;
-		unsigned long long rare_value = 0;
-		unsigned long long rare_width = 0;
+	double *batch = NULL;
+	if(batched) {
+		batch = malloc(batch_size * (width + 1) * sizeof(double));
+		check_malloc(batch, NULL);
+	}
 
-		printf("processing %s\n", filenames[i]);
-		file_sequence_count = count_sequences(filenames[i]);
-		printf("%s has %llu sequences\n", filenames[i],  file_sequence_count);
+	// what every sample shares, which comes off the top of --max-memory
+	unsigned long long shared_memory = dir_count * sequences * sizeof(unsigned long long);
+	if(sensing_matrix->map != NULL)
+		shared_memory += sensing_matrix->map_size;
+	else
+		shared_memory += sequences * width * sizeof(double);
+	if(gram != NULL)
+		shared_memory += sequences * sequences * sizeof(double);
+	if(shared_a != NULL)
+		shared_memory += (width + 1) * sequences * sizeof(double);
+	if(shared_a_float != NULL)
+		shared_memory += (width + 1) * sequences * sizeof(float);
+	if(shared_sparse != NULL)
+		shared_memory += sparse_memory(shared_sparse);
+	if(batched)
+		shared_memory += batch_size * (width + 1 + 2 * sequences) * sizeof(double);
+
+	if(max_memory != 0 && shared_memory >= max_memory) {
+		fprintf(stderr, "Error: the sensing matrix and solutions alone take %llu bytes, more than --max-memory\n", shared_memory);
+		exit(EXIT_FAILURE);
+	}
 
-		// load counts matrix
-		double *count_matrix = malloc(width * sizeof(double));
-		check_malloc(count_matrix, NULL);
+	// the bigger a sample the longer it takes, so starting with the biggest
+	// ones keeps a big one from holding everyone up at the end
+	unsigned long long *sample_size = malloc(dir_count * sizeof(unsigned long long));
+	check_malloc(sample_size, NULL);
+	unsigned long long *sample_estimate = malloc(dir_count * sizeof(unsigned long long));
+	check_malloc(sample_estimate, NULL);
+	size_t *order = malloc(dir_count * sizeof(size_t));
+	check_malloc(order, NULL);
+	size_t *position = malloc(dir_count * sizeof(size_t));
+	check_malloc(position, NULL);
+
+	// lawson-hanson keeps a factor of set P unless it is householder nnls
+	int factor = solver != NNLS_SOLVER_APG && (gram != NULL || sensing_matrix->sparse != NULL || warm_start != NULL || warm_chain || options.screen);
+
+	for(i = 0; i < dir_count; i++) {
+		struct stat st;
+		sample_size[i] = stat(filenames[i], &st) == 0 ? (unsigned long long)st.st_size : 0;
+		sample_estimate[i] = sample_memory(filenames[i], sample_size[i], sensing_matrix, shared_sparse != NULL || batched, gram != NULL, single, factor);
+	}
 
-		// convert our matrix into  doubles
-		{
-			unsigned long long *integer_counts = get_kmer_counts_from_file(filenames[i], kmer);
+	schedule_largest_first(sample_size, dir_count, order);
+	for(i = 0; i < dir_count; i++)
+		position[order[i]] = i;
 
-			for(x = 0; x < width; x++) {
-				count_matrix[x] = (double)integer_counts[x];
-			}
+	if(verbose) {
+		printf("memory shared by every sample: %llu bytes\n", shared_memory);
+		if(max_memory != 0)
+			printf("memory left for samples: %llu bytes\n", max_memory - shared_memory);
+	}
 
-			free(integer_counts);
-		}
+	unsigned long long peak_memory = 0;
+	struct queue_stats queue_stats;
+	memset(&queue_stats, 0, sizeof(struct queue_stats));
 
-		// get_rare_value
-		get_rare_value(count_matrix, width, rare_percent, &rare_value, &rare_width);
+	struct otu_run run = {
+		filenames, dir_count, sensing_matrix, kmer, width, lambda, rare_percent, single, verbose,
+		&options, warm_start, warm_chain, gram, shared_sparse, batch, 0, position, solutions, sample_sequences, 0, max_memory != 0
+	};
 
-		if(verbose)
-			printf("there are %llu values less than %llu\n", rare_width, rare_value);
+	// every solver thread keeps its memory from sample to sample
+	struct otu_worker *workers = malloc(jobs * sizeof(struct otu_worker));
+	check_malloc(workers, NULL);
+	for(unsigned int j = 0; j < jobs; j++)
+		otu_worker_init(&workers[j], &run, huge_pages);
+
+	// with readers the counted samples go round between them and the solvers,
+	// there are enough for every reader and solver to hold one with the queue
+	// full
+	struct reader *reader_state = NULL;
+	struct counted_sample *spares = NULL;
+	struct work_queue spare;
+	size_t spare_count = readers + queue_depth + jobs;
+
+	if(readers > 0) {
+		reader_state = calloc(readers, sizeof(struct reader));
+		check_malloc(reader_state, NULL);
+
+		spares = malloc(spare_count * sizeof(struct counted_sample));
+		check_malloc(spares, NULL);
+		work_queue_init(&spare, spare_count, 1);
+		for(size_t s = 0; s < spare_count; s++) {
+			counted_sample_init(&spares[s], width);
+			work_queue_push(&spare, &spares[s]);
+		}
+	}
 
-		// add a extra space for our zero's array, so we can set the first column to 1's
-		rare_width++;
+	printf("Beginning to process samples\n");
 
-		// store our count matrix
-		double *count_matrix_rare = calloc(rare_width, sizeof(double));
-		check_malloc(count_matrix_rare, NULL);
+	for(size_t start = 0; start < dir_count; start += batch_size) {
+		size_t end = start + batch_size < dir_count ? start + batch_size : dir_count;
 
-		double *sensing_matrix_rare = calloc(rare_width * sequences, sizeof(double));
-		check_malloc(sensing_matrix_rare, NULL);
+		run.start = start;
 
-		// copy only kmers from our original counts that match our rareness percentage
-		// in both our count matrix and our sensing matrix
-		//
-		// y = 1 because we are offsetting the array by 1, so we can set the first row to all 1's
-		for(x = 0, y = 1;  x < width; x++) {
-			if(count_matrix[x] <= rare_value) {
-				count_matrix_rare[y] = count_matrix[x];
+		// the threads take samples from the scheduler until it runs out, so a
+		// thread that finishes early just takes the next one
+		struct scheduler scheduler;
+		scheduler_init(&scheduler, &order[start], sample_estimate, end - start, max_memory ? max_memory - shared_memory : 0);
 
-				for(z = 0; z < sequences; z++)
-					sensing_matrix_rare[z*rare_width + y] = sensing_matrix_ptr[z*width + x];
+		if(readers == 0) {
+			#pragma omp parallel shared(run)
+			{
+				struct otu_worker *worker = &workers[omp_get_thread_num()];
 
-				y++;
+				for(size_t i = scheduler_next(&scheduler); i != SIZE_MAX; scheduler_done(&scheduler, i), i = scheduler_next(&scheduler)) {
+					count_sample(&run, i, &worker->sample, &worker->counted);
+					solve_counted(&run, &worker->counted, worker);
+				}
 			}
 		}
+		else {
+			// the readers count samples into the queue while the solvers empty
+			// it, so a sample is read while the one before it is solved. A
+			// sample's memory is given back once it is solved
+			struct work_queue queue;
+			work_queue_init(&queue, queue_depth, readers);
+
+			pthread_t *threads = malloc(readers * sizeof(pthread_t));
+			check_malloc(threads, NULL);
+
+			for(int r = 0; r < readers; r++) {
+				reader_state[r].run = &run;
+				reader_state[r].scheduler = &scheduler;
+				reader_state[r].queue = &queue;
+				reader_state[r].spare = &spare;
+				if(pthread_create(&threads[r], NULL, reader_thread, &reader_state[r]) != 0) {
+					fprintf(stderr, "Error: could not start reader %d\n", r);
+					exit(EXIT_FAILURE);
+				}
+			}
 
+			#pragma omp parallel shared(run, queue, spare)
+			{
+				struct otu_worker *worker = &workers[omp_get_thread_num()];
+				struct counted_sample *counted = NULL;
 
-		// normalize our kmer counts and our sensing_matrix
-		normalize_matrix(count_matrix_rare, 1, rare_width);
-		normalize_matrix(sensing_matrix_rare, sequences, rare_width);
-
-		// multiply our kmer counts and sensing matrix by lambda
-		for(x = 1; x < rare_width; x++)
-			count_matrix_rare[x] *= lambda;
-
-		//TODO use one loop
-		for(x = 0; x < sequences; x++) {
-			for(y = 1; y < rare_width; y++) {
-				sensing_matrix_rare[rare_width*x + y] *= lambda;
+				while((counted = work_queue_pop(&queue)) != NULL) {
+					solve_counted(&run, counted, worker);
+					scheduler_done(&scheduler, counted->sample);
+					work_queue_push(&spare, counted);
+				}
 			}
-		}
 
-		// count_matrix's first element should be zero
-		count_matrix_rare[0] = 0;
-		// stack one's on our first row of our sensing matrix
-		for(x = 0; x < sequences; x++) {
-			sensing_matrix_rare[x*rare_width] = 1.0;
+			for(int r = 0; r < readers; r++)
+				pthread_join(threads[r], NULL);
+			free(threads);
+
+			queue_stats.taken += queue.stats.taken;
+			queue_stats.waiting += queue.stats.waiting;
+			if(queue.stats.most > queue_stats.most)
+				queue_stats.most = queue.stats.most;
+			queue_stats.full_wait += queue.stats.full_wait;
+			queue_stats.empty_wait += queue.stats.empty_wait;
+			work_queue_free(&queue);
 		}
 
-		double *solution = nnls(sensing_matrix_rare, count_matrix_rare, sequences, rare_width);
+		if(scheduler.peak > peak_memory)
+			peak_memory = scheduler.peak;
+		scheduler_free(&scheduler);
+
+		if(batched) {
+			struct nnls_options batch_options = options;
+			batch_options.start = warm_start;
+			batch_options.jobs = jobs;
 
-		// normalize our solution
-		normalize_matrix(solution, 1, sequences);
+			double *batch_solutions = NULL;
+			if(shared_a_float != NULL)
+				batch_solutions = nnls_batch_float(shared_a_float, batch, end - start, sequences, width + 1, &batch_options, warm_chain);
+			else
+				batch_solutions = nnls_batch(shared_a, batch, end - start, sequences, width + 1, &batch_options, warm_chain);
 
-		// add the current solution to the solutions array
-		for(unsigned long long z = 0; z < sequences; z++ )  {
-			solutions[sensing_matrix->sequences*i + z] = (unsigned long long)round(solution[z] * file_sequence_count);
+			for(size_t p = start; p < end; p++) {
+				size_t i = order[p];
+				double *solution = &batch_solutions[(p - start) * sequences];
+
+				normalize_matrix(solution, 1, sequences);
+				for(unsigned long long z = 0; z < sequences; z++ )
+					solutions[sequences*i + z] = (unsigned long long)round(solution[z] * sample_sequences[i]);
+
+				run.done++;
+				printf("%ld/%llu samples processed\n", run.done, dir_count);
+			}
+
+			free(batch_solutions);
 		}
+	}
 
-		done++;
-		printf("%ld/%llu samples processed\n", done, dir_count);
-		free(solution);
-		free(count_matrix_rare);
-		free(count_matrix);
-		free(sensing_matrix_rare);
+	if(verbose && readers > 0 && queue_stats.taken > 0) {
+		printf("queue: on average %.2f of %zu samples waiting when a solver took one, at most %zu\n", (double)queue_stats.waiting / queue_stats.taken, queue_depth, queue_stats.most);
+		printf("readers waited %.3f s for room in the queue, solvers waited %.3f s for samples\n", queue_stats.full_wait, queue_stats.empty_wait);
 	}
 
+	if(verbose)
+		printf("most memory the samples were estimated to need at once: %llu bytes\n", peak_memory);
+
 	// output our matrix
 	FILE *output_fh = fopen(output_filename, "w");
 	if(output_fh == NULL) {
@@ -494,5 +1148,33 @@ int main(int argc, char **argv) {
 	}
 	fclose(output_fh);
 
+	free(solutions);
+	free(sample_sequences);
+	free(sample_size);
+	free(sample_estimate);
+	free(order);
+	free(position);
+	free(warm_start);
+	for(unsigned int j = 0; j < jobs; j++)
+		otu_worker_free(&workers[j]);
+	free(workers);
+	if(readers > 0) {
+		for(int r = 0; r < readers; r++)
+			free(reader_state[r].sample.counts);
+		free(reader_state);
+		for(size_t s = 0; s < spare_count; s++)
+			counted_sample_free(&spares[s]);
+		free(spares);
+		work_queue_free(&spare);
+	}
+	free(batch);
+	free(shared_a);
+	free(shared_a_float);
+	if(shared_sparse != NULL)
+		free_sparse_matrix(shared_sparse);
+	if(gram != NULL)
+		free_gram_matrix(gram);
+	free_sensing_matrix(sensing_matrix);
+
 	return EXIT_SUCCESS;
 }
@@ -34,9 +34,165 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <math.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "nnls.h"
+#include "quikr.h"
+#include "vector.h"
+
 #define MAX(a,b) ((a) >= (b) ? (a) : (b))
+#define MIN(a,b) ((a) <= (b) ? (a) : (b))
 #define ABS(x) ((x) >= 0 ? (x) : -(x))
 
+/*
+ *  Workspaces. The buffer is a stack: a solver marks it, takes its arrays off
+ *  the top and releases the mark when it returns. Once one allocation doesn't
+ *  fit, it and everything after it are malloc'd on the side, and freed again
+ *  with the mark they were taken after. When the outermost mark is released
+ *  the buffer is regrown to the peak, so the next solve of the same size
+ *  fits.
+ */
+#define NNLS_WORKSPACE_ALIGN 64
+#define NNLS_HUGE_PAGE ((size_t)2 << 20)
+
+struct nnls_spill {
+  void *p;
+  /* where it would have started in the buffer */
+  size_t offset;
+};
+
+void nnls_workspace_init(struct nnls_workspace *workspace, int huge) {
+  memset(workspace, 0, sizeof(struct nnls_workspace));
+  workspace->huge = huge;
+}
+
+/* free what spilled from offset on */
+static void nnls_workspace_spill_free(struct nnls_workspace *workspace, size_t offset) {
+  while(workspace->spill_count > 0 && workspace->spill[workspace->spill_count - 1].offset >= offset)
+    free(workspace->spill[--workspace->spill_count].p);
+}
+
+static void nnls_workspace_unmap(struct nnls_workspace *workspace) {
+  if(workspace->mapped)
+    munmap(workspace->buffer, workspace->size);
+  else
+    free(workspace->buffer);
+  workspace->buffer = NULL;
+  workspace->size = 0;
+  workspace->mapped = 0;
+}
+
+/* if this fails the buffer stays empty and everything spills */
+static void nnls_workspace_grow(struct nnls_workspace *workspace, size_t size) {
+  void *buffer = NULL;
+
+  nnls_workspace_unmap(workspace);
+
+  if(workspace->huge) {
+    size = (size + NNLS_HUGE_PAGE - 1) & ~(NNLS_HUGE_PAGE - 1);
+    buffer = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(buffer != MAP_FAILED) {
+#ifdef MADV_HUGEPAGE
+      madvise(buffer, size, MADV_HUGEPAGE);
+#endif
+      workspace->buffer = buffer;
+      workspace->size = size;
+      workspace->mapped = 1;
+      return;
+    }
+  }
+
+  if(posix_memalign(&buffer, NNLS_WORKSPACE_ALIGN, size) == 0) {
+    workspace->buffer = buffer;
+    workspace->size = size;
+  }
+}
+
+void nnls_workspace_free(struct nnls_workspace *workspace) {
+  nnls_workspace_spill_free(workspace, 0);
+  free(workspace->spill);
+  nnls_workspace_unmap(workspace);
+  workspace->spill = NULL;
+  workspace->spill_alloc = 0;
+}
+
+void *nnls_workspace_alloc(struct nnls_workspace *workspace, size_t size) {
+  void *p;
+
+  size = (MAX(size, 1) + NNLS_WORKSPACE_ALIGN - 1) & ~(size_t)(NNLS_WORKSPACE_ALIGN - 1);
+
+  if(workspace->spill_count == 0 && workspace->in_buffer + size <= workspace->size) {
+    p = workspace->buffer + workspace->in_buffer;
+    workspace->in_buffer += size;
+  }
+  else {
+    if(workspace->spill_count == workspace->spill_alloc) {
+      size_t spill_alloc = workspace->spill_alloc ? workspace->spill_alloc * 2 : 16;
+      struct nnls_spill *spill = realloc(workspace->spill, spill_alloc * sizeof(struct nnls_spill));
+      if(spill == NULL)
+        return NULL;
+      workspace->spill = spill;
+      workspace->spill_alloc = spill_alloc;
+    }
+    p = malloc(size);
+    if(p == NULL)
+      return NULL;
+    workspace->spill[workspace->spill_count].p = p;
+    workspace->spill[workspace->spill_count++].offset = workspace->used;
+  }
+
+  workspace->used += size;
+  workspace->peak = MAX(workspace->peak, workspace->used);
+  return p;
+}
+
+void *nnls_workspace_calloc(struct nnls_workspace *workspace, size_t count, size_t size) {
+  void *p = nnls_workspace_alloc(workspace, count * size);
+  if(p != NULL)
+    memset(p, 0, count * size);
+  return p;
+}
+
+size_t nnls_workspace_mark(struct nnls_workspace *workspace) {
+  workspace->depth++;
+  return workspace->used;
+}
+
+void nnls_workspace_release(struct nnls_workspace *workspace, size_t mark) {
+  nnls_workspace_spill_free(workspace, mark);
+  workspace->used = mark;
+  workspace->in_buffer = MIN(workspace->in_buffer, mark);
+
+  if(--workspace->depth == 0 && workspace->peak > workspace->size)
+    nnls_workspace_grow(workspace, workspace->peak);
+}
+
+void nnls_workspace_shrink(struct nnls_workspace *workspace) {
+  if(workspace->depth != 0)
+    return;
+  nnls_workspace_unmap(workspace);
+  workspace->peak = 0;
+}
+
+/* the workspace a solver takes its arrays from, a temporary one if it wasn't
+ * given one, which nnls_workspace_leave frees without growing */
+static struct nnls_workspace *nnls_workspace_enter(struct nnls_workspace *workspace, struct nnls_workspace *local, size_t *mark) {
+  if(workspace == NULL) {
+    nnls_workspace_init(local, 0);
+    workspace = local;
+  }
+  *mark = nnls_workspace_mark(workspace);
+  return workspace;
+}
+
+static void nnls_workspace_leave(struct nnls_workspace *workspace, struct nnls_workspace *local, size_t mark) {
+  if(workspace == local)
+    nnls_workspace_free(local);
+  else
+    nnls_workspace_release(workspace, mark);
+}
+
 int64_t h12( int64_t mode, int64_t lpivot, int64_t l1, int64_t m, double *u, int64_t u_dim1, double *up, double *cm, int64_t ice, int64_t icv, int64_t ncv) {
   double d1,  b, clinv, cl, sm;
   int64_t k, j;
@@ -124,17 +280,24 @@ int64_t h12( int64_t mode, int64_t lpivot, int64_t l1, int64_t m, double *u, int
   for (j =0; j < ncv; j++) {
     sm = cm[ lpivot * ice + j * icv ] * (up[0]);
 
-    for (k=l1; k<m; k++) 
-      sm += cm[ k * ice + j*icv ] * u[ k*u_dim1 ]; 
+    // our columns are contiguous, which the vector kernels need
+    if (ice == 1 && u_dim1 == 1)
+      sm += vector_dot(&cm[ l1 + j*icv ], &u[ l1 ], m - l1);
+    else
+      for (k=l1; k<m; k++) 
+        sm += cm[ k * ice + j*icv ] * u[ k*u_dim1 ]; 
 
     if (sm != 0.0) {
       sm *= (1/b); 
       // cm[lpivot, j] = ..
       cm[ lpivot * ice + j*icv] += sm * (up[0]);
-      for (k= l1; k<m; k++) 
-      {
-        cm[ k*ice + j*icv] += u[k * u_dim1]*sm;
-      }
+      if (ice == 1 && u_dim1 == 1)
+        vector_axpy(sm, &u[ l1 ], &cm[ l1 + j*icv ], m - l1);
+      else
+        for (k= l1; k<m; k++) 
+        {
+          cm[ k*ice + j*icv] += u[k * u_dim1]*sm;
+        }
     }
   }
 
@@ -167,7 +330,11 @@ void g1(double a, double b, double *cterm, double *sterm, double *sig)
 } 
 
 
-int64_t nnls_algorithm(double *a, int64_t m,int64_t n, double *b, double *x, double *rnorm) {
+/* Loops over the columns of A go parallel once they touch this many
+ * elements, below it the threads cost more than they save */
+#define NNLS_PARALLEL_WORK 65536
+
+int64_t nnls_algorithm(double *a, int64_t m,int64_t n, double *b, double *x, double *rnorm, int jobs, struct nnls_workspace *workspace) {
   int64_t pfeas;
   int ret=0;
   int64_t iz;
@@ -181,12 +348,17 @@ int64_t nnls_algorithm(double *a, int64_t m,int64_t n, double *b, double *x, dou
   if(m <= 0 || n <= 0 || a == NULL || b == NULL || x == NULL) 
     return(2);
 
-  /* Allocate memory for working space, if required */
-  double *w = calloc(n, sizeof(double));
-  double *zz = calloc(m, sizeof(double));
-  int64_t *index = calloc(n, sizeof(int64_t));
-  if(w == NULL || zz == NULL || index == NULL) 
+  /* Take the working space from the workspace */
+  struct nnls_workspace local;
+  size_t mark;
+  workspace = nnls_workspace_enter(workspace, &local, &mark);
+  double *w = nnls_workspace_calloc(workspace, n, sizeof(double));
+  double *zz = nnls_workspace_calloc(workspace, m, sizeof(double));
+  int64_t *index = nnls_workspace_calloc(workspace, n, sizeof(int64_t));
+  if(w == NULL || zz == NULL || index == NULL) {
+    nnls_workspace_leave(workspace, &local, mark);
     return(2);
+  }
 
   /* Initialize the arrays INDEX[] and X[] */
   for(k=0; k<n; k++) {
@@ -210,12 +382,10 @@ int64_t nnls_algorithm(double *a, int64_t m,int64_t n, double *b, double *x, dou
 
   while(iz1 <= iz2 && nsetp < m) {
     /* Compute components of the dual (negative gradient) vector W[] */
+    #pragma omp parallel for private(j) num_threads(jobs) if(jobs > 1 && (iz2 - iz1 + 1) * (m - npp1) > NNLS_PARALLEL_WORK)
     for(iz=iz1; iz<=iz2; iz++) {
       j=index[iz];
-      sm=0.;
-      for(l=npp1; l<m; l++) 
-        sm+=a[j*m + l]*b[l];
-      w[j]=sm;
+      w[j]=vector_dot(&a[j*m + npp1], &b[npp1], m - npp1);
     }
 
     while(1) {
@@ -277,6 +447,8 @@ int64_t nnls_algorithm(double *a, int64_t m,int64_t n, double *b, double *x, dou
     nsetp=npp1;
 
     if(iz1<=iz2) {
+     /* every column only reads column j, so they can go at once */
+     #pragma omp parallel for private(jj) num_threads(jobs) if(jobs > 1 && (iz2 - iz1 + 1) * (m - nsetp) > NNLS_PARALLEL_WORK)
      for(jz=iz1; jz<=iz2; jz++) {
         jj=index[jz];
         h12(2, nsetp-1, npp1, m, &a[j*m +0], 1, &up, &a[jj*m +0], 1, m, 1);
@@ -332,7 +504,9 @@ int64_t nnls_algorithm(double *a, int64_t m,int64_t n, double *b, double *x, dou
           for(j=jj+1; j<nsetp; j++) {
             ii=index[j]; index[j-1]=ii;
             g1(a[ii*m + (j-1)], a[ii*m + j], &cc, &ss, &a[ii*m + j-1]);
-            for(a[ii*m + j]=0., l=0; l<n; l++) if(l!=ii) {
+            a[ii*m + j]=0.;
+            #pragma omp parallel for private(temp) num_threads(jobs) if(jobs > 1 && n > NNLS_PARALLEL_WORK / 16)
+            for(l=0; l<n; l++) if(l!=ii) {
               /* Apply procedure G2 (CC,SS,A(J-1,L),A(J,L)) */
               temp=a[l*m + j-1];
               a[l*m + j-1]=cc*temp+ss*a[l*m + j];
@@ -387,16 +561,28 @@ int64_t nnls_algorithm(double *a, int64_t m,int64_t n, double *b, double *x, dou
     *rnorm=sqrt(sm);
   } 
 
-  /* Free working space, if it was allocated here */
-  free(w);
-  free(zz);
-  free(index);
+  /* Give the working space back */
+  nnls_workspace_leave(workspace, &local, mark);
   return(ret);
 }
 /* nnls_ */
 
 
-double *nnls(double *a_matrix, double *b_matrix, int64_t height, int64_t width) {
+int try_nnls_into(double *a_matrix, double *b_matrix, int64_t height, int64_t width, double *x, int jobs, struct nnls_workspace *workspace) {
+  return nnls_algorithm(a_matrix, width, height, b_matrix, x, NULL, jobs, workspace);
+}
+
+void nnls_into(double *a_matrix, double *b_matrix, int64_t height, int64_t width, double *x, int jobs, struct nnls_workspace *workspace) {
+  int ret = try_nnls_into(a_matrix, b_matrix, height, width, x, jobs, workspace);
+  if(ret == 1) {
+    printf("NNLS has reached the maximum iterations\n");
+  } else if(ret == 2) {
+    fprintf(stderr, "NNLS could not allocate enough memory\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+double *nnls(double *a_matrix, double *b_matrix, int64_t height, int64_t width, int jobs) {
 
   double *solution = calloc(height, sizeof(double));
 
@@ -405,13 +591,1264 @@ double *nnls(double *a_matrix, double *b_matrix, int64_t height, int64_t width)
     exit(EXIT_FAILURE);
   }
 
-  int ret = nnls_algorithm(a_matrix, width, height, b_matrix, solution, NULL);
+  nnls_into(a_matrix, b_matrix, height, width, solution, jobs, NULL);
+
+  return solution;
+}
+
+
+/*
+ *  Lawson-Hanson in normal equation form.
+ *
+ *  nnls_algorithm() triangularizes the columns of A in place, which needs A as
+ *  a dense matrix we are allowed to destroy. This version follows the same
+ *  main and secondary loops, but solves the least squares problem on set P
+ *  through a Cholesky factor of the gram matrix of the columns in P, and takes
+ *  the dual vector from the residual, so A is only read through the operator.
+ *  That lets A stay sparse.
+ *
+ *  A candidate column is rejected when the part of it that is orthogonal to
+ *  the columns already in P is below NNLS_DEPENDENCE_TOL relative to its norm,
+ *  which plays the part of the unorm test in nnls_algorithm().
+ */
+#define NNLS_DEPENDENCE_TOL 1e-10
+
+struct nnls_normal_state {
+  struct nnls_workspace *workspace;
+  int64_t cap;
+  /* gram matrix of the columns in P, in the order of index[], leading dim cap */
+  double *gpp;
+  /* its lower Cholesky factor */
+  double *chol;
+  double *z;
+};
+
+static int nnls_normal_reserve(struct nnls_normal_state *s, int64_t size) {
+  int64_t cap = s->cap, i;
+  double *gpp, *chol;
+
+  if(size <= s->cap)
+    return 0;
+
+  while(cap < size)
+    cap = cap ? cap * 2 : 16;
+
+  /* the old ones are only given back with the rest of the workspace, which
+   * the doubling bounds to a third more than the last */
+  gpp = nnls_workspace_calloc(s->workspace, cap * cap, sizeof(double));
+  chol = nnls_workspace_calloc(s->workspace, cap * cap, sizeof(double));
+  if(gpp == NULL || chol == NULL)
+    return 2;
+  for(i = 0; i < s->cap; i++) {
+    memcpy(&gpp[i * cap], &s->gpp[i * s->cap], s->cap * sizeof(double));
+    memcpy(&chol[i * cap], &s->chol[i * s->cap], s->cap * sizeof(double));
+  }
+  s->gpp = gpp;
+  s->chol = chol;
+  s->z = nnls_workspace_calloc(s->workspace, cap, sizeof(double));
+  if(s->z == NULL)
+    return 2;
+  s->cap = cap;
+  return 0;
+}
+
+/* Add row p of the Cholesky factor, from row p of gpp. Returns the pivot
+ * squared, which is the squared norm of the new column orthogonal to the
+ * columns before it. */
+static double nnls_normal_chol_row(struct nnls_normal_state *s, int64_t p) {
+  int64_t i, k, ld = s->cap;
+  double d, sm;
+
+  for(i = 0; i < p; i++) {
+    sm = s->gpp[p * ld + i];
+    for(k = 0; k < i; k++)
+      sm -= s->chol[p * ld + k] * s->chol[i * ld + k];
+    s->chol[p * ld + i] = sm / s->chol[i * ld + i];
+  }
+  d = s->gpp[p * ld + p];
+  for(k = 0; k < p; k++)
+    d -= s->chol[p * ld + k] * s->chol[p * ld + k];
+  s->chol[p * ld + p] = d > 0. ? sqrt(d) : 0.;
+  return d;
+}
+
+/* Solve for the coefficients of the columns in P into z */
+static void nnls_normal_solve(struct nnls_normal_state *s, int64_t nsetp, const int64_t *index, const double *atb) {
+  int64_t i, k, ld = s->cap;
+  double sm;
+
+  for(i = 0; i < nsetp; i++) {
+    sm = atb[index[i]];
+    for(k = 0; k < i; k++)
+      sm -= s->chol[i * ld + k] * s->z[k];
+    s->z[i] = sm / s->chol[i * ld + i];
+  }
+  for(i = nsetp - 1; i >= 0; i--) {
+    sm = s->z[i];
+    for(k = i + 1; k < nsetp; k++)
+      sm -= s->chol[k * ld + i] * s->z[k];
+    s->z[i] = sm / s->chol[i * ld + i];
+  }
+}
+
+/* Drop the column at position ip of P, and refactor */
+static void nnls_normal_remove(struct nnls_normal_state *s, int64_t nsetp, int64_t ip) {
+  int64_t i, j, ld = s->cap;
+
+  for(i = ip; i < nsetp - 1; i++)
+    for(j = 0; j < nsetp; j++)
+      s->gpp[i * ld + j] = s->gpp[(i + 1) * ld + j];
+  for(i = 0; i < nsetp - 1; i++)
+    for(j = ip; j < nsetp - 1; j++)
+      s->gpp[i * ld + j] = s->gpp[i * ld + j + 1];
+
+  /* rows of the factor before ip don't change */
+  for(i = ip; i < nsetp - 1; i++)
+    nnls_normal_chol_row(s, i);
+}
+
+/* The secondary loop: z holds the solution on set P, interpolate from x
+ * towards it and drop coefficients from P until z is feasible. Returns 1 if
+ * we run out of iterations */
+static int nnls_normal_feasible(struct nnls_normal_state *s, int64_t *index, int64_t *nsetp, double *x, const double *atb, int64_t *iter, int64_t itmax) {
+  int64_t k, l, ip, jj = 0;
+  double alpha, t;
+
+  while(++(*iter) < itmax) {
+    /* See if all new constrained coeffs are feasible; if not, compute alpha */
+    for(alpha = 2.0, ip = 0; ip < *nsetp; ip++) {
+      l = index[ip];
+      if(s->z[ip] <= 0.) {
+        t = -x[l] / (s->z[ip] - x[l]);
+        if(alpha > t) {
+          alpha = t;
+          jj = ip;
+        }
+      }
+    }
+
+    if(alpha == 2.0)
+      break;
+
+    /* Use alpha (0.<alpha<1.) to interpolate between old X and new Z */
+    for(ip = 0; ip < *nsetp; ip++) {
+      l = index[ip];
+      x[l] += alpha * (s->z[ip] - x[l]);
+    }
+    x[index[jj]] = 0.;
+
+    /* Move every coefficient that is not positive from set P to set Z */
+    for(ip = *nsetp - 1; ip >= 0; ip--) {
+      k = index[ip];
+      if(x[k] <= 0.) {
+        x[k] = 0.;
+        nnls_normal_remove(s, *nsetp, ip);
+        for(l = ip; l < *nsetp - 1; l++)
+          index[l] = index[l + 1];
+        index[*nsetp - 1] = k;
+        (*nsetp)--;
+      }
+    }
+
+    nnls_normal_solve(s, *nsetp, index, atb);
+  }
+
+  return *iter >= itmax;
+}
+
+int64_t nnls_normal_algorithm(const struct nnls_operator *op, const double *atb, double *x, const double *start) {
+  int64_t m = op->m, n = op->n;
+  int64_t iz, j = 0, k, ip, izmax = 0, itmax;
+  int64_t nsetp = 0, iter = 0;
+  double wmax, d;
+  int ret = 0;
+
+  struct nnls_workspace local;
+  size_t mark;
+  struct nnls_normal_state s = {NULL, 0, NULL, NULL, NULL};
+
+  if(m <= 0 || n <= 0 || atb == NULL || x == NULL)
+    return(2);
+
+  s.workspace = nnls_workspace_enter(op->workspace, &local, &mark);
+
+  double *w = nnls_workspace_calloc(s.workspace, n, sizeof(double));
+  double *g = nnls_workspace_calloc(s.workspace, MIN(m, n) + 1, sizeof(double));
+  int64_t *index = nnls_workspace_calloc(s.workspace, n, sizeof(int64_t));
+  if(w == NULL || g == NULL || index == NULL || nnls_normal_reserve(&s, 16)) {
+    nnls_workspace_leave(s.workspace, &local, mark);
+    return(2);
+  }
+
+  for(k = 0; k < n; k++) {
+    x[k] = 0.;
+    index[k] = k;
+  }
+
+  if(n < 3)
+    itmax = n * 3;
+  else
+    itmax = n * n;
+
+  /* A warm start puts the columns that are positive in start into set P, as
+   * long as they are independent, and starts from their coefficients. The
+   * secondary loop then makes the solution on P feasible, and the main loop
+   * carries on from there */
+  if(start != NULL) {
+    for(j = 0; j < n && nsetp < m; j++) {
+      if(start[j] <= 0.)
+        continue;
+
+      if(nnls_normal_reserve(&s, nsetp + 1)) {
+        ret = 2;
+        goto done;
+      }
+      index[j] = index[nsetp];
+      index[nsetp] = j;
+      op->gram(op, j, index, nsetp, g);
+      for(k = 0; k <= nsetp; k++) {
+        s.gpp[nsetp * s.cap + k] = g[k];
+        s.gpp[k * s.cap + nsetp] = g[k];
+      }
+      d = nnls_normal_chol_row(&s, nsetp);
+      if(d > g[nsetp] * NNLS_DEPENDENCE_TOL) {
+        x[j] = start[j];
+        nsetp++;
+      }
+      else {
+        index[nsetp] = index[j];
+        index[j] = j;
+      }
+    }
+
+    if(nsetp > 0) {
+      nnls_normal_solve(&s, nsetp, index, atb);
+      if(nnls_normal_feasible(&s, index, &nsetp, x, atb, &iter, itmax)) {
+        ret = 1;
+        goto done;
+      }
+      for(ip = 0; ip < nsetp; ip++)
+        x[index[ip]] = s.z[ip];
+    }
+  }
+
+  /* index[0..nsetp) is set P, index[nsetp..n) is set Z */
+  while(nsetp < n && nsetp < m) {
+    /* Compute components of the dual (negative gradient) vector W[] */
+    op->dual(op, x, index, nsetp, &index[nsetp], n - nsetp, w);
+
+    while(1) {
+      /* Find largest positive W[j] */
+      for(wmax = 0., iz = nsetp; iz < n; iz++) {
+        j = index[iz]; if(w[j] > wmax) {wmax = w[j]; izmax = iz;}}
+
+      if(wmax <= 0.)
+        break;
+
+      j = index[izmax];
+
+      /* Check that column j is sufficiently independent of set P, and that
+       * its proposed coefficient is positive */
+      if(nnls_normal_reserve(&s, nsetp + 1)) {
+        ret = 2;
+        goto done;
+      }
+      op->gram(op, j, index, nsetp, g);
+      for(k = 0; k <= nsetp; k++) {
+        s.gpp[nsetp * s.cap + k] = g[k];
+        s.gpp[k * s.cap + nsetp] = g[k];
+      }
+      d = nnls_normal_chol_row(&s, nsetp);
+      if(d > g[nsetp] * NNLS_DEPENDENCE_TOL) {
+        index[izmax] = index[nsetp];
+        index[nsetp] = j;
+        nnls_normal_solve(&s, nsetp + 1, index, atb);
+        if(s.z[nsetp] > 0.)
+          break;
+        index[nsetp] = index[izmax];
+        index[izmax] = j;
+      }
+
+      /* Reject j as a candidate to be moved from set Z to set P */
+      w[j] = 0.;
+    }
+
+    if(wmax <= 0.)
+      break;
+
+    /* Column j has been moved to the end of set P, and z holds the
+     * solution of the least squares problem on the new set P */
+    nsetp++;
+
+    if(nnls_normal_feasible(&s, index, &nsetp, x, atb, &iter, itmax)) {
+      ret = 1;
+      break;
+    }
+
+    for(ip = 0; ip < nsetp; ip++)
+      x[index[ip]] = s.z[ip];
+  } /* end of main loop */
+
+done:
+  nnls_workspace_leave(s.workspace, &local, mark);
+  return(ret);
+}
+
+
+/* A stored as a sparse matrix with one row per column of A */
+struct nnls_sparse_data {
+  const struct sparse_matrix *a;
+  const double *b;
+  double *scratch;
+};
+
+static void nnls_sparse_dual(const struct nnls_operator *op, const double *x, const int64_t *passive, int64_t nsetp, const int64_t *zset, int64_t nz, double *w) {
+  const struct nnls_sparse_data *data = op->data;
+  const struct sparse_matrix *a = data->a;
+  double *r = data->scratch;
+  unsigned long long l;
+  int64_t ip, iz;
+
+  /* r = b - A x, x is only nonzero in set P */
+  memcpy(r, data->b, op->m * sizeof(double));
+  for(ip = 0; ip < nsetp; ip++) {
+    int64_t j = passive[ip];
+    for(l = a->row_ptr[j]; l < a->row_ptr[j + 1]; l++)
+      r[a->column[l]] -= a->values[l] * x[j];
+  }
+
+  #pragma omp parallel for private(l) schedule(dynamic, 64) num_threads(op->jobs) if(op->jobs > 1)
+  for(iz = 0; iz < nz; iz++) {
+    int64_t j = zset[iz];
+    double sm = 0.;
+    for(l = a->row_ptr[j]; l < a->row_ptr[j + 1]; l++)
+      sm += a->values[l] * r[a->column[l]];
+    w[j] = sm;
+  }
+}
+
+static void nnls_sparse_gram(const struct nnls_operator *op, int64_t t, const int64_t *passive, int64_t nsetp, double *g) {
+  const struct nnls_sparse_data *data = op->data;
+  const struct sparse_matrix *a = data->a;
+  double *d = data->scratch;
+  unsigned long long l;
+  int64_t ip;
+  double sm = 0.;
+
+  /* scatter column t, dot it with every column in P, and clean up */
+  memset(d, 0, op->m * sizeof(double));
+  for(l = a->row_ptr[t]; l < a->row_ptr[t + 1]; l++) {
+    d[a->column[l]] = a->values[l];
+    sm += a->values[l] * a->values[l];
+  }
+  g[nsetp] = sm;
+
+  for(ip = 0; ip < nsetp; ip++) {
+    int64_t j = passive[ip];
+    sm = 0.;
+    for(l = a->row_ptr[j]; l < a->row_ptr[j + 1]; l++)
+      sm += a->values[l] * d[a->column[l]];
+    g[ip] = sm;
+  }
+}
+
+
+/* A only seen through its precomputed gram matrix G = A^T A */
+struct nnls_gram_data {
+  const double *gram;
+  const double *atb;
+};
+
+static void nnls_gram_dual(const struct nnls_operator *op, const double *x, const int64_t *passive, int64_t nsetp, const int64_t *zset, int64_t nz, double *w) {
+  const struct nnls_gram_data *data = op->data;
+  int64_t ip, iz;
+
+  /* w = A^T b - G x, x is only nonzero in set P */
+  #pragma omp parallel for private(ip) schedule(static) num_threads(op->jobs) if(op->jobs > 1)
+  for(iz = 0; iz < nz; iz++) {
+    int64_t j = zset[iz];
+    const double *row = &data->gram[j * op->n];
+    double sm = data->atb[j];
+    for(ip = 0; ip < nsetp; ip++)
+      sm -= row[passive[ip]] * x[passive[ip]];
+    w[j] = sm;
+  }
+}
+
+static void nnls_gram_gram(const struct nnls_operator *op, int64_t t, const int64_t *passive, int64_t nsetp, double *g) {
+  const struct nnls_gram_data *data = op->data;
+  const double *row = &data->gram[t * op->n];
+  int64_t ip;
+
+  for(ip = 0; ip < nsetp; ip++)
+    g[ip] = row[passive[ip]];
+  g[nsetp] = row[t];
+}
+
+
+/* A stored like nnls() takes it, one row per column of A, but read only.
+ * Either a or a_float is set, a single precision A is widened to double as it
+ * is read, so everything is still accumulated in double */
+struct nnls_dense_data {
+  const double *a;
+  const float *a_float;
+  const double *b;
+  double *scratch;
+};
+
+static double nnls_dense_dot(const struct nnls_dense_data *data, int64_t j, int64_t m, const double *y) {
+  if(data->a_float != NULL)
+    return vector_dot_float(&data->a_float[j * m], y, m);
+  return vector_dot(&data->a[j * m], y, m);
+}
+
+static void nnls_dense_dual(const struct nnls_operator *op, const double *x, const int64_t *passive, int64_t nsetp, const int64_t *zset, int64_t nz, double *w) {
+  const struct nnls_dense_data *data = op->data;
+  double *r = data->scratch;
+  int64_t ip, iz, m = op->m;
+
+  /* r = b - A x, x is only nonzero in set P */
+  memcpy(r, data->b, m * sizeof(double));
+  for(ip = 0; ip < nsetp; ip++) {
+    if(data->a_float != NULL)
+      vector_axpy_float(-x[passive[ip]], &data->a_float[passive[ip] * m], r, m);
+    else
+      vector_axpy(-x[passive[ip]], &data->a[passive[ip] * m], r, m);
+  }
+
+  #pragma omp parallel for schedule(static) num_threads(op->jobs) if(op->jobs > 1)
+  for(iz = 0; iz < nz; iz++)
+    w[zset[iz]] = nnls_dense_dot(data, zset[iz], m, r);
+}
+
+static void nnls_dense_gram(const struct nnls_operator *op, int64_t t, const int64_t *passive, int64_t nsetp, double *g) {
+  const struct nnls_dense_data *data = op->data;
+  const double *col_t = data->scratch;
+  int64_t ip, l, m = op->m;
+
+  /* widen column t once, the dual rebuilds the scratch space every time */
+  if(data->a_float != NULL)
+    for(l = 0; l < m; l++)
+      data->scratch[l] = data->a_float[t * m + l];
+  else
+    col_t = &data->a[t * m];
+
+  for(ip = 0; ip < nsetp; ip++)
+    g[ip] = nnls_dense_dot(data, passive[ip], m, col_t);
+  g[nsetp] = nnls_dense_dot(data, t, m, col_t);
+}
+
+
+/*
+ *  First order solvers. These trade the exact answer of the active set
+ *  method for a fixed cost per iteration, and stop once the KKT violation
+ *
+ *    max_j  x_j > 0 ? |w_j| : max(w_j, 0),  w = A^T (b - A x)
+ *
+ *  is below tolerance relative to max_j |(A^T b)_j|, or after max_iterations.
+ */
+void nnls_default_options(struct nnls_options *options) {
+  options->solver = NNLS_SOLVER_LAWSON_HANSON;
+  options->start = NULL;
+  options->tolerance = 1e-6;
+  options->max_iterations = 10000;
+  options->jobs = 1;
+  options->workspace = NULL;
+  options->solution = NULL;
+  options->screen = 0;
+  options->quiet = 0;
+  options->status = 0;
+  options->kkt = 0.;
+  options->iterations = 0;
+  options->screened = 0;
+  options->working = 0;
+}
+
+static double nnls_kkt(const double *x, const double *w, int64_t n) {
+  double kkt = 0., v;
+  int64_t j;
+
+  for(j = 0; j < n; j++) {
+    v = x[j] > 0. ? ABS(w[j]) : MAX(w[j], 0.);
+    kkt = MAX(kkt, v);
+  }
+  return kkt;
+}
+
+static double nnls_atb_scale(const double *atb, int64_t n) {
+  double scale = 0.;
+  int64_t j;
+
+  for(j = 0; j < n; j++)
+    scale = MAX(scale, ABS(atb[j]));
+  return scale > 0. ? scale : 1.;
+}
+
+/* the nonzero columns of x, for the operator's passive set */
+static int64_t nnls_support(const double *x, int64_t n, int64_t *support) {
+  int64_t j, k = 0;
+
+  for(j = 0; j < n; j++)
+    if(x[j] != 0.)
+      support[k++] = j;
+  return k;
+}
+
+/*
+ *  Accelerated projected gradient (FISTA) with adaptive restart. The step is
+ *  1/L, with L, the largest eigenvalue of A^T A, from a power iteration. Only
+ *  the operator's dual is used, which is A^T (b - A y), so this works on the
+ *  dense, sparse and gram operators alike. The momentum restarts whenever it
+ *  points against the last step.
+ *
+ *  A column at zero with a negative gradient stays at zero, and most of them
+ *  do for good, so between full steps the dual is only taken on the columns
+ *  that are positive. Every NNLS_APG_FULL iterations, more while nothing
+ *  new joins them, or once those satisfy the KKT conditions, a step takes
+ *  the gradient on every column, which is also the KKT check, so checking
+ *  costs nothing extra.
+ */
+#define NNLS_APG_FULL 10
+#define NNLS_APG_FULL_MOST 160
+#define NNLS_APG_POWER 30
+
+int64_t nnls_apg_algorithm(const struct nnls_operator *op, const double *atb, double *x, struct nnls_options *options) {
+  int64_t n = op->n, j, k, iter, nsupport, nactive, entered, last_full = 0, interval = NNLS_APG_FULL;
+  double lipschitz = 0., t = 1., t_next, scale, momentum, dot, norm, kkt;
+  int ret = 1, full = 1;
+
+  struct nnls_workspace local, *workspace;
+  size_t mark;
+  workspace = nnls_workspace_enter(op->workspace, &local, &mark);
+
+  double *y = nnls_workspace_alloc(workspace, n * sizeof(double));
+  double *w = nnls_workspace_alloc(workspace, n * sizeof(double));
+  double *x_next = nnls_workspace_alloc(workspace, n * sizeof(double));
+  int64_t *all = nnls_workspace_alloc(workspace, n * sizeof(int64_t));
+  int64_t *active = nnls_workspace_alloc(workspace, n * sizeof(int64_t));
+  int64_t *support = nnls_workspace_alloc(workspace, n * sizeof(int64_t));
+  if(y == NULL || w == NULL || x_next == NULL || all == NULL || active == NULL || support == NULL) {
+    nnls_workspace_leave(workspace, &local, mark);
+    return(2);
+  }
+
+  for(j = 0; j < n; j++)
+    all[j] = j;
+
+  /* power iteration, A^T A y = A^T b - w(y). A is non-negative, so the top
+   * eigenvalue stands well clear of the rest and this settles quickly */
+  for(j = 0; j < n; j++)
+    y[j] = 1. / sqrt((double)n);
+  for(k = 0; k < NNLS_APG_POWER; k++) {
+    op->dual(op, y, all, n, all, n, w);
+    for(norm = 0., j = 0; j < n; j++) {
+      w[j] = atb[j] - w[j];
+      norm += w[j] * w[j];
+    }
+    norm = sqrt(norm);
+    if(norm == 0.)
+      break;
+    if(ABS(norm - lipschitz) <= 1e-4 * norm) {
+      lipschitz = norm;
+      break;
+    }
+    lipschitz = norm;
+    for(j = 0; j < n; j++)
+      y[j] = w[j] / norm;
+  }
+  /* the power iteration approaches L from below */
+  lipschitz = lipschitz > 0. ? lipschitz * 1.05 : 1.;
+
+  for(j = 0; j < n; j++)
+    x[j] = options->start != NULL ? MAX(options->start[j], 0.) : 0.;
+  memcpy(y, x, n * sizeof(double));
+  memcpy(x_next, x, n * sizeof(double));
+
+  scale = nnls_atb_scale(atb, n);
+  nactive = 0;
+
+  for(iter = 1; iter <= options->max_iterations; iter++) {
+    const int64_t *zset = full ? all : active;
+    const int64_t nz = full ? n : nactive;
+
+    nsupport = nnls_support(y, n, support);
+    op->dual(op, y, support, nsupport, zset, nz, w);
+
+    /* the KKT conditions at y, which stops where it is if they hold */
+    for(kkt = 0., k = 0; k < nz; k++) {
+      j = zset[k];
+      kkt = MAX(kkt, y[j] > 0. ? ABS(w[j]) : MAX(w[j], 0.));
+    }
+    kkt /= scale;
+    if(full) {
+      options->kkt = kkt;
+      if(kkt <= options->tolerance) {
+        memcpy(x, y, n * sizeof(double));
+        ret = 0;
+        break;
+      }
+    }
+
+    for(dot = 0., entered = 0, k = 0; k < nz; k++) {
+      j = zset[k];
+      x_next[j] = MAX(y[j] + w[j] / lipschitz, 0.);
+      entered += x[j] == 0. && x_next[j] > 0.;
+      /* restart when the momentum works against the step */
+      dot += (y[j] - x_next[j]) * (x_next[j] - x[j]);
+    }
+
+    if(dot > 0.) {
+      t = 1.;
+      for(k = 0; k < nz; k++)
+        y[zset[k]] = x_next[zset[k]];
+    }
+    else {
+      t_next = (1. + sqrt(1. + 4. * t * t)) / 2.;
+      momentum = (t - 1.) / t_next;
+      for(k = 0; k < nz; k++) {
+        j = zset[k];
+        y[j] = MAX(x_next[j] + momentum * (x_next[j] - x[j]), 0.);
+      }
+      t = t_next;
+    }
+    for(k = 0; k < nz; k++)
+      x[zset[k]] = x_next[zset[k]];
+
+    /* what a full step left positive is all that moves until the next one.
+     * While full steps bring in no new columns they grow further apart */
+    if(full) {
+      last_full = iter;
+      nactive = nnls_support(x, n, active);
+      interval = entered > 0 ? NNLS_APG_FULL : MIN(interval * 2, NNLS_APG_FULL_MOST);
+    }
+    full = iter - last_full >= interval - 1 || (!full && kkt <= options->tolerance) || iter == options->max_iterations - 1;
+  }
+
+  options->iterations = MIN(iter, options->max_iterations);
+
+  nnls_workspace_leave(workspace, &local, mark);
+  return(ret);
+}
+
+/*
+ *  Cyclic coordinate descent on the gram matrix. Every coordinate is set to
+ *  its exact minimizer with the others fixed, and the gradient G x - A^T b
+ *  is kept up to date with one row of G, so a sweep costs n^2.
+ */
+int64_t nnls_cd_algorithm(const double *gram, const double *atb, int64_t n, double *x, struct nnls_options *options) {
+  int64_t j, k, iter;
+  double scale, d;
+  int ret = 1;
+
+  struct nnls_workspace local, *workspace;
+  size_t mark;
+  workspace = nnls_workspace_enter(options->workspace, &local, &mark);
+
+  double *w = nnls_workspace_alloc(workspace, n * sizeof(double));
+  if(w == NULL) {
+    nnls_workspace_leave(workspace, &local, mark);
+    return(2);
+  }
+
+  /* w is the negative gradient, A^T b - G x */
+  for(j = 0; j < n; j++)
+    x[j] = options->start != NULL ? MAX(options->start[j], 0.) : 0.;
+  for(j = 0; j < n; j++) {
+    double sm = atb[j];
+    for(k = 0; k < n; k++)
+      sm -= gram[j * n + k] * x[k];
+    w[j] = sm;
+  }
+
+  scale = nnls_atb_scale(atb, n);
+
+  for(iter = 1; iter <= options->max_iterations; iter++) {
+    for(j = 0; j < n; j++) {
+      const double *row = &gram[j * n];
+      if(row[j] <= 0.)
+        continue;
+
+      d = MAX(x[j] + w[j] / row[j], 0.) - x[j];
+      if(d == 0.)
+        continue;
+
+      x[j] += d;
+      vector_axpy(-d, row, w, n);
+    }
+
+    options->kkt = nnls_kkt(x, w, n) / scale;
+    if(options->kkt <= options->tolerance) {
+      ret = 0;
+      break;
+    }
+  }
+
+  options->iterations = MIN(iter, options->max_iterations);
+
+  nnls_workspace_leave(workspace, &local, mark);
+  return(ret);
+}
+
+/* the solver options picks on op, without screening */
+static int nnls_solve(const struct nnls_operator *op, const double *atb, double *x, struct nnls_options *options) {
+  if(options->solver == NNLS_SOLVER_APG)
+    return nnls_apg_algorithm(op, atb, x, options);
+
+  if(options->solver == NNLS_SOLVER_CD) {
+    const struct nnls_gram_data *data = op->data;
+    if(op->dual != nnls_gram_dual)
+      return 3;
+    return nnls_cd_algorithm(data->gram, atb, op->n, x, options);
+  }
+
+  return nnls_normal_algorithm(op, atb, x, options->start);
+}
+
+
+/* A restricted to the columns of a working set */
+struct nnls_subset_data {
+  const struct nnls_operator *op;
+  const int64_t *columns;
+  int64_t *passive;
+  int64_t *zset;
+  double *x;
+  double *w;
+};
+
+static void nnls_subset_dual(const struct nnls_operator *op, const double *x, const int64_t *passive, int64_t nsetp, const int64_t *zset, int64_t nz, double *w) {
+  const struct nnls_subset_data *data = op->data;
+  int64_t ip, iz;
+
+  /* data->x stays zero outside of the call */
+  for(ip = 0; ip < nsetp; ip++) {
+    data->passive[ip] = data->columns[passive[ip]];
+    data->x[data->passive[ip]] = x[passive[ip]];
+  }
+  for(iz = 0; iz < nz; iz++)
+    data->zset[iz] = data->columns[zset[iz]];
+
+  data->op->dual(data->op, data->x, data->passive, nsetp, data->zset, nz, data->w);
+
+  for(iz = 0; iz < nz; iz++)
+    w[zset[iz]] = data->w[data->zset[iz]];
+  for(ip = 0; ip < nsetp; ip++)
+    data->x[data->passive[ip]] = 0.;
+}
+
+static void nnls_subset_gram(const struct nnls_operator *op, int64_t t, const int64_t *passive, int64_t nsetp, double *g) {
+  const struct nnls_subset_data *data = op->data;
+  int64_t ip;
+
+  for(ip = 0; ip < nsetp; ip++)
+    data->passive[ip] = data->columns[passive[ip]];
+
+  data->op->gram(data->op, data->columns[t], data->passive, nsetp, g);
+}
+
+/*
+ *  Screening. Most database sequences end up at zero, so rather than solve
+ *  against every column we solve against a working set, seeded with the
+ *  columns best correlated with b, and check the KKT conditions on the rest.
+ *  The columns that violate them most join the working set, a few at a time,
+ *  until none do, so the answer is the one the full solve finds.
+ *
+ *  Each check also proves columns inactive for good. The first row of A is
+ *  all ones, so with t = max(0, max_j w_j), u = (b - A x) - t e_0 is feasible
+ *  for the dual, max b^T u - |u|^2 / 2 subject to A^T u <= 0. The optimal
+ *  residual r* is within R = sqrt(2 gap) of u, where the duality gap is
+ *
+ *    gap = -w^T x + t sum(x) + t^2 / 2,
+ *
+ *  so a_j^T r* < 0, and x*_j = 0, whenever w_j - t + |a_j| R < 0.
+ */
+#define NNLS_SCREEN_SEED 64
+/* the most columns that join the working set in a round */
+#define NNLS_SCREEN_GROW 16
+
+struct nnls_screen_seed {
+  double key;
+  int64_t column;
+};
+
+static int nnls_screen_compare(const void *a, const void *b) {
+  double ka = ((const struct nnls_screen_seed *)a)->key;
+  double kb = ((const struct nnls_screen_seed *)b)->key;
+  return (ka < kb) - (ka > kb);
+}
+
+int64_t nnls_screen_algorithm(const struct nnls_operator *op, const double *atb, double *x, struct nnls_options *options) {
+  int64_t n = op->n, j, k, count = 0, alive_count = 0, nsupport, added;
+  double scale, threshold, t, gap, radius, sx, wx;
+  int ret = 0;
+
+  struct nnls_workspace local, *workspace;
+  size_t mark;
+  workspace = nnls_workspace_enter(op->workspace, &local, &mark);
+
+  double *norm = nnls_workspace_alloc(workspace, n * sizeof(double));
+  double *w = nnls_workspace_alloc(workspace, n * sizeof(double));
+  double *sub_atb = nnls_workspace_alloc(workspace, n * sizeof(double));
+  double *sub_x = nnls_workspace_alloc(workspace, n * sizeof(double));
+  double *sub_start = nnls_workspace_alloc(workspace, n * sizeof(double));
+  double *full_x = nnls_workspace_calloc(workspace, n, sizeof(double));
+  double *full_w = nnls_workspace_alloc(workspace, n * sizeof(double));
+  int64_t *columns = nnls_workspace_alloc(workspace, n * sizeof(int64_t));
+  int64_t *alive = nnls_workspace_alloc(workspace, n * sizeof(int64_t));
+  int64_t *support = nnls_workspace_alloc(workspace, n * sizeof(int64_t));
+  int64_t *passive = nnls_workspace_alloc(workspace, n * sizeof(int64_t));
+  int64_t *zset = nnls_workspace_alloc(workspace, n * sizeof(int64_t));
+  char *working = nnls_workspace_calloc(workspace, n, sizeof(char));
+  struct nnls_screen_seed *seed = nnls_workspace_alloc(workspace, n * sizeof(struct nnls_screen_seed));
+  if(norm == NULL || w == NULL || sub_atb == NULL || sub_x == NULL || sub_start == NULL || full_x == NULL || full_w == NULL || columns == NULL || alive == NULL || support == NULL || passive == NULL || zset == NULL || working == NULL || seed == NULL) {
+    ret = 2;
+    goto done;
+  }
+
+  for(j = 0; j < n; j++) {
+    op->gram(op, j, NULL, 0, w);
+    norm[j] = sqrt(w[0]);
+    x[j] = 0.;
+  }
+
+  /* seed with the best correlated columns, and whatever we warm start from.
+   * Columns that share no kmers with the sample have a_j^T b = 0 and are
+   * left out */
+  for(j = 0; j < n; j++) {
+    if(atb[j] > 0. && norm[j] > 0.) {
+      seed[alive_count].key = atb[j] / norm[j];
+      seed[alive_count++].column = j;
+    }
+  }
+  qsort(seed, alive_count, sizeof(struct nnls_screen_seed), nnls_screen_compare);
+  for(k = 0; k < alive_count && k < MAX(NNLS_SCREEN_SEED, n / 16); k++)
+    working[seed[k].column] = 1;
+  if(options->start != NULL)
+    for(j = 0; j < n; j++)
+      if(options->start[j] > 0.)
+        working[j] = 1;
+
+  for(j = 0, alive_count = 0; j < n; j++) {
+    if(working[j])
+      columns[count++] = j;
+    alive[alive_count++] = j;
+  }
+
+  scale = nnls_atb_scale(atb, n);
+  threshold = options->solver == NNLS_SOLVER_APG || options->solver == NNLS_SOLVER_CD ? options->tolerance * scale : 0.;
+  options->screened = 0;
+  options->iterations = 0;
+
+  struct nnls_subset_data data = {op, columns, passive, zset, full_x, full_w};
+
+  while(count > 0) {
+    struct nnls_options sub_options = *options;
+    struct nnls_operator sub = {op->m, count, &data, nnls_subset_dual, nnls_subset_gram, op->jobs, workspace};
+
+    for(k = 0; k < count; k++) {
+      sub_atb[k] = atb[columns[k]];
+      sub_start[k] = x[columns[k]] > 0. ? x[columns[k]] : (options->start != NULL ? options->start[columns[k]] : 0.);
+    }
+    sub_options.start = sub_start;
+    sub_options.workspace = workspace;
+
+    if(options->solver == NNLS_SOLVER_CD) {
+      const struct nnls_gram_data *gram_data = op->data;
+      int64_t l;
+      if(op->dual != nnls_gram_dual) {
+        ret = 3;
+        goto done;
+      }
+      size_t sub_mark = nnls_workspace_mark(workspace);
+      double *sub_gram = nnls_workspace_alloc(workspace, count * count * sizeof(double));
+      if(sub_gram == NULL) {
+        nnls_workspace_release(workspace, sub_mark);
+        ret = 2;
+        goto done;
+      }
+      for(k = 0; k < count; k++)
+        for(l = 0; l < count; l++)
+          sub_gram[k * count + l] = gram_data->gram[columns[k] * n + columns[l]];
+      ret = nnls_cd_algorithm(sub_gram, sub_atb, count, sub_x, &sub_options);
+      nnls_workspace_release(workspace, sub_mark);
+    }
+    else {
+      ret = nnls_solve(&sub, sub_atb, sub_x, &sub_options);
+    }
+    options->kkt = sub_options.kkt;
+    options->iterations += sub_options.iterations;
+    if(ret != 0)
+      break;
+
+    for(k = 0; k < count; k++)
+      x[columns[k]] = sub_x[k];
+
+    /* check every column that isn't proven inactive */
+    nsupport = nnls_support(x, n, support);
+    op->dual(op, x, support, nsupport, alive, alive_count, w);
+
+    for(t = 0., k = 0; k < alive_count; k++)
+      t = MAX(t, w[alive[k]]);
+    for(sx = 0., wx = 0., k = 0; k < nsupport; k++) {
+      sx += x[support[k]];
+      wx += w[support[k]] * x[support[k]];
+    }
+    gap = MAX(-wx + t * sx + t * t / 2., 0.);
+    radius = sqrt(2. * gap);
+
+    for(added = 0, j = 0, k = 0; k < alive_count; k++) {
+      int64_t c = alive[k];
+      if(working[c]) {
+        alive[j++] = c;
+        continue;
+      }
+      if(w[c] - t + norm[c] * radius < 0.) {
+        options->screened++;
+        continue;
+      }
+      alive[j++] = c;
+      if(w[c] > threshold) {
+        seed[added].key = w[c];
+        seed[added++].column = c;
+      }
+    }
+    alive_count = j;
+
+    if(added == 0)
+      break;
+
+    /* only the worst violators join, the rest are checked again against the
+     * next solution, which usually satisfies most of them */
+    if(added > NNLS_SCREEN_GROW) {
+      qsort(seed, added, sizeof(struct nnls_screen_seed), nnls_screen_compare);
+      added = NNLS_SCREEN_GROW;
+    }
+    for(k = 0; k < added; k++)
+      working[seed[k].column] = 1;
+
+    for(j = 0, count = 0; j < n; j++)
+      if(working[j])
+        columns[count++] = j;
+  }
+
+  options->working = count;
+
+done:
+  nnls_workspace_leave(workspace, &local, mark);
+  return(ret);
+}
+
+/* report a solver's return code the way options asks for, returns nonzero if
+ * there is no solution */
+static int nnls_report(struct nnls_options *options, int ret) {
+  options->status = ret;
+
+  if(options->quiet)
+    return ret >= 2;
+
   if(ret == 1) {
     printf("NNLS has reached the maximum iterations\n");
   } else if(ret == 2) {
     fprintf(stderr, "NNLS could not allocate enough memory\n");
     exit(EXIT_FAILURE);
+  } else if(ret == 3) {
+    fprintf(stderr, "coordinate descent needs the gram matrix\n");
+    exit(EXIT_FAILURE);
+  }
+
+  return 0;
+}
+
+/* options->solution zeroed, or a new solution */
+static double *nnls_solution(struct nnls_options *options, int64_t height) {
+  double *solution = options->solution;
+
+  if(solution != NULL)
+    memset(solution, 0, height * sizeof(double));
+  else
+    solution = calloc(height, sizeof(double));
+
+  if(solution == NULL)
+    nnls_report(options, 2);
+
+  return solution;
+}
+
+/* give back a solution nnls_solution allocated */
+static void nnls_solution_free(const struct nnls_options *options, double *solution) {
+  if(solution != options->solution)
+    free(solution);
+}
+
+/* run the solver options picks on op, returns nonzero if there is no solution */
+static int nnls_run(const struct nnls_operator *op, const double *atb, double *x, struct nnls_options *options) {
+  int ret;
+
+  if(options->screen)
+    ret = nnls_screen_algorithm(op, atb, x, options);
+  else
+    ret = nnls_solve(op, atb, x, options);
+
+  return nnls_report(options, ret);
+}
+
+double *nnls_sparse(const struct sparse_matrix *a_matrix, const double *b_matrix, int64_t height, int64_t width, struct nnls_options *options) {
+  struct nnls_options defaults;
+  unsigned long long l;
+  int64_t j;
+
+  if(options == NULL) {
+    nnls_default_options(&defaults);
+    options = &defaults;
+  }
+
+  struct nnls_workspace local, *workspace;
+  size_t mark;
+  workspace = nnls_workspace_enter(options->workspace, &local, &mark);
+
+  double *solution = nnls_solution(options, height);
+  double *atb = nnls_workspace_alloc(workspace, height * sizeof(double));
+  double *scratch = nnls_workspace_alloc(workspace, width * sizeof(double));
+
+  if(solution == NULL || atb == NULL || scratch == NULL) {
+    nnls_report(options, 2);
+    nnls_solution_free(options, solution);
+    nnls_workspace_leave(workspace, &local, mark);
+    return NULL;
+  }
+
+  for(j = 0; j < height; j++) {
+    double sm = 0.;
+    for(l = a_matrix->row_ptr[j]; l < a_matrix->row_ptr[j + 1]; l++)
+      sm += a_matrix->values[l] * b_matrix[a_matrix->column[l]];
+    atb[j] = sm;
+  }
+
+  struct nnls_sparse_data data = {a_matrix, b_matrix, scratch};
+  struct nnls_operator op = {width, height, &data, nnls_sparse_dual, nnls_sparse_gram, options->jobs, workspace};
+
+  if(nnls_run(&op, atb, solution, options) != 0) {
+    nnls_solution_free(options, solution);
+    solution = NULL;
+  }
+
+  nnls_workspace_leave(workspace, &local, mark);
+
+  return solution;
+}
+
+double *nnls_gram(const double *gram, const double *atb, int64_t height, int64_t width, struct nnls_options *options) {
+  struct nnls_options defaults;
+
+  if(options == NULL) {
+    nnls_default_options(&defaults);
+    options = &defaults;
+  }
+
+  double *solution = nnls_solution(options, height);
+  if(solution == NULL)
+    return NULL;
+
+  struct nnls_gram_data data = {gram, atb};
+  struct nnls_operator op = {width, height, &data, nnls_gram_dual, nnls_gram_gram, options->jobs, options->workspace};
+
+  if(nnls_run(&op, atb, solution, options) != 0) {
+    nnls_solution_free(options, solution);
+    solution = NULL;
+  }
+
+  return solution;
+}
+
+static double *nnls_dense_run(const double *a_matrix, const float *a_float, const double *b_matrix, int64_t height, int64_t width, struct nnls_options *options) {
+  struct nnls_options defaults;
+  int64_t j;
+
+  if(options == NULL) {
+    nnls_default_options(&defaults);
+    options = &defaults;
+  }
+
+  struct nnls_workspace local, *workspace;
+  size_t mark;
+  workspace = nnls_workspace_enter(options->workspace, &local, &mark);
+
+  double *solution = nnls_solution(options, height);
+  double *atb = nnls_workspace_alloc(workspace, height * sizeof(double));
+  double *scratch = nnls_workspace_alloc(workspace, width * sizeof(double));
+
+  if(solution == NULL || atb == NULL || scratch == NULL) {
+    nnls_report(options, 2);
+    nnls_solution_free(options, solution);
+    nnls_workspace_leave(workspace, &local, mark);
+    return NULL;
+  }
+
+  struct nnls_dense_data data = {a_matrix, a_float, b_matrix, scratch};
+  struct nnls_operator op = {width, height, &data, nnls_dense_dual, nnls_dense_gram, options->jobs, workspace};
+
+  for(j = 0; j < height; j++)
+    atb[j] = nnls_dense_dot(&data, j, width, b_matrix);
+
+  if(nnls_run(&op, atb, solution, options) != 0) {
+    nnls_solution_free(options, solution);
+    solution = NULL;
   }
 
+  nnls_workspace_leave(workspace, &local, mark);
+
   return solution;
 }
+
+double *nnls_dense(const double *a_matrix, const double *b_matrix, int64_t height, int64_t width, struct nnls_options *options) {
+  return nnls_dense_run(a_matrix, NULL, b_matrix, height, width, options);
+}
+
+double *nnls_dense_float(const float *a_matrix, const double *b_matrix, int64_t height, int64_t width, struct nnls_options *options) {
+  return nnls_dense_run(NULL, a_matrix, b_matrix, height, width, options);
+}
+
+/* A^T B for every sample at once. A block of NNLS_BATCH_COLUMNS columns of A
+ * stays in cache while the samples stream past it, so A is only read from
+ * memory once rather than once per sample */
+#define NNLS_BATCH_COLUMNS 16
+#define NNLS_BATCH_ROWS 512
+
+static void nnls_batch_atb(const double *a, const float *a_float, const double *b, int64_t count, int64_t n, int64_t m, double *atb, int jobs) {
+  int64_t j0;
+
+  #pragma omp parallel for schedule(dynamic) num_threads(jobs)
+  for(j0 = 0; j0 < n; j0 += NNLS_BATCH_COLUMNS) {
+    int64_t j1 = MIN(j0 + NNLS_BATCH_COLUMNS, n), j, s, l0;
+
+    for(s = 0; s < count; s++)
+      for(j = j0; j < j1; j++)
+        atb[s * n + j] = 0.;
+
+    for(l0 = 0; l0 < m; l0 += NNLS_BATCH_ROWS) {
+      int64_t l1 = MIN(l0 + NNLS_BATCH_ROWS, m);
+      for(s = 0; s < count; s++) {
+        const double *bs = &b[s * m];
+        for(j = j0; j < j1; j++) {
+          if(a_float != NULL)
+            atb[s * n + j] += vector_dot_float(&a_float[j * m + l0], &bs[l0], l1 - l0);
+          else
+            atb[s * n + j] += vector_dot(&a[j * m + l0], &bs[l0], l1 - l0);
+        }
+      }
+    }
+  }
+}
+
+static double *nnls_batch_run(const double *a_matrix, const float *a_float, const double *b_matrix, int64_t count, int64_t height, int64_t width, struct nnls_options *options, int chain) {
+  struct nnls_options defaults;
+  int64_t s;
+  int64_t stopped = 0;
+  int status = 0;
+
+  if(options == NULL) {
+    nnls_default_options(&defaults);
+    options = &defaults;
+  }
+
+  int jobs = options->jobs > 0 ? options->jobs : 1;
+
+  /* chained samples are split into one run per thread, in order */
+  int64_t run = (count + jobs - 1) / jobs;
+
+  options->status = 0;
+
+  double *solutions = calloc(count * height, sizeof(double));
+  double *atb = malloc(count * height * sizeof(double));
+
+  if(solutions == NULL || atb == NULL) {
+    free(solutions);
+    free(atb);
+    nnls_report(options, 2);
+    return NULL;
+  }
+
+  nnls_batch_atb(a_matrix, a_float, b_matrix, count, height, width, atb, jobs);
+
+  /* every sample runs its own active set updates against the shared A, and
+   * every thread keeps one workspace for all of its samples */
+  /* the samples are solved quietly so nothing exits on a worker thread, and
+   * the batch reports their worst status once they are done */
+  #pragma omp parallel num_threads(jobs) reduction(max:status) reduction(+:stopped)
+  {
+    struct nnls_workspace workspace;
+    nnls_workspace_init(&workspace, options->workspace != NULL && options->workspace->huge);
+
+    #pragma omp for schedule(static, run)
+    for(s = 0; s < count; s++) {
+      struct nnls_options sample_options = *options;
+      sample_options.jobs = 1;
+      sample_options.workspace = &workspace;
+      sample_options.solution = NULL;
+      sample_options.quiet = 1;
+      if(chain && s % run != 0)
+        sample_options.start = &solutions[(s - 1) * height];
+
+      size_t mark = nnls_workspace_mark(&workspace);
+      double *scratch = nnls_workspace_alloc(&workspace, width * sizeof(double));
+      if(scratch == NULL) {
+        nnls_workspace_release(&workspace, mark);
+        status = MAX(status, 2);
+        continue;
+      }
+
+      struct nnls_dense_data data = {a_matrix, a_float, &b_matrix[s * width], scratch};
+      struct nnls_operator op = {width, height, &data, nnls_dense_dual, nnls_dense_gram, 1, &workspace};
+
+      nnls_run(&op, &atb[s * height], &solutions[s * height], &sample_options);
+      status = MAX(status, sample_options.status);
+      if(sample_options.status == 1)
+        stopped++;
+
+      /* the batch reports its worst sample */
+      #pragma omp critical
+      {
+        options->kkt = MAX(options->kkt, sample_options.kkt);
+        options->iterations = MAX(options->iterations, sample_options.iterations);
+      }
+
+      nnls_workspace_release(&workspace, mark);
+    }
+
+    nnls_workspace_free(&workspace);
+  }
+
+  free(atb);
+
+  if(status >= 2) {
+    free(solutions);
+    nnls_report(options, status);
+    return NULL;
+  }
+
+  /* like a solve at a time, one message for every sample that stopped */
+  for(s = 0; s < stopped; s++)
+    nnls_report(options, 1);
+  options->status = status;
+
+  return solutions;
+}
+
+double *nnls_batch(const double *a_matrix, const double *b_matrix, int64_t count, int64_t height, int64_t width, struct nnls_options *options, int chain) {
+  return nnls_batch_run(a_matrix, NULL, b_matrix, count, height, width, options, chain);
+}
+
+double *nnls_batch_float(const float *a_matrix, const double *b_matrix, int64_t count, int64_t height, int64_t width, struct nnls_options *options, int chain) {
+  return nnls_batch_run(NULL, a_matrix, b_matrix, count, height, width, options, chain);
+}
+
+int nnls_solver_from_name(const char *name) {
+  if(strcmp(name, "lawson-hanson") == 0)
+    return NNLS_SOLVER_LAWSON_HANSON;
+  if(strcmp(name, "gram") == 0)
+    return NNLS_SOLVER_GRAM;
+  if(strcmp(name, "apg") == 0)
+    return NNLS_SOLVER_APG;
+  if(strcmp(name, "cd") == 0)
+    return NNLS_SOLVER_CD;
+  return -1;
+}
@@ -1 +1,167 @@
-double *nnls(double *a_matrix, double *b_matrix, int height, int width);
+#include <stdint.h>
+#include <stddef.h>
+
+// the solvers quikr and multifasta_to_otu can use, see nnls_solver_from_name
+#define NNLS_SOLVER_LAWSON_HANSON 0
+#define NNLS_SOLVER_GRAM 1
+#define NNLS_SOLVER_APG 2
+#define NNLS_SOLVER_CD 3
+
+struct nnls_spill;
+struct sparse_matrix;
+
+// scratch memory the solvers take their working arrays from and give back
+// when they return. What doesn't fit is allocated on the side, and once the
+// outermost user gives everything back the buffer grows to the most that was
+// needed, so a thread that keeps one workspace for sample after sample stops
+// allocating after the first. Only one thread may use a workspace at a time
+struct nnls_workspace {
+	char *buffer;
+	size_t size;
+	// the bytes in use as if everything fit in the buffer, and the most of them
+	size_t used;
+	size_t peak;
+	// of used, the bytes at the start of the buffer. Once something spills
+	// everything after it does, so the buffer is always a prefix of used
+	size_t in_buffer;
+	struct nnls_spill *spill;
+	size_t spill_count;
+	size_t spill_alloc;
+	int depth;
+	// back the buffer with transparent huge pages, where there are any
+	int huge;
+	int mapped;
+};
+
+void nnls_workspace_init(struct nnls_workspace *workspace, int huge);
+void nnls_workspace_free(struct nnls_workspace *workspace);
+
+// take size bytes, 64 byte aligned, or NULL if they can't be allocated.
+// nnls_workspace_calloc zeroes them
+void *nnls_workspace_alloc(struct nnls_workspace *workspace, size_t size);
+void *nnls_workspace_calloc(struct nnls_workspace *workspace, size_t count, size_t size);
+
+// everything taken after a mark is given back by releasing it. Marks nest
+size_t nnls_workspace_mark(struct nnls_workspace *workspace);
+void nnls_workspace_release(struct nnls_workspace *workspace, size_t mark);
+// give the buffer back once nothing is taken, and forget how big it got, for a
+// thread that shouldn't hold on to its biggest sample's memory
+void nnls_workspace_shrink(struct nnls_workspace *workspace);
+
+// householder nnls, which destroys a_matrix. The loops over the columns of A
+// run on jobs threads
+double *nnls(double *a_matrix, double *b_matrix, int64_t height, int64_t width, int jobs);
+
+// nnls() into a height long x, with its working arrays from workspace, or
+// allocated if it is NULL
+void nnls_into(double *a_matrix, double *b_matrix, int64_t height, int64_t width, double *x, int jobs, struct nnls_workspace *workspace);
+// the same, but returns instead of printing or exiting: 0, 1 if the maximum
+// iterations were reached (x still holds where it got to) or 2 if it ran out
+// of memory
+int try_nnls_into(double *a_matrix, double *b_matrix, int64_t height, int64_t width, double *x, int jobs, struct nnls_workspace *workspace);
+
+// the operator nnls_normal_algorithm reads A through
+struct nnls_operator {
+	int64_t m;
+	int64_t n;
+	void *data;
+	// w[j] = a_j . (b - A x) for the nz columns j in zset, x is zero outside of
+	// the nsetp columns in passive
+	void (*dual)(const struct nnls_operator *op, const double *x, const int64_t *passive, int64_t nsetp, const int64_t *zset, int64_t nz, double *w);
+	// g[k] = a_t . a_passive[k] for k < nsetp, and g[nsetp] = a_t . a_t
+	void (*gram)(const struct nnls_operator *op, int64_t t, const int64_t *passive, int64_t nsetp, double *g);
+	// threads dual may use, 1 or less is serial
+	int jobs;
+	// where the algorithms take their working arrays from, or NULL
+	struct nnls_workspace *workspace;
+};
+
+// how the solvers taking options solve, NULL is lawson-hanson from zero
+struct nnls_options {
+	// one of the NNLS_SOLVER_*, gram is lawson-hanson against the gram matrix
+	int solver;
+	// a previous solution to warm start from, or NULL to start from zero
+	const double *start;
+	// apg and cd stop once the KKT violation relative to max |A^T b| is this
+	// small (default 1e-6)
+	double tolerance;
+	// or after this many iterations, a sweep over every column for cd
+	// (default 10000)
+	int64_t max_iterations;
+	// threads a single solve may use
+	int jobs;
+	// where the solver takes its working arrays from, NULL allocates them for
+	// every solve. nnls_batch ignores it
+	struct nnls_workspace *workspace;
+	// a height long vector the solvers returning a solution write it to,
+	// instead of allocating it. nnls_batch ignores it
+	double *solution;
+	// solve against a working set of columns and screen out the rest, see
+	// nnls_screen_algorithm. The first row of A has to be all ones
+	int screen;
+	// the solvers print when they stop at max_iterations and exit when they run
+	// out of memory. With quiet set they only set status, and return NULL
+	// instead of exiting
+	int quiet;
+	// set by the solvers, 0, 1 if max_iterations was reached, 2 if they ran
+	// out of memory and 3 if the solver can't work on this A
+	int status;
+	// set by apg and cd, the KKT violation and the iterations they ended at
+	double kkt;
+	int64_t iterations;
+	// set by screening, the columns proven inactive and the final working set
+	int64_t screened;
+	int64_t working;
+};
+
+// the options the solvers use for NULL
+void nnls_default_options(struct nnls_options *options);
+
+// x gets the solution. start is a previous solution to warm start from, its
+// positive entries seed set P, or NULL to start from zero
+int64_t nnls_normal_algorithm(const struct nnls_operator *op, const double *atb, double *x, const double *start);
+
+// accelerated projected gradient, which only uses op->dual. x gets the
+// solution. Returns 1 if max_iterations was reached before tolerance
+int64_t nnls_apg_algorithm(const struct nnls_operator *op, const double *atb, double *x, struct nnls_options *options);
+
+// cyclic coordinate descent against the n * n gram matrix, like apg
+int64_t nnls_cd_algorithm(const double *gram, const double *atb, int64_t n, double *x, struct nnls_options *options);
+
+// options->solver on a growing working set of op's columns, until the rest
+// satisfy the KKT conditions, so the solution is the same as without it.
+// Columns a gap safe bound proves are zero at the optimum stop being
+// checked. This needs the first row of A to be all ones, like quikr's
+int64_t nnls_screen_algorithm(const struct nnls_operator *op, const double *atb, double *x, struct nnls_options *options);
+
+// nnls on a sparse matrix with one row per column of A, which is the layout
+// of a sparse sensing matrix. options picks lawson-hanson or apg
+double *nnls_sparse(const struct sparse_matrix *a_matrix, const double *b_matrix, int64_t height, int64_t width, struct nnls_options *options);
+
+// nnls against A's gram matrix G = A^T A (height * height) and A^T b. A has
+// width rows, which only bounds the size of set P. Any solver works here
+double *nnls_gram(const double *gram, const double *atb, int64_t height, int64_t width, struct nnls_options *options);
+
+// nnls on an A stored like nnls() takes it, which is only read, so it can be
+// shared and can warm start. options picks lawson-hanson or apg
+double *nnls_dense(const double *a_matrix, const double *b_matrix, int64_t height, int64_t width, struct nnls_options *options);
+
+// nnls_dense with A in single precision, which halves the memory it takes and
+// the bandwidth the solver needs. A is widened as it is read, so the solver
+// still works in double
+double *nnls_dense_float(const float *a_matrix, const double *b_matrix, int64_t height, int64_t width, struct nnls_options *options);
+
+// nnls for count samples against one A, stored like nnls() takes it with one
+// row per column of A. A is only read, so the samples can share it, and the
+// samples are solved on options->jobs threads. b_matrix holds the samples'
+// width long vectors one after another, and the solutions come back the same
+// way. With chain set, every sample is warm started from the one before it on
+// its thread, and options->start only seeds the first. options gets the worst
+// kkt, iterations and status of the batch
+double *nnls_batch(const double *a_matrix, const double *b_matrix, int64_t count, int64_t height, int64_t width, struct nnls_options *options, int chain);
+
+// nnls_batch with A in single precision, like nnls_dense_float
+double *nnls_batch_float(const float *a_matrix, const double *b_matrix, int64_t count, int64_t height, int64_t width, struct nnls_options *options, int chain);
+
+// the NNLS_SOLVER_* for a --solver name, or -1
+int nnls_solver_from_name(const char *name);
@@ -7,11 +7,35 @@
 #include <unistd.h>
 
 #include "nnls.h"
-#include "kmer_utils.h"
+#include "libquikr.h"
 #include "quikr_functions.h"
 #include "quikr.h"
+#include "serve.h"
 
-#define USAGE "Usage:\n\tquikr [OPTION...] - Calculate estimated frequencies of bacteria in a sample.\n\nOptions:\n\n-i, --input\n\tthe sample's fasta file of NGS READS (fasta format)\n\n-s, --sensing-matrix\n\t location of the sensing matrix. (trained from quikr_train)\n\n-k, --kmer\n\tspecify what size of kmer to use. (default value is 6)\n\n-l, --lambda\n\tlambda value to use. (default value is 10000)\n\n-o, --output\n\tOTU_FRACTION_PRESENT a vector representing the percentage of database sequence's presence in sample. (csv output)\n\n-v, --verbose\n\tverbose mode.\n\n-V, --version\n\tprint version."
+#ifdef Linux
+#include <sys/sysinfo.h>
+#endif
+
+#define USAGE "Usage:\n\tquikr [OPTION...] - Calculate estimated frequencies of bacteria in a sample.\n\nOptions:\n\n-i, --input\n\tthe sample's fasta file of NGS READS (fasta format)\n\n-s, --sensing-matrix\n\t location of the sensing matrix. (trained from quikr_train)\n\n-k, --kmer\n\tspecify what size of kmer to use. (default value is 6)\n\n-l, --lambda\n\tlambda value to use. (default value is 10000)\n\n-j, --jobs\n\tthe number of threads counting the sample and solving it. (default value is the number of CPUs)\n\n-S, --solver\n\tthe nnls solver, lawson-hanson, gram, apg or cd. gram precomputes the gram matrix of the sensing matrix and caches it next to it, and needs a rare percent of 1. apg (accelerated projected gradient) and cd (coordinate descent on the gram matrix, so also needing a rare percent of 1) are iterative and stop at --tolerance. (default value is lawson-hanson)\n\n-x, --screen\n\tsolve against a working set of the database sequences best matching the sample, adding any others the solution leaves out of balance, and skip the ones a safe bound proves absent. The result is the same.\n\n-F, --float\n\tkeep the sensing matrix the solver works on in single precision, which halves its memory and bandwidth. The solver still accumulates in double, and the result differs from the double precision one in about the seventh digit. Only for dense sensing matrices and the lawson-hanson and apg solvers. lawson-hanson then solves the normal equations instead of householder, which is most of the speedup.\n\n-t, --tolerance\n\tapg and cd stop once the KKT violation relative to the largest entry of A^T b is this small. (default value is 1e-6)\n\n-m, --max-iterations\n\tapg and cd stop after this many iterations. (default value is 10000)\n\n-o, --output\n\tOTU_FRACTION_PRESENT a vector representing the percentage of database sequence's presence in sample. (csv output)\n\n-L, --serve\n\tkeep the sensing matrices loaded and classify samples sent to a unix socket at this path, instead of -i. -s can be given more than once, and -j is how many requests are answered at once. See the manual for the protocol.\n\n-T, --idle\n\twith --serve, close a connection that sends nothing for this many seconds, so it doesn't keep a worker from other clients. 0 never closes it. (default value is 60)\n\n-v, --verbose\n\tverbose mode.\n\n-V, --version\n\tprint version."
+
+// the gram matrix the gram and cd solvers need, loaded up front so the time
+// it takes isn't counted against the first sample
+static void load_gram(struct quikr_database *database, const char *filename, unsigned long long lambda, int jobs) {
+	char warning[QUIKR_ERROR_LENGTH];
+
+	int code = quikr_database_gram(database, lambda, jobs, warning);
+	if(code == QUIKR_ERROR_IO) {
+		fprintf(stderr, "could not open %s - %s\n", filename, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	else if(code != QUIKR_OK) {
+		fprintf(stderr, "Error: %s\n", quikr_strerror(code));
+		exit(EXIT_FAILURE);
+	}
+
+	if(warning[0] != '\0')
+		fprintf(stderr, "Warning: %s\n", warning);
+}
 
 int main(int argc, char **argv) {
 
@@ -20,13 +44,19 @@ int main(int argc, char **argv) {
 	char *input_fasta_filename = NULL;
 	char *sensing_matrix_filename = NULL;
 	char *output_filename = NULL;
+	char *serve_path = NULL;
+	// with --serve, the seconds a connection can be idle
+	int idle = 60;
+
+	// --serve can keep more than one sensing matrix loaded
+	char **sensing_matrix_filenames = NULL;
+	int sensing_matrices = 0;
 
 	unsigned long long x = 0;
-	unsigned long long y = 0;
-	unsigned long long z = 0;
+	int i = 0;
+	int code = 0;
 
-	unsigned long long rare_value = 0;
-	unsigned long long rare_width = 0;
+	char error[QUIKR_ERROR_LENGTH];
 
 	double rare_percent = 1.0;
 
@@ -35,7 +65,22 @@ int main(int argc, char **argv) {
 	unsigned int kmer = 6;
 	unsigned long long lambda = 10000;
 
+	int jobs = 1;
+	int solver = NNLS_SOLVER_LAWSON_HANSON;
+
+	struct nnls_options options;
+	nnls_default_options(&options);
+
+	#ifdef Linux
+		jobs = get_nprocs();
+	#endif
+
+	#ifdef Darwin
+		jobs = sysconf (_SC_NPROCESSORS_ONLN);
+	#endif
+
 	int verbose = 0;
+	int single = 0;
 
 	while (1) {
 		static struct option long_options[] = {
@@ -45,6 +90,14 @@ int main(int argc, char **argv) {
 			{"output", required_argument, 0, 'o'},
 			{"sensing-matrix", required_argument, 0, 's'},
 			{"rare-percent", required_argument, 0, 'r'},
+			{"jobs", required_argument, 0, 'j'},
+			{"solver", required_argument, 0, 'S'},
+			{"tolerance", required_argument, 0, 't'},
+			{"max-iterations", required_argument, 0, 'm'},
+			{"screen", no_argument, 0, 'x'},
+			{"float", no_argument, 0, 'F'},
+			{"serve", required_argument, 0, 'L'},
+			{"idle", required_argument, 0, 'T'},
 			{"verbose", no_argument, 0, 'v'},
 			{"version", no_argument, 0, 'V'},
 			{"help", no_argument, 0, 'h'},
@@ -54,7 +107,7 @@ int main(int argc, char **argv) {
 
 		int option_index = 0;
 
-		c = getopt_long (argc, argv, "k:l:s:r:i:o:r:hdvV", long_options, &option_index);
+		c = getopt_long (argc, argv, "k:l:s:r:i:j:o:r:S:t:m:L:T:xFhdvV", long_options, &option_index);
 
 		if (c == -1)
 			break;
@@ -71,10 +124,45 @@ int main(int argc, char **argv) {
 				break;
 			case 's':
 				sensing_matrix_filename = optarg;
+				sensing_matrix_filenames = realloc(sensing_matrix_filenames, (sensing_matrices + 1) * sizeof(char *));
+				check_malloc(sensing_matrix_filenames, NULL);
+				sensing_matrix_filenames[sensing_matrices++] = optarg;
 				break;
 			case 'i':
 				input_fasta_filename = optarg;
 				break;
+			case 'j':
+				jobs = atoi(optarg);
+				break;
+			case 'S':
+				solver = nnls_solver_from_name(optarg);
+				if(solver == -1) {
+					fprintf(stderr, "Error: unknown solver %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 't':
+				options.tolerance = atof(optarg);
+				break;
+			case 'm':
+				options.max_iterations = atoll(optarg);
+				break;
+			case 'x':
+				options.screen = 1;
+				break;
+			case 'F':
+				single = 1;
+				break;
+			case 'L':
+				serve_path = optarg;
+				break;
+			case 'T':
+				idle = atoi(optarg);
+				if(idle < 0) {
+					fprintf(stderr, "Error: idle must be 0 or more seconds\n");
+					exit(EXIT_FAILURE);
+				}
+				break;
 			case 'o':
 				output_filename = optarg;
 				break;
@@ -97,22 +185,97 @@ int main(int argc, char **argv) {
 		fprintf(stderr, "%s\n", USAGE);
 		exit(EXIT_FAILURE);
 	}
-	if(output_filename == NULL) {
+	if(sensing_matrices > 1 && serve_path == NULL) {
+		fprintf(stderr, "Error: only --serve can take more than one sensing matrix\n");
+		exit(EXIT_FAILURE);
+	}
+	if(output_filename == NULL && serve_path == NULL) {
 		fprintf(stderr, "Error: output filename (-o) must be specified\n\n");
 		fprintf(stderr, "%s\n", USAGE);
 		exit(EXIT_FAILURE);
 	}
-	if(input_fasta_filename == NULL) {
+	if(input_fasta_filename == NULL && serve_path == NULL) {
 		fprintf(stderr, "Error: input fasta file (-i) must be specified\n\n");
 		fprintf(stderr, "%s\n", USAGE);
 		exit(EXIT_FAILURE);
 	}
 
+	if(jobs < 1) {
+		fprintf(stderr, "Error: jobs must be at least 1\n");
+		exit(EXIT_FAILURE);
+	}
+
 	if(rare_percent <= 0 || rare_percent > 1.0) {
 		fprintf(stderr, "Error: rare percent must be between 0 and 1\n");
 		exit(EXIT_FAILURE);
 	}
 
+	// the gram matrix is only the same for every sample when we keep every kmer
+	if((solver == NNLS_SOLVER_GRAM || solver == NNLS_SOLVER_CD) && rare_percent != 1.0) {
+		fprintf(stderr, "Error: the gram and cd solvers need a rare percent of 1\n");
+		exit(EXIT_FAILURE);
+	}
+
+	// the gram matrix is already as small as it gets
+	if(single && (solver == NNLS_SOLVER_GRAM || solver == NNLS_SOLVER_CD)) {
+		fprintf(stderr, "Error: --float works with the lawson-hanson and apg solvers\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if(options.tolerance <= 0 || options.max_iterations < 1) {
+		fprintf(stderr, "Error: tolerance and max iterations must be positive\n");
+		exit(EXIT_FAILURE);
+	}
+
+	struct quikr_params params;
+	quikr_default_params(&params);
+	params.lambda = lambda;
+	params.rare_percent = rare_percent;
+	params.solver = solver;
+	params.screen = options.screen;
+	params.single = single;
+	params.tolerance = options.tolerance;
+	params.max_iterations = options.max_iterations;
+	params.jobs = jobs;
+
+	if(serve_path != NULL) {
+		struct serve_config config;
+
+		config.databases = malloc(sensing_matrices * sizeof(struct serve_database));
+		check_malloc(config.databases, NULL);
+		config.count = sensing_matrices;
+		config.workers = jobs;
+		config.idle = idle;
+		config.params = params;
+		config.verbose = verbose;
+
+		// every database keeps the kmer it was trained with
+		for(i = 0; i < sensing_matrices; i++) {
+			struct serve_database *database = &config.databases[i];
+
+			if(access (sensing_matrix_filenames[i], F_OK) == -1) {
+				fprintf(stderr, "Error: could not find %s\n", sensing_matrix_filenames[i]);
+				exit(EXIT_FAILURE);
+			}
+
+			database->filename = sensing_matrix_filenames[i];
+			if(quikr_database_open(database->filename, 0, &database->database, error) != QUIKR_OK) {
+				fprintf(stderr, "%s\n", error);
+				exit(EXIT_FAILURE);
+			}
+			if(solver == NNLS_SOLVER_GRAM || solver == NNLS_SOLVER_CD)
+				load_gram(database->database, database->filename, lambda, jobs);
+
+			if(verbose)
+				printf("%s: kmer %u, %llu sequences\n", database->filename, quikr_database_kmer(database->database), quikr_database_sequences(database->database));
+		}
+
+		serve(serve_path, &config);
+
+		fprintf(stderr, "Error: could not listen on %s - %s\n", serve_path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
 	if(verbose) {
 		printf("kmer: %u\n", kmer);
 		printf("rare: %lf\n", rare_percent);
@@ -120,6 +283,8 @@ int main(int argc, char **argv) {
 		printf("fasta: %s\n", input_fasta_filename);
 		printf("sensing matrix: %s\n", sensing_matrix_filename);
 		printf("output: %s\n", output_filename);
+		printf("precision: %s\n", single ? "single" : "double");
+		printf("jobs: %d\n", jobs);
 	}
 
 	if(access (sensing_matrix_filename, F_OK) == -1) {
@@ -141,86 +306,65 @@ int main(int argc, char **argv) {
 	width = pow_four(kmer);
 
 	// load sensing matrix
-	struct matrix *sensing_matrix = load_sensing_matrix(sensing_matrix_filename, kmer);
+	struct quikr_database *database = NULL;
+	if(quikr_database_open(sensing_matrix_filename, kmer, &database, error) != QUIKR_OK) {
+		fprintf(stderr, "%s\n", error);
+		exit(EXIT_FAILURE);
+	}
+
+	const unsigned long long sequences = quikr_database_sequences(database);
 
 	if(verbose) {
 		printf("width: %llu\n", width);
-		printf("sequences: %llu\n", sensing_matrix->sequences);
+		printf("sequences: %llu\n", sequences);
 	}
 
+	if(solver == NNLS_SOLVER_GRAM || solver == NNLS_SOLVER_CD)
+		load_gram(database, sensing_matrix_filename, lambda, jobs);
 
+	// load counts matrix, with room for the skipped kmers
+	unsigned long long *counts = malloc((width + 1) * sizeof(unsigned long long));
+	check_malloc(counts, NULL);
 
-	// load counts matrix
-	double *count_matrix = malloc(width * sizeof(double));
-	check_malloc(count_matrix, NULL);
-
-	// convert our matrix into doubles
 	{
-		unsigned long long *integer_counts = get_kmer_counts_from_file(input_fasta_filename, kmer);
+		unsigned long long reads = 0;
+		unsigned long long bases = 0;
 
-		for(x = 0; x < width; x++) {
-			count_matrix[x] = (double)integer_counts[x];
+		code = quikr_count_file(input_fasta_filename, kmer, jobs, counts, &reads, &bases);
+		if(code == QUIKR_ERROR_FORMAT) {
+			fprintf(stderr, "Error reading %s - corrupt compressed file\n", input_fasta_filename);
+			exit(EXIT_FAILURE);
 		}
-
-		free(integer_counts);
-	}
-
-	// get_rare_value
-	get_rare_value(count_matrix, width, rare_percent, &rare_value, &rare_width);
-
-	if(verbose)
-		printf("there are %llu values less than %llu\n", rare_width, rare_value);
-
-	// add a extra space for our zero's array, so we can set the first column to 1's
-	rare_width++;
-
-	// store our count matrix
-	double *count_matrix_rare = calloc(rare_width, sizeof(double));
-	check_malloc(count_matrix_rare, NULL);
-
-	double *sensing_matrix_rare = calloc(rare_width * sensing_matrix->sequences, sizeof(double));
-	check_malloc(sensing_matrix_rare, NULL);
-
-	// copy only kmers from our original counts that match our rareness percentage
-	// in both our count matrix and our sensing matrix
-	//
-	// y = 1 because we are offsetting the arrah by 1, so we can set the first row to all 1's
-	for(x = 0, y = 1;  x < width; x++) {
-		if(count_matrix[x] <= rare_value) {
-			count_matrix_rare[y] = count_matrix[x];
-
-			for(z = 0; z < sensing_matrix->sequences; z++)
-				sensing_matrix_rare[z*rare_width + y] = sensing_matrix->matrix[z*width + x];
-
-			y++;
+		else if(code != QUIKR_OK) {
+			fprintf(stderr, "Error opening %s - %s\n", input_fasta_filename, code == QUIKR_ERROR_IO ? strerror(errno) : quikr_strerror(code));
+			exit(EXIT_FAILURE);
 		}
-	}
 
+		if(verbose)
+			printf("sample: %llu sequences, %llu bases, %llu kmers skipped\n", reads, bases, counts[width]);
+	}
 
-	// normalize our kmer counts and our sensing_matrix
-	normalize_matrix(sensing_matrix_rare, sensing_matrix->sequences, rare_width);
-	normalize_matrix(count_matrix_rare, 1, rare_width);
+	struct quikr_stats stats;
 
-	// multiply our kmer counts and sensing matrix by lambda
-	for(x = 0; x < sensing_matrix->sequences; x++) {
-		for(y = 1; y < rare_width; y++) {
-			sensing_matrix_rare[rare_width*x + y] *= lambda;
-		}
-	}
+	double *solution = malloc(sequences * sizeof(double));
+	check_malloc(solution, NULL);
 
-	for(x = 0; x < sensing_matrix->sequences; x++) {
-		sensing_matrix_rare[x*rare_width] = 1.0;
+	code = quikr_classify(database, counts, &params, solution, &stats);
+	if(code < 0) {
+		fprintf(stderr, "Error: could not classify %s - %s\n", input_fasta_filename, quikr_strerror(code));
+		exit(EXIT_FAILURE);
 	}
 
-	// count_matrix's first element should be zero
-	count_matrix_rare[0] = 0;
-	for(x = 1; x < rare_width; x++)
-		count_matrix_rare[x] *= lambda;
+	if(verbose)
+		printf("there are %llu values less than %llu\n", stats.rare_width, stats.rare_value);
 
-	double *solution = nnls(sensing_matrix_rare, count_matrix_rare, sensing_matrix->sequences, rare_width);
+	if(code == QUIKR_MAX_ITERATIONS)
+		printf("NNLS has reached the maximum iterations\n");
 
-	// normalize our solution vector
-	normalize_matrix(solution, 1, sensing_matrix->sequences);
+	if(verbose && (solver == NNLS_SOLVER_APG || solver == NNLS_SOLVER_CD))
+		printf("solver: %lld iterations, KKT violation %g\n", stats.iterations, stats.kkt);
+	if(verbose && options.screen)
+		printf("screening: %lld sequences solved, %lld proven absent\n", stats.working, stats.screened);
 
 	// output our matrix
 	FILE *output_fh = fopen(output_filename, "w");
@@ -229,18 +373,16 @@ int main(int argc, char **argv) {
 		exit(EXIT_FAILURE);
 	}
 
-	for(x = 0; x < sensing_matrix->sequences; x++)
+	for(x = 0; x < sequences; x++)
 		fprintf(output_fh, "%.10lf\n", solution[x]);
 
 	fclose(output_fh);
 
 	free(solution);
 
-	free(count_matrix);
-	free(sensing_matrix);
-
-	free(count_matrix_rare);
-	free(sensing_matrix_rare);
+	free(counts);
+	quikr_database_close(database);
+	free(sensing_matrix_filenames);
 
 	return EXIT_SUCCESS;
 }
@@ -1,10 +1,126 @@
-#define MATRIX_REVISION 0
-#define pow_four(x) ( (unsigned long long)1 << (x * 2 ) )
+#ifndef QUIKR_H
+#define QUIKR_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdint.h>
+
+// revision 0 is the gzip'd text format, which is still accepted by
+// load_sensing_matrix, revision 1 is the dense binary format below,
+// revision 2 adds the sparse layout and revision 3 the kmer-major layout
+#define MATRIX_REVISION 3
+#define MATRIX_MIN_REVISION 1
+#define MATRIX_TEXT_REVISION 0
+#define MATRIX_DENSE 0
+#define MATRIX_SPARSE 1
+#define MATRIX_KMER_MAJOR 2
+#define MATRIX_MAGIC "QUIKRBIN"
+#define MATRIX_BYTE_ORDER 0x01020304
+#define MATRIX_DATA_OFFSET 4096
+#define pow_four(x) ( (unsigned long long)1 << ((x) * 2 ) )
 #define str_eq(s1,s2)  (!strcmp ((s1),(s2)))
+// compressed sparse rows, for sensing matrices each row is a sequence
+struct sparse_matrix {
+	unsigned long long rows;
+	unsigned long long columns;
+	unsigned long long nnz;
+	unsigned long long *row_ptr;
+	uint32_t *column;
+	double *values;
+};
+
 struct matrix {
 	unsigned long long sequences;
 	unsigned int kmer;
+	// exactly one of matrix, kmer_major and sparse is set. matrix is
+	// sequences * width by sequence, kmer_major is width * sequences by kmer
 	double *matrix;
+	double *kmer_major;
+	struct sparse_matrix *sparse;
 	char **headers;
+	// set when the matrix is a mapping of a binary sensing matrix
+	void *map;
+	size_t map_size;
+};
+
+// on disk header of a binary sensing matrix. A dense matrix follows at
+// matrix_offset as sequences * width native doubles. A sparse matrix stores
+// nnz doubles at matrix_offset, nnz uint32_t columns at columns_offset and
+// sequences + 1 row pointers at row_ptr_offset. A kmer-major matrix (revision
+// 3) stores width * sequences doubles at matrix_offset, every sequence's count
+// of the first kmer, then of the second and so on. The headers follow as NUL
+// terminated strings, and checksum is the crc32 of everything from
+// matrix_offset to the end of the file, which verify_sensing_matrix checks.
+struct matrix_file_header {
+	char magic[8];
+	uint32_t revision;
+	uint32_t byte_order;
+	uint32_t kmer;
+	uint32_t checksum;
+	uint64_t sequences;
+	uint64_t width;
+	uint64_t matrix_offset;
+	uint64_t headers_offset;
+	uint64_t headers_size;
+	// revision 2, zero in revision 1 files
+	uint32_t layout;
+	uint32_t reserved;
+	uint64_t nnz;
+	uint64_t columns_offset;
+	uint64_t row_ptr_offset;
+};
+
+// the gram matrix A^T A of the normalized, lambda scaled sensing matrix and
+// its row of ones, which is the same for every sample when rare_percent is 1.
+// It is cached next to the sensing matrix, and the source fields tie it to
+// the file it was computed from. sequences * sequences native doubles follow
+// at GRAM_DATA_OFFSET.
+#define GRAM_MAGIC "QUIKRGRM"
+#define GRAM_REVISION 1
+#define GRAM_DATA_OFFSET 4096
+
+struct gram_file_header {
+	char magic[8];
+	uint32_t revision;
+	uint32_t byte_order;
+	uint32_t kmer;
+	uint32_t reserved;
+	uint64_t sequences;
+	uint64_t lambda;
+	uint64_t source_size;
+	int64_t source_mtime;
+	int64_t source_mtime_nsec;
+};
+
+struct gram_matrix {
+	unsigned long long sequences;
+	unsigned long long lambda;
+	double *gram;
+	// lambda over each sequence's kmer total, which scales A^T b
+	double *scale;
+	// set when the gram matrix is a mapping of the cache
+	void *map;
+	size_t map_size;
+	// where it is cached, and the errno writing the cache failed with, or 0
+	char *cache;
+	int cache_error;
+};
+
+// streaming writer for binary sensing matrices, see matrix_writer_open
+struct matrix_writer {
+	FILE *fh;
+	struct matrix_file_header header;
+	unsigned long crc;
+	unsigned long long rows;
+	char *headers;
+	size_t headers_len;
+	size_t headers_alloc;
+	// sparse matrices spool their columns until the values are written, and
+	// kmer-major matrices their rows until they can be transposed
+	FILE *columns;
+	unsigned long long *row_ptr;
+	uint32_t *row_columns;
+	double *row_values;
 };
 
+#endif
@@ -0,0 +1,769 @@
+#include <ctype.h>
+#include <errno.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "fasta.h"
+#include "kmer_utils.h"
+#include "libquikr.h"
+#include "nnls.h"
+#include "quikr.h"
+#include "quikr_functions.h"
+
+#define USAGE "Usage:\n\tquikr_bench COMMAND [OPTION...] - generate synthetic data and time quikr on it.\n\nCommands:\n\nreference -o FILE [-n sequences] [-l length] [-c clusters] [-d divergence] [-s seed]\n\twrite a synthetic reference database, sequences mutated from clusters random roots. (defaults 1000, 1500, sequences / 10, 0.05, 1)\n\nsample -i REFERENCE -o FILE [-n reads] [-l length] [-c community] [-e error] [-s seed] [-t truth]\n\twrite reads drawn from community sequences of the reference with zipf distributed abundances, and the abundances to truth. (defaults 100000, 250, 20, 0.01, 1)\n\nheader\n\tprint the header of the results.\n\ncount -i SAMPLE [-k kmer] [-j jobs] [-n repetitions]\n\ttime counting a sample's kmers.\n\nload -s SENSING_MATRIX [-k kmer] [-n repetitions]\n\ttime loading a sensing matrix.\n\nclassify -s SENSING_MATRIX -i SAMPLE [-k kmer] [-j jobs] [-n repetitions]\n\ttime each step of classifying a sample, the rare kmers, normalizing the sample, gathering the rare sensing matrix, solving it with lawson-hanson and apg, and all of them together.\n\nexec -l NAME [-k kmer] [-d sequences] [-r reads] [-j jobs] [-n repetitions] -- COMMAND...\n\ttime a command, with its output thrown away. The options only label the result.\n\nResults are tab separated, see the header command."
+
+// the columns every result has
+#define BENCH_HEADER "version\tbenchmark\tkmer\tsequences\treads\tjobs\trepetitions\tmin_seconds\tmedian_seconds"
+
+// the options every command takes, what doesn't apply is left at its default
+struct bench_options {
+	char *input;
+	char *output;
+	char *sensing_matrix;
+	char *truth;
+	char *name;
+	unsigned int kmer;
+	int jobs;
+	int repetitions;
+	unsigned long long count;
+	unsigned long long length;
+	unsigned long long clusters;
+	unsigned long long sequences;
+	unsigned long long reads;
+	double rate;
+	uint64_t seed;
+};
+
+// splitmix64, so the generated data is the same everywhere
+static uint64_t bench_random(uint64_t *state) {
+	uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+// uniform in [0, 1)
+static double bench_uniform(uint64_t *state) {
+	return (bench_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static char bench_base(uint64_t *state) {
+	return "ACGT"[bench_random(state) & 3];
+}
+
+// replace each base of sequence with a random one at rate
+static void mutate(char *sequence, size_t length, double rate, uint64_t *state) {
+	size_t i = 0;
+	for(i = 0; i < length; i++)
+		if(bench_uniform(state) < rate)
+			sequence[i] = bench_base(state);
+}
+
+static FILE *open_output(const char *filename) {
+	FILE *fh = fopen(filename, "w");
+	if(fh == NULL) {
+		fprintf(stderr, "could not open %s - %s\n", filename, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	return fh;
+}
+
+static void close_output(FILE *fh, const char *filename) {
+	if(ferror(fh) || fclose(fh) != 0) {
+		fprintf(stderr, "could not write %s - %s\n", filename, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void generate_reference(const struct bench_options *options) {
+	unsigned long long i = 0;
+	unsigned long long j = 0;
+	uint64_t state = options->seed;
+
+	unsigned long long clusters = options->clusters ? options->clusters : options->count / 10;
+	if(clusters == 0)
+		clusters = 1;
+
+	char *roots = malloc(clusters * options->length);
+	char *sequence = malloc(options->length);
+	check_malloc(roots, NULL);
+	check_malloc(sequence, NULL);
+
+	for(i = 0; i < clusters * options->length; i++)
+		roots[i] = bench_base(&state);
+
+	FILE *fh = open_output(options->output);
+
+	for(i = 0; i < options->count; i++) {
+		memcpy(sequence, roots + (i % clusters) * options->length, options->length);
+		mutate(sequence, options->length, options->rate, &state);
+
+		fprintf(fh, ">synthetic_%llu cluster_%llu\n", i, i % clusters);
+		for(j = 0; j < options->length; j += 70) {
+			fwrite(sequence + j, 1, options->length - j < 70 ? options->length - j : 70, fh);
+			fputc('\n', fh);
+		}
+	}
+
+	close_output(fh, options->output);
+	free(roots);
+	free(sequence);
+}
+
+// a reference sequence, without the newlines
+struct reference {
+	char *header;
+	char *sequence;
+	size_t length;
+};
+
+static struct reference *read_reference(const char *filename, unsigned long long *count) {
+	struct fasta_record record;
+	unsigned long long allocated = 1024;
+	unsigned long long n = 0;
+	size_t i = 0;
+	int ret = 0;
+
+	struct fasta_reader *reader = fasta_open(filename, 1);
+	if(reader == NULL) {
+		fprintf(stderr, "could not open %s - %s\n", filename, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	struct reference *references = malloc(allocated * sizeof(struct reference));
+	check_malloc(references, NULL);
+
+	while((ret = fasta_next(reader, &record)) > 0) {
+		if(n == allocated) {
+			allocated *= 2;
+			references = realloc(references, allocated * sizeof(struct reference));
+			check_malloc(references, NULL);
+		}
+
+		struct reference *reference = &references[n++];
+
+		// the name, the header up to the first space
+		size_t header_len = 0;
+		while(header_len < record.header_len && !isspace((unsigned char)record.header[header_len]))
+			header_len++;
+
+		reference->header = strndup(record.header, header_len);
+		reference->sequence = malloc(record.sequence_len + 1);
+		check_malloc(reference->header, NULL);
+		check_malloc(reference->sequence, NULL);
+
+		reference->length = 0;
+		for(i = 0; i < record.sequence_len; i++)
+			if(record.sequence[i] != '\n' && record.sequence[i] != '\r')
+				reference->sequence[reference->length++] = record.sequence[i];
+	}
+
+	if(ret < 0 || n == 0) {
+		fprintf(stderr, "Error: %s has no sequences or is corrupt\n", filename);
+		exit(EXIT_FAILURE);
+	}
+
+	fasta_close(reader);
+	*count = n;
+	return references;
+}
+
+static void generate_sample(const struct bench_options *options) {
+	unsigned long long references_count = 0;
+	unsigned long long i = 0;
+	uint64_t state = options->seed;
+
+	struct reference *references = read_reference(options->input, &references_count);
+
+	unsigned long long community = options->clusters;
+	if(community == 0 || community > references_count)
+		community = references_count;
+
+	// the community is a random pick of the reference, in shuffled order
+	unsigned long long *members = malloc(references_count * sizeof(unsigned long long));
+	double *cumulative = malloc(community * sizeof(double));
+	char *read = malloc(options->length + 1);
+	check_malloc(members, NULL);
+	check_malloc(cumulative, NULL);
+	check_malloc(read, NULL);
+
+	for(i = 0; i < references_count; i++)
+		members[i] = i;
+	for(i = 0; i < community; i++) {
+		unsigned long long j = i + bench_random(&state) % (references_count - i);
+		unsigned long long swap = members[i];
+		members[i] = members[j];
+		members[j] = swap;
+	}
+
+	// the i-th member is 1 / (i + 1) as abundant as the first
+	double total = 0;
+	for(i = 0; i < community; i++) {
+		total += 1.0 / (i + 1);
+		cumulative[i] = total;
+	}
+
+	if(options->truth != NULL) {
+		FILE *truth = open_output(options->truth);
+		for(i = 0; i < community; i++)
+			fprintf(truth, "%s\t%.10f\n", references[members[i]].header, 1.0 / (i + 1) / total);
+		close_output(truth, options->truth);
+	}
+
+	FILE *fh = open_output(options->output);
+
+	for(i = 0; i < options->count; i++) {
+		double pick = bench_uniform(&state) * total;
+		unsigned long long low = 0;
+		unsigned long long high = community - 1;
+
+		while(low < high) {
+			unsigned long long middle = (low + high) / 2;
+			if(cumulative[middle] <= pick)
+				low = middle + 1;
+			else
+				high = middle;
+		}
+
+		const struct reference *reference = &references[members[low]];
+		size_t length = options->length < reference->length ? options->length : reference->length;
+		size_t start = 0;
+		if(reference->length > length)
+			start = bench_random(&state) % (reference->length - length + 1);
+
+		memcpy(read, reference->sequence + start, length);
+		mutate(read, length, options->rate, &state);
+		read[length] = '\0';
+
+		fprintf(fh, ">read_%llu %s\n%s\n", i, reference->header, read);
+	}
+
+	close_output(fh, options->output);
+
+	for(i = 0; i < references_count; i++) {
+		free(references[i].header);
+		free(references[i].sequence);
+	}
+	free(references);
+	free(members);
+	free(cumulative);
+	free(read);
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+// print a result from the times of each repetition
+static void report(const char *benchmark, const struct bench_options *options, unsigned long long sequences, unsigned long long reads, int jobs, double *times) {
+	int n = options->repetitions;
+
+	qsort(times, n, sizeof(double), compare_doubles);
+	double median = n % 2 ? times[n / 2] : (times[n / 2 - 1] + times[n / 2]) / 2;
+
+	printf("%s\t%s\t%u\t%llu\t%llu\t%d\t%d\t%.6f\t%.6f\n", VERSION, benchmark, options->kmer, sequences, reads, jobs, n, times[0], median);
+	fflush(stdout);
+}
+
+static void bench_count(const struct bench_options *options, double *times) {
+	struct sample sample;
+	int i = 0;
+
+	memset(&sample, 0, sizeof(struct sample));
+
+	for(i = 0; i < options->repetitions; i++) {
+		double start = now();
+		if(try_read_sample_into(options->input, options->kmer, options->jobs, &sample) != 0) {
+			fprintf(stderr, "could not read %s - %s\n", options->input, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		times[i] = now() - start;
+	}
+
+	report("count", options, 0, sample.sequences, options->jobs, times);
+	free(sample.counts);
+}
+
+static const char *layout_name(const struct matrix *sensing_matrix) {
+	if(sensing_matrix->map == NULL)
+		return "text";
+	if(sensing_matrix->sparse != NULL)
+		return "sparse";
+	if(sensing_matrix->kmer_major != NULL)
+		return "kmer-major";
+	return "dense";
+}
+
+static void bench_load(const struct bench_options *options, double *times) {
+	char benchmark[64];
+	unsigned long long sequences = 0;
+	int i = 0;
+
+	for(i = 0; i < options->repetitions; i++) {
+		double start = now();
+		struct matrix *sensing_matrix = load_sensing_matrix(options->sensing_matrix, options->kmer);
+		times[i] = now() - start;
+
+		snprintf(benchmark, sizeof(benchmark), "load-%s", layout_name(sensing_matrix));
+		sequences = sensing_matrix->sequences;
+		free_sensing_matrix(sensing_matrix);
+	}
+
+	report(benchmark, options, sequences, 0, 1, times);
+}
+
+// the steps of quikr_classify one at a time, each on its own copy of what the
+// step before it made, so each can be repeated alone
+static void bench_classify(const struct bench_options *options, double *times) {
+	char benchmark[64];
+	struct quikr_params params;
+	struct nnls_options nnls_options;
+	struct nnls_workspace workspace;
+	unsigned long long rare_value = 0;
+	unsigned long long rare_width = 0;
+	unsigned long long x = 0;
+	unsigned long long y = 0;
+	int i = 0;
+
+	struct matrix *sensing_matrix = load_sensing_matrix(options->sensing_matrix, options->kmer);
+	struct sample *sample = read_sample(options->input, options->kmer, options->jobs);
+
+	const char *layout = layout_name(sensing_matrix);
+	const unsigned long long width = pow_four(options->kmer);
+	const unsigned long long sequences = sensing_matrix->sequences;
+	const unsigned long long reads = sample->sequences;
+
+	quikr_default_params(&params);
+	params.jobs = options->jobs;
+
+	double *count_matrix = malloc(width * sizeof(double));
+	double *scratch = malloc(width * sizeof(double));
+	check_malloc(count_matrix, NULL);
+	check_malloc(scratch, NULL);
+
+	for(x = 0; x < width; x++)
+		count_matrix[x] = (double)sample->counts[x];
+
+	for(i = 0; i < options->repetitions; i++) {
+		double start = now();
+		get_rare_value_into(count_matrix, width, params.rare_percent, &rare_value, &rare_width, scratch);
+		times[i] = now() - start;
+	}
+	snprintf(benchmark, sizeof(benchmark), "rare-%s", layout);
+	report(benchmark, options, sequences, reads, 1, times);
+
+	rare_width++;
+
+	double *count_matrix_rare = malloc(rare_width * sizeof(double));
+	check_malloc(count_matrix_rare, NULL);
+
+	for(i = 0; i < options->repetitions; i++) {
+		double start = now();
+		count_matrix_rare[0] = 0;
+		for(x = 0, y = 1; x < width; x++) {
+			if(count_matrix[x] <= rare_value) {
+				count_matrix_rare[y] = count_matrix[x];
+				y++;
+			}
+		}
+		normalize_matrix(count_matrix_rare, 1, rare_width);
+		count_matrix_rare[0] = 0;
+		for(x = 1; x < rare_width; x++)
+			count_matrix_rare[x] *= params.lambda;
+		times[i] = now() - start;
+	}
+	snprintf(benchmark, sizeof(benchmark), "normalize-%s", layout);
+	report(benchmark, options, sequences, reads, 1, times);
+
+	double *solution = malloc(sequences * sizeof(double));
+	check_malloc(solution, NULL);
+
+	nnls_default_options(&nnls_options);
+	nnls_options.jobs = options->jobs;
+	nnls_options.solution = solution;
+	nnls_options.quiet = 1;
+
+	if(sensing_matrix->sparse != NULL) {
+		const struct sparse_matrix *sparse = sensing_matrix->sparse;
+		struct sparse_matrix rare;
+
+		rare.row_ptr = malloc((sparse->rows + 1) * sizeof(unsigned long long));
+		rare.column = malloc((sparse->nnz + sparse->rows) * sizeof(uint32_t));
+		rare.values = malloc((sparse->nnz + sparse->rows) * sizeof(double));
+		uint32_t *rare_column = malloc(sparse->columns * sizeof(uint32_t));
+		check_malloc(rare.row_ptr, NULL);
+		check_malloc(rare.column, NULL);
+		check_malloc(rare.values, NULL);
+		check_malloc(rare_column, NULL);
+
+		for(i = 0; i < options->repetitions; i++) {
+			double start = now();
+			gather_sparse_rare_into(sparse, count_matrix, rare_value, rare_width, params.lambda, &rare, rare_column);
+			times[i] = now() - start;
+		}
+		snprintf(benchmark, sizeof(benchmark), "gather-%s", layout);
+		report(benchmark, options, sequences, reads, 1, times);
+
+		for(i = 0; i < options->repetitions; i++) {
+			double start = now();
+			if(nnls_sparse(&rare, count_matrix_rare, sequences, rare_width, &nnls_options) == NULL) {
+				fprintf(stderr, "Error: nnls failed\n");
+				exit(EXIT_FAILURE);
+			}
+			times[i] = now() - start;
+		}
+		snprintf(benchmark, sizeof(benchmark), "nnls-lawson-hanson-%s", layout);
+		report(benchmark, options, sequences, reads, options->jobs, times);
+
+		nnls_options.solver = NNLS_SOLVER_APG;
+		for(i = 0; i < options->repetitions; i++) {
+			double start = now();
+			if(nnls_sparse(&rare, count_matrix_rare, sequences, rare_width, &nnls_options) == NULL && nnls_options.status != 1) {
+				fprintf(stderr, "Error: nnls failed\n");
+				exit(EXIT_FAILURE);
+			}
+			times[i] = now() - start;
+		}
+		snprintf(benchmark, sizeof(benchmark), "nnls-apg-%s", layout);
+		report(benchmark, options, sequences, reads, options->jobs, times);
+
+		free(rare.row_ptr);
+		free(rare.column);
+		free(rare.values);
+		free(rare_column);
+	}
+	else {
+		double *rare = malloc(rare_width * sequences * sizeof(double));
+		double *a_matrix = malloc(rare_width * sequences * sizeof(double));
+		double *b_matrix = malloc(rare_width * sizeof(double));
+		double *row_sum = malloc(sequences * sizeof(double));
+		check_malloc(rare, NULL);
+		check_malloc(a_matrix, NULL);
+		check_malloc(b_matrix, NULL);
+		check_malloc(row_sum, NULL);
+
+		for(i = 0; i < options->repetitions; i++) {
+			double start = now();
+			gather_rare_into(sensing_matrix, count_matrix, rare_value, rare_width, params.lambda, rare, NULL, row_sum);
+			times[i] = now() - start;
+		}
+		snprintf(benchmark, sizeof(benchmark), "gather-%s", layout);
+		report(benchmark, options, sequences, reads, 1, times);
+
+		// householder lawson-hanson destroys A and b, so it works on copies,
+		// and keeps its workspace between solves like multifasta_to_otu
+		nnls_workspace_init(&workspace, 0);
+		for(i = 0; i < options->repetitions; i++) {
+			memcpy(a_matrix, rare, rare_width * sequences * sizeof(double));
+			memcpy(b_matrix, count_matrix_rare, rare_width * sizeof(double));
+			memset(solution, 0, sequences * sizeof(double));
+
+			double start = now();
+			if(try_nnls_into(a_matrix, b_matrix, sequences, rare_width, solution, options->jobs, &workspace) >= 2) {
+				fprintf(stderr, "Error: nnls failed\n");
+				exit(EXIT_FAILURE);
+			}
+			times[i] = now() - start;
+		}
+		nnls_workspace_free(&workspace);
+		snprintf(benchmark, sizeof(benchmark), "nnls-lawson-hanson-%s", layout);
+		report(benchmark, options, sequences, reads, options->jobs, times);
+
+		// lawson-hanson through the normal equations, which is what --float
+		// solves with, in double and then single precision, so the two show
+		// what the solver and the precision each change
+		for(i = 0; i < options->repetitions; i++) {
+			double start = now();
+			if(nnls_dense(rare, count_matrix_rare, sequences, rare_width, &nnls_options) == NULL) {
+				fprintf(stderr, "Error: nnls failed\n");
+				exit(EXIT_FAILURE);
+			}
+			times[i] = now() - start;
+		}
+		snprintf(benchmark, sizeof(benchmark), "nnls-normal-%s", layout);
+		report(benchmark, options, sequences, reads, options->jobs, times);
+
+		float *rare_float = malloc(rare_width * sequences * sizeof(float));
+		check_malloc(rare_float, NULL);
+		gather_rare_into(sensing_matrix, count_matrix, rare_value, rare_width, params.lambda, NULL, rare_float, row_sum);
+		for(i = 0; i < options->repetitions; i++) {
+			double start = now();
+			if(nnls_dense_float(rare_float, count_matrix_rare, sequences, rare_width, &nnls_options) == NULL) {
+				fprintf(stderr, "Error: nnls failed\n");
+				exit(EXIT_FAILURE);
+			}
+			times[i] = now() - start;
+		}
+		free(rare_float);
+		snprintf(benchmark, sizeof(benchmark), "nnls-normal-float-%s", layout);
+		report(benchmark, options, sequences, reads, options->jobs, times);
+
+		nnls_options.solver = NNLS_SOLVER_APG;
+		for(i = 0; i < options->repetitions; i++) {
+			double start = now();
+			if(nnls_dense(rare, count_matrix_rare, sequences, rare_width, &nnls_options) == NULL && nnls_options.status != 1) {
+				fprintf(stderr, "Error: nnls failed\n");
+				exit(EXIT_FAILURE);
+			}
+			times[i] = now() - start;
+		}
+		snprintf(benchmark, sizeof(benchmark), "nnls-apg-%s", layout);
+		report(benchmark, options, sequences, reads, options->jobs, times);
+
+		free(rare);
+		free(a_matrix);
+		free(b_matrix);
+		free(row_sum);
+	}
+
+	// and everything together, through libquikr like quikr
+	char error[QUIKR_ERROR_LENGTH];
+	struct quikr_database *database = NULL;
+
+	if(quikr_database_open(options->sensing_matrix, options->kmer, &database, error) != QUIKR_OK) {
+		fprintf(stderr, "Error: %s\n", error);
+		exit(EXIT_FAILURE);
+	}
+
+	for(i = 0; i < options->repetitions; i++) {
+		double start = now();
+		if(quikr_classify(database, sample->counts, &params, solution, NULL) < 0) {
+			fprintf(stderr, "Error: classifying %s failed\n", options->input);
+			exit(EXIT_FAILURE);
+		}
+		times[i] = now() - start;
+	}
+	snprintf(benchmark, sizeof(benchmark), "classify-%s", layout);
+	report(benchmark, options, sequences, reads, options->jobs, times);
+
+	quikr_database_close(database);
+	free_sensing_matrix(sensing_matrix);
+	free_sample(sample);
+	free(count_matrix);
+	free(scratch);
+	free(count_matrix_rare);
+	free(solution);
+}
+
+static void bench_exec(const struct bench_options *options, char **command, double *times) {
+	int i = 0;
+	int status = 0;
+
+	for(i = 0; i < options->repetitions; i++) {
+		double start = now();
+
+		pid_t pid = fork();
+		if(pid == -1) {
+			fprintf(stderr, "could not run %s - %s\n", command[0], strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		if(pid == 0) {
+			int null = open("/dev/null", O_WRONLY);
+			if(null != -1)
+				dup2(null, STDOUT_FILENO);
+			execvp(command[0], command);
+			fprintf(stderr, "could not run %s - %s\n", command[0], strerror(errno));
+			_exit(127);
+		}
+
+		if(waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			fprintf(stderr, "Error: %s failed\n", command[0]);
+			exit(EXIT_FAILURE);
+		}
+		times[i] = now() - start;
+	}
+
+	report(options->name, options, options->sequences, options->reads, options->jobs, times);
+}
+
+int main(int argc, char **argv) {
+	struct bench_options options;
+	int c = 0;
+
+	if(argc < 2 || str_eq(argv[1], "-h") || str_eq(argv[1], "--help")) {
+		printf("%s\n", USAGE);
+		exit(argc < 2 ? EXIT_FAILURE : EXIT_SUCCESS);
+	}
+	if(str_eq(argv[1], "-V") || str_eq(argv[1], "--version")) {
+		printf("%s\n", VERSION);
+		exit(EXIT_SUCCESS);
+	}
+
+	// the generators and the benchmarks give some options different meanings
+	const char *command = argv[1];
+	const int generator = str_eq(command, "reference") || str_eq(command, "sample");
+
+	memset(&options, 0, sizeof(struct bench_options));
+	options.kmer = 6;
+	options.jobs = 1;
+	options.repetitions = 3;
+	options.seed = 1;
+
+	if(str_eq(command, "reference")) {
+		options.count = 1000;
+		options.length = 1500;
+		options.rate = 0.05;
+	}
+	else {
+		options.count = 100000;
+		options.length = 250;
+		options.clusters = 20;
+		options.rate = 0.01;
+	}
+
+	while (1) {
+		static struct option long_options[] = {
+			{"input", required_argument, 0, 'i'},
+			{"output", required_argument, 0, 'o'},
+			{"truth", required_argument, 0, 't'},
+			{"kmer", required_argument, 0, 'k'},
+			{"jobs", required_argument, 0, 'j'},
+			{"clusters", required_argument, 0, 'c'},
+			{"error", required_argument, 0, 'e'},
+			{"reads", required_argument, 0, 'r'},
+			{0, 0, 0, 0}
+		};
+
+		int option_index = 0;
+
+		c = getopt_long(argc - 1, argv + 1, "i:o:s:t:l:k:j:n:c:d:e:r:", long_options, &option_index);
+
+		if(c == -1)
+			break;
+
+		switch(c) {
+			case 'i':
+				options.input = optarg;
+				break;
+			case 'o':
+				options.output = optarg;
+				break;
+			case 's':
+				if(generator)
+					options.seed = strtoull(optarg, NULL, 10);
+				else
+					options.sensing_matrix = optarg;
+				break;
+			case 't':
+				options.truth = optarg;
+				break;
+			case 'l':
+				if(generator)
+					options.length = strtoull(optarg, NULL, 10);
+				else
+					options.name = optarg;
+				break;
+			case 'k':
+				options.kmer = atoi(optarg);
+				break;
+			case 'j':
+				options.jobs = atoi(optarg);
+				break;
+			case 'n':
+				if(generator)
+					options.count = strtoull(optarg, NULL, 10);
+				else
+					options.repetitions = atoi(optarg);
+				break;
+			case 'c':
+				options.clusters = strtoull(optarg, NULL, 10);
+				break;
+			case 'd':
+				if(generator)
+					options.rate = atof(optarg);
+				else
+					options.sequences = strtoull(optarg, NULL, 10);
+				break;
+			case 'e':
+				options.rate = atof(optarg);
+				break;
+			case 'r':
+				options.reads = strtoull(optarg, NULL, 10);
+				break;
+			default:
+				exit(EXIT_FAILURE);
+		}
+	}
+
+	if(options.kmer == 0 || options.kmer > 16) {
+		fprintf(stderr, "Error: kmer must be between 1 and 16\n");
+		exit(EXIT_FAILURE);
+	}
+	if(options.jobs < 1 || options.repetitions < 1) {
+		fprintf(stderr, "Error: jobs and repetitions must be at least 1\n");
+		exit(EXIT_FAILURE);
+	}
+
+	double *times = malloc(options.repetitions * sizeof(double));
+	check_malloc(times, NULL);
+
+	if(str_eq(command, "reference")) {
+		if(options.output == NULL || options.count == 0 || options.length == 0) {
+			fprintf(stderr, "Error: reference needs an output (-o), and sequences and a length of at least 1\n");
+			exit(EXIT_FAILURE);
+		}
+		generate_reference(&options);
+	}
+	else if(str_eq(command, "sample")) {
+		if(options.input == NULL || options.output == NULL || options.length == 0) {
+			fprintf(stderr, "Error: sample needs a reference (-i), an output (-o) and a length of at least 1\n");
+			exit(EXIT_FAILURE);
+		}
+		generate_sample(&options);
+	}
+	else if(str_eq(command, "header")) {
+		printf("%s\n", BENCH_HEADER);
+	}
+	else if(str_eq(command, "count")) {
+		if(options.input == NULL) {
+			fprintf(stderr, "Error: count needs a sample (-i)\n");
+			exit(EXIT_FAILURE);
+		}
+		bench_count(&options, times);
+	}
+	else if(str_eq(command, "load")) {
+		if(options.sensing_matrix == NULL) {
+			fprintf(stderr, "Error: load needs a sensing matrix (-s)\n");
+			exit(EXIT_FAILURE);
+		}
+		bench_load(&options, times);
+	}
+	else if(str_eq(command, "classify")) {
+		if(options.sensing_matrix == NULL || options.input == NULL) {
+			fprintf(stderr, "Error: classify needs a sensing matrix (-s) and a sample (-i)\n");
+			exit(EXIT_FAILURE);
+		}
+		bench_classify(&options, times);
+	}
+	else if(str_eq(command, "exec")) {
+		// optind counts from argv + 1
+		if(options.name == NULL || optind + 1 >= argc) {
+			fprintf(stderr, "Error: exec needs a name (-l) and a command after --\n");
+			exit(EXIT_FAILURE);
+		}
+		bench_exec(&options, argv + optind + 1, times);
+	}
+	else {
+		fprintf(stderr, "Error: unknown command %s\n\n%s\n", command, USAGE);
+		exit(EXIT_FAILURE);
+	}
+
+	free(times);
+	return EXIT_SUCCESS;
+}
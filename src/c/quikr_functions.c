@@ -1,110 +1,32 @@
 #include <ctype.h>
 #include <errno.h>
 #include <math.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <zlib.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-#include "kmer_utils.h"
-#include "quikr.h"
-
-
-/* getdelim.c --- Implementation of replacement getdelim function.
-	 Copyright (C) 1994, 1996, 1997, 1998, 2001, 2003, 2005 Free
-	 Software Foundation, Inc.
-
-	 This program is free software; you can redistribute it and/or
-	 modify it under the terms of the GNU General Public License as
-	 published by the Free Software Foundation; either version 2, or (at
-	 your option) any later version.
-
-	 This program is distributed in the hope that it will be useful, but
-	 WITHOUT ANY WARRANTY; without even the implied warranty of
-	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
-	 General Public License for more details.
-
-	 You should have received a copy of the GNU General Public License
-	 along with this program; if not, write to the Free Software
-	 Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
-	 02110-1301, USA.  */
-
-ssize_t getseq(char **lineptr, size_t *n, FILE *fp) {
-	int result = 0;
-	ssize_t cur_len = 0;
-
-	if (lineptr == NULL || n == NULL || fp == NULL)
-	{
-		errno = EINVAL;
-		return -1;
-	}
-
-	flockfile (fp);
-
-	if (*lineptr == NULL || *n == 0)
-	{
-		*n = 120;
-		*lineptr = (char *) malloc (*n);
-		if (*lineptr == NULL)
-		{
-			result = -1;
-			goto unlock_return;
-		}
-	}
-
-		int newline = 0;
-	for (;;) {
-		int i;
-
-		i = getc (fp);
-		if (i == EOF)
-		{
-			result = -1;
-			break;
-		}
-
-		/* Make enough space for len+1 (for final NUL) bytes.  */
-		if (cur_len + 2 >= *n)
-		{
-			size_t needed = 2 * (cur_len + 1) + 2;   /* Be generous. */
-			char *new_lineptr;
-
-			if (needed < cur_len)
-			{
-				result = -1;
-				goto unlock_return;
-			}
-
-			new_lineptr = (char *) realloc (*lineptr, needed);
-			if (new_lineptr == NULL){
-				result = -1;
-				goto unlock_return;
-			}
-
-			*lineptr = new_lineptr;
-			*n = needed;
-		}
-
-		(*lineptr)[cur_len] = i;
-		cur_len++;
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
-		if (i == '\n') {
-			newline = 1;
-		}
+#ifdef Darwin
+#define st_mtim st_mtimespec
+#endif
 
-		if(i == '>' && newline == 1) {
-			break;
-		}
-	}
-	(*lineptr)[cur_len] = '\0';
-	result = cur_len ? cur_len : result;
+#include "fasta.h"
+#include "kmer_utils.h"
+#include "libquikr.h"
+#include "quikr.h"
+#include "quikr_functions.h"
+#include "vector.h"
 
-	unlock_return:
-		funlockfile (fp);
-		return result;
-}
 
 void check_malloc(void *ptr, char *error) {
 	if (ptr == NULL) {
@@ -116,43 +38,90 @@ void check_malloc(void *ptr, char *error) {
 		exit(EXIT_FAILURE);
 	}
 }
-static int double_cmp (const void * a, const void * b) {
-	return ( *(double*)a - *(double*)b );
+// the k'th smallest of values[0..n), which values is partially sorted around.
+// Hoare's selection with a median of three pivot, so linear on average
+static double select_kth(double *values, size_t n, size_t k) {
+	size_t lo = 0;
+	size_t hi = n - 1;
+
+	while(lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		double a = values[lo], b = values[mid], c = values[hi];
+		double pivot = a < b ? (b < c ? b : (a < c ? c : a)) : (a < c ? a : (b < c ? c : b));
+		size_t i = lo;
+		size_t j = hi;
+
+		while(i <= j) {
+			while(values[i] < pivot)
+				i++;
+			while(values[j] > pivot)
+				j--;
+			if(i <= j) {
+				double t = values[i];
+				values[i] = values[j];
+				values[j] = t;
+				i++;
+				if(j == 0)
+					break;
+				j--;
+			}
+		}
+
+		if(k <= j)
+			hi = j;
+		else if(k >= i)
+			lo = i;
+		else
+			return values[k];
+	}
+
+	return values[k];
 }
 
-void get_rare_value(double *count_matrix, unsigned long long width, double rare_percent, unsigned long long *ret_rare_value, unsigned long long  *ret_rare_width) { 
-	size_t y, x;
+void get_rare_value_into(const double *count_matrix, unsigned long long width, double rare_percent, unsigned long long *ret_rare_value, unsigned long long *ret_rare_width, double *scratch) {
+	size_t x;
 	unsigned long long rare_width = 0;
+	unsigned long long rank = 0;
 	double rare_value = 0;
 
-	// allocate * sort a temporary matrix
-	double *sorted_count_matrix = malloc(width * sizeof(double));
-	check_malloc(sorted_count_matrix, NULL);
-
-	memcpy(sorted_count_matrix, count_matrix, width * sizeof(double));
+	if(width == 0) {
+		*ret_rare_width = 0;
+		*ret_rare_value = 0;
+		return;
+	}
 
-	qsort(sorted_count_matrix, width, sizeof(double), double_cmp);
+	// the threshold is the smallest count with at least rare_percent of the
+	// counts at or below it, which is the rank'th smallest for the smallest
+	// rank with (rank + 1) / width >= rare_percent
+	rank = (unsigned long long)ceil(rare_percent * width);
+	while(rank > 1 && (double)(rank - 1) / (double)width >= rare_percent)
+		rank--;
+	while(rank < width && (double)rank / (double)width < rare_percent)
+		rank++;
+	if(rank > 0)
+		rank--;
+	// a rare percent over 1 keeps everything, like 1 does
+	if(rank > width - 1)
+		rank = width - 1;
+
+	memcpy(scratch, count_matrix, width * sizeof(double));
+	rare_value = select_kth(scratch, width, rank);
+
+	for(x = 0; x < width; x++)
+		if(count_matrix[x] <= rare_value)
+			rare_width++;
 
-	// get our "rare" counts
-	for(y = 0; y < width; y++) {
-		double percentage = 0;
+	*ret_rare_width = rare_width;
+	*ret_rare_value = rare_value;
+}
 
-		rare_value = sorted_count_matrix[y];
-		rare_width = 0;
-		for(x = 0; x < width; x++) {
-			if(count_matrix[x] <= rare_value) {
-				rare_width++;
-			}
-		}
-		percentage = (double)rare_width / (double)width;
+void get_rare_value(double *count_matrix, unsigned long long width, double rare_percent, unsigned long long *ret_rare_value, unsigned long long  *ret_rare_width) { 
+	double *scratch = malloc((width ? width : 1) * sizeof(double));
+	check_malloc(scratch, NULL);
 
-		if(percentage >= rare_percent)
-			break;
-	}
+	get_rare_value_into(count_matrix, width, rare_percent, ret_rare_value, ret_rare_width, scratch);
 
-	free(sorted_count_matrix);
-	*ret_rare_width = rare_width;
-	*ret_rare_value = rare_value;
+	free(scratch);
 }
 
 void debug_arrays(double *count_matrix, struct matrix *sensing_matrix) {
@@ -164,9 +133,14 @@ void debug_arrays(double *count_matrix, struct matrix *sensing_matrix) {
 	unsigned long long j = 0;
 
 	for(i = 0; i < sensing_matrix->sequences; i++) {
-		for(j = 0; j < width - 1; j++)
-			fprintf(sensing_fh, "%lf\t", sensing_matrix->matrix[width*i + j]);
-		fprintf(sensing_fh, "%lf\n", sensing_matrix->matrix[width*i + width-1]);
+		for(j = 0; j < width; j++) {
+			double value = 0;
+			if(sensing_matrix->kmer_major != NULL)
+				value = sensing_matrix->kmer_major[sensing_matrix->sequences*j + i];
+			else
+				value = sensing_matrix->matrix[width*i + j];
+			fprintf(sensing_fh, j < width - 1 ? "%lf\t" : "%lf\n", value);
+		}
 	}
 
 	fclose(sensing_fh);
@@ -194,26 +168,247 @@ void normalize_matrix(double *matrix, unsigned long long height, unsigned long l
 	}
 }
 
+void normalize_sparse_matrix(struct sparse_matrix *matrix) {
+	unsigned long long x = 0;
+	unsigned long long y = 0;
+
+	for(x = 0; x < matrix->rows; x++) {
+
+		double row_sum = 0;
+
+		for(y = matrix->row_ptr[x]; y < matrix->row_ptr[x + 1]; y++)
+			row_sum = row_sum + matrix->values[y];
+		for(y = matrix->row_ptr[x]; y < matrix->row_ptr[x + 1]; y++)
+			matrix->values[y] = matrix->values[y] / row_sum;
+	}
+}
+
+// where each kmer ends up in the rare matrix, 0 if it isn't rare
+static void sparse_rare_columns(const struct sparse_matrix *sensing_matrix, const double *count_matrix, unsigned long long rare_value, uint32_t *rare_column) {
+	unsigned long long x = 0;
+	unsigned long long y = 0;
+
+	for(x = 0, y = 1; x < sensing_matrix->columns; x++) {
+		if(count_matrix == NULL || count_matrix[x] <= rare_value)
+			rare_column[x] = y++;
+		else
+			rare_column[x] = 0;
+	}
+}
+
+// the rows of gather_sparse_rare into rare, which has room for them
+static void gather_sparse_rows(const struct sparse_matrix *sensing_matrix, const uint32_t *rare_column, unsigned long long rare_width, unsigned long long lambda, struct sparse_matrix *rare) {
+	unsigned long long x = 0;
+	unsigned long long y = 0;
+	unsigned long long z = 0;
+
+	rare->rows = sensing_matrix->rows;
+	rare->columns = rare_width;
+
+	for(x = 0, y = 0; x < sensing_matrix->rows; x++) {
+		unsigned long long start = 0;
+		double row_sum = 0;
+
+		rare->row_ptr[x] = y;
+
+		rare->column[y] = 0;
+		rare->values[y] = 1.0;
+		y++;
+
+		start = y;
+		for(z = sensing_matrix->row_ptr[x]; z < sensing_matrix->row_ptr[x + 1]; z++) {
+			uint32_t column = rare_column[sensing_matrix->column[z]];
+			if(column) {
+				rare->column[y] = column;
+				rare->values[y] = sensing_matrix->values[z];
+				row_sum += sensing_matrix->values[z];
+				y++;
+			}
+		}
+
+		for(z = start; z < y; z++)
+			rare->values[z] = rare->values[z] / row_sum * lambda;
+	}
+	rare->row_ptr[rare->rows] = y;
+	rare->nnz = y;
+}
+
+struct sparse_matrix *gather_sparse_rare(const struct sparse_matrix *sensing_matrix, const double *count_matrix, unsigned long long rare_value, unsigned long long rare_width, unsigned long long lambda) {
+	unsigned long long x = 0;
+	unsigned long long nnz = 0;
+
+	uint32_t *rare_column = malloc(sensing_matrix->columns * sizeof(uint32_t));
+	check_malloc(rare_column, NULL);
+
+	sparse_rare_columns(sensing_matrix, count_matrix, rare_value, rare_column);
+
+	for(x = 0; x < sensing_matrix->nnz; x++) {
+		if(rare_column[sensing_matrix->column[x]])
+			nnz++;
+	}
+
+	struct sparse_matrix *rare = malloc(sizeof(struct sparse_matrix));
+	check_malloc(rare, NULL);
+
+	// one extra entry per row for the zero column
+	rare->row_ptr = malloc((sensing_matrix->rows + 1) * sizeof(unsigned long long));
+	rare->column = malloc((nnz + sensing_matrix->rows) * sizeof(uint32_t));
+	rare->values = malloc((nnz + sensing_matrix->rows) * sizeof(double));
+	check_malloc(rare->row_ptr, NULL);
+	check_malloc(rare->column, NULL);
+	check_malloc(rare->values, NULL);
+
+	gather_sparse_rows(sensing_matrix, rare_column, rare_width, lambda, rare);
+
+	free(rare_column);
+
+	return rare;
+}
+
+void gather_sparse_rare_into(const struct sparse_matrix *sensing_matrix, const double *count_matrix, unsigned long long rare_value, unsigned long long rare_width, unsigned long long lambda, struct sparse_matrix *rare, uint32_t *rare_column) {
+	sparse_rare_columns(sensing_matrix, count_matrix, rare_value, rare_column);
+	gather_sparse_rows(sensing_matrix, rare_column, rare_width, lambda, rare);
+}
+
+// gather_dense_rare into either a double or a float matrix
+static void gather_row_major_rare(const double *sensing_matrix, unsigned long long sequences, unsigned long long width, const double *count_matrix, unsigned long long rare_value, unsigned long long rare_width, unsigned long long lambda, double *rare, float *rare_float) {
+	unsigned long long z = 0;
+
+	// rows are read and written in order, once to sum them and once to copy
+	for(z = 0; z < sequences; z++) {
+		const double *row = &sensing_matrix[z * width];
+		unsigned long long x = 0;
+		unsigned long long y = 0;
+		double row_sum = 0;
+
+		for(x = 0; x < width; x++)
+			if(count_matrix == NULL || count_matrix[x] <= rare_value)
+				row_sum += row[x];
+
+		// the sum and the scaling are in double either way
+		if(rare_float != NULL) {
+			float *rare_row = &rare_float[z * rare_width];
+			rare_row[0] = 1.0;
+			for(x = 0, y = 1; x < width; x++)
+				if(count_matrix == NULL || count_matrix[x] <= rare_value)
+					rare_row[y++] = row[x] / row_sum * lambda;
+		}
+		else {
+			double *rare_row = &rare[z * rare_width];
+			rare_row[0] = 1.0;
+			for(x = 0, y = 1; x < width; x++)
+				if(count_matrix == NULL || count_matrix[x] <= rare_value)
+					rare_row[y++] = row[x] / row_sum * lambda;
+		}
+	}
+}
+
+// the same from a kmer-major matrix. Only the kept kmers are read, each one a
+// contiguous row, and they are summed in the same order as above so the
+// result doesn't depend on the layout. The transpose into A goes a tile of
+// sequences at a time so the rows being written stay in cache
+#define GATHER_TILE 64
+static void gather_kmer_major_rare(const double *kmer_major, unsigned long long sequences, unsigned long long width, const double *count_matrix, unsigned long long rare_value, unsigned long long rare_width, unsigned long long lambda, double *rare, float *rare_float, double *row_sum) {
+	unsigned long long kept = 0;
+	unsigned long long x = 0;
+	unsigned long long y = 0;
+	unsigned long long z = 0;
+
+	memset(row_sum, 0, sequences * sizeof(double));
+
+	for(x = 0; x < width; x++) {
+		if(count_matrix == NULL || count_matrix[x] <= rare_value) {
+			vector_axpy(1.0, &kmer_major[x * sequences], row_sum, sequences);
+			kept++;
+		}
+	}
+
+	for(z = 0; z < sequences; z += GATHER_TILE) {
+		unsigned long long end = z + GATHER_TILE < sequences ? z + GATHER_TILE : sequences;
+
+		for(y = z; y < end; y++) {
+			if(rare_float != NULL)
+				rare_float[y * rare_width] = 1.0;
+			else
+				rare[y * rare_width] = 1.0;
+		}
+
+		for(x = 0, kept = 1; x < width; x++) {
+			const double *row = &kmer_major[x * sequences];
+
+			if(count_matrix != NULL && count_matrix[x] > rare_value)
+				continue;
+
+			if(rare_float != NULL)
+				for(y = z; y < end; y++)
+					rare_float[y * rare_width + kept] = row[y] / row_sum[y] * lambda;
+			else
+				for(y = z; y < end; y++)
+					rare[y * rare_width + kept] = row[y] / row_sum[y] * lambda;
+			kept++;
+		}
+	}
+}
+
+void gather_rare_into(const struct matrix *sensing_matrix, const double *count_matrix, unsigned long long rare_value, unsigned long long rare_width, unsigned long long lambda, double *rare, float *rare_float, double *scratch) {
+	const unsigned long long width = pow_four(sensing_matrix->kmer);
+
+	if(sensing_matrix->kmer_major != NULL) {
+		double *row_sum = scratch;
+		if(row_sum == NULL) {
+			row_sum = malloc(sensing_matrix->sequences * sizeof(double));
+			check_malloc(row_sum, NULL);
+		}
+
+		gather_kmer_major_rare(sensing_matrix->kmer_major, sensing_matrix->sequences, width, count_matrix, rare_value, rare_width, lambda, rare, rare_float, row_sum);
+
+		if(scratch == NULL)
+			free(row_sum);
+	}
+	else {
+		gather_row_major_rare(sensing_matrix->matrix, sensing_matrix->sequences, width, count_matrix, rare_value, rare_width, lambda, rare, rare_float);
+	}
+}
+
+double *gather_dense_rare(const struct matrix *sensing_matrix, const double *count_matrix, unsigned long long rare_value, unsigned long long rare_width, unsigned long long lambda) {
+	double *rare = malloc(rare_width * sensing_matrix->sequences * sizeof(double));
+	check_malloc(rare, NULL);
+
+	gather_rare_into(sensing_matrix, count_matrix, rare_value, rare_width, lambda, rare, NULL, NULL);
+
+	return rare;
+}
+
+float *gather_dense_rare_float(const struct matrix *sensing_matrix, const double *count_matrix, unsigned long long rare_value, unsigned long long rare_width, unsigned long long lambda) {
+	float *rare = malloc(rare_width * sensing_matrix->sequences * sizeof(float));
+	check_malloc(rare, NULL);
+
+	gather_rare_into(sensing_matrix, count_matrix, rare_value, rare_width, lambda, NULL, rare, NULL);
+
+	return rare;
+}
+
 unsigned long long count_sequences(const char *filename) {
-	char *line = NULL;
-	size_t len = 0;
-	ssize_t read;
+	struct fasta_record record;
+	int ret = 0;
 
 	unsigned long long sequences = 0;
 
-	FILE *fh = fopen(filename, "r");
-	if(fh == NULL) {
+	struct fasta_reader *reader = fasta_open(filename, 0);
+	if(reader == NULL) {
 		fprintf(stderr, "could not open \"%s\"\n", filename );
 		return 0;
 	}
 
-	while ((read = getline(&line, &len, fh)) != -1) {
-		if(line[0] == '>')
-			sequences++;
+	while((ret = fasta_next(reader, &record)) > 0)
+		sequences++;
+
+	if(ret < 0) {
+		fprintf(stderr, "could not read \"%s\"\n", filename);
+		sequences = 0;
 	}
 
-	free(line);
-	fclose(fh);
+	fasta_close(reader);
 
 	return sequences;
 }
@@ -255,7 +450,20 @@ size_t gzgetline(char **s, size_t * n, gzFile f) {
 	return *n;
 }
 
-struct matrix *load_sensing_matrix(const char *filename, unsigned int target_kmer) {
+// fill error, if there is one, and return code
+static int matrix_error(char *error, int code, const char *format, ...) {
+	va_list args;
+
+	if(error != NULL) {
+		va_start(args, format);
+		vsnprintf(error, QUIKR_ERROR_LENGTH, format, args);
+		va_end(args);
+	}
+
+	return code;
+}
+
+static int load_text_sensing_matrix(const char *filename, unsigned int target_kmer, struct matrix **sensing_matrix, char *error) {
 
 	char *line = NULL;
 	char **headers = NULL;
@@ -271,68 +479,65 @@ struct matrix *load_sensing_matrix(const char *filename, unsigned int target_kme
 
 	struct matrix *ret = NULL;
 	size_t lineno = 0;
+	int code = QUIKR_OK;
 
 	gzFile fh = NULL;
 
 	fh = gzopen(filename, "r");
-	if(fh == NULL) {
-		fprintf(stderr, "could not open %s", filename);
-		exit(EXIT_FAILURE);
-	}
+	if(fh == NULL)
+		return matrix_error(error, QUIKR_ERROR_IO, "could not open %s", filename);
 
 	line = malloc(1024 * sizeof(char));
-	check_malloc(line, NULL);
+	if(line == NULL) {
+		gzclose(fh);
+		return matrix_error(error, QUIKR_ERROR_MEMORY, "Could not allocate enough memory - %s", strerror(errno));
+	}
 
 	// Check for quikr
-	line = gzgets(fh, line, 1024);
-	lineno++;
-	if(strcmp(line, "quikr\n") != 0) {
-		fprintf(stderr, "This does not look like a quikr sensing matrix. Please check your path: %s\n", filename);
-		exit(EXIT_FAILURE);
+	if(gzgets(fh, line, 1024) == NULL || strcmp(line, "quikr\n") != 0) {
+		code = matrix_error(error, QUIKR_ERROR_FORMAT, "This does not look like a quikr sensing matrix. Please check your path: %s", filename);
+		goto done;
 	}
+	lineno++;
 
 	// check version
-	line = gzgets(fh, line, 1024);
-	if(atoi(line) != MATRIX_REVISION) {
-		fprintf(stderr, "Sensing Matrix uses an unsupported version, please retrain your matrix\n");
-		exit(EXIT_FAILURE);
+	if(gzgets(fh, line, 1024) == NULL || atoi(line) != MATRIX_TEXT_REVISION) {
+		code = matrix_error(error, QUIKR_ERROR_FORMAT, "Sensing Matrix uses an unsupported version, please retrain your matrix");
+		goto done;
 	}
 	lineno++;
 
 	// get number of sequences
-	line = gzgets(fh, line, 1024);
-	sequences = strtoull(line, NULL, 10);
+	sequences = gzgets(fh, line, 1024) == NULL ? 0 : strtoull(line, NULL, 10);
 	if(sequences == 0) {
-		fprintf(stderr, "Error parsing sensing matrix, sequence count is zero\n");
-		exit(EXIT_FAILURE);
+		code = matrix_error(error, QUIKR_ERROR_FORMAT, "Error parsing sensing matrix, sequence count is zero");
+		goto done;
 	}
 	lineno++;
 
 	// get kmer
-	gzgets(fh, line, 1024);
-	kmer = atoi(line);
+	kmer = gzgets(fh, line, 1024) == NULL ? 0 : atoi(line);
 	if(kmer == 0) {
-		fprintf(stderr, "Error parsing sensing matrix, kmer is zero\n");
-		exit(EXIT_FAILURE);
+		code = matrix_error(error, QUIKR_ERROR_FORMAT, "Error parsing sensing matrix, kmer is zero");
+		goto done;
 	}
 	lineno++;
 
-	if(kmer != target_kmer) {
-		fprintf(stderr, "The sensing_matrix was trained with a different kmer than your requested kmer\n");
-		exit(EXIT_FAILURE);
+	if(target_kmer != 0 && kmer != target_kmer) {
+		code = matrix_error(error, QUIKR_ERROR_KMER, "The sensing_matrix was trained with a different kmer than your requested kmer");
+		goto done;
 	}
 
 	width = pow_four(kmer);
 
 	// allocate a +1 size for the extra row
 	matrix = malloc(sequences * (width) * sizeof(double));
-	check_malloc(matrix, NULL);
-
 	row = malloc((width) * sizeof(unsigned long long));
-	check_malloc(row, NULL);
-	
 	headers = malloc(sequences * sizeof(char *));
-	check_malloc(headers, NULL);
+	if(matrix == NULL || row == NULL || headers == NULL) {
+		code = matrix_error(error, QUIKR_ERROR_MEMORY, "Could not allocate enough memory - %s", strerror(errno));
+		goto done;
+	}
 
 	char *buf = NULL;
 	size_t len = 0;
@@ -342,17 +547,21 @@ struct matrix *load_sensing_matrix(const char *filename, unsigned int target_kme
 		// get header and add it to headers array
 		//
 		read = gzgetline(&buf, &len, fh);
-		if(read == 0)  {
-			fprintf(stderr, "Error parsing sensing matrix, could not read header\n");
-			exit(EXIT_FAILURE);
+		if(read == 0 || read == (size_t)-1)  {
+			code = matrix_error(error, QUIKR_ERROR_FORMAT, "Error parsing sensing matrix, could not read header");
+			break;
 		}
 
 		char *header = malloc(sizeof(char) * read + 1);
-		check_malloc(header, NULL);	
+		if(header == NULL) {
+			code = matrix_error(error, QUIKR_ERROR_MEMORY, "Could not allocate enough memory - %s", strerror(errno));
+			break;
+		}
 		header = strncpy(header, buf, read - 1);
 		if(header[0] != '>') {
-			fprintf(stderr, "Error parsing sensing matrix, could not read header in line %llu\n", lineno);
-			exit(EXIT_FAILURE);
+			free(header);
+			code = matrix_error(error, QUIKR_ERROR_FORMAT, "Error parsing sensing matrix, could not read header in line %zu", lineno);
+			break;
 		}
 		lineno++;
 
@@ -362,36 +571,921 @@ struct matrix *load_sensing_matrix(const char *filename, unsigned int target_kme
 		row = memset(row, 0, (width) * sizeof(unsigned long long));
 
 		for(j = 0; j < width; j++) {
-			line = gzgets(fh, line, 32);
 			lineno++;
-			if(line == NULL || line[0] == '>') {
-				fprintf(stderr, "Error parsing sensing matrix, line %zu does not look like a value\n", lineno);
-				exit(EXIT_FAILURE);
+			if(gzgets(fh, line, 32) == NULL || line[0] == '>') {
+				code = matrix_error(error, QUIKR_ERROR_FORMAT, "Error parsing sensing matrix, line %zu does not look like a value", lineno);
+				break;
 			}
 			lineno++;
 
+			errno = 0;
 			row[j] = strtoull(line, NULL, 10);
 			if(errno) {
-				printf("could not parse '%s'\n into a number", line);
-				exit(EXIT_FAILURE);
+				code = matrix_error(error, QUIKR_ERROR_FORMAT, "could not parse '%s' into a number", line);
+				break;
 			}
 
 		}
+		if(code != QUIKR_OK) {
+			i++;
+			break;
+		}
 		for(j = 0; j < width; j++) {
 			matrix[i*(width) + j] = ((double)row[j]);
 		}
 	}
+	free(buf);
+
+	if(code == QUIKR_OK) {
+		ret = malloc(sizeof(struct matrix));
+		if(ret == NULL)
+			code = matrix_error(error, QUIKR_ERROR_MEMORY, "Could not allocate enough memory - %s", strerror(errno));
+	}
 
+	if(code != QUIKR_OK) {
+		// the headers read so far, allocated with the '>' in front of them
+		while(i > 0)
+			free(headers[--i] - 1);
+		free(headers);
+		free(matrix);
+		goto done;
+	}
+
+	(*ret).kmer = kmer;
+	(*ret).sequences = sequences;
+	(*ret).matrix = matrix;
+	(*ret).kmer_major = NULL;
+	(*ret).sparse = NULL;
+	(*ret).headers = headers;
+	(*ret).map = NULL;
+	(*ret).map_size = 0;
+
+	*sensing_matrix = ret;
+
+done:
 	// load the matrix of counts
 	gzclose(fh);
 
 	free(line);
 	free(row);
+
+	return code;
+}
+
+static int map_sparse_matrix(char *map, struct matrix_file_header *header, const char *filename, struct sparse_matrix **ret, char *error) {
+	unsigned long long i = 0;
+
+	// the offsets are already inside the file, so bounding the counts by it
+	// keeps the sums below from overflowing
+	if(header->columns_offset % sizeof(uint32_t) != 0 ||
+			header->row_ptr_offset % sizeof(unsigned long long) != 0 ||
+			header->nnz > header->headers_offset / sizeof(double) ||
+			header->sequences >= header->headers_offset / sizeof(unsigned long long) ||
+			header->columns_offset > header->headers_offset || header->row_ptr_offset > header->headers_offset ||
+			header->matrix_offset + header->nnz * sizeof(double) > header->columns_offset ||
+			header->columns_offset + header->nnz * sizeof(uint32_t) > header->row_ptr_offset ||
+			header->row_ptr_offset + (header->sequences + 1) * sizeof(unsigned long long) > header->headers_offset)
+		return matrix_error(error, QUIKR_ERROR_FORMAT, "Error parsing sensing matrix, %s is truncated or corrupt", filename);
+
+	struct sparse_matrix *sparse = malloc(sizeof(struct sparse_matrix));
+	if(sparse == NULL)
+		return matrix_error(error, QUIKR_ERROR_MEMORY, "Could not allocate enough memory - %s", strerror(errno));
+
+	sparse->rows = header->sequences;
+	sparse->columns = header->width;
+	sparse->nnz = header->nnz;
+	sparse->values = (double *)(map + header->matrix_offset);
+	sparse->column = (uint32_t *)(map + header->columns_offset);
+	sparse->row_ptr = (unsigned long long *)(map + header->row_ptr_offset);
+
+	// make sure a corrupt matrix can't send us out of bounds later
+	int corrupt = sparse->row_ptr[0] != 0 || sparse->row_ptr[sparse->rows] != sparse->nnz;
+	for(i = 0; !corrupt && i < sparse->rows; i++)
+		corrupt = sparse->row_ptr[i] > sparse->row_ptr[i + 1];
+	if(corrupt) {
+		free(sparse);
+		return matrix_error(error, QUIKR_ERROR_FORMAT, "Error parsing sensing matrix, %s has corrupt row pointers", filename);
+	}
+	for(i = 0; i < sparse->nnz; i++) {
+		if(sparse->column[i] >= sparse->columns) {
+			free(sparse);
+			return matrix_error(error, QUIKR_ERROR_FORMAT, "Error parsing sensing matrix, %s has corrupt columns", filename);
+		}
+	}
+
+	*ret = sparse;
+	return QUIKR_OK;
+}
+
+static int load_binary_sensing_matrix(const char *filename, unsigned int target_kmer, struct matrix **sensing_matrix, char *error) {
+
+	struct stat st;
+	struct matrix_file_header header;
+	struct matrix *ret = NULL;
+	struct sparse_matrix *sparse = NULL;
+
+	unsigned long long i = 0;
+	char **headers = NULL;
+	char *map = NULL;
+	int code = QUIKR_OK;
+
+	int fd = open(filename, O_RDONLY);
+	if(fd == -1)
+		return matrix_error(error, QUIKR_ERROR_IO, "could not open %s - %s", filename, strerror(errno));
+
+	if(fstat(fd, &st) == -1 || (size_t)st.st_size < MATRIX_DATA_OFFSET) {
+		close(fd);
+		return matrix_error(error, QUIKR_ERROR_FORMAT, "Error parsing sensing matrix, %s is truncated", filename);
+	}
+
+	// map the whole file read only and shared, so concurrent quikr processes
+	// use the same copy in the page cache
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if(map == MAP_FAILED) {
+		code = matrix_error(error, QUIKR_ERROR_IO, "could not map %s - %s", filename, strerror(errno));
+		close(fd);
+		return code;
+	}
+	close(fd);
+
+	memcpy(&header, map, sizeof(struct matrix_file_header));
+
+	if(header.byte_order != MATRIX_BYTE_ORDER) {
+		code = matrix_error(error, QUIKR_ERROR_FORMAT, "Sensing Matrix was written on a machine with a different byte order, please retrain your matrix");
+		goto fail;
+	}
+
+	if(header.revision < MATRIX_MIN_REVISION || header.revision > MATRIX_REVISION) {
+		code = matrix_error(error, QUIKR_ERROR_FORMAT, "Sensing Matrix uses an unsupported version, please retrain your matrix");
+		goto fail;
+	}
+
+	if(header.sequences == 0) {
+		code = matrix_error(error, QUIKR_ERROR_FORMAT, "Error parsing sensing matrix, sequence count is zero");
+		goto fail;
+	}
+
+	// pow_four needs a kmer it can shift by, and the widths below can't
+	// overflow with one this small
+	if(header.kmer == 0 || header.kmer > 16) {
+		code = matrix_error(error, QUIKR_ERROR_FORMAT, "Error parsing sensing matrix, %s has an invalid kmer", filename);
+		goto fail;
+	}
+
+	if(target_kmer != 0 && header.kmer != target_kmer) {
+		code = matrix_error(error, QUIKR_ERROR_KMER, "The sensing_matrix was trained with a different kmer than your requested kmer");
+		goto fail;
+	}
+
+	if(header.width != pow_four(header.kmer) ||
+			(header.layout != MATRIX_DENSE && header.layout != MATRIX_SPARSE && header.layout != MATRIX_KMER_MAJOR) ||
+			header.matrix_offset < sizeof(struct matrix_file_header) ||
+			header.matrix_offset % sizeof(double) != 0 ||
+			header.headers_offset > (uint64_t)st.st_size || header.matrix_offset > header.headers_offset ||
+			header.headers_size != (uint64_t)st.st_size - header.headers_offset ||
+			(header.layout != MATRIX_SPARSE && header.sequences > (header.headers_offset - header.matrix_offset) / (header.width * sizeof(double))) ||
+			header.headers_size == 0 || header.sequences > header.headers_size || map[st.st_size - 1] != '\0') {
+		code = matrix_error(error, QUIKR_ERROR_FORMAT, "Error parsing sensing matrix, %s is truncated or corrupt", filename);
+		goto fail;
+	}
+
+	headers = malloc(header.sequences * sizeof(char *));
 	ret = malloc(sizeof(struct matrix));
-	(*ret).kmer = kmer;
-	(*ret).sequences = sequences;
-	(*ret).matrix = matrix;
+	if(headers == NULL || ret == NULL) {
+		code = matrix_error(error, QUIKR_ERROR_MEMORY, "Could not allocate enough memory - %s", strerror(errno));
+		goto fail;
+	}
+
+	// headers point straight into the mapping
+	char *header_ptr = map + header.headers_offset;
+	char *header_end = header_ptr + header.headers_size;
+	for(i = 0; i < header.sequences; i++) {
+		if(header_ptr >= header_end) {
+			code = matrix_error(error, QUIKR_ERROR_FORMAT, "Error parsing sensing matrix, could not read header %llu", i);
+			goto fail;
+		}
+		headers[i] = header_ptr;
+		header_ptr += strlen(header_ptr) + 1;
+	}
+
+	if(header.layout == MATRIX_SPARSE) {
+		code = map_sparse_matrix(map, &header, filename, &sparse, error);
+		if(code != QUIKR_OK)
+			goto fail;
+	}
+
+	(*ret).kmer = header.kmer;
+	(*ret).sequences = header.sequences;
+	(*ret).matrix = NULL;
+	(*ret).kmer_major = NULL;
+	(*ret).sparse = sparse;
+	if(header.layout == MATRIX_KMER_MAJOR)
+		(*ret).kmer_major = (double *)(map + header.matrix_offset);
+	else if(header.layout == MATRIX_DENSE)
+		(*ret).matrix = (double *)(map + header.matrix_offset);
 	(*ret).headers = headers;
+	(*ret).map = map;
+	(*ret).map_size = st.st_size;
 
+	*sensing_matrix = ret;
+	return QUIKR_OK;
+
+fail:
+	free(headers);
+	free(ret);
+	munmap(map, st.st_size);
+	return code;
+}
+
+int try_load_sensing_matrix(const char *filename, unsigned int target_kmer, struct matrix **sensing_matrix, char *error) {
+	char magic[sizeof(MATRIX_MAGIC) - 1];
+
+	FILE *fh = fopen(filename, "r");
+	if(fh == NULL)
+		return matrix_error(error, QUIKR_ERROR_IO, "could not open %s", filename);
+
+	size_t read = fread(magic, 1, sizeof(magic), fh);
+	fclose(fh);
+
+	// anything that isn't a binary matrix goes through the text parser, gzopen
+	// handles both compressed and plain files
+	if(read == sizeof(magic) && memcmp(magic, MATRIX_MAGIC, sizeof(magic)) == 0)
+		return load_binary_sensing_matrix(filename, target_kmer, sensing_matrix, error);
+
+	return load_text_sensing_matrix(filename, target_kmer, sensing_matrix, error);
+}
+
+int verify_sensing_matrix(const struct matrix *sensing_matrix, const char *filename, char *error) {
+	// gzip checks the text format's crc as it is read
+	if(sensing_matrix->map == NULL)
+		return QUIKR_OK;
+
+	struct matrix_file_header header;
+	memcpy(&header, sensing_matrix->map, sizeof(struct matrix_file_header));
+
+	uLong crc = crc32(0L, Z_NULL, 0);
+	crc = crc32_z(crc, (Bytef *)sensing_matrix->map + header.matrix_offset, sensing_matrix->map_size - header.matrix_offset);
+	if(crc != header.checksum)
+		return matrix_error(error, QUIKR_ERROR_FORMAT, "Error parsing sensing matrix, checksum mismatch in %s", filename);
+
+	return QUIKR_OK;
+}
+
+struct matrix *load_sensing_matrix(const char *filename, unsigned int target_kmer) {
+	char error[QUIKR_ERROR_LENGTH];
+	struct matrix *sensing_matrix = NULL;
+
+	if(try_load_sensing_matrix(filename, target_kmer, &sensing_matrix, error) != QUIKR_OK) {
+		fprintf(stderr, "%s\n", error);
+		exit(EXIT_FAILURE);
+	}
+
+	return sensing_matrix;
+}
+
+void free_sparse_matrix(struct sparse_matrix *sparse) {
+	free(sparse->row_ptr);
+	free(sparse->column);
+	free(sparse->values);
+	free(sparse);
+}
+
+void free_sensing_matrix(struct matrix *sensing_matrix) {
+	unsigned long long i = 0;
+
+	if(sensing_matrix->map != NULL) {
+		// a mapped sparse matrix only owns the struct
+		free(sensing_matrix->sparse);
+		munmap(sensing_matrix->map, sensing_matrix->map_size);
+	}
+	else {
+		// text headers were allocated with the '>' in front of them
+		for(i = 0; i < sensing_matrix->sequences; i++)
+			free(sensing_matrix->headers[i] - 1);
+		free(sensing_matrix->matrix);
+	}
+
+	free(sensing_matrix->headers);
+	free(sensing_matrix);
+}
+
+static void matrix_writer_write(struct matrix_writer *writer, const void *data, size_t size) {
+	if(fwrite(data, 1, size, writer->fh) != size) {
+		fprintf(stderr, "Error: could not write output file, error code: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	writer->crc = crc32_z(writer->crc, (const Bytef *)data, size);
+}
+
+struct matrix_writer *matrix_writer_open(const char *filename, unsigned int kmer, unsigned long long sequences, int layout) {
+	struct matrix_writer *writer = malloc(sizeof(struct matrix_writer));
+	check_malloc(writer, NULL);
+
+	writer->fh = fopen(filename, "w");
+	if(writer->fh == NULL) {
+		fprintf(stderr, "Error: could not open output file, error code: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	memset(&writer->header, 0, sizeof(struct matrix_file_header));
+	memcpy(writer->header.magic, MATRIX_MAGIC, sizeof(writer->header.magic));
+	// files are written with the oldest revision that can hold them
+	writer->header.revision = layout == MATRIX_KMER_MAJOR ? 3 : layout == MATRIX_SPARSE ? 2 : MATRIX_MIN_REVISION;
+	writer->header.byte_order = MATRIX_BYTE_ORDER;
+	writer->header.kmer = kmer;
+	writer->header.sequences = sequences;
+	writer->header.width = pow_four(kmer);
+	writer->header.matrix_offset = MATRIX_DATA_OFFSET;
+	writer->header.layout = layout;
+
+	writer->rows = 0;
+	writer->crc = crc32(0L, Z_NULL, 0);
+
+	writer->headers = NULL;
+	writer->headers_len = 0;
+	writer->headers_alloc = 0;
+
+	writer->columns = NULL;
+	writer->row_ptr = NULL;
+	writer->row_columns = NULL;
+	writer->row_values = NULL;
+
+	if(layout != MATRIX_DENSE) {
+		writer->columns = tmpfile();
+		if(writer->columns == NULL) {
+			fprintf(stderr, "Error: could not create temporary file, error code: %s\n", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if(layout == MATRIX_SPARSE) {
+		writer->row_ptr = malloc((sequences + 1) * sizeof(unsigned long long));
+		check_malloc(writer->row_ptr, NULL);
+		writer->row_ptr[0] = 0;
+
+		writer->row_columns = malloc(writer->header.width * sizeof(uint32_t));
+		check_malloc(writer->row_columns, NULL);
+		writer->row_values = malloc(writer->header.width * sizeof(double));
+		check_malloc(writer->row_values, NULL);
+	}
+
+	// the header is rewritten with the checksum once we are done
+	if(fseek(writer->fh, MATRIX_DATA_OFFSET, SEEK_SET) != 0) {
+		fprintf(stderr, "Error: could not seek output file, error code: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	return writer;
+}
+
+void matrix_writer_add_row(struct matrix_writer *writer, const char *header, size_t header_len, const double *row) {
+	unsigned long long j = 0;
+
+	if(writer->rows == writer->header.sequences) {
+		fprintf(stderr, "Error: expected %llu sequences but got more\n", (unsigned long long)writer->header.sequences);
+		exit(EXIT_FAILURE);
+	}
+
+	if(writer->header.layout == MATRIX_SPARSE) {
+		unsigned long long nnz = 0;
+
+		for(j = 0; j < writer->header.width; j++) {
+			if(row[j] != 0) {
+				writer->row_columns[nnz] = j;
+				writer->row_values[nnz] = row[j];
+				nnz++;
+			}
+		}
+
+		// values go straight to the output, columns are appended later
+		matrix_writer_write(writer, writer->row_values, nnz * sizeof(double));
+		if(fwrite(writer->row_columns, sizeof(uint32_t), nnz, writer->columns) != nnz) {
+			fprintf(stderr, "Error: could not write temporary file, error code: %s\n", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+
+		writer->header.nnz += nnz;
+		writer->row_ptr[writer->rows + 1] = writer->header.nnz;
+	}
+	else if(writer->header.layout == MATRIX_KMER_MAJOR) {
+		if(fwrite(row, sizeof(double), writer->header.width, writer->columns) != writer->header.width) {
+			fprintf(stderr, "Error: could not write temporary file, error code: %s\n", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+	else {
+		matrix_writer_write(writer, row, writer->header.width * sizeof(double));
+	}
+
+	// headers are written after the matrix, so keep them until we finish
+	if(writer->headers_len + header_len + 1 > writer->headers_alloc) {
+		writer->headers_alloc = 2 * (writer->headers_len + header_len + 1);
+		writer->headers = realloc(writer->headers, writer->headers_alloc);
+		check_malloc(writer->headers, NULL);
+	}
+	memcpy(writer->headers + writer->headers_len, header, header_len);
+	writer->headers_len += header_len;
+	writer->headers[writer->headers_len++] = '\0';
+
+	writer->rows++;
+}
+
+// the side of the tiles matrix_writer_transpose moves, in doubles
+#define TRANSPOSE_TILE 2048
+
+static void transpose_io(ssize_t (*io)(int, void *, size_t, off_t), int fd, void *data, size_t size, off_t offset, const char *what) {
+	while(size > 0) {
+		ssize_t done = io(fd, data, size, offset);
+		if(done <= 0) {
+			fprintf(stderr, "Error: could not %s, error code: %s\n", what, done == 0 ? "unexpected end of file" : strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		data = (char *)data + done;
+		size -= done;
+		offset += done;
+	}
+}
+
+static ssize_t transpose_write(int fd, void *data, size_t size, off_t offset) {
+	return pwrite(fd, data, size, offset);
+}
+
+// write the spooled rows out kmer by kmer. The matrix is moved a tile of rows
+// and kmers at a time, read from the spool a row and written to the output a
+// kmer at a time, so every read and write is a tile side long and the spool is
+// read exactly once. The tiles of a band of kmers go out in the order of the
+// rows, so each kmer's checksum is kept as it grows and they are combined in
+// file order once the band is done
+static void matrix_writer_transpose(struct matrix_writer *writer) {
+	const unsigned long long width = writer->header.width;
+	const unsigned long long sequences = writer->rows;
+	const unsigned long long tile = (unsigned long long)TRANSPOSE_TILE * TRANSPOSE_TILE;
+	unsigned long long x = 0;
+	unsigned long long y = 0;
+	unsigned long long z = 0;
+	unsigned long long r = 0;
+
+	if(sequences == 0) {
+		fclose(writer->columns);
+		return;
+	}
+
+	// square tiles, unless the matrix is too narrow or short for them
+	unsigned long long rows = sequences < TRANSPOSE_TILE ? sequences : TRANSPOSE_TILE;
+	unsigned long long kmers = width < tile / rows ? width : tile / rows;
+	if(sequences < tile / kmers)
+		rows = sequences;
+	else
+		rows = tile / kmers;
+
+	double *in = malloc(rows * kmers * sizeof(double));
+	double *out = malloc(rows * kmers * sizeof(double));
+	uLong *crc = malloc(kmers * sizeof(uLong));
+	check_malloc(in, NULL);
+	check_malloc(out, NULL);
+	check_malloc(crc, NULL);
+
+	if(fflush(writer->columns) != 0 || fflush(writer->fh) != 0) {
+		fprintf(stderr, "Error: could not write output file, error code: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	const int spool = fileno(writer->columns);
+	const int output = fileno(writer->fh);
+
+	for(x = 0; x < width; x += kmers) {
+		const unsigned long long band = x + kmers < width ? kmers : width - x;
+
+		for(z = 0; z < band; z++)
+			crc[z] = crc32(0L, Z_NULL, 0);
+
+		for(y = 0; y < sequences; y += rows) {
+			const unsigned long long height = y + rows < sequences ? rows : sequences - y;
+
+			for(r = 0; r < height; r++)
+				transpose_io(pread, spool, in + r * band, band * sizeof(double), (off_t)(((y + r) * width + x) * sizeof(double)), "read temporary file");
+
+			// in blocks that stay in the cache
+			for(unsigned long long r0 = 0; r0 < height; r0 += 32)
+				for(unsigned long long z0 = 0; z0 < band; z0 += 32)
+					for(r = r0; r < height && r < r0 + 32; r++)
+						for(z = z0; z < band && z < z0 + 32; z++)
+							out[z * height + r] = in[r * band + z];
+
+			for(z = 0; z < band; z++) {
+				transpose_io(transpose_write, output, out + z * height, height * sizeof(double), (off_t)(writer->header.matrix_offset + ((x + z) * sequences + y) * sizeof(double)), "write output file");
+				crc[z] = crc32_z(crc[z], (const Bytef *)(out + z * height), height * sizeof(double));
+			}
+		}
+
+		for(z = 0; z < band; z++)
+			writer->crc = crc32_combine(writer->crc, crc[z], (z_off_t)(sequences * sizeof(double)));
+	}
+
+	// the headers go after the matrix, through the stream again
+	if(fseeko(writer->fh, (off_t)(writer->header.matrix_offset + width * sequences * sizeof(double)), SEEK_SET) != 0) {
+		fprintf(stderr, "Error: could not seek output file, error code: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	fclose(writer->columns);
+	free(in);
+	free(out);
+	free(crc);
+}
+
+void matrix_writer_close(struct matrix_writer *writer) {
+	if(writer->rows != writer->header.sequences) {
+		fprintf(stderr, "Error: expected %llu sequences but wrote %llu\n", (unsigned long long)writer->header.sequences, writer->rows);
+		exit(EXIT_FAILURE);
+	}
+
+	uint64_t offset = writer->header.matrix_offset;
+
+	if(writer->header.layout == MATRIX_SPARSE) {
+		char buf[65536];
+		size_t read = 0;
+		uint64_t padding = 0;
+
+		offset += writer->header.nnz * sizeof(double);
+		writer->header.columns_offset = offset;
+
+		rewind(writer->columns);
+		while((read = fread(buf, 1, sizeof(buf), writer->columns)) > 0)
+			matrix_writer_write(writer, buf, read);
+		if(ferror(writer->columns)) {
+			fprintf(stderr, "Error: could not read temporary file, error code: %s\n", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		fclose(writer->columns);
+		offset += writer->header.nnz * sizeof(uint32_t);
+
+		// keep the row pointers aligned
+		if(offset % sizeof(unsigned long long) != 0) {
+			size_t pad = sizeof(unsigned long long) - offset % sizeof(unsigned long long);
+			matrix_writer_write(writer, &padding, pad);
+			offset += pad;
+		}
+
+		writer->header.row_ptr_offset = offset;
+		matrix_writer_write(writer, writer->row_ptr, (writer->rows + 1) * sizeof(unsigned long long));
+		offset += (writer->rows + 1) * sizeof(unsigned long long);
+
+		free(writer->row_ptr);
+		free(writer->row_columns);
+		free(writer->row_values);
+	}
+	else if(writer->header.layout == MATRIX_KMER_MAJOR) {
+		matrix_writer_transpose(writer);
+		offset += writer->rows * writer->header.width * sizeof(double);
+	}
+	else {
+		offset += writer->rows * writer->header.width * sizeof(double);
+	}
+
+	writer->header.headers_offset = offset;
+	writer->header.headers_size = writer->headers_len;
+	matrix_writer_write(writer, writer->headers, writer->headers_len);
+	writer->header.checksum = writer->crc;
+
+	if(fseek(writer->fh, 0, SEEK_SET) != 0 ||
+			fwrite(&writer->header, sizeof(struct matrix_file_header), 1, writer->fh) != 1 ||
+			fclose(writer->fh) != 0) {
+		fprintf(stderr, "Error: could not write output file, error code: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	free(writer->headers);
+	free(writer);
+}
+
+// every sequence's kmers are normalized to sum to one and scaled by lambda.
+// NULL if there isn't the memory
+static double *sensing_scale(const struct matrix *sensing_matrix, unsigned long long lambda) {
+	const unsigned long long width = pow_four(sensing_matrix->kmer);
+	unsigned long long x = 0;
+	unsigned long long y = 0;
+
+	double *scale = malloc(sensing_matrix->sequences * sizeof(double));
+	if(scale == NULL)
+		return NULL;
+
+	if(sensing_matrix->kmer_major != NULL) {
+		memset(scale, 0, sensing_matrix->sequences * sizeof(double));
+		for(y = 0; y < width; y++)
+			vector_axpy(1.0, &sensing_matrix->kmer_major[sensing_matrix->sequences * y], scale, sensing_matrix->sequences);
+		for(x = 0; x < sensing_matrix->sequences; x++)
+			scale[x] = lambda / scale[x];
+
+		return scale;
+	}
+
+	for(x = 0; x < sensing_matrix->sequences; x++) {
+		double row_sum = 0;
+
+		if(sensing_matrix->sparse != NULL) {
+			const struct sparse_matrix *sparse = sensing_matrix->sparse;
+			for(y = sparse->row_ptr[x]; y < sparse->row_ptr[x + 1]; y++)
+				row_sum = row_sum + sparse->values[y];
+		}
+		else {
+			for(y = 0; y < width; y++)
+				row_sum = row_sum + sensing_matrix->matrix[width * x + y];
+		}
+
+		scale[x] = lambda / row_sum;
+	}
+
+	return scale;
+}
+
+// NULL if there isn't the memory
+static double *compute_gram_matrix(const struct matrix *sensing_matrix, const double *scale, int jobs) {
+	const unsigned long long width = pow_four(sensing_matrix->kmer);
+	const long long sequences = sensing_matrix->sequences;
+	const struct sparse_matrix *sparse = sensing_matrix->sparse;
+	const double *kmer_major = sensing_matrix->kmer_major;
+	long long x = 0;
+	int failed = 0;
+
+	double *gram = malloc(sequences * sequences * sizeof(double));
+	if(gram == NULL)
+		return NULL;
+
+	#pragma omp parallel num_threads(jobs) reduction(|:failed)
+	{
+		unsigned long long y = 0;
+		unsigned long long z = 0;
+		double *row = NULL;
+
+		// sparse rows are scattered so the others can be dotted against them,
+		// and kmer-major rows of the gram matrix are summed a kmer at a time
+		if(sparse != NULL)
+			row = calloc(width, sizeof(double));
+		else if(kmer_major != NULL)
+			row = malloc(sequences * sizeof(double));
+		if((sparse != NULL || kmer_major != NULL) && row == NULL)
+			failed = 1;
+
+		#pragma omp for schedule(dynamic)
+		for(x = 0; x < sequences; x++) {
+			if(failed)
+				continue;
+
+			if(kmer_major != NULL) {
+				memset(&row[x], 0, (sequences - x) * sizeof(double));
+				for(z = 0; z < width; z++) {
+					const double *kmer_row = &kmer_major[sequences * z];
+					if(kmer_row[x] != 0)
+						vector_axpy(kmer_row[x], &kmer_row[x], &row[x], sequences - x);
+				}
+
+				for(y = x; y < (unsigned long long)sequences; y++)
+					gram[sequences * x + y] = gram[sequences * y + x] = 1.0 + row[y] * scale[x] * scale[y];
+				continue;
+			}
+
+			if(sparse != NULL)
+				for(z = sparse->row_ptr[x]; z < sparse->row_ptr[x + 1]; z++)
+					row[sparse->column[z]] = sparse->values[z];
+
+			for(y = x; y < (unsigned long long)sequences; y++) {
+				double sum = 0;
+
+				if(sparse != NULL) {
+					for(z = sparse->row_ptr[y]; z < sparse->row_ptr[y + 1]; z++)
+						sum += sparse->values[z] * row[sparse->column[z]];
+				}
+				else {
+					sum = vector_dot(&sensing_matrix->matrix[width * x], &sensing_matrix->matrix[width * y], width);
+				}
+
+				// the row of ones adds one to every entry
+				gram[sequences * x + y] = gram[sequences * y + x] = 1.0 + sum * scale[x] * scale[y];
+			}
+
+			if(sparse != NULL)
+				for(z = sparse->row_ptr[x]; z < sparse->row_ptr[x + 1]; z++)
+					row[sparse->column[z]] = 0;
+		}
+
+		free(row);
+	}
+
+	if(failed) {
+		free(gram);
+		return NULL;
+	}
+
+	return gram;
+}
+
+// map the cache if it was made from this sensing matrix with this lambda
+static int map_gram_cache(const char *cache, const struct stat *source, const struct matrix *sensing_matrix, unsigned long long lambda, struct gram_matrix *gram) {
+	struct stat st;
+	struct gram_file_header header;
+	const uint64_t size = GRAM_DATA_OFFSET + (uint64_t)sensing_matrix->sequences * sensing_matrix->sequences * sizeof(double);
+
+	int fd = open(cache, O_RDONLY);
+	if(fd == -1)
+		return 0;
+
+	if(fstat(fd, &st) == -1 || (uint64_t)st.st_size != size) {
+		close(fd);
+		return 0;
+	}
+
+	void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED)
+		return 0;
+
+	memcpy(&header, map, sizeof(struct gram_file_header));
+	if(memcmp(header.magic, GRAM_MAGIC, sizeof(header.magic)) != 0 ||
+			header.revision != GRAM_REVISION ||
+			header.byte_order != MATRIX_BYTE_ORDER ||
+			header.kmer != sensing_matrix->kmer ||
+			header.sequences != sensing_matrix->sequences ||
+			header.lambda != lambda ||
+			header.source_size != (uint64_t)source->st_size ||
+			header.source_mtime != source->st_mtim.tv_sec ||
+			header.source_mtime_nsec != source->st_mtim.tv_nsec) {
+		munmap(map, size);
+		return 0;
+	}
+
+	gram->gram = (double *)((char *)map + GRAM_DATA_OFFSET);
+	gram->map = map;
+	gram->map_size = size;
+	return 1;
+}
+
+// write the cache to a temporary file and move it into place, so other
+// processes never see half of it
+static int write_gram_cache(const char *cache, const struct stat *source, const struct matrix *sensing_matrix, unsigned long long lambda, const double *gram) {
+	char padding[GRAM_DATA_OFFSET];
+	struct gram_file_header header;
+	int ret = 0;
+
+	char *temporary = malloc(strlen(cache) + 8);
+	if(temporary == NULL)
+		return -1;
+	sprintf(temporary, "%s.XXXXXX", cache);
+
+	int fd = mkstemp(temporary);
+	if(fd == -1) {
+		free(temporary);
+		return -1;
+	}
+
+	memset(&header, 0, sizeof(struct gram_file_header));
+	memcpy(header.magic, GRAM_MAGIC, sizeof(header.magic));
+	header.revision = GRAM_REVISION;
+	header.byte_order = MATRIX_BYTE_ORDER;
+	header.kmer = sensing_matrix->kmer;
+	header.sequences = sensing_matrix->sequences;
+	header.lambda = lambda;
+	header.source_size = source->st_size;
+	header.source_mtime = source->st_mtim.tv_sec;
+	header.source_mtime_nsec = source->st_mtim.tv_nsec;
+
+	memset(padding, 0, sizeof(padding));
+	memcpy(padding, &header, sizeof(struct gram_file_header));
+
+	FILE *fh = fdopen(fd, "w");
+	if(fh == NULL ||
+			fwrite(padding, sizeof(padding), 1, fh) != 1 ||
+			fwrite(gram, sizeof(double), sensing_matrix->sequences * sensing_matrix->sequences, fh) != sensing_matrix->sequences * sensing_matrix->sequences)
+		ret = -1;
+
+	if((fh != NULL && fclose(fh) != 0) || (fh == NULL && close(fd) != 0))
+		ret = -1;
+
+	// mkstemp files are only readable by us
+	if(ret == 0 && (chmod(temporary, 0644) != 0 || rename(temporary, cache) != 0))
+		ret = -1;
+
+	if(ret != 0)
+		unlink(temporary);
+
+	free(temporary);
 	return ret;
 }
+
+int try_load_gram_matrix(const char *filename, const struct matrix *sensing_matrix, unsigned long long lambda, int jobs, struct gram_matrix **ret) {
+	struct stat source;
+
+	if(stat(filename, &source) == -1)
+		return QUIKR_ERROR_IO;
+
+	struct gram_matrix *gram = calloc(1, sizeof(struct gram_matrix));
+	if(gram == NULL)
+		return QUIKR_ERROR_MEMORY;
+
+	gram->sequences = sensing_matrix->sequences;
+	gram->lambda = lambda;
+	gram->scale = sensing_scale(sensing_matrix, lambda);
+
+	gram->cache = malloc(strlen(filename) + 32);
+	if(gram->scale == NULL || gram->cache == NULL) {
+		free_gram_matrix(gram);
+		return QUIKR_ERROR_MEMORY;
+	}
+	sprintf(gram->cache, "%s.%llu.gram", filename, lambda);
+
+	if(!map_gram_cache(gram->cache, &source, sensing_matrix, lambda, gram)) {
+		gram->gram = compute_gram_matrix(sensing_matrix, gram->scale, jobs);
+		if(gram->gram == NULL) {
+			free_gram_matrix(gram);
+			return QUIKR_ERROR_MEMORY;
+		}
+
+		// we can still solve without the cache, just not as quickly next time
+		if(write_gram_cache(gram->cache, &source, sensing_matrix, lambda, gram->gram) != 0)
+			gram->cache_error = errno;
+	}
+
+	*ret = gram;
+	return QUIKR_OK;
+}
+
+struct gram_matrix *load_gram_matrix(const char *filename, const struct matrix *sensing_matrix, unsigned long long lambda, int jobs) {
+	struct gram_matrix *gram = NULL;
+
+	int code = try_load_gram_matrix(filename, sensing_matrix, lambda, jobs, &gram);
+	if(code == QUIKR_ERROR_IO) {
+		fprintf(stderr, "could not open %s - %s\n", filename, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	check_malloc(gram, NULL);
+
+	if(gram->cache_error != 0)
+		fprintf(stderr, "Warning: could not cache the gram matrix in %s - %s\n", gram->cache, strerror(gram->cache_error));
+
+	return gram;
+}
+
+void free_gram_matrix(struct gram_matrix *gram) {
+	if(gram->map != NULL)
+		munmap(gram->map, gram->map_size);
+	else
+		free(gram->gram);
+	free(gram->scale);
+	free(gram->cache);
+	free(gram);
+}
+
+void gram_atb(const struct gram_matrix *gram, const struct matrix *sensing_matrix, const double *b, double *atb) {
+	const unsigned long long width = pow_four(sensing_matrix->kmer);
+	const struct sparse_matrix *sparse = sensing_matrix->sparse;
+	unsigned long long x = 0;
+	unsigned long long y = 0;
+
+	// a kmer-major matrix is summed a kmer at a time into atb
+	if(sensing_matrix->kmer_major != NULL) {
+		memset(atb, 0, gram->sequences * sizeof(double));
+		for(y = 0; y < width; y++)
+			if(b[y + 1] != 0)
+				vector_axpy(b[y + 1], &sensing_matrix->kmer_major[gram->sequences * y], atb, gram->sequences);
+		for(x = 0; x < gram->sequences; x++)
+			atb[x] = b[0] + atb[x] * gram->scale[x];
+
+		return;
+	}
+
+	for(x = 0; x < gram->sequences; x++) {
+		double sum = 0;
+
+		if(sparse != NULL) {
+			for(y = sparse->row_ptr[x]; y < sparse->row_ptr[x + 1]; y++)
+				sum += sparse->values[y] * b[sparse->column[y] + 1];
+		}
+		else {
+			sum = vector_dot(&sensing_matrix->matrix[width * x], &b[1], width);
+		}
+
+		atb[x] = b[0] + sum * gram->scale[x];
+	}
+}
+
+double *load_solution(const char *filename, unsigned long long sequences) {
+	unsigned long long x = 0;
+
+	FILE *fh = fopen(filename, "r");
+	if(fh == NULL) {
+		fprintf(stderr, "could not open %s - %s\n", filename, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	double *solution = malloc(sequences * sizeof(double));
+	check_malloc(solution, NULL);
+
+	for(x = 0; x < sequences; x++) {
+		if(fscanf(fh, "%lf", &solution[x]) != 1) {
+			fprintf(stderr, "Error: %s has %llu values, but the sensing matrix has %llu sequences\n", filename, x, sequences);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	fclose(fh);
+	return solution;
+}
@@ -1,3 +1,10 @@
+#include <stdint.h>
+
+struct gram_matrix;
+struct matrix;
+struct matrix_writer;
+struct sparse_matrix;
+
 // our malloc checker
 void check_malloc(void *ptr, char *error);
 
@@ -5,14 +12,63 @@ void check_malloc(void *ptr, char *error);
 unsigned long long count_sequences(const char *filename);
 
 // normalize a matrix by dividing each element by the sum of it's column
-void normalize_matrix(double *matrix, int height, int width);
+void normalize_matrix(double *matrix, unsigned long long height, unsigned long long width);
+void normalize_sparse_matrix(struct sparse_matrix *matrix);
+
+// quikr's A for a sample: row z of the sensing matrix cut down to the kmers
+// that are at most rare_value in count_matrix (or every kmer if it is NULL),
+// divided by their sum and times lambda, after a one in column 0. The rows are
+// gathered, normalized and scaled in one pass. The dense gathers take either
+// dense layout
+struct sparse_matrix *gather_sparse_rare(const struct sparse_matrix *sensing_matrix, const double *count_matrix, unsigned long long rare_value, unsigned long long rare_width, unsigned long long lambda);
+double *gather_dense_rare(const struct matrix *sensing_matrix, const double *count_matrix, unsigned long long rare_value, unsigned long long rare_width, unsigned long long lambda);
+
+// the same in single precision, only the stored values are rounded
+float *gather_dense_rare_float(const struct matrix *sensing_matrix, const double *count_matrix, unsigned long long rare_value, unsigned long long rare_width, unsigned long long lambda);
+
+// the gathers into memory the caller keeps. The dense one fills whichever of
+// rare and rare_float isn't NULL, with room for rare_width * sequences values,
+// and kmer-major matrices use scratch for sequences row sums, or allocate them
+// if it is NULL. The sparse one needs room in rare for rows + 1 row pointers
+// and nnz + rows entries, and in rare_column for a column of every kmer
+void gather_rare_into(const struct matrix *sensing_matrix, const double *count_matrix, unsigned long long rare_value, unsigned long long rare_width, unsigned long long lambda, double *rare, float *rare_float, double *scratch);
+void gather_sparse_rare_into(const struct sparse_matrix *sensing_matrix, const double *count_matrix, unsigned long long rare_value, unsigned long long rare_width, unsigned long long lambda, struct sparse_matrix *rare, uint32_t *rare_column);
 
-// load a sensing matrix  
+// load a sensing matrix, either the binary format (which is mapped) or the
+// gzip'd text format. It has to be trained with target_kmer, unless that is 0
 struct matrix *load_sensing_matrix(const char *filename, unsigned int target_kmer);
+// the same, but returns one of libquikr's codes and writes the message into
+// error (QUIKR_ERROR_LENGTH bytes, or NULL) instead of exiting
+int try_load_sensing_matrix(const char *filename, unsigned int target_kmer, struct matrix **sensing_matrix, char *error);
+// check a binary sensing matrix against its checksum, which loading it doesn't
+// do so that it only reads the pages it uses. Text matrices always pass
+int verify_sensing_matrix(const struct matrix *sensing_matrix, const char *filename, char *error);
+void free_sensing_matrix(struct matrix *sensing_matrix);
+void free_sparse_matrix(struct sparse_matrix *sparse);
+
+// write a binary sensing matrix one row at a time, in layout MATRIX_DENSE,
+// MATRIX_SPARSE or MATRIX_KMER_MAJOR
+struct matrix_writer *matrix_writer_open(const char *filename, unsigned int kmer, unsigned long long sequences, int layout);
+void matrix_writer_add_row(struct matrix_writer *writer, const char *header, size_t header_len, const double *row);
+void matrix_writer_close(struct matrix_writer *writer);
+
+// load the gram matrix of the sensing matrix in filename for lambda from its
+// cache, or compute it on jobs threads and write the cache
+struct gram_matrix *load_gram_matrix(const char *filename, const struct matrix *sensing_matrix, unsigned long long lambda, int jobs);
+// the same, but returns one of libquikr's codes instead of exiting, and
+// leaves the warning about a cache that couldn't be written to the caller
+int try_load_gram_matrix(const char *filename, const struct matrix *sensing_matrix, unsigned long long lambda, int jobs, struct gram_matrix **gram);
+void free_gram_matrix(struct gram_matrix *gram);
+
+// A^T b for a count vector laid out like count_matrix_rare with every kmer,
+// so b[0] lines up with the row of ones
+void gram_atb(const struct gram_matrix *gram, const struct matrix *sensing_matrix, const double *b, double *atb);
+
+// read a solution written by quikr, one value for each of the sequences
+double *load_solution(const char *filename, unsigned long long sequences);
 
 // get_rare_value 
 void get_rare_value(double *count_matrix, unsigned long long width, double rare_percent, unsigned long long *ret_rare_value, unsigned long long  *ret_rare_width);
+// the same, with width doubles of scratch
+void get_rare_value_into(const double *count_matrix, unsigned long long width, double rare_percent, unsigned long long *ret_rare_value, unsigned long long *ret_rare_width, double *scratch);
 
-
-// getline reimpl
-ssize_t getseq(char **lineptr, size_t *n, FILE *fp);
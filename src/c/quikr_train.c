@@ -6,20 +6,214 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <zlib.h>
 
+#include "fasta.h"
 #include "kmer_utils.h"
+#include "libquikr.h"
 #include "quikr_functions.h"
+#include "quikr.h"
+
+// a record scanned by the main thread, counted by a worker, and written out in
+// input order by the writer
+struct train_record {
+	// points into the mapped input, or into copy for compressed input
+	struct fasta_record fasta;
+	char *copy;
+	size_t copy_size;
+
+	size_t header_len;
+	int counted;
+
+	// the formatted text output, or the row for the binary format, in the
+	// buffer of the worker that counted it
+	const char *out;
+	size_t out_len;
+	const double *row;
+};
+
+// what a worker counts and formats a record into. The worker keeps it until
+// the writer is done with the record, so the memory we need grows with the
+// jobs and not with the records in flight
+struct train_buffer {
+	unsigned long long *counts;
+	char *out;
+	size_t out_size;
+	double *row;
+};
+
+struct train_pipeline {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	struct train_record *records;
+	unsigned int slots;
+
+	// sequence numbers of the records read, claimed by workers and written
+	unsigned long long read;
+	unsigned long long claimed;
+	unsigned long long written;
+	int eof;
+
+	int kmer;
+	unsigned long width;
+	int binary;
+	gzFile output;
+	struct matrix_writer *binary_output;
+};
+
+struct train_worker {
+	struct train_pipeline *pipeline;
+	struct train_buffer buffer;
+};
+
+// write value in decimal followed by a newline, the same as "%llu\n"
+static size_t format_count(char *dest, unsigned long long value) {
+	char digits[20];
+	size_t n = 0;
+	size_t i = 0;
+
+	do {
+		digits[n++] = '0' + (value % 10);
+		value /= 10;
+	} while(value);
+
+	for(i = 0; i < n; i++)
+		dest[i] = digits[n - i - 1];
+	dest[n] = '\n';
+
+	return n + 1;
+}
 
-#define USAGE "Usage:\n\tquikr_train [OPTION...] - train a database for use with quikr.\n\nOptions:\n\n-i, --input\n\tthe database of sequences to create the sensing matrix (fasta format)\n\n-k, --kmer\n\tspecify what size of kmer to use. (default value is 6)\n\n-o, --output\n\tthe sensing matrix. (a gzip'd text file)\n\n-v, --verbose\n\tverbose mode.\n\n-V, --version\n\tprint version."
+static void count_record(struct train_pipeline *pipeline, struct train_record *record, struct train_buffer *buffer) {
 
-int main(int argc, char **argv) {
+	size_t i = 0;
+	const char *header = record->fasta.header;
+
+	// find first whitespace
+	for(i = 0; i < record->fasta.header_len; i ++) {
+		if(header[i] == ' ' || header[i] == '\t')
+			break;
+	}
+	record->header_len = i;
+
+	memset(buffer->counts, 0, (pipeline->width + 1) * sizeof(unsigned long long));
+	count_kmers(record->fasta.sequence, record->fasta.sequence_len, pipeline->kmer, buffer->counts);
+}
+
+// format the record the way it will be written, so the writer only has to
+// hand the bytes to zlib
+static void format_record(struct train_pipeline *pipeline, struct train_record *record, struct train_buffer *buffer) {
+	unsigned long long j = 0;
+	size_t out_len = 0;
+
+	if(pipeline->binary) {
+		for(j = 0; j < pipeline->width; j++)
+			buffer->row[j] = (double)buffer->counts[j];
+		record->row = buffer->row;
+		return;
+	}
+
+	if(record->header_len + 2 > buffer->out_size) {
+		buffer->out_size = record->header_len + 2;
+		buffer->out = realloc(buffer->out, buffer->out_size);
+		check_malloc(buffer->out, NULL);
+	}
+
+	buffer->out[out_len++] = '>';
+	memcpy(buffer->out + out_len, record->fasta.header, record->header_len);
+	out_len += record->header_len;
+	buffer->out[out_len++] = '\n';
+
+	// most counts are a digit or two, so the buffer grows with what the rows
+	// take instead of room for 20 digits of every count
+	for(j = 0; j < pipeline->width; j++) {
+		if(out_len + 21 > buffer->out_size) {
+			buffer->out_size = buffer->out_size * 2 + 21;
+			buffer->out = realloc(buffer->out, buffer->out_size);
+			check_malloc(buffer->out, NULL);
+		}
+		out_len += format_count(buffer->out + out_len, buffer->counts[j]);
+	}
+
+	record->out = buffer->out;
+	record->out_len = out_len;
+}
+
+static void *train_worker(void *arg) {
+	struct train_worker *worker = arg;
+	struct train_pipeline *pipeline = worker->pipeline;
+
+	while(1) {
+		unsigned long long claimed = 0;
+
+		pthread_mutex_lock(&pipeline->lock);
+		while(pipeline->claimed == pipeline->read && !pipeline->eof)
+			pthread_cond_wait(&pipeline->cond, &pipeline->lock);
+
+		if(pipeline->claimed == pipeline->read) {
+			pthread_mutex_unlock(&pipeline->lock);
+			return NULL;
+		}
+
+		claimed = pipeline->claimed++;
+		pthread_mutex_unlock(&pipeline->lock);
+
+		struct train_record *record = &pipeline->records[claimed % pipeline->slots];
+		count_record(pipeline, record, &worker->buffer);
+		format_record(pipeline, record, &worker->buffer);
+
+		// the record points into our buffer until the writer is done with it
+		pthread_mutex_lock(&pipeline->lock);
+		record->counted = 1;
+		pthread_cond_broadcast(&pipeline->cond);
+		while(pipeline->written <= claimed)
+			pthread_cond_wait(&pipeline->cond, &pipeline->lock);
+		pthread_mutex_unlock(&pipeline->lock);
+	}
+}
+
+// the writer is the only thread touching the output, and it writes records
+// strictly in the order they were read
+static void *train_writer(void *arg) {
+	struct train_pipeline *pipeline = arg;
+
+	while(1) {
+		struct train_record *record = NULL;
+
+		pthread_mutex_lock(&pipeline->lock);
+		while(1) {
+			record = &pipeline->records[pipeline->written % pipeline->slots];
+			if(pipeline->written < pipeline->read && record->counted)
+				break;
+			if(pipeline->written == pipeline->read && pipeline->eof) {
+				pthread_mutex_unlock(&pipeline->lock);
+				return NULL;
+			}
+			pthread_cond_wait(&pipeline->cond, &pipeline->lock);
+		}
+		pthread_mutex_unlock(&pipeline->lock);
+
+		if(pipeline->binary) {
+			matrix_writer_add_row(pipeline->binary_output, record->fasta.header, record->header_len, record->row);
+		}
+		else if(gzwrite(pipeline->output, record->out, record->out_len) != (int)record->out_len) {
+			fprintf(stderr, "Error: could not write output file\n");
+			exit(EXIT_FAILURE);
+		}
+
+		pthread_mutex_lock(&pipeline->lock);
+		record->counted = 0;
+		pipeline->written++;
+		pthread_cond_broadcast(&pipeline->cond);
+		pthread_mutex_unlock(&pipeline->lock);
+	}
+}
 
-	// getline variables
-  char *line = NULL;
-  size_t len = 0;
-  ssize_t read;
+#define USAGE "Usage:\n\tquikr_train [OPTION...] - train a database for use with quikr.\n\nOptions:\n\n-i, --input\n\tthe database of sequences to create the sensing matrix (fasta format)\n\n-k, --kmer\n\tspecify what size of kmer to use. (default value is 6)\n\n-o, --output\n\tthe sensing matrix. (a gzip'd text file)\n\n-b, --binary\n\twrite the sensing matrix in the binary format, which quikr maps instead of parsing.\n\n-S, --sparse\n\twrite the sensing matrix in the sparse binary format, for large kmers.\n\n-m, --kmer-major\n\twrite the sensing matrix in the binary format with each kmer's counts stored together, which is quicker to cut down to the rare kmers.\n\n-j, --jobs\n\tthe number of threads counting sequences. (default value is 1)\n\n-c, --verify\n\tcheck a binary sensing matrix against its checksum and exit.\n\n-v, --verbose\n\tverbose mode.\n\n-V, --version\n\tprint version."
 
+int main(int argc, char **argv) {
 
   int c;
 
@@ -29,34 +223,42 @@ int main(int argc, char **argv) {
 	// revision number
 	int revision = 0;
 	// iterators
-  long long i = 0;
   unsigned long long j = 0;
-	unsigned long long position = 0;
 
   int verbose = 0;
   int force_name = 0;
+  int binary = 0;
+  int layout = MATRIX_DENSE;
+  int jobs = 1;
 
   char *fasta_filename = NULL;
   char *output_file = NULL;
+  char *verify_file = NULL;
 
   gzFile output = NULL;
-  FILE *input = NULL;
+  struct matrix_writer *binary_output = NULL;
+  struct fasta_reader *input = NULL;
 
   while (1) {
     static struct option long_options[] = {
       {"verbose", no_argument, 0, 'v'},
       {"force_name", no_argument, 0, 'f'},
+      {"binary", no_argument, 0, 'b'},
+      {"sparse", no_argument, 0, 'S'},
+      {"kmer-major", no_argument, 0, 'm'},
       {"help", no_argument, 0, 'h'},
       {"version", no_argument, 0, 'V'},
       {"input", required_argument, 0, 'i'},
       {"kmer",  required_argument, 0, 'k'},
+      {"jobs",  required_argument, 0, 'j'},
       {"output", required_argument, 0, 'o'},
+      {"verify", required_argument, 0, 'c'},
       {0, 0, 0, 0}
     };
 
     int option_index = 0;
 
-    c = getopt_long (argc, argv, "i:o:k:fhvV", long_options, &option_index);
+    c = getopt_long (argc, argv, "i:o:k:j:c:bSmfhvV", long_options, &option_index);
 
     if (c == -1)
       break;
@@ -68,15 +270,32 @@ int main(int argc, char **argv) {
       case 'k':
         kmer = atoi(optarg);
         break;
+      case 'j':
+        jobs = atoi(optarg);
+        break;
       case 'o':
         output_file = optarg;
         break;
+      case 'c':
+        verify_file = optarg;
+        break;
       case 'v':
         verbose = 1;
         break;
       case 'f':
         force_name = 1;
         break;
+      case 'b':
+        binary = 1;
+        break;
+      case 'S':
+        binary = 1;
+        layout = MATRIX_SPARSE;
+        break;
+      case 'm':
+        binary = 1;
+        layout = MATRIX_KMER_MAJOR;
+        break;
       case 'V':
         printf("%s\n", VERSION);
         exit(EXIT_SUCCESS);
@@ -93,6 +312,19 @@ int main(int argc, char **argv) {
     }
   }
 
+  if(verify_file != NULL) {
+    char error[QUIKR_ERROR_LENGTH];
+    struct matrix *sensing_matrix = load_sensing_matrix(verify_file, 0);
+    if(verify_sensing_matrix(sensing_matrix, verify_file, error) != QUIKR_OK) {
+      fprintf(stderr, "%s\n", error);
+      exit(EXIT_FAILURE);
+    }
+    free_sensing_matrix(sensing_matrix);
+    if(verbose)
+      printf("%s: ok\n", verify_file);
+    exit(EXIT_SUCCESS);
+  }
+
   if(fasta_filename == NULL) {
     fprintf(stderr, "Error: input fasta file (-i) must be specified\n\n");
     fprintf(stderr, "%s\n", USAGE);
@@ -107,6 +339,7 @@ int main(int argc, char **argv) {
 
   if(verbose) {
     printf("kmer size: %d\n", kmer);
+    printf("jobs: %d\n", jobs);
     printf("fasta file: %s\n", fasta_filename);
     printf("output file: %s\n", output_file);
   }
@@ -121,7 +354,12 @@ int main(int argc, char **argv) {
     exit(EXIT_FAILURE);
 	}
 
-  if(strcmp(&output_file[strlen(output_file) - 3], ".gz") != 0 && !force_name) {
+  if(jobs < 1) {
+    fprintf(stderr, "Error: jobs must be at least 1\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if(strcmp(&output_file[strlen(output_file) - 3], ".gz") != 0 && !force_name && !binary) {
     char *temp = malloc(strlen(output_file) + 4);
     if(temp == NULL) {
       fprintf(stderr, "Could not allocate enough memory\n"); 
@@ -146,118 +384,147 @@ int main(int argc, char **argv) {
     printf("Writing our sensing matrix to %s\n", output_file);
 	}
 
-  input = fopen(fasta_filename, "r" );
+  input = fasta_open(fasta_filename, 0);
   if(input == NULL) {
     fprintf(stderr, "Error opening %s - %s\n", fasta_filename, strerror(errno));
     exit(EXIT_FAILURE);
   }
 
   // open our output file
-  output = gzopen(output_file, "w");
-  if(output == NULL) {
-    fprintf(stderr, "Error: could not open output file, error code: %s\n", strerror(errno));
-    exit(EXIT_FAILURE);
+  if(binary) {
+    binary_output = matrix_writer_open(output_file, kmer, sequences, layout);
   }
+  else {
+    output = gzopen(output_file, "w");
+    if(output == NULL) {
+      fprintf(stderr, "Error: could not open output file, error code: %s\n", strerror(errno));
+      exit(EXIT_FAILURE);
+    }
 
-	// create our header 
-	gzprintf(output, "quikr\n");
-	gzprintf(output, "%ld\n", revision);
-	gzprintf(output, "%ld\n", sequences);
-	gzprintf(output, "%d\n", kmer);
+    // create our header 
+    gzprintf(output, "quikr\n");
+    gzprintf(output, "%ld\n", revision);
+    gzprintf(output, "%ld\n", sequences);
+    gzprintf(output, "%d\n", kmer);
+  }
 
-	// malloc our return array
-  unsigned long long * counts = malloc((width + 1) * sizeof(unsigned long long));
-  if(counts == NULL)  {
-		fprintf(stderr, strerror(errno));
-    exit(EXIT_FAILURE);
+	struct train_pipeline pipeline;
+	pthread_t writer_thread;
+	pthread_t *worker_threads = malloc(jobs * sizeof(pthread_t));
+	struct train_worker *workers = calloc(jobs, sizeof(struct train_worker));
+	check_malloc(worker_threads, NULL);
+	check_malloc(workers, NULL);
+
+	pipeline.kmer = kmer;
+	pipeline.width = width;
+	pipeline.binary = binary;
+	pipeline.output = output;
+	pipeline.binary_output = binary_output;
+
+	// a slot for every worker and one more for the record being read, the
+	// records themselves only point into the input
+	pipeline.slots = jobs + 1;
+	pipeline.read = 0;
+	pipeline.claimed = 0;
+	pipeline.written = 0;
+	pipeline.eof = 0;
+	pthread_mutex_init(&pipeline.lock, NULL);
+	pthread_cond_init(&pipeline.cond, NULL);
+
+	pipeline.records = calloc(pipeline.slots, sizeof(struct train_record));
+	check_malloc(pipeline.records, NULL);
+
+	for(j = 0; j < (unsigned)jobs; j++) {
+		struct train_buffer *buffer = &workers[j].buffer;
+
+		workers[j].pipeline = &pipeline;
+		buffer->counts = malloc((width + 1) * sizeof(unsigned long long));
+		check_malloc(buffer->counts, NULL);
+
+		if(binary) {
+			buffer->row = malloc(width * sizeof(double));
+			check_malloc(buffer->row, NULL);
+		}
 	}
 
-	char *str = malloc(4096);
-	if(str == NULL) { 
-		fprintf(stderr, strerror(errno));
+	for(j = 0; j < (unsigned)jobs; j++) {
+		if(pthread_create(&worker_threads[j], NULL, train_worker, &workers[j]) != 0) {
+			fprintf(stderr, "Error: could not create worker thread\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	if(pthread_create(&writer_thread, NULL, train_writer, &pipeline) != 0) {
+		fprintf(stderr, "Error: could not create writer thread\n");
 		exit(EXIT_FAILURE);
 	}
 
-	unsigned long long str_size = 4096;
+	while(1) {
+		struct train_record *record = NULL;
 
-	// seek the first character, and skip over it
-	fseek(input, 1, SEEK_CUR);
-	while ((read = getseq(&line, &len, input)) != -1) {
+		// wait for the writer to free up the next slot
+		pthread_mutex_lock(&pipeline.lock);
+		while(pipeline.read - pipeline.written >= pipeline.slots)
+			pthread_cond_wait(&pipeline.cond, &pipeline.lock);
+		pthread_mutex_unlock(&pipeline.lock);
 
-		// find first whitespace
-		for(i = 0; i < read; i ++) {
-			if(line[i] == ' ' || line[i] == '\t' || line[i] == '\n')
-				break;
+		record = &pipeline.records[pipeline.read % pipeline.slots];
+		int more = fasta_next(input, &record->fasta);
+		if(more < 0) {
+			fprintf(stderr, "Error reading %s - corrupt compressed file\n", fasta_filename);
+			exit(EXIT_FAILURE);
 		}
-		
-		// write our header
-    gzprintf(output, ">%.*s\n", i, line);
-
-		// find our first \n, this should be the end of the header
-		char *start = strchr(line, '\n');	
-		if(start == NULL) 
-			continue;
-
-		size_t start_len = strlen(start);
-
 
-		// if our current str buffer isn't big enough, realloc
-		if(start_len + 1 > str_size + 1) { 
-			str = realloc(str, start_len + 1);
-			if(str == NULL) { 
-				exit(EXIT_FAILURE);
-				fprintf(stderr, strerror(errno));
+		// compressed input is decompressed into a buffer that the next record
+		// reuses, so hang on to our own copy
+		if(more && !input->mapped) {
+			struct fasta_record *fasta = &record->fasta;
+			size_t size = fasta->header_len + fasta->sequence_len;
+			if(size > record->copy_size) {
+				record->copy = realloc(record->copy, size);
+				check_malloc(record->copy, NULL);
+				record->copy_size = size;
 			}
+			memcpy(record->copy, fasta->header, fasta->header_len);
+			memcpy(record->copy + fasta->header_len, fasta->sequence, fasta->sequence_len);
+			fasta->header = record->copy;
+			fasta->sequence = record->copy + fasta->header_len;
 		}
 
-		// strip out all other newlines to handle multiline sequences
-		str = strnstrip(start, str, '\n',start_len);
-		size_t seq_length = strlen(str);
+		pthread_mutex_lock(&pipeline.lock);
+		if(more)
+			pipeline.read++;
+		else
+			pipeline.eof = 1;
+		pthread_cond_broadcast(&pipeline.cond);
+		pthread_mutex_unlock(&pipeline.lock);
 
-		// relace A, C, G and T with 0, 1, 2, 3 respectively
-		// everything else is 5 
-		for(j = 0; j < seq_length; j++) {
-			str[j] = alpha[(int)str[j]];
-		}
-		
-		// set counts to zero
-		memset(counts, 0, width * sizeof(unsigned long long));
-
-		// loop through our string to process each k-mer
-		for(position = 0; position < (seq_length - kmer + 1); position++) {
-			unsigned long mer = 0;
-			unsigned long multiply = 1;
-
-			// for each char in the k-mer check if it is an error char
-			for(i = position + kmer - 1; i >= (signed)position; i--){
-				if(str[i] >> 2) { 
-					mer = width;
-					position = i;
-					goto next;
-				}
-
-				// multiply this char in the mer by the multiply
-				// and bitshift the multiply for the next round
-				mer += str[i] * multiply;
-				multiply = multiply << 2;
-			}
-			// use this point to get mer of our loop
-			next:
-			// bump up the mer value in the counts array
-			counts[mer]++;
-		}
-
-		for(j = 0; j < width; j++) {
-			gzprintf(output, "%lld\n", counts[j]);
-		}
-
-	} 
+		if(!more)
+			break;
+	}
 
-	free(counts);
-	free(line);
+	for(j = 0; j < (unsigned)jobs; j++)
+		pthread_join(worker_threads[j], NULL);
+	pthread_join(writer_thread, NULL);
 
-  gzclose(output);
-  fclose(input);
+	for(j = 0; j < pipeline.slots; j++)
+		free(pipeline.records[j].copy);
+	for(j = 0; j < (unsigned)jobs; j++) {
+		free(workers[j].buffer.counts);
+		free(workers[j].buffer.row);
+		free(workers[j].buffer.out);
+	}
+	free(pipeline.records);
+	free(workers);
+	free(worker_threads);
+
+	pthread_mutex_destroy(&pipeline.lock);
+	pthread_cond_destroy(&pipeline.cond);
+
+  if(binary)
+    matrix_writer_close(binary_output);
+  else
+    gzclose(output);
+  fasta_close(input);
 
   return EXIT_SUCCESS;
 }
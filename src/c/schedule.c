@@ -0,0 +1,203 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "quikr_functions.h"
+#include "schedule.h"
+
+struct schedule_entry {
+	unsigned long long size;
+	size_t sample;
+};
+
+// ties go to the sample that came first, so the order is stable
+static int schedule_cmp(const void *a, const void *b) {
+	const struct schedule_entry *x = a;
+	const struct schedule_entry *y = b;
+
+	if(x->size != y->size)
+		return x->size < y->size ? 1 : -1;
+	return x->sample < y->sample ? -1 : x->sample > y->sample;
+}
+
+void schedule_largest_first(const unsigned long long *size, size_t count, size_t *order) {
+	size_t i = 0;
+
+	struct schedule_entry *entries = malloc((count ? count : 1) * sizeof(struct schedule_entry));
+	check_malloc(entries, NULL);
+
+	for(i = 0; i < count; i++) {
+		entries[i].size = size[i];
+		entries[i].sample = i;
+	}
+
+	qsort(entries, count, sizeof(struct schedule_entry), schedule_cmp);
+
+	for(i = 0; i < count; i++)
+		order[i] = entries[i].sample;
+
+	free(entries);
+}
+
+void scheduler_init(struct scheduler *scheduler, const size_t *order, const unsigned long long *memory, size_t count, unsigned long long budget) {
+	pthread_mutex_init(&scheduler->lock, NULL);
+	pthread_cond_init(&scheduler->finished, NULL);
+
+	scheduler->count = count;
+	scheduler->order = order;
+	scheduler->taken = calloc(count ? count : 1, sizeof(char));
+	check_malloc(scheduler->taken, NULL);
+	scheduler->next = 0;
+	scheduler->memory = memory;
+	scheduler->budget = budget;
+	scheduler->in_use = 0;
+	scheduler->peak = 0;
+	scheduler->running = 0;
+}
+
+void scheduler_free(struct scheduler *scheduler) {
+	pthread_mutex_destroy(&scheduler->lock);
+	pthread_cond_destroy(&scheduler->finished);
+	free(scheduler->taken);
+}
+
+size_t scheduler_next(struct scheduler *scheduler) {
+	size_t sample = SIZE_MAX;
+	size_t i = 0;
+
+	pthread_mutex_lock(&scheduler->lock);
+
+	while(scheduler->next < scheduler->count) {
+		// the largest sample that fits, so a big one waiting for memory doesn't
+		// leave the other threads idle
+		for(i = scheduler->next; i < scheduler->count; i++) {
+			size_t candidate = scheduler->order[i];
+
+			if(scheduler->taken[i])
+				continue;
+			if(scheduler->budget == 0 || scheduler->running == 0 ||
+					scheduler->in_use + scheduler->memory[candidate] <= scheduler->budget) {
+				scheduler->taken[i] = 1;
+				sample = candidate;
+				break;
+			}
+		}
+
+		if(sample != SIZE_MAX)
+			break;
+
+		pthread_cond_wait(&scheduler->finished, &scheduler->lock);
+	}
+
+	if(sample != SIZE_MAX) {
+		while(scheduler->next < scheduler->count && scheduler->taken[scheduler->next])
+			scheduler->next++;
+
+		scheduler->in_use += scheduler->memory[sample];
+		if(scheduler->in_use > scheduler->peak)
+			scheduler->peak = scheduler->in_use;
+		scheduler->running++;
+	}
+
+	pthread_mutex_unlock(&scheduler->lock);
+
+	return sample;
+}
+
+void scheduler_done(struct scheduler *scheduler, size_t sample) {
+	pthread_mutex_lock(&scheduler->lock);
+
+	scheduler->in_use -= scheduler->memory[sample];
+	scheduler->running--;
+
+	pthread_cond_broadcast(&scheduler->finished);
+	pthread_mutex_unlock(&scheduler->lock);
+}
+
+static double seconds_since(const struct timespec *start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+void work_queue_init(struct work_queue *queue, size_t capacity, int producers) {
+	pthread_mutex_init(&queue->lock, NULL);
+	pthread_cond_init(&queue->not_empty, NULL);
+	pthread_cond_init(&queue->not_full, NULL);
+
+	queue->capacity = capacity ? capacity : 1;
+	queue->items = malloc(queue->capacity * sizeof(void *));
+	check_malloc(queue->items, NULL);
+	queue->head = 0;
+	queue->count = 0;
+	queue->producers = producers;
+	memset(&queue->stats, 0, sizeof(struct queue_stats));
+}
+
+void work_queue_free(struct work_queue *queue) {
+	pthread_mutex_destroy(&queue->lock);
+	pthread_cond_destroy(&queue->not_empty);
+	pthread_cond_destroy(&queue->not_full);
+	free(queue->items);
+}
+
+void work_queue_push(struct work_queue *queue, void *item) {
+	pthread_mutex_lock(&queue->lock);
+
+	if(queue->count == queue->capacity) {
+		struct timespec start;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		while(queue->count == queue->capacity)
+			pthread_cond_wait(&queue->not_full, &queue->lock);
+		queue->stats.full_wait += seconds_since(&start);
+	}
+
+	queue->items[(queue->head + queue->count) % queue->capacity] = item;
+	queue->count++;
+	if(queue->count > queue->stats.most)
+		queue->stats.most = queue->count;
+
+	pthread_cond_signal(&queue->not_empty);
+	pthread_mutex_unlock(&queue->lock);
+}
+
+void work_queue_finish(struct work_queue *queue) {
+	pthread_mutex_lock(&queue->lock);
+
+	queue->producers--;
+	if(queue->producers <= 0)
+		pthread_cond_broadcast(&queue->not_empty);
+
+	pthread_mutex_unlock(&queue->lock);
+}
+
+void *work_queue_pop(struct work_queue *queue) {
+	void *item = NULL;
+
+	pthread_mutex_lock(&queue->lock);
+
+	if(queue->count == 0 && queue->producers > 0) {
+		struct timespec start;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		while(queue->count == 0 && queue->producers > 0)
+			pthread_cond_wait(&queue->not_empty, &queue->lock);
+		queue->stats.empty_wait += seconds_since(&start);
+	}
+
+	if(queue->count > 0) {
+		queue->stats.taken++;
+		queue->stats.waiting += queue->count;
+
+		item = queue->items[queue->head];
+		queue->head = (queue->head + 1) % queue->capacity;
+		queue->count--;
+
+		pthread_cond_signal(&queue->not_full);
+	}
+
+	pthread_mutex_unlock(&queue->lock);
+
+	return item;
+}
@@ -0,0 +1,77 @@
+#include <pthread.h>
+#include <stddef.h>
+
+// hands samples out to worker threads, largest first, only starting a sample
+// once the memory it is expected to need fits in what the running samples
+// leave of the budget. A sample that doesn't fit even on its own still runs,
+// but only when nothing else is
+struct scheduler {
+	pthread_mutex_t lock;
+	pthread_cond_t finished;
+	size_t count;
+	// the samples in the order they are handed out, and which have been
+	const size_t *order;
+	char *taken;
+	// the first of order that hasn't been taken
+	size_t next;
+	const unsigned long long *memory;
+	// 0 is no limit
+	unsigned long long budget;
+	unsigned long long in_use;
+	unsigned long long peak;
+	int running;
+};
+
+// order count samples by size, largest first, into order. Equal sizes keep
+// their order
+void schedule_largest_first(const unsigned long long *size, size_t count, size_t *order);
+
+// hand out count samples in order, each needing memory[i] bytes
+void scheduler_init(struct scheduler *scheduler, const size_t *order, const unsigned long long *memory, size_t count, unsigned long long budget);
+void scheduler_free(struct scheduler *scheduler);
+
+// the next sample to process, waiting until one fits if it has to, or
+// SIZE_MAX once every sample has been handed out
+size_t scheduler_next(struct scheduler *scheduler);
+
+// give back the memory of a sample scheduler_next returned
+void scheduler_done(struct scheduler *scheduler, size_t sample);
+
+// what a work_queue saw, to tell whether the readers or the solvers are the
+// bottleneck
+struct queue_stats {
+	unsigned long long taken;
+	// the items waiting, summed over every take, and the most there were
+	unsigned long long waiting;
+	size_t most;
+	// seconds producers waited for room and consumers for an item
+	double full_wait;
+	double empty_wait;
+};
+
+// a bounded first in first out queue between producer and consumer threads
+struct work_queue {
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	void **items;
+	size_t capacity;
+	size_t head;
+	size_t count;
+	// producers that haven't finished yet
+	int producers;
+	struct queue_stats stats;
+};
+
+void work_queue_init(struct work_queue *queue, size_t capacity, int producers);
+void work_queue_free(struct work_queue *queue);
+
+// add an item, waiting while the queue is full
+void work_queue_push(struct work_queue *queue, void *item);
+
+// a producer won't push anything more
+void work_queue_finish(struct work_queue *queue);
+
+// the oldest item, waiting while the queue is empty, or NULL once every
+// producer has finished and the queue is empty
+void *work_queue_pop(struct work_queue *queue);
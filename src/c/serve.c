@@ -0,0 +1,460 @@
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "libquikr.h"
+#include "quikr_functions.h"
+#include "quikr.h"
+#include "serve.h"
+
+// The protocol is one request per line, of space separated key=value fields:
+//
+//   sample=PATH       a fasta or fastq file the server can read, or
+//   fasta=BYTES       the sample itself, in the BYTES after the newline
+//   database=NAME     which database to solve against, if more than one is
+//                     loaded
+//   kmer=K            checked against the database's kmer
+//   lambda=L          defaults to the server's
+//   rare=R            rare percent, defaults to the server's
+//
+// The reply is "ok SEQUENCES READ_MS SOLVE_MS STATUS" followed by SEQUENCES
+// lines of the solution, like quikr's output file, or "error MESSAGE". STATUS
+// is "solved", or "max-iterations" if apg or cd stopped before the tolerance. A connection
+// can send any number of requests, and is closed once it has been idle for
+// config->idle seconds.
+
+#define SERVE_BACKLOG 64
+// how long a worker waits to accept again after running out of something
+#define SERVE_RETRY_US 100000
+
+struct serve_request {
+	struct serve_database *database;
+	const char *sample;
+	// set for a streamed sample, and how many bytes of it follow
+	int stream;
+	unsigned long long size;
+	// set if the size couldn't be read, so there's no telling where the next
+	// request starts
+	int lost;
+	unsigned int kmer;
+	unsigned long long lambda;
+	double rare_percent;
+};
+
+struct serve_worker {
+	struct serve_config *config;
+	int listener;
+};
+
+static double elapsed_ms(const struct timespec *start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+static struct serve_database *find_database(struct serve_config *config, const char *name) {
+	int i = 0;
+
+	for(i = 0; i < config->count; i++) {
+		const char *filename = config->databases[i].filename;
+		const char *base = strrchr(filename, '/');
+
+		if(strcmp(filename, name) == 0 || (base != NULL && strcmp(base + 1, name) == 0))
+			return &config->databases[i];
+	}
+
+	return NULL;
+}
+
+// fill request from a request line, returns an error message or NULL. The
+// fields are all read before any is checked, so the size of a streamed sample
+// is known and it can be skipped on an error
+static const char *parse_request(struct serve_config *config, char *line, struct serve_request *request) {
+	const char *fasta = NULL;
+	const char *database = NULL;
+	const char *kmer = NULL;
+	const char *lambda = NULL;
+	const char *rare = NULL;
+	const char *error = NULL;
+	char *save = NULL;
+	char *field = NULL;
+	char *end = NULL;
+
+	memset(request, 0, sizeof(struct serve_request));
+	request->lambda = config->params.lambda;
+	request->rare_percent = config->params.rare_percent;
+
+	for(field = strtok_r(line, " \t\r\n", &save); field != NULL; field = strtok_r(NULL, " \t\r\n", &save)) {
+		char *value = strchr(field, '=');
+		if(value == NULL) {
+			error = "fields are key=value";
+			continue;
+		}
+		*value++ = '\0';
+
+		if(strcmp(field, "sample") == 0)
+			request->sample = value;
+		else if(strcmp(field, "fasta") == 0)
+			fasta = value;
+		else if(strcmp(field, "database") == 0)
+			database = value;
+		else if(strcmp(field, "kmer") == 0)
+			kmer = value;
+		else if(strcmp(field, "lambda") == 0)
+			lambda = value;
+		else if(strcmp(field, "rare") == 0)
+			rare = value;
+		else
+			error = "unknown field";
+	}
+
+	if(fasta != NULL) {
+		errno = 0;
+		request->stream = 1;
+		request->size = strtoull(fasta, &end, 10);
+		if(*end != '\0' || errno || fasta[0] == '-') {
+			request->size = 0;
+			request->lost = 1;
+			return "fasta is the size of the sample in bytes";
+		}
+	}
+
+	if(error != NULL)
+		return error;
+
+	if((request->sample != NULL) == request->stream)
+		return "a request needs one of sample or fasta";
+
+	if(database != NULL) {
+		request->database = find_database(config, database);
+		if(request->database == NULL)
+			return "no such database";
+	}
+	else if(config->count == 1) {
+		request->database = &config->databases[0];
+	}
+	else {
+		return "database must be given when more than one is loaded";
+	}
+
+	errno = 0;
+	if(kmer != NULL) {
+		request->kmer = strtoul(kmer, &end, 10);
+		if(*end != '\0' || errno || request->kmer == 0)
+			return "kmer is a positive integer";
+		if(request->kmer != quikr_database_kmer(request->database->database))
+			return "the database was trained with a different kmer";
+	}
+	if(lambda != NULL) {
+		request->lambda = strtoull(lambda, &end, 10);
+		if(*end != '\0' || errno || request->lambda == 0 || lambda[0] == '-')
+			return "lambda is a positive integer";
+	}
+	if(rare != NULL) {
+		request->rare_percent = strtod(rare, &end);
+		if(*end != '\0' || !(request->rare_percent > 0 && request->rare_percent <= 1.0))
+			return "rare percent must be between 0 and 1";
+	}
+
+	// the gram matrix was computed for the server's lambda and every kmer
+	if((config->params.solver == QUIKR_SOLVER_GRAM || config->params.solver == QUIKR_SOLVER_CD) &&
+			(request->lambda != config->params.lambda || request->rare_percent != 1.0))
+		return "the gram and cd solvers only solve for the server's lambda with a rare percent of 1";
+
+	return NULL;
+}
+
+// write a streamed sample to a temporary file, so it is read like any other
+static char *spool_sample(FILE *in, unsigned long long size) {
+	char buf[65536];
+	const char *directory = getenv("TMPDIR");
+
+	if(directory == NULL)
+		directory = "/tmp";
+
+	char *path = malloc(strlen(directory) + 32);
+	if(path == NULL)
+		return NULL;
+	sprintf(path, "%s/quikr_sample_XXXXXX", directory);
+
+	int fd = mkstemp(path);
+	if(fd == -1) {
+		free(path);
+		return NULL;
+	}
+
+	FILE *fh = fdopen(fd, "w");
+	while(fh != NULL && size > 0) {
+		size_t want = size < sizeof(buf) ? size : sizeof(buf);
+		size_t got = fread(buf, 1, want, in);
+		if(got == 0 || fwrite(buf, 1, got, fh) != got)
+			break;
+		size -= got;
+	}
+
+	if(fh == NULL || fclose(fh) != 0 || size > 0) {
+		if(fh == NULL)
+			close(fd);
+		unlink(path);
+		free(path);
+		return NULL;
+	}
+
+	return path;
+}
+
+static void skip_sample(FILE *in, unsigned long long size) {
+	char buf[65536];
+
+	while(size > 0) {
+		size_t got = fread(buf, 1, size < sizeof(buf) ? size : sizeof(buf), in);
+		if(got == 0)
+			break;
+		size -= got;
+	}
+}
+
+// answer one request, returns -1 if the connection can't be used any more
+static int serve_request(struct serve_config *config, FILE *in, FILE *out, char *line) {
+	struct serve_request request;
+	struct timespec start;
+	char *spooled = NULL;
+	unsigned long long x = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	const char *error = parse_request(config, line, &request);
+	if(error != NULL) {
+		skip_sample(in, request.size);
+		fprintf(out, "error %s\n", error);
+		if(fflush(out) != 0 || request.lost)
+			return -1;
+		return 0;
+	}
+
+	const char *path = request.sample;
+	if(request.stream) {
+		spooled = spool_sample(in, request.size);
+		if(spooled == NULL) {
+			fprintf(out, "error could not receive the sample - %s\n", strerror(errno));
+			fflush(out);
+			return -1;
+		}
+		path = spooled;
+	}
+
+	struct quikr_database *database = request.database->database;
+	const unsigned int kmer = quikr_database_kmer(database);
+	const unsigned long long sequences = quikr_database_sequences(database);
+	unsigned long long reads = 0;
+
+	unsigned long long *counts = malloc((pow_four(kmer) + 1) * sizeof(unsigned long long));
+	double *solution = malloc(sequences * sizeof(double));
+	if(counts == NULL || solution == NULL) {
+		if(spooled != NULL) {
+			unlink(spooled);
+			free(spooled);
+		}
+		free(solution);
+		free(counts);
+		fprintf(out, "error %s\n", quikr_strerror(QUIKR_ERROR_MEMORY));
+		return fflush(out);
+	}
+
+	int code = quikr_count_file(path, kmer, 1, counts, &reads, NULL);
+	int read_error = errno;
+	if(spooled != NULL) {
+		unlink(spooled);
+		free(spooled);
+	}
+	if(code != QUIKR_OK) {
+		if(code == QUIKR_ERROR_FORMAT)
+			fprintf(out, "error could not read the sample - corrupt compressed file\n");
+		else
+			fprintf(out, "error could not read the sample - %s\n", code == QUIKR_ERROR_IO ? strerror(read_error) : quikr_strerror(code));
+		free(solution);
+		free(counts);
+		return fflush(out);
+	}
+
+	double read_ms = elapsed_ms(&start);
+
+	// every request gets its own parameters, solving on one thread
+	struct quikr_params params = config->params;
+	params.lambda = request.lambda;
+	params.rare_percent = request.rare_percent;
+	params.jobs = 1;
+
+	code = quikr_classify(database, counts, &params, solution, NULL);
+
+	double solve_ms = elapsed_ms(&start) - read_ms;
+
+	if(code < 0) {
+		fprintf(out, "error could not classify the sample - %s\n", quikr_strerror(code));
+	}
+	else {
+		// the client decides whether a solution the solver stopped short on
+		// will do
+		fprintf(out, "ok %llu %.3f %.3f %s\n", sequences, read_ms, solve_ms, code == QUIKR_MAX_ITERATIONS ? "max-iterations" : "solved");
+		for(x = 0; x < sequences; x++)
+			fprintf(out, "%.10lf\n", solution[x]);
+
+		if(config->verbose) {
+			printf("%s: %llu reads against %s, read in %.3f ms, solved in %.3f ms\n", request.stream ? "streamed sample" : request.sample, reads, request.database->filename, read_ms, solve_ms);
+			fflush(stdout);
+		}
+	}
+
+	free(solution);
+	free(counts);
+
+	return fflush(out);
+}
+
+static void serve_connection(struct serve_config *config, int fd) {
+	char *line = NULL;
+	size_t len = 0;
+
+	// a worker only answers one connection at a time, so one left open and
+	// idle would keep it from the rest. Reads and writes that wait longer
+	// fail, which ends the connection
+	if(config->idle > 0) {
+		struct timeval timeout = {config->idle, 0};
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	}
+
+	// separate streams for reading and writing, a single one would need a seek
+	// between every read and write
+	FILE *in = fdopen(fd, "r");
+	int out_fd = dup(fd);
+	FILE *out = out_fd == -1 ? NULL : fdopen(out_fd, "w");
+
+	if(in == NULL || out == NULL) {
+		fprintf(stderr, "Warning: could not answer a connection - %s\n", strerror(errno));
+		if(in != NULL)
+			fclose(in);
+		else
+			close(fd);
+		if(out == NULL && out_fd != -1)
+			close(out_fd);
+		return;
+	}
+
+	while(getline(&line, &len, in) > 0) {
+		// blank lines keep the connection alive
+		if(strspn(line, " \t\r\n") == strlen(line))
+			continue;
+		if(serve_request(config, in, out, line) != 0)
+			break;
+	}
+
+	free(line);
+	fclose(out);
+	fclose(in);
+}
+
+static void *serve_worker(void *arg) {
+	struct serve_worker *worker = arg;
+
+	while(1) {
+		int fd = accept(worker->listener, NULL, NULL);
+		if(fd == -1) {
+			if(errno == EINTR || errno == ECONNABORTED)
+				continue;
+			// only a broken listener is fatal. Out of file descriptors or
+			// memory, give the connections being answered a moment to finish
+			// and try again
+			if(errno == EBADF || errno == EINVAL || errno == ENOTSOCK) {
+				fprintf(stderr, "Error: could not accept a connection - %s\n", strerror(errno));
+				exit(EXIT_FAILURE);
+			}
+			fprintf(stderr, "Warning: could not accept a connection - %s\n", strerror(errno));
+			usleep(SERVE_RETRY_US);
+			continue;
+		}
+
+		serve_connection(worker->config, fd);
+	}
+
+	return NULL;
+}
+
+int serve(const char *path, struct serve_config *config) {
+	struct sockaddr_un address;
+	struct stat st;
+	int i = 0;
+
+	if(strlen(path) >= sizeof(address.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	// a client hanging up shouldn't take the server with it
+	signal(SIGPIPE, SIG_IGN);
+
+	int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(listener == -1)
+		return -1;
+
+	memset(&address, 0, sizeof(struct sockaddr_un));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, path);
+
+	// a socket left over from a server that was killed refuses connections,
+	// one that accepts them belongs to a server that is still running
+	if(lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+		int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+		int live = probe != -1 && connect(probe, (struct sockaddr *)&address, sizeof(struct sockaddr_un)) == 0;
+		int saved = live ? EADDRINUSE : errno;
+		if(probe != -1)
+			close(probe);
+		if(saved != ECONNREFUSED && saved != ENOENT) {
+			close(listener);
+			errno = saved;
+			return -1;
+		}
+		unlink(path);
+	}
+
+	if(bind(listener, (struct sockaddr *)&address, sizeof(struct sockaddr_un)) == -1 ||
+			listen(listener, SERVE_BACKLOG) == -1) {
+		int saved = errno;
+		close(listener);
+		errno = saved;
+		return -1;
+	}
+
+	if(config->verbose)
+		printf("listening on %s with %d workers\n", path, config->workers);
+	fflush(stdout);
+
+	struct serve_worker worker = {config, listener};
+
+	// the workers all accept on the same socket, so at most workers
+	// connections are answered at once and the rest wait in the backlog
+	pthread_t *threads = malloc(config->workers * sizeof(pthread_t));
+	check_malloc(threads, NULL);
+
+	for(i = 0; i < config->workers; i++) {
+		if(pthread_create(&threads[i], NULL, serve_worker, &worker) != 0) {
+			fprintf(stderr, "Error: could not start worker %d\n", i);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	for(i = 0; i < config->workers; i++)
+		pthread_join(threads[i], NULL);
+
+	free(threads);
+	return 0;
+}
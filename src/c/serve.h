@@ -0,0 +1,24 @@
+// a sensing matrix quikr --serve keeps loaded, requests name it by its
+// filename or the last part of it
+struct serve_database {
+	const char *filename;
+	struct quikr_database *database;
+};
+
+struct serve_config {
+	struct serve_database *databases;
+	int count;
+	// how many connections are answered at once, each solving on one thread
+	int workers;
+	// seconds a connection can send nothing, or not read its replies, before
+	// it is closed and its worker freed, 0 for no limit
+	int idle;
+	// what a request doesn't ask for
+	struct quikr_params params;
+	int verbose;
+};
+
+// listen on a unix socket at path and answer requests on config->workers
+// threads. Only returns, with errno set, if the socket can't be set up, which
+// is EADDRINUSE if another server is answering on path
+int serve(const char *path, struct serve_config *config);
@@ -1,14 +1,25 @@
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <math.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <zlib.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
+#include "kmer_utils.h"
+#include "libquikr.h"
+#include "nnls.h"
 #include "quikr.h"
 #include "quikr_functions.h"
+#include "schedule.h"
+#include "serve.h"
+#include "vector.h"
 
 
 static int failed = 0;
@@ -105,6 +116,956 @@ void test_normalize_matrix() {
 		
 }
 
+void test_count_kmers() {
+
+	int test_number = 1;
+	int fail_flag = 0;
+	char *test_name = "test_count_kmers";
+
+	unsigned long long counts[17];
+	char coded[2];
+	int i = 0;
+
+	memset(counts, 0, sizeof(counts));
+	count_kmers("ACgtNAC", 7, 2, counts);
+
+	// test 1
+	// AC twice, CG and GT once, case doesn't matter
+	if(counts[1] != 2 || counts[6] != 1 || counts[11] != 1)
+		fail_flag = 1;
+	test_eq(fail_flag, 0);
+
+	// test 2
+	// the two kmers with an N in them are skipped
+	test_eq(counts[16], 2);
+
+	// test 3
+	// kmers span the lines of multiline records
+	memset(counts, 0, sizeof(counts));
+	count_kmers("AC\nGT\n", 6, 2, counts);
+	test_eq(counts[6], 1);
+
+	// test 4
+	// num_to_index agrees with the rolling encoder
+	fail_flag = 0;
+	for(i = 0; i < 16; i++) {
+		coded[0] = i >> 2;
+		coded[1] = i & 3;
+		if(num_to_index(coded, 2, -1) != (unsigned long)i)
+			fail_flag = 1;
+	}
+	test_eq(fail_flag, 0);
+}
+
+void test_binary_matrix() {
+
+	int test_number = 1;
+	int fail_flag = 0;
+	char *test_name = "test_binary_matrix";
+
+	char filename[] = "/tmp/quikr_test_matrix_XXXXXX";
+	double rows[2][4] = {{1, 0, 2, 0}, {0, 3, 0, 4}};
+	int i = 0;
+	int j = 0;
+
+	int fd = mkstemp(filename);
+	close(fd);
+
+	struct matrix_writer *writer = matrix_writer_open(filename, 1, 2, 0);
+	matrix_writer_add_row(writer, "first", 5, rows[0]);
+	matrix_writer_add_row(writer, "second sequence", 6, rows[1]);
+	matrix_writer_close(writer);
+
+	// test 1
+	// the matrix should load back with the same dimensions
+	struct matrix *sensing_matrix = load_sensing_matrix(filename, 1);
+	test_eq(sensing_matrix->sequences, 2);
+
+	// test 2
+	// and the same values
+	for(i = 0; i < 2; i++)
+		for(j = 0; j < 4; j++)
+			if(sensing_matrix->matrix[i*4 + j] != rows[i][j])
+				fail_flag = 1;
+	test_eq(fail_flag, 0);
+
+	// test 3
+	// headers are cut at the length we gave the writer
+	test_eq(strcmp(sensing_matrix->headers[1], "second"), 0);
+
+	// the dense matrix is still mapped, so this goes in a file of its own
+	char kmer_major_filename[] = "/tmp/quikr_test_matrix_XXXXXX";
+	fd = mkstemp(kmer_major_filename);
+	close(fd);
+
+	writer = matrix_writer_open(kmer_major_filename, 1, 2, MATRIX_KMER_MAJOR);
+	matrix_writer_add_row(writer, "first", 5, rows[0]);
+	matrix_writer_add_row(writer, "second", 6, rows[1]);
+	matrix_writer_close(writer);
+
+	// test 4
+	// a kmer-major matrix keeps each kmer's counts together
+	struct matrix *kmer_major = load_sensing_matrix(kmer_major_filename, 1);
+	fail_flag = 0;
+	for(i = 0; i < 2; i++)
+		for(j = 0; j < 4; j++)
+			if(kmer_major->kmer_major[j*2 + i] != rows[i][j])
+				fail_flag = 1;
+	test_eq(fail_flag, 0);
+
+	// test 5
+	// and gathers the same A as the dense layout
+	double count_matrix[4] = {1, 5, 0, 2};
+	double *dense_rare = gather_dense_rare(sensing_matrix, count_matrix, 2, 4, 10);
+	double *kmer_major_rare = gather_dense_rare(kmer_major, count_matrix, 2, 4, 10);
+	test_eq(memcmp(dense_rare, kmer_major_rare, 2 * 4 * sizeof(double)), 0);
+
+	// test 6
+	// an intact matrix matches its checksum
+	test_eq(verify_sensing_matrix(kmer_major, kmer_major_filename, NULL), QUIKR_OK);
+	free_sensing_matrix(kmer_major);
+
+	// test 7
+	// a changed count still loads, since only the header is checked, but
+	// doesn't verify
+	struct matrix_file_header file_header;
+	double changed = 7;
+	fd = open(kmer_major_filename, O_RDWR);
+	pread(fd, &file_header, sizeof(file_header), 0);
+	pwrite(fd, &changed, sizeof(changed), file_header.matrix_offset);
+	test_eq(try_load_sensing_matrix(kmer_major_filename, 1, &kmer_major, NULL), QUIKR_OK);
+
+	// test 8
+	test_eq(verify_sensing_matrix(kmer_major, kmer_major_filename, NULL), QUIKR_ERROR_FORMAT);
+	free_sensing_matrix(kmer_major);
+
+	// test 9
+	// a kmer too big for pow_four is rejected before it's used
+	file_header.kmer = 40;
+	pwrite(fd, &file_header, sizeof(file_header), 0);
+	close(fd);
+	test_eq(try_load_sensing_matrix(kmer_major_filename, 0, &kmer_major, NULL), QUIKR_ERROR_FORMAT);
+
+	free(dense_rare);
+	free(kmer_major_rare);
+	free_sensing_matrix(sensing_matrix);
+	unlink(kmer_major_filename);
+	unlink(filename);
+}
+
+void test_libquikr() {
+
+	int test_number = 1;
+	char *test_name = "test_libquikr";
+
+	char filename[] = "/tmp/quikr_test_matrix_XXXXXX";
+	double rows[2][4] = {{1, 0, 2, 0}, {0, 3, 0, 4}};
+	struct quikr_database *database = NULL;
+	struct quikr_params params;
+	double out[2] = {0, 0};
+
+	int fd = mkstemp(filename);
+	close(fd);
+
+	struct matrix_writer *writer = matrix_writer_open(filename, 1, 2, MATRIX_DENSE);
+	matrix_writer_add_row(writer, "first", 5, rows[0]);
+	matrix_writer_add_row(writer, "second", 6, rows[1]);
+	matrix_writer_close(writer);
+
+	// test 1
+	// errors come back as codes instead of exiting
+	test_eq(quikr_database_open("/tmp/quikr_test_missing.bin", 0, &database, NULL), QUIKR_ERROR_IO);
+
+	// test 2
+	test_eq(quikr_database_open(filename, 2, &database, NULL), QUIKR_ERROR_KMER);
+
+	// test 3
+	test_eq(quikr_database_open(filename, 1, &database, NULL), QUIKR_OK);
+
+	// test 4
+	// a sample made of the first sequence is all the first sequence
+	unsigned long long counts[4] = {2, 0, 4, 0};
+	quikr_default_params(&params);
+	int code = quikr_classify(database, counts, &params, out, NULL);
+	test_eq((code == QUIKR_OK && fabs(out[0] - 1) < 1e-9 && out[1] == 0), 1);
+
+	// test 5
+	params.rare_percent = 0;
+	test_eq(quikr_classify(database, counts, &params, out, NULL), QUIKR_ERROR_INVALID);
+
+	quikr_database_close(database);
+	unlink(filename);
+}
+
+
+static void *serve_thread(void *arg) {
+	void **args = arg;
+	serve(args[0], args[1]);
+	return NULL;
+}
+
+// read one reply, returns the sequences of an ok reply or -1 for an error and
+// fills solution with what follows and state with its status
+static int read_reply(FILE *in, double *solution, int sequences, char state[32]) {
+	char line[256];
+	unsigned long long replied = 0;
+	int x = 0;
+
+	if(fgets(line, sizeof(line), in) == NULL || sscanf(line, "ok %llu %*f %*f %31s", &replied, state) != 2)
+		return -1;
+
+	for(x = 0; x < (int)replied; x++) {
+		if(fgets(line, sizeof(line), in) == NULL)
+			return -1;
+		if(x < sequences)
+			solution[x] = atof(line);
+	}
+
+	return replied;
+}
+
+void test_serve() {
+
+	int test_number = 1;
+	char *test_name = "test_serve";
+
+	char filename[] = "/tmp/quikr_test_matrix_XXXXXX";
+	char sample[] = "/tmp/quikr_test_sample_XXXXXX";
+	char socket_path[] = "/tmp/quikr_test_serve_XXXXXX";
+	const char fasta[] = ">read\nAGGAGG\n";
+	double rows[2][4] = {{1, 0, 2, 0}, {0, 3, 0, 4}};
+	struct quikr_database *database = NULL;
+	struct serve_database served;
+	struct serve_config config;
+	struct sockaddr_un address;
+	unsigned long long counts[5];
+	double expected[2] = {0, 0};
+	double solution[2] = {0, 0};
+	char request[256];
+	char state[32];
+	pthread_t thread;
+	int i = 0;
+
+	int fd = mkstemp(filename);
+	close(fd);
+
+	struct matrix_writer *writer = matrix_writer_open(filename, 1, 2, MATRIX_DENSE);
+	matrix_writer_add_row(writer, "first", 5, rows[0]);
+	matrix_writer_add_row(writer, "second", 6, rows[1]);
+	matrix_writer_close(writer);
+
+	fd = mkstemp(sample);
+	if(write(fd, fasta, strlen(fasta)) != (ssize_t)strlen(fasta))
+		fprintf(stderr, "could not write %s\n", sample);
+	close(fd);
+
+	// serve binds the socket itself, the temporary file only reserves a name
+	fd = mkstemp(socket_path);
+	close(fd);
+	unlink(socket_path);
+
+	quikr_database_open(filename, 1, &database, NULL);
+	served.filename = filename;
+	served.database = database;
+	config.databases = &served;
+	config.count = 1;
+	config.workers = 1;
+	config.idle = 1;
+	config.verbose = 0;
+	quikr_default_params(&config.params);
+
+	// what quikr would answer for the sample
+	quikr_count_file(sample, 1, 1, counts, NULL, NULL);
+	quikr_classify(database, counts, &config.params, expected, NULL);
+
+	// the server never returns, it goes when the tests do
+	void *args[2] = {socket_path, &config};
+	pthread_create(&thread, NULL, serve_thread, args);
+	pthread_detach(thread);
+
+	memset(&address, 0, sizeof(struct sockaddr_un));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, socket_path);
+
+	int client = socket(AF_UNIX, SOCK_STREAM, 0);
+	for(i = 0; i < 500; i++) {
+		if(connect(client, (struct sockaddr *)&address, sizeof(struct sockaddr_un)) == 0)
+			break;
+		usleep(10000);
+	}
+	FILE *in = fdopen(dup(client), "r");
+
+	// test 1
+	// a sample the server reads itself
+	snprintf(request, sizeof(request), "sample=%s\n", sample);
+	if(write(client, request, strlen(request)) != (ssize_t)strlen(request))
+		fprintf(stderr, "could not send a request\n");
+	int replied = read_reply(in, solution, 2, state);
+	test_eq((replied == 2 && strcmp(state, "solved") == 0 && fabs(solution[0] - expected[0]) < 1e-9 && fabs(solution[1] - expected[1]) < 1e-9), 1);
+
+	// test 2
+	// the same sample streamed after the request line
+	memset(solution, 0, sizeof(solution));
+	snprintf(request, sizeof(request), "fasta=%zu\n%s", strlen(fasta), fasta);
+	if(write(client, request, strlen(request)) != (ssize_t)strlen(request))
+		fprintf(stderr, "could not send a request\n");
+	replied = read_reply(in, solution, 2, state);
+	test_eq((replied == 2 && fabs(solution[0] - expected[0]) < 1e-9 && fabs(solution[1] - expected[1]) < 1e-9), 1);
+
+	// test 3
+	// a bad request is answered with an error and its sample is skipped
+	snprintf(request, sizeof(request), "fasta=%zu lambda=0\n%s", strlen(fasta), fasta);
+	if(write(client, request, strlen(request)) != (ssize_t)strlen(request))
+		fprintf(stderr, "could not send a request\n");
+	char line[256];
+	int error = fgets(line, sizeof(line), in) != NULL && strncmp(line, "error ", 6) == 0;
+	test_eq(error, 1);
+
+	// test 4
+	// and the connection still answers the next one
+	memset(solution, 0, sizeof(solution));
+	snprintf(request, sizeof(request), "sample=%s\n", sample);
+	if(write(client, request, strlen(request)) != (ssize_t)strlen(request))
+		fprintf(stderr, "could not send a request\n");
+	replied = read_reply(in, solution, 2, state);
+	test_eq((replied == 2 && fabs(solution[0] - expected[0]) < 1e-9 && fabs(solution[1] - expected[1]) < 1e-9), 1);
+
+	// test 5
+	// a second server doesn't take the path over from one that is running
+	errno = 0;
+	int second = serve(socket_path, &config);
+	test_eq((second == -1 && errno == EADDRINUSE), 1);
+
+	// test 6
+	// and the first still answers
+	memset(solution, 0, sizeof(solution));
+	snprintf(request, sizeof(request), "sample=%s\n", sample);
+	if(write(client, request, strlen(request)) != (ssize_t)strlen(request))
+		fprintf(stderr, "could not send a request\n");
+	replied = read_reply(in, solution, 2, state);
+	test_eq((replied == 2 && fabs(solution[0] - expected[0]) < 1e-9 && fabs(solution[1] - expected[1]) < 1e-9), 1);
+
+	// test 7
+	// the only worker is still on the first connection, which it closes once
+	// that has been idle for a second, and then it answers another
+	int other = socket(AF_UNIX, SOCK_STREAM, 0);
+	int connected = connect(other, (struct sockaddr *)&address, sizeof(struct sockaddr_un)) == 0;
+	FILE *other_in = fdopen(dup(other), "r");
+	memset(solution, 0, sizeof(solution));
+	if(write(other, request, strlen(request)) != (ssize_t)strlen(request))
+		fprintf(stderr, "could not send a request\n");
+	replied = read_reply(other_in, solution, 2, state);
+	int closed = fgets(line, sizeof(line), in) == NULL;
+	test_eq((connected && closed && replied == 2 && fabs(solution[0] - expected[0]) < 1e-9), 1);
+
+	fclose(other_in);
+	close(other);
+
+	// test 8
+	// a solver stopped at max iterations says so in the reply, from a server
+	// of its own on the next path
+	struct serve_config stopping = config;
+	char stopping_path[sizeof(socket_path) + 1];
+	stopping.params.solver = QUIKR_SOLVER_APG;
+	stopping.params.max_iterations = 1;
+	snprintf(stopping_path, sizeof(stopping_path), "%s2", socket_path);
+	void *stopping_args[2] = {stopping_path, &stopping};
+	pthread_create(&thread, NULL, serve_thread, stopping_args);
+	pthread_detach(thread);
+
+	strcpy(address.sun_path, stopping_path);
+	other = socket(AF_UNIX, SOCK_STREAM, 0);
+	for(i = 0; i < 500; i++) {
+		if(connect(other, (struct sockaddr *)&address, sizeof(struct sockaddr_un)) == 0)
+			break;
+		usleep(10000);
+	}
+	other_in = fdopen(dup(other), "r");
+	if(write(other, request, strlen(request)) != (ssize_t)strlen(request))
+		fprintf(stderr, "could not send a request\n");
+	replied = read_reply(other_in, solution, 2, state);
+	test_eq((replied == 2 && strcmp(state, "max-iterations") == 0), 1);
+
+	fclose(other_in);
+	close(other);
+	fclose(in);
+	close(client);
+	unlink(stopping_path);
+	unlink(socket_path);
+	unlink(sample);
+	unlink(filename);
+}
+
+void test_gzip_fastq() {
+
+	int test_number = 1;
+	char *test_name = "test_gzip_fastq";
+
+	char filename[] = "/tmp/quikr_test_fastq_XXXXXX";
+	char fastq[] = "@first\nACGTA\n+\n@@@@@\n@second\nCCGT\n+first\n@III\n";
+
+	int fd = mkstemp(filename);
+	close(fd);
+
+	gzFile fh = gzopen(filename, "w");
+	gzwrite(fh, fastq, strlen(fastq));
+	gzclose(fh);
+
+	// test 1
+	// quality lines that start with @ are not records
+	test_eq(count_sequences(filename), 2);
+
+	// test 2
+	// the kmers come from the sequence lines only, CG is in both
+	unsigned long long *counts = get_kmer_counts_from_file(filename, 2, 1);
+	test_eq(counts[1 * 4 + 2], 2);
+
+	free(counts);
+
+	// test 3
+	// the same pass also counts the reads and their bases
+	struct sample *sample = read_sample(filename, 2, 1);
+	test_eq((sample->sequences == 2 && sample->bases == 9), 1);
+	free_sample(sample);
+
+	// test 4
+	// try_read_sample reports a missing file instead of exiting
+	sample = try_read_sample("/tmp/quikr_test_missing.fa", 2, 1);
+	test_eq((sample == NULL && errno == ENOENT), 1);
+
+	unlink(filename);
+}
+
+void test_parallel_counts() {
+
+	int test_number = 1;
+	int fail_flag = 0;
+	char *test_name = "test_parallel_counts";
+
+	char filename[] = "/tmp/quikr_test_parallel_XXXXXX";
+	int i = 0;
+
+	// lots of small fastq records whose qualities look like headers, so the
+	// chunks have to find the real record boundaries
+	int fd = mkstemp(filename);
+	FILE *fh = fdopen(fd, "w");
+	for(i = 0; i < 500; i++)
+		fprintf(fh, "@read%d\n%.*s\n+\n@%.*s\n", i, 20 + i % 13, "ACGTTGCANNACGGTACCAGTTACGGATCCA", 19 + i % 13, "IIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIII");
+	fclose(fh);
+
+	unsigned long long *serial = get_kmer_counts_from_file(filename, 3, 1);
+	unsigned long long *parallel = get_kmer_counts_from_file(filename, 3, 4);
+
+	// test 1
+	// splitting the file up gives exactly the same counts, skipped kmers too
+	for(i = 0; i < 64 + 1; i++)
+		if(serial[i] != parallel[i])
+			fail_flag = 1;
+	test_eq(fail_flag, 0);
+
+	free(serial);
+	free(parallel);
+	unlink(filename);
+}
+
+// whether two files have the same bytes
+static int files_equal(const char *a, const char *b) {
+	FILE *fa = fopen(a, "rb");
+	FILE *fb = fopen(b, "rb");
+	int equal = fa != NULL && fb != NULL;
+	int ca = 0;
+	int cb = 0;
+
+	while(equal) {
+		ca = fgetc(fa);
+		cb = fgetc(fb);
+		if(ca != cb)
+			equal = 0;
+		if(ca == EOF)
+			break;
+	}
+
+	if(fa != NULL)
+		fclose(fa);
+	if(fb != NULL)
+		fclose(fb);
+	return equal;
+}
+
+void test_quikr_train_jobs() {
+
+	int test_number = 1;
+	char *test_name = "test_quikr_train_jobs";
+
+	char filename[] = "/tmp/quikr_test_train_XXXXXX";
+	char command[512];
+	char serial[64];
+	char parallel[64];
+	const char *formats[2] = {"", "-b"};
+	int i = 0;
+	int j = 0;
+	int f = 0;
+
+	// many more sequences than quikr_train keeps in flight, of every length
+	int fd = mkstemp(filename);
+	FILE *fh = fdopen(fd, "w");
+	for(i = 0; i < 300; i++) {
+		fprintf(fh, ">sequence%d description\n", i);
+		for(j = 0; j < 50 + (i * 37) % 400; j++)
+			fputc("ACGTN"[(i * 7 + j * j) % 5], fh);
+		fputc('\n', fh);
+	}
+	fclose(fh);
+
+	// tests 1 and 2
+	// the text and binary sensing matrices trained on 4 jobs are byte for
+	// byte the ones trained on 1
+	for(f = 0; f < 2; f++) {
+		snprintf(serial, sizeof(serial), "%s.1.gz", filename);
+		snprintf(parallel, sizeof(parallel), "%s.4.gz", filename);
+
+		snprintf(command, sizeof(command), "./quikr_train -i %s -k 5 -j 1 %s -o %s > /dev/null", filename, formats[f], serial);
+		int ran = system(command) == 0;
+		snprintf(command, sizeof(command), "./quikr_train -i %s -k 5 -j 4 %s -o %s > /dev/null", filename, formats[f], parallel);
+		ran = ran && system(command) == 0;
+
+		int equal = ran && files_equal(serial, parallel);
+		test_eq(equal, 1);
+
+		unlink(serial);
+		unlink(parallel);
+	}
+
+	unlink(filename);
+}
+
+void test_nnls_sparse() {
+
+	int test_number = 1;
+	int fail_flag = 0;
+	char *test_name = "test_nnls_sparse";
+
+	int i = 0;
+
+	// three columns of A stored as rows, the third is the sum of the others
+	double dense[12] = {1, 2, 0, 0, 1, 0, 3, 1, 1, 2, 3, 1};
+	double b[4] = {0, 4, 6, 2};
+	unsigned long long row_ptr[4] = {0, 2, 5, 9};
+	uint32_t column[9] = {0, 1, 0, 2, 3, 0, 1, 2, 3};
+	double values[9] = {1, 2, 1, 3, 1, 1, 2, 3, 1};
+	struct sparse_matrix sparse = {3, 4, 9, row_ptr, column, values};
+
+	double dense_b[4];
+	memcpy(dense_b, b, sizeof(b));
+	double a_copy[12];
+	memcpy(a_copy, dense, sizeof(dense));
+
+	// nnls() destroys A, so take A^T A and A^T b first
+	double gram[9];
+	double atb[3];
+	int j = 0, k = 0;
+	for(i = 0; i < 3; i++) {
+		atb[i] = 0;
+		for(k = 0; k < 4; k++)
+			atb[i] += dense[i * 4 + k] * b[k];
+		for(j = 0; j < 3; j++) {
+			gram[i * 3 + j] = 0;
+			for(k = 0; k < 4; k++)
+				gram[i * 3 + j] += dense[i * 4 + k] * dense[j * 4 + k];
+		}
+	}
+
+	double *dense_solution = nnls(dense, dense_b, 3, 4, 1);
+	double *sparse_solution = nnls_sparse(&sparse, b, 3, 4, NULL);
+
+	// test 1
+	// both solvers should find the same solution
+	for(i = 0; i < 3; i++)
+		if(fabs(dense_solution[i] - sparse_solution[i]) > 1e-9)
+			fail_flag = 1;
+	test_eq(fail_flag, 0);
+
+	// test 2
+	// and it should be non negative
+	fail_flag = 0;
+	for(i = 0; i < 3; i++)
+		if(sparse_solution[i] < 0)
+			fail_flag = 1;
+	test_eq(fail_flag, 0);
+
+	// test 3
+	// so should the gram solver, which only sees A^T A and A^T b
+	double *gram_solution = nnls_gram(gram, atb, 3, 4, NULL);
+	fail_flag = 0;
+	for(i = 0; i < 3; i++)
+		if(fabs(gram_solution[i] - sparse_solution[i]) > 1e-9)
+			fail_flag = 1;
+	test_eq(fail_flag, 0);
+
+	// test 4
+	// apg and cd only get close, and A is rank deficient, so compare the fits
+	// A x, which every minimizer shares
+	struct nnls_options options;
+	nnls_default_options(&options);
+	options.tolerance = 1e-10;
+	options.solver = NNLS_SOLVER_APG;
+	double *apg_solution = nnls_sparse(&sparse, b, 3, 4, &options);
+	options.solver = NNLS_SOLVER_CD;
+	double *cd_solution = nnls_gram(gram, atb, 3, 4, &options);
+	fail_flag = 0;
+	for(k = 0; k < 4; k++) {
+		double fit = 0, apg_fit = 0, cd_fit = 0;
+		for(i = 0; i < 3; i++) {
+			fit += a_copy[i * 4 + k] * sparse_solution[i];
+			apg_fit += a_copy[i * 4 + k] * apg_solution[i];
+			cd_fit += a_copy[i * 4 + k] * cd_solution[i];
+		}
+		if(fabs(fit - apg_fit) > 1e-6 || fabs(fit - cd_fit) > 1e-6)
+			fail_flag = 1;
+	}
+	test_eq(fail_flag, 0);
+
+	// test 5
+	// the first row of A is all ones, so it can be screened, which shouldn't
+	// change the solution
+	nnls_default_options(&options);
+	options.screen = 1;
+	double *screen_solution = nnls_sparse(&sparse, b, 3, 4, &options);
+	fail_flag = 0;
+	for(i = 0; i < 3; i++)
+		if(fabs(screen_solution[i] - sparse_solution[i]) > 1e-9)
+			fail_flag = 1;
+	test_eq(fail_flag, 0);
+
+	// test 6
+	// a single precision A gets close to the double precision solution
+	float a_float[12];
+	for(i = 0; i < 12; i++)
+		a_float[i] = a_copy[i];
+	double *float_solution = nnls_dense_float(a_float, b, 3, 4, NULL);
+	fail_flag = 0;
+	for(i = 0; i < 3; i++)
+		if(fabs(float_solution[i] - sparse_solution[i]) > 1e-5)
+			fail_flag = 1;
+	test_eq(fail_flag, 0);
+
+	// test 7
+	// with many more columns than screening seeds the working set with, most
+	// never join it and many are proven absent, and the solution is still the
+	// same. Like quikr's A, each column is a normalized profile times lambda
+	// under a row of ones
+	const int columns = 1000;
+	const int rows = 65;
+	double *a_big = malloc(columns * rows * sizeof(double));
+	double b_big[65];
+	double sum = 0;
+	unsigned int seed = 1;
+	for(i = 0; i < columns; i++) {
+		sum = 0;
+		a_big[i * rows] = 1;
+		for(k = 1; k < rows; k++) {
+			seed = seed * 1103515245 + 12345;
+			a_big[i * rows + k] = (seed >> 16) % 100 < 30 ? (seed >> 8) % 100 + 1 : 0;
+			sum += a_big[i * rows + k];
+		}
+		for(k = 1; k < rows; k++)
+			a_big[i * rows + k] *= 1000 / sum;
+	}
+	b_big[0] = 0;
+	for(sum = 0, k = 1; k < rows; k++) {
+		seed = seed * 1103515245 + 12345;
+		b_big[k] = (seed >> 8) % 100 + 1;
+		sum += b_big[k];
+	}
+	for(k = 1; k < rows; k++)
+		b_big[k] *= 1000 / sum;
+
+	double *full_solution = nnls_dense(a_big, b_big, columns, rows, NULL);
+	nnls_default_options(&options);
+	options.screen = 1;
+	double *screened_solution = nnls_dense(a_big, b_big, columns, rows, &options);
+	fail_flag = options.screened == 0 || options.working > columns / 4;
+	for(i = 0; i < columns; i++)
+		if(fabs(screened_solution[i] - full_solution[i]) > 1e-9)
+			fail_flag = 1;
+	test_eq(fail_flag, 0);
+
+	free(dense_solution);
+	free(sparse_solution);
+	free(gram_solution);
+	free(apg_solution);
+	free(cd_solution);
+	free(screen_solution);
+	free(float_solution);
+	free(full_solution);
+	free(screened_solution);
+	free(a_big);
+}
+
+void test_nnls_workspace() {
+
+	int test_number = 1;
+	char *test_name = "test_nnls_workspace";
+
+	struct nnls_workspace workspace;
+	nnls_workspace_init(&workspace, 0);
+
+	// test 1
+	// nothing fits the first time, so it all spills
+	size_t mark = nnls_workspace_mark(&workspace);
+	nnls_workspace_alloc(&workspace, 1000);
+	nnls_workspace_alloc(&workspace, 3000);
+	test_eq(workspace.spill_count, 2);
+
+	// test 2
+	// and the buffer grows to hold it once it is given back
+	nnls_workspace_release(&workspace, mark);
+	test_eq((workspace.spill_count == 0 && workspace.size >= 4000), 1);
+
+	// test 3
+	// so the same again comes out of the buffer
+	mark = nnls_workspace_mark(&workspace);
+	char *first = nnls_workspace_alloc(&workspace, 1000);
+	char *second = nnls_workspace_alloc(&workspace, 3000);
+	test_eq((first == workspace.buffer && second > first && second + 3000 <= workspace.buffer + workspace.size && workspace.spill_count == 0), 1);
+	nnls_workspace_release(&workspace, mark);
+
+	// test 4
+	// shrinking gives the buffer back, and it doesn't grow back to the old peak
+	nnls_workspace_shrink(&workspace);
+	mark = nnls_workspace_mark(&workspace);
+	nnls_workspace_alloc(&workspace, 100);
+	nnls_workspace_release(&workspace, mark);
+	test_eq((workspace.size >= 100 && workspace.size < 4000), 1);
+
+	nnls_workspace_free(&workspace);
+}
+
+void test_nnls_batch() {
+
+	int test_number = 1;
+	int fail_flag = 0;
+	char *test_name = "test_nnls_batch";
+
+	int i = 0;
+	int s = 0;
+
+	// two samples against the A from test_nnls_sparse
+	const double a[12] = {1, 2, 0, 0, 1, 0, 3, 1, 1, 2, 3, 1};
+	const double b[8] = {0, 4, 6, 2, 1, 0, 3, 5};
+
+	struct nnls_options options;
+	nnls_default_options(&options);
+	options.jobs = 2;
+
+	double *batch_solution = nnls_batch(a, b, 2, 3, 4, &options, 0);
+
+	// test 1
+	// every sample gets the solution nnls() finds for it alone
+	for(s = 0; s < 2; s++) {
+		double a_copy[12];
+		double b_copy[4];
+		memcpy(a_copy, a, sizeof(a_copy));
+		memcpy(b_copy, &b[s * 4], sizeof(b_copy));
+
+		double *solution = nnls(a_copy, b_copy, 3, 4, 1);
+		for(i = 0; i < 3; i++)
+			if(fabs(solution[i] - batch_solution[s * 3 + i]) > 1e-9)
+				fail_flag = 1;
+		free(solution);
+	}
+	test_eq(fail_flag, 0);
+
+	// test 2
+	// warm starting the second sample from the first doesn't change it
+	options.jobs = 1;
+	double *warm_solution = nnls_batch(a, b, 2, 3, 4, &options, 1);
+	fail_flag = 0;
+	for(i = 0; i < 6; i++)
+		if(fabs(warm_solution[i] - batch_solution[i]) > 1e-9)
+			fail_flag = 1;
+	test_eq(fail_flag, 0);
+
+	// test 3
+	// a quiet batch keeps the samples that stopped at max_iterations in
+	// status instead of printing
+	options.solver = NNLS_SOLVER_APG;
+	options.max_iterations = 1;
+	options.tolerance = 1e-15;
+	options.quiet = 1;
+	double *stopped_solution = nnls_batch(a, b, 2, 3, 4, &options, 0);
+	int stopped = stopped_solution != NULL && options.status == 1;
+	test_eq(stopped, 1);
+
+	free(batch_solution);
+	free(warm_solution);
+	free(stopped_solution);
+}
+
+void test_vector() {
+
+	int test_number = 1;
+	int fail_flag = 0;
+	char *test_name = "test_vector";
+
+	int i = 0;
+	int n = 0;
+
+	double x[37];
+	double y[37];
+	for(i = 0; i < 37; i++) {
+		x[i] = 1.0 / (i + 1);
+		y[i] = sin(i) * 1e3;
+	}
+
+	// test 1
+	// whichever kernel runs, the dot product is summed in 8 lanes and then a
+	// fixed tree, so it matches this exactly for every length
+	for(n = 0; n <= 37; n++) {
+		double lane[8] = {0};
+		for(i = 0; i + 8 <= n; i += 8) {
+			int l = 0;
+			for(l = 0; l < 8; l++) {
+				double p = x[i + l] * y[i + l];
+				lane[l] += p;
+			}
+		}
+		double sm = ((lane[0] + lane[1]) + (lane[2] + lane[3])) + ((lane[4] + lane[5]) + (lane[6] + lane[7]));
+		for(; i < n; i++) {
+			double p = x[i] * y[i];
+			sm += p;
+		}
+		if(vector_dot(x, y, n) != sm)
+			fail_flag = 1;
+	}
+	test_eq(fail_flag, 0);
+
+	// test 2
+	// axpy is exact per element too
+	double z[37];
+	memcpy(z, y, sizeof(z));
+	vector_axpy(-3.0, x, z, 37);
+	fail_flag = 0;
+	for(i = 0; i < 37; i++) {
+		double p = -3.0 * x[i];
+		if(z[i] != y[i] + p)
+			fail_flag = 1;
+	}
+	test_eq(fail_flag, 0);
+}
+
+void test_rare_value() {
+
+	int test_number = 1;
+	char *test_name = "test_rare_value";
+
+	double counts[10] = {7, 0, 3, 3, 9, 1, 0, 5, 3, 2};
+	unsigned long long rare_value = 0;
+	unsigned long long rare_width = 0;
+
+	// test 1
+	// the median of the sorted counts 0 0 1 2 3 3 3 5 7 9 is 3, and all of
+	// the ties at 3 are kept
+	get_rare_value(counts, 10, 0.5, &rare_value, &rare_width);
+	test_eq(rare_value, 3);
+
+	// test 2
+	test_eq(rare_width, 7);
+
+	// test 3
+	// the count matrix isn't reordered by the selection
+	test_eq(counts[0], 7);
+
+	// test 4
+	// a rare percent of 1 keeps everything
+	get_rare_value(counts, 10, 1, &rare_value, &rare_width);
+	test_eq(rare_value, 9);
+
+	// test 5
+	test_eq(rare_width, 10);
+
+	// test 6
+	// and so does one over 1, without selecting past the end
+	get_rare_value(counts, 10, 1.5, &rare_value, &rare_width);
+	test_eq(rare_value, 9);
+
+	// test 7
+	test_eq(rare_width, 10);
+}
+
+void test_scheduler() {
+
+	int test_number = 1;
+	char *test_name = "test_scheduler";
+
+	const unsigned long long size[3] = {1, 3, 2};
+	const unsigned long long memory[3] = {6, 3, 8};
+	size_t order[3];
+	struct scheduler scheduler;
+
+	// test 1
+	// the biggest sample comes first
+	schedule_largest_first(size, 3, order);
+	test_eq((order[0] == 1 && order[1] == 2 && order[2] == 0), 1);
+
+	scheduler_init(&scheduler, order, memory, 3, 10);
+
+	// test 2
+	// sample 2 doesn't fit next to sample 1, so the smaller sample 0 goes first
+	size_t first = scheduler_next(&scheduler);
+	size_t second = scheduler_next(&scheduler);
+	test_eq((first == 1 && second == 0), 1);
+
+	// test 3
+	// and sample 2 once they are done
+	scheduler_done(&scheduler, first);
+	scheduler_done(&scheduler, second);
+	test_eq(scheduler_next(&scheduler), 2);
+
+	// test 4
+	scheduler_done(&scheduler, 2);
+	test_eq(scheduler_next(&scheduler), SIZE_MAX);
+
+	// test 5
+	test_eq(scheduler.peak, 9);
+
+	scheduler_free(&scheduler);
+}
+
+void test_work_queue() {
+
+	int test_number = 1;
+	char *test_name = "test_work_queue";
+
+	int items[3] = {0, 1, 2};
+	struct work_queue queue;
+
+	work_queue_init(&queue, 2, 1);
+	work_queue_push(&queue, &items[0]);
+	work_queue_push(&queue, &items[1]);
+
+	// test 1
+	// first in first out
+	test_eq(*(int *)work_queue_pop(&queue), 0);
+
+	// test 2
+	// the slot it left is reused once the queue wraps around
+	work_queue_push(&queue, &items[2]);
+	work_queue_finish(&queue);
+	int *second = work_queue_pop(&queue);
+	int *third = work_queue_pop(&queue);
+	test_eq((*second == 1 && *third == 2), 1);
+
+	// test 3
+	// empty once its only producer is done
+	test_eq((work_queue_pop(&queue) == NULL), 1);
+
+	// test 4
+	test_eq(queue.stats.most, 2);
+
+	work_queue_free(&queue);
+}
+
 int main() {
 
 	header("count_sequences");
@@ -115,6 +1076,62 @@ int main() {
 	test_normalize_matrix();
 	footer();
 
+	header("count_kmers");
+	test_count_kmers();
+	footer();
+
+	header("binary_matrix");
+	test_binary_matrix();
+	footer();
+
+	header("libquikr");
+	test_libquikr();
+	footer();
+
+	header("serve");
+	test_serve();
+	footer();
+
+	header("gzip_fastq");
+	test_gzip_fastq();
+	footer();
+
+	header("parallel_counts");
+	test_parallel_counts();
+	footer();
+
+	header("quikr_train_jobs");
+	test_quikr_train_jobs();
+	footer();
+
+	header("rare_value");
+	test_rare_value();
+	footer();
+
+	header("scheduler");
+	test_scheduler();
+	footer();
+
+	header("work_queue");
+	test_work_queue();
+	footer();
+
+	header("vector");
+	test_vector();
+	footer();
+
+	header("nnls_sparse");
+	test_nnls_sparse();
+	footer();
+
+	header("nnls_batch");
+	test_nnls_batch();
+	footer();
+
+	header("nnls_workspace");
+	test_nnls_workspace();
+	footer();
+
 	if(failed)
 		return EXIT_FAILURE;
 	else
@@ -0,0 +1,290 @@
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define VECTOR_X86 1
+#endif
+
+#ifdef __aarch64__
+#include <arm_neon.h>
+#endif
+
+#include "vector.h"
+
+// the dot products keep 8 partial sums, lane i takes the elements i mod 8,
+// and they are added up in a fixed tree at the end with the tail after them.
+// Every kernel follows this, so they round the same way. This file is built
+// with -ffp-contract=off so the compiler can't fuse the multiply and add
+#define VECTOR_LANES 8
+
+static double vector_tree(const double *lane) {
+	return ((lane[0] + lane[1]) + (lane[2] + lane[3])) + ((lane[4] + lane[5]) + (lane[6] + lane[7]));
+}
+
+static double vector_reduce(const double *lane, const double *x, const double *y, int64_t i, int64_t n) {
+	double sm = vector_tree(lane);
+
+	for(; i < n; i++)
+		sm += x[i] * y[i];
+	return sm;
+}
+
+static double vector_reduce_float(const double *lane, const float *x, const double *y, int64_t i, int64_t n) {
+	double sm = vector_tree(lane);
+
+	for(; i < n; i++)
+		sm += (double)x[i] * y[i];
+	return sm;
+}
+
+static double dot_generic(const double *x, const double *y, int64_t n) {
+	double lane[VECTOR_LANES] = {0};
+	int64_t i, l;
+
+	for(i = 0; i + VECTOR_LANES <= n; i += VECTOR_LANES)
+		for(l = 0; l < VECTOR_LANES; l++)
+			lane[l] += x[i + l] * y[i + l];
+
+	return vector_reduce(lane, x, y, i, n);
+}
+
+static void axpy_generic(double a, const double *x, double *y, int64_t n) {
+	int64_t i;
+
+	for(i = 0; i < n; i++)
+		y[i] += a * x[i];
+}
+
+static double dot_float_generic(const float *x, const double *y, int64_t n) {
+	double lane[VECTOR_LANES] = {0};
+	int64_t i, l;
+
+	for(i = 0; i + VECTOR_LANES <= n; i += VECTOR_LANES)
+		for(l = 0; l < VECTOR_LANES; l++)
+			lane[l] += (double)x[i + l] * y[i + l];
+
+	return vector_reduce_float(lane, x, y, i, n);
+}
+
+static void axpy_float_generic(double a, const float *x, double *y, int64_t n) {
+	int64_t i;
+
+	for(i = 0; i < n; i++)
+		y[i] += a * (double)x[i];
+}
+
+#ifdef VECTOR_X86
+__attribute__((target("avx2")))
+static double dot_avx2(const double *x, const double *y, int64_t n) {
+	double lane[VECTOR_LANES];
+	__m256d lo = _mm256_setzero_pd();
+	__m256d hi = _mm256_setzero_pd();
+	int64_t i;
+
+	for(i = 0; i + VECTOR_LANES <= n; i += VECTOR_LANES) {
+		lo = _mm256_add_pd(lo, _mm256_mul_pd(_mm256_loadu_pd(&x[i]), _mm256_loadu_pd(&y[i])));
+		hi = _mm256_add_pd(hi, _mm256_mul_pd(_mm256_loadu_pd(&x[i + 4]), _mm256_loadu_pd(&y[i + 4])));
+	}
+	_mm256_storeu_pd(&lane[0], lo);
+	_mm256_storeu_pd(&lane[4], hi);
+
+	return vector_reduce(lane, x, y, i, n);
+}
+
+__attribute__((target("avx2")))
+static void axpy_avx2(double a, const double *x, double *y, int64_t n) {
+	__m256d va = _mm256_set1_pd(a);
+	int64_t i;
+
+	for(i = 0; i + 4 <= n; i += 4)
+		_mm256_storeu_pd(&y[i], _mm256_add_pd(_mm256_loadu_pd(&y[i]), _mm256_mul_pd(va, _mm256_loadu_pd(&x[i]))));
+	for(; i < n; i++)
+		y[i] += a * x[i];
+}
+
+__attribute__((target("avx2")))
+static double dot_float_avx2(const float *x, const double *y, int64_t n) {
+	double lane[VECTOR_LANES];
+	__m256d lo = _mm256_setzero_pd();
+	__m256d hi = _mm256_setzero_pd();
+	int64_t i;
+
+	for(i = 0; i + VECTOR_LANES <= n; i += VECTOR_LANES) {
+		lo = _mm256_add_pd(lo, _mm256_mul_pd(_mm256_cvtps_pd(_mm_loadu_ps(&x[i])), _mm256_loadu_pd(&y[i])));
+		hi = _mm256_add_pd(hi, _mm256_mul_pd(_mm256_cvtps_pd(_mm_loadu_ps(&x[i + 4])), _mm256_loadu_pd(&y[i + 4])));
+	}
+	_mm256_storeu_pd(&lane[0], lo);
+	_mm256_storeu_pd(&lane[4], hi);
+
+	return vector_reduce_float(lane, x, y, i, n);
+}
+
+__attribute__((target("avx2")))
+static void axpy_float_avx2(double a, const float *x, double *y, int64_t n) {
+	__m256d va = _mm256_set1_pd(a);
+	int64_t i;
+
+	for(i = 0; i + 4 <= n; i += 4)
+		_mm256_storeu_pd(&y[i], _mm256_add_pd(_mm256_loadu_pd(&y[i]), _mm256_mul_pd(va, _mm256_cvtps_pd(_mm_loadu_ps(&x[i])))));
+	for(; i < n; i++)
+		y[i] += a * (double)x[i];
+}
+
+__attribute__((target("avx512f")))
+static double dot_avx512(const double *x, const double *y, int64_t n) {
+	double lane[VECTOR_LANES];
+	__m512d acc = _mm512_setzero_pd();
+	int64_t i;
+
+	for(i = 0; i + VECTOR_LANES <= n; i += VECTOR_LANES)
+		acc = _mm512_add_pd(acc, _mm512_mul_pd(_mm512_loadu_pd(&x[i]), _mm512_loadu_pd(&y[i])));
+	_mm512_storeu_pd(lane, acc);
+
+	return vector_reduce(lane, x, y, i, n);
+}
+
+__attribute__((target("avx512f")))
+static void axpy_avx512(double a, const double *x, double *y, int64_t n) {
+	__m512d va = _mm512_set1_pd(a);
+	int64_t i;
+
+	for(i = 0; i + 8 <= n; i += 8)
+		_mm512_storeu_pd(&y[i], _mm512_add_pd(_mm512_loadu_pd(&y[i]), _mm512_mul_pd(va, _mm512_loadu_pd(&x[i]))));
+	for(; i < n; i++)
+		y[i] += a * x[i];
+}
+
+__attribute__((target("avx512f")))
+static double dot_float_avx512(const float *x, const double *y, int64_t n) {
+	double lane[VECTOR_LANES];
+	__m512d acc = _mm512_setzero_pd();
+	int64_t i;
+
+	for(i = 0; i + VECTOR_LANES <= n; i += VECTOR_LANES)
+		acc = _mm512_add_pd(acc, _mm512_mul_pd(_mm512_cvtps_pd(_mm256_loadu_ps(&x[i])), _mm512_loadu_pd(&y[i])));
+	_mm512_storeu_pd(lane, acc);
+
+	return vector_reduce_float(lane, x, y, i, n);
+}
+
+__attribute__((target("avx512f")))
+static void axpy_float_avx512(double a, const float *x, double *y, int64_t n) {
+	__m512d va = _mm512_set1_pd(a);
+	int64_t i;
+
+	for(i = 0; i + 8 <= n; i += 8)
+		_mm512_storeu_pd(&y[i], _mm512_add_pd(_mm512_loadu_pd(&y[i]), _mm512_mul_pd(va, _mm512_cvtps_pd(_mm256_loadu_ps(&x[i])))));
+	for(; i < n; i++)
+		y[i] += a * (double)x[i];
+}
+#endif
+
+#ifdef __aarch64__
+static double dot_neon(const double *x, const double *y, int64_t n) {
+	double lane[VECTOR_LANES];
+	float64x2_t acc[4] = {vdupq_n_f64(0.), vdupq_n_f64(0.), vdupq_n_f64(0.), vdupq_n_f64(0.)};
+	int64_t i, l;
+
+	for(i = 0; i + VECTOR_LANES <= n; i += VECTOR_LANES)
+		for(l = 0; l < 4; l++)
+			acc[l] = vaddq_f64(acc[l], vmulq_f64(vld1q_f64(&x[i + 2 * l]), vld1q_f64(&y[i + 2 * l])));
+	for(l = 0; l < 4; l++)
+		vst1q_f64(&lane[2 * l], acc[l]);
+
+	return vector_reduce(lane, x, y, i, n);
+}
+
+static void axpy_neon(double a, const double *x, double *y, int64_t n) {
+	float64x2_t va = vdupq_n_f64(a);
+	int64_t i;
+
+	for(i = 0; i + 2 <= n; i += 2)
+		vst1q_f64(&y[i], vaddq_f64(vld1q_f64(&y[i]), vmulq_f64(va, vld1q_f64(&x[i]))));
+	for(; i < n; i++)
+		y[i] += a * x[i];
+}
+
+static double dot_float_neon(const float *x, const double *y, int64_t n) {
+	double lane[VECTOR_LANES];
+	float64x2_t acc[4] = {vdupq_n_f64(0.), vdupq_n_f64(0.), vdupq_n_f64(0.), vdupq_n_f64(0.)};
+	int64_t i, l;
+
+	for(i = 0; i + VECTOR_LANES <= n; i += VECTOR_LANES)
+		for(l = 0; l < 4; l++)
+			acc[l] = vaddq_f64(acc[l], vmulq_f64(vcvt_f64_f32(vld1_f32(&x[i + 2 * l])), vld1q_f64(&y[i + 2 * l])));
+	for(l = 0; l < 4; l++)
+		vst1q_f64(&lane[2 * l], acc[l]);
+
+	return vector_reduce_float(lane, x, y, i, n);
+}
+
+static void axpy_float_neon(double a, const float *x, double *y, int64_t n) {
+	float64x2_t va = vdupq_n_f64(a);
+	int64_t i;
+
+	for(i = 0; i + 2 <= n; i += 2)
+		vst1q_f64(&y[i], vaddq_f64(vld1q_f64(&y[i]), vmulq_f64(va, vcvt_f64_f32(vld1_f32(&x[i])))));
+	for(; i < n; i++)
+		y[i] += a * (double)x[i];
+}
+#endif
+
+struct vector_kernels {
+	const char *name;
+	double (*dot)(const double *x, const double *y, int64_t n);
+	void (*axpy)(double a, const double *x, double *y, int64_t n);
+	double (*dot_float)(const float *x, const double *y, int64_t n);
+	void (*axpy_float)(double a, const float *x, double *y, int64_t n);
+};
+
+static const struct vector_kernels *vector_selected = NULL;
+
+// threads racing here all pick the same kernels, and the pointer is read and
+// written atomically so none of them sees it half set
+static const struct vector_kernels *vector_select(void) {
+	static const struct vector_kernels generic = {"generic", dot_generic, axpy_generic, dot_float_generic, axpy_float_generic};
+	const struct vector_kernels *kernels = &generic;
+
+	const struct vector_kernels *selected = __atomic_load_n(&vector_selected, __ATOMIC_ACQUIRE);
+	if(selected != NULL)
+		return selected;
+
+#ifdef VECTOR_X86
+	static const struct vector_kernels avx2 = {"avx2", dot_avx2, axpy_avx2, dot_float_avx2, axpy_float_avx2};
+	static const struct vector_kernels avx512 = {"avx512", dot_avx512, axpy_avx512, dot_float_avx512, axpy_float_avx512};
+
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx512f"))
+		kernels = &avx512;
+	else if(__builtin_cpu_supports("avx2"))
+		kernels = &avx2;
+#endif
+
+#ifdef __aarch64__
+	static const struct vector_kernels neon = {"neon", dot_neon, axpy_neon, dot_float_neon, axpy_float_neon};
+	kernels = &neon;
+#endif
+
+	__atomic_store_n(&vector_selected, kernels, __ATOMIC_RELEASE);
+	return kernels;
+}
+
+double vector_dot(const double *x, const double *y, int64_t n) {
+	return vector_select()->dot(x, y, n);
+}
+
+void vector_axpy(double a, const double *x, double *y, int64_t n) {
+	vector_select()->axpy(a, x, y, n);
+}
+
+double vector_dot_float(const float *x, const double *y, int64_t n) {
+	return vector_select()->dot_float(x, y, n);
+}
+
+void vector_axpy_float(double a, const float *x, double *y, int64_t n) {
+	vector_select()->axpy_float(a, x, y, n);
+}
+
+const char *vector_kernel(void) {
+	return vector_select()->name;
+}
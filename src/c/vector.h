@@ -0,0 +1,20 @@
+#include <stdint.h>
+
+// dot products and axpys over contiguous doubles, for the solvers' inner
+// loops. The kernel is picked for the CPU on the first call, and every kernel
+// sums in the same order without fused multiply adds, so the results are the
+// same bit for bit whichever one runs
+
+// x . y
+double vector_dot(const double *x, const double *y, int64_t n);
+
+// y += a * x
+void vector_axpy(double a, const double *x, double *y, int64_t n);
+
+// the same with x in single precision, which is widened to double before it
+// is multiplied, so the sums are as accurate as x is
+double vector_dot_float(const float *x, const double *y, int64_t n);
+void vector_axpy_float(double a, const float *x, double *y, int64_t n);
+
+// the kernel in use, "avx512", "avx2", "neon" or "generic"
+const char *vector_kernel(void);
@@ -0,0 +1,637 @@
+// Python bindings to libquikr, the C engine behind the quikr tools. Arrays go
+// both ways through the buffer protocol, so sensing matrices, counts and
+// solutions are shared with NumPy instead of copied, and the GIL is released
+// while loading, counting and solving so Python threads run them in parallel
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libquikr.h"
+#include "nnls.h"
+#include "quikr.h"
+
+// numpy.asarray, or NULL to hand out memoryviews when NumPy isn't installed
+static PyObject *asarray = NULL;
+
+// memory exported through the buffer protocol, either owned or kept alive by
+// owner
+typedef struct {
+	PyObject_HEAD
+	void *data;
+	int owned;
+	PyObject *owner;
+	const char *format;
+	Py_ssize_t itemsize;
+	int ndim;
+	Py_ssize_t shape[2];
+	Py_ssize_t strides[2];
+	int readonly;
+} BufferObject;
+
+static void buffer_dealloc(BufferObject *self) {
+	if(self->owned)
+		free(self->data);
+	Py_XDECREF(self->owner);
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static int buffer_getbuffer(BufferObject *self, Py_buffer *view, int flags) {
+	if(self->readonly && (flags & PyBUF_WRITABLE)) {
+		PyErr_SetString(PyExc_BufferError, "the sensing matrix is read only");
+		return -1;
+	}
+
+	view->buf = self->data;
+	view->obj = (PyObject *)self;
+	view->len = self->itemsize * self->shape[0] * (self->ndim == 2 ? self->shape[1] : 1);
+	view->readonly = self->readonly;
+	view->itemsize = self->itemsize;
+	view->format = (flags & PyBUF_FORMAT) ? (char *)self->format : NULL;
+	view->ndim = self->ndim;
+	view->shape = (flags & PyBUF_ND) ? self->shape : NULL;
+	view->strides = (flags & PyBUF_STRIDES) ? self->strides : NULL;
+	view->suboffsets = NULL;
+	view->internal = NULL;
+
+	Py_INCREF(self);
+	return 0;
+}
+
+static PyBufferProcs buffer_procs = {
+	(getbufferproc)buffer_getbuffer,
+	NULL,
+};
+
+static PyTypeObject BufferType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name = "libquikr.Buffer",
+	.tp_basicsize = sizeof(BufferObject),
+	.tp_dealloc = (destructor)buffer_dealloc,
+	.tp_as_buffer = &buffer_procs,
+	.tp_flags = Py_TPFLAGS_DEFAULT,
+	.tp_doc = "memory libquikr shares with NumPy",
+};
+
+// an array of rows * columns (or rows, for one dimension) items of data,
+// which is freed with the array if owned is set, and otherwise lives as long
+// as owner
+static PyObject *array_new(void *data, int owned, PyObject *owner, const char *format, Py_ssize_t itemsize, int ndim, Py_ssize_t rows, Py_ssize_t columns, int readonly) {
+	BufferObject *buffer = PyObject_New(BufferObject, &BufferType);
+	if(buffer == NULL) {
+		if(owned)
+			free(data);
+		return NULL;
+	}
+
+	buffer->data = data;
+	buffer->owned = owned;
+	buffer->owner = owner;
+	Py_XINCREF(owner);
+	buffer->format = format;
+	buffer->itemsize = itemsize;
+	buffer->ndim = ndim;
+	buffer->shape[0] = rows;
+	buffer->shape[1] = columns;
+	buffer->strides[0] = ndim == 2 ? columns * itemsize : itemsize;
+	buffer->strides[1] = itemsize;
+	buffer->readonly = readonly;
+
+	PyObject *array = asarray != NULL ?
+		PyObject_CallFunctionObjArgs(asarray, (PyObject *)buffer, NULL) :
+		PyMemoryView_FromObject((PyObject *)buffer);
+	Py_DECREF(buffer);
+
+	return array;
+}
+
+// raise the exception for one of libquikr's codes
+static PyObject *quikr_raise(int code, int error, const char *message, const char *filename) {
+	if(message == NULL || message[0] == '\0')
+		message = quikr_strerror(code);
+
+	if(code == QUIKR_ERROR_MEMORY)
+		return PyErr_NoMemory();
+	if(code == QUIKR_ERROR_IO && filename != NULL) {
+		PyObject *args = Py_BuildValue("(iss)", error, strerror(error), filename);
+		if(args != NULL) {
+			PyErr_SetObject(PyExc_OSError, args);
+			Py_DECREF(args);
+		}
+		return NULL;
+	}
+
+	PyErr_SetString(code == QUIKR_ERROR_IO ? PyExc_OSError : PyExc_ValueError, message);
+	return NULL;
+}
+
+// a contiguous one dimensional buffer of count items with an 8 byte format of
+// one of kinds, released by the caller
+static int get_vector(PyObject *object, Py_buffer *view, const char *kinds, Py_ssize_t count, const char *name) {
+	if(PyObject_GetBuffer(object, view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) != 0)
+		return -1;
+
+	const char *format = view->format != NULL ? view->format : "B";
+	if(strchr("<@=", format[0]) != NULL)
+		format++;
+
+	if(view->itemsize != 8 || strlen(format) != 1 || strchr(kinds, format[0]) == NULL) {
+		PyErr_Format(PyExc_TypeError, "%s must be an array of %s", name, strchr(kinds, 'd') ? "float64" : "uint64");
+		PyBuffer_Release(view);
+		return -1;
+	}
+	if(view->len / 8 < count) {
+		PyErr_Format(PyExc_ValueError, "%s needs at least %zd values", name, count);
+		PyBuffer_Release(view);
+		return -1;
+	}
+
+	return 0;
+}
+
+typedef struct {
+	PyObject_HEAD
+	struct quikr_database *database;
+} DatabaseObject;
+
+static int database_init(DatabaseObject *self, PyObject *args, PyObject *kwds) {
+	static char *keywords[] = {"path", "kmer", NULL};
+	char error[QUIKR_ERROR_LENGTH];
+	PyObject *path = NULL;
+	struct quikr_database *database = NULL;
+	unsigned int kmer = 0;
+	int code = 0;
+	int saved = 0;
+
+	if(!PyArg_ParseTupleAndKeywords(args, kwds, "O&|I", keywords, PyUnicode_FSConverter, &path, &kmer))
+		return -1;
+
+	// other threads may be classifying against an open database without the
+	// GIL, so it is never swapped for another one
+	if(self->database != NULL) {
+		Py_DECREF(path);
+		PyErr_SetString(PyExc_RuntimeError, "the database is already open");
+		return -1;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	code = quikr_database_open(PyBytes_AS_STRING(path), kmer, &database, error);
+	saved = errno;
+	Py_END_ALLOW_THREADS
+
+	// and another thread may have opened it while we did
+	if(code == QUIKR_OK && self->database != NULL) {
+		quikr_database_close(database);
+		Py_DECREF(path);
+		PyErr_SetString(PyExc_RuntimeError, "the database is already open");
+		return -1;
+	}
+
+	if(code != QUIKR_OK) {
+		if(code == QUIKR_ERROR_MEMORY)
+			PyErr_NoMemory();
+		else if(code == QUIKR_ERROR_IO) {
+			PyObject *exception = Py_BuildValue("(isO)", saved, error, path);
+			if(exception != NULL) {
+				PyErr_SetObject(PyExc_OSError, exception);
+				Py_DECREF(exception);
+			}
+		}
+		else
+			PyErr_SetString(PyExc_ValueError, error);
+		Py_DECREF(path);
+		return -1;
+	}
+
+	self->database = database;
+	Py_DECREF(path);
+	return 0;
+}
+
+static void database_dealloc(DatabaseObject *self) {
+	if(self->database != NULL)
+		quikr_database_close(self->database);
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static int database_check(DatabaseObject *self) {
+	if(self->database == NULL) {
+		PyErr_SetString(PyExc_ValueError, "the database isn't open");
+		return -1;
+	}
+	return 0;
+}
+
+static PyObject *database_kmer(DatabaseObject *self, void *closure) {
+	if(database_check(self) != 0)
+		return NULL;
+	return PyLong_FromUnsignedLong(quikr_database_kmer(self->database));
+}
+
+static PyObject *database_sequences(DatabaseObject *self, void *closure) {
+	if(database_check(self) != 0)
+		return NULL;
+	return PyLong_FromUnsignedLongLong(quikr_database_sequences(self->database));
+}
+
+static PyObject *database_headers(DatabaseObject *self, void *closure) {
+	unsigned long long i = 0;
+
+	if(database_check(self) != 0)
+		return NULL;
+
+	unsigned long long sequences = quikr_database_sequences(self->database);
+	PyObject *headers = PyList_New(sequences);
+	if(headers == NULL)
+		return NULL;
+
+	for(i = 0; i < sequences; i++) {
+		PyObject *header = PyUnicode_DecodeFSDefault(quikr_database_header(self->database, i));
+		if(header == NULL) {
+			Py_DECREF(headers);
+			return NULL;
+		}
+		PyList_SET_ITEM(headers, i, header);
+	}
+
+	return headers;
+}
+
+// the sensing matrix, mapped straight from the file for binary matrices
+static PyObject *database_matrix(DatabaseObject *self, void *closure) {
+	struct quikr_matrix matrix;
+
+	if(database_check(self) != 0)
+		return NULL;
+
+	const Py_ssize_t sequences = quikr_database_sequences(self->database);
+	const Py_ssize_t width = pow_four(quikr_database_kmer(self->database));
+
+	quikr_database_matrix(self->database, &matrix);
+
+	if(matrix.layout == QUIKR_LAYOUT_DENSE)
+		return array_new((void *)matrix.values, 0, (PyObject *)self, "d", 8, 2, sequences, width, 1);
+	if(matrix.layout == QUIKR_LAYOUT_KMER_MAJOR)
+		return array_new((void *)matrix.values, 0, (PyObject *)self, "d", 8, 2, width, sequences, 1);
+
+	// compressed sparse rows, the way scipy.sparse.csr_matrix takes them
+	PyObject *values = array_new((void *)matrix.values, 0, (PyObject *)self, "d", 8, 1, matrix.nnz, 0, 1);
+	PyObject *columns = array_new((void *)matrix.columns, 0, (PyObject *)self, "I", 4, 1, matrix.nnz, 0, 1);
+	PyObject *row_ptr = array_new((void *)matrix.row_ptr, 0, (PyObject *)self, "Q", 8, 1, sequences + 1, 0, 1);
+
+	if(values == NULL || columns == NULL || row_ptr == NULL) {
+		Py_XDECREF(values);
+		Py_XDECREF(columns);
+		Py_XDECREF(row_ptr);
+		return NULL;
+	}
+
+	return Py_BuildValue("(NNN)", values, columns, row_ptr);
+}
+
+static PyObject *database_layout(DatabaseObject *self, void *closure) {
+	struct quikr_matrix matrix;
+
+	if(database_check(self) != 0)
+		return NULL;
+
+	quikr_database_matrix(self->database, &matrix);
+	if(matrix.layout == QUIKR_LAYOUT_SPARSE)
+		return PyUnicode_FromString("sparse");
+	if(matrix.layout == QUIKR_LAYOUT_KMER_MAJOR)
+		return PyUnicode_FromString("kmer-major");
+	return PyUnicode_FromString("dense");
+}
+
+static PyObject *database_classify(DatabaseObject *self, PyObject *args, PyObject *kwds) {
+	static char *keywords[] = {"counts", "lambda_", "rare_percent", "solver", "screen", "single", "tolerance", "max_iterations", "start", "jobs", NULL};
+	struct quikr_params params;
+	struct quikr_stats stats;
+	Py_buffer counts;
+	Py_buffer start;
+	PyObject *counts_object = NULL;
+	PyObject *start_object = Py_None;
+	const char *solver = "lawson-hanson";
+	int code = 0;
+
+	if(database_check(self) != 0)
+		return NULL;
+
+	quikr_default_params(&params);
+
+	if(!PyArg_ParseTupleAndKeywords(args, kwds, "O|KdsppdLOi", keywords, &counts_object, &params.lambda, &params.rare_percent, &solver, &params.screen, &params.single, &params.tolerance, &params.max_iterations, &start_object, &params.jobs))
+		return NULL;
+
+	params.solver = nnls_solver_from_name(solver);
+	if(params.solver == -1)
+		return PyErr_Format(PyExc_ValueError, "unknown solver %s", solver);
+
+	const Py_ssize_t sequences = quikr_database_sequences(self->database);
+	const Py_ssize_t width = pow_four(quikr_database_kmer(self->database));
+
+	if(get_vector(counts_object, &counts, "QL", width, "counts") != 0)
+		return NULL;
+
+	if(start_object != Py_None) {
+		if(get_vector(start_object, &start, "d", sequences, "start") != 0) {
+			PyBuffer_Release(&counts);
+			return NULL;
+		}
+		params.start = start.buf;
+	}
+
+	double *out = malloc(sequences * sizeof(double));
+	if(out == NULL) {
+		PyBuffer_Release(&counts);
+		if(start_object != Py_None)
+			PyBuffer_Release(&start);
+		return PyErr_NoMemory();
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	code = quikr_classify(self->database, counts.buf, &params, out, &stats);
+	Py_END_ALLOW_THREADS
+
+	PyBuffer_Release(&counts);
+	if(start_object != Py_None)
+		PyBuffer_Release(&start);
+
+	if(code < 0) {
+		free(out);
+		return quikr_raise(code, 0, NULL, NULL);
+	}
+
+	if(code == QUIKR_MAX_ITERATIONS && PyErr_WarnEx(PyExc_RuntimeWarning, quikr_strerror(code), 1) != 0) {
+		free(out);
+		return NULL;
+	}
+
+	return array_new(out, 1, NULL, "d", 8, 1, sequences, 0, 0);
+}
+
+static PyObject *database_gram(DatabaseObject *self, PyObject *args, PyObject *kwds) {
+	static char *keywords[] = {"lambda_", "jobs", NULL};
+	char warning[QUIKR_ERROR_LENGTH];
+	unsigned long long lambda = 10000;
+	int jobs = 1;
+	int code = 0;
+	int saved = 0;
+
+	if(database_check(self) != 0)
+		return NULL;
+
+	if(!PyArg_ParseTupleAndKeywords(args, kwds, "|Ki", keywords, &lambda, &jobs))
+		return NULL;
+
+	Py_BEGIN_ALLOW_THREADS
+	code = quikr_database_gram(self->database, lambda, jobs, warning);
+	saved = errno;
+	Py_END_ALLOW_THREADS
+
+	if(code != QUIKR_OK)
+		return quikr_raise(code, saved, NULL, NULL);
+
+	if(warning[0] != '\0' && PyErr_WarnEx(PyExc_RuntimeWarning, warning, 1) != 0)
+		return NULL;
+
+	Py_RETURN_NONE;
+}
+
+static PyMethodDef database_methods[] = {
+	{"classify", (PyCFunction)(void(*)(void))database_classify, METH_VARARGS | METH_KEYWORDS,
+		"classify(counts, lambda_=10000, rare_percent=1.0, solver='lawson-hanson', screen=False, single=False, tolerance=1e-6, max_iterations=10000, start=None, jobs=1)\n\n"
+		"How much of each of the database's sequences is in a sample, from its uint64\n"
+		"kmer counts, as from count(). The options are quikr's."},
+	{"gram", (PyCFunction)(void(*)(void))database_gram, METH_VARARGS | METH_KEYWORDS,
+		"gram(lambda_=10000, jobs=1)\n\n"
+		"Load the gram matrix the gram and cd solvers need now, instead of on the\n"
+		"first classification."},
+	{NULL}
+};
+
+static PyGetSetDef database_getset[] = {
+	{"kmer", (getter)database_kmer, NULL, "the kmer the database was trained with", NULL},
+	{"sequences", (getter)database_sequences, NULL, "how many sequences it has", NULL},
+	{"headers", (getter)database_headers, NULL, "the sequences' headers", NULL},
+	{"layout", (getter)database_layout, NULL, "dense, kmer-major or sparse", NULL},
+	{"matrix", (getter)database_matrix, NULL,
+		"the kmer counts, read only and without a copy. sequences x 4^kmer for\n"
+		"dense databases, 4^kmer x sequences for kmer-major ones and (values,\n"
+		"columns, row pointers) of compressed sparse rows for sparse ones", NULL},
+	{NULL}
+};
+
+static PyTypeObject DatabaseType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name = "libquikr.Database",
+	.tp_basicsize = sizeof(DatabaseObject),
+	.tp_dealloc = (destructor)database_dealloc,
+	.tp_flags = Py_TPFLAGS_DEFAULT,
+	.tp_doc = "Database(path, kmer=0)\n\n"
+		"A sensing matrix trained by quikr_train, which has to be trained with kmer\n"
+		"unless that is 0. Any number of threads can classify against it at once.",
+	.tp_methods = database_methods,
+	.tp_getset = database_getset,
+	.tp_init = (initproc)database_init,
+	.tp_new = PyType_GenericNew,
+};
+
+static PyObject *libquikr_count(PyObject *module, PyObject *args, PyObject *kwds) {
+	static char *keywords[] = {"path", "kmer", "jobs", NULL};
+	PyObject *path = NULL;
+	unsigned int kmer = 6;
+	int jobs = 1;
+	unsigned long long sequences = 0;
+	unsigned long long bases = 0;
+	int code = 0;
+	int saved = 0;
+
+	if(!PyArg_ParseTupleAndKeywords(args, kwds, "O&|Ii", keywords, PyUnicode_FSConverter, &path, &kmer, &jobs))
+		return NULL;
+
+	if(kmer == 0 || kmer > 16) {
+		Py_DECREF(path);
+		return PyErr_Format(PyExc_ValueError, "kmer must be between 1 and 16");
+	}
+
+	const Py_ssize_t width = pow_four(kmer);
+
+	unsigned long long *counts = malloc((width + 1) * sizeof(unsigned long long));
+	if(counts == NULL) {
+		Py_DECREF(path);
+		return PyErr_NoMemory();
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	code = quikr_count_file(PyBytes_AS_STRING(path), kmer, jobs, counts, &sequences, &bases);
+	saved = errno;
+	Py_END_ALLOW_THREADS
+
+	if(code != QUIKR_OK) {
+		free(counts);
+		quikr_raise(code, saved, NULL, PyBytes_AS_STRING(path));
+		Py_DECREF(path);
+		return NULL;
+	}
+	Py_DECREF(path);
+
+	PyObject *array = array_new(counts, 1, NULL, "Q", 8, 1, width + 1, 0, 0);
+	if(array == NULL)
+		return NULL;
+
+	return Py_BuildValue("(NKK)", array, sequences, bases);
+}
+
+static PyObject *libquikr_nnls(PyObject *module, PyObject *args, PyObject *kwds) {
+	static char *keywords[] = {"a", "b", "solver", "tolerance", "max_iterations", "start", "jobs", NULL};
+	struct nnls_options options;
+	Py_buffer a;
+	Py_buffer b;
+	Py_buffer start;
+	PyObject *a_object = NULL;
+	PyObject *b_object = NULL;
+	PyObject *start_object = Py_None;
+	const char *solver = "lawson-hanson";
+	long long max_iterations = 0;
+	Py_ssize_t i = 0;
+	Py_ssize_t j = 0;
+
+	nnls_default_options(&options);
+	max_iterations = options.max_iterations;
+
+	if(!PyArg_ParseTupleAndKeywords(args, kwds, "OO|sdLOi", keywords, &a_object, &b_object, &solver, &options.tolerance, &max_iterations, &start_object, &options.jobs))
+		return NULL;
+
+	options.max_iterations = max_iterations;
+	options.solver = nnls_solver_from_name(solver);
+	if(options.solver != NNLS_SOLVER_LAWSON_HANSON && options.solver != NNLS_SOLVER_APG)
+		return PyErr_Format(PyExc_ValueError, "nnls solves with lawson-hanson or apg, not %s", solver);
+	if(options.tolerance <= 0 || options.max_iterations < 1 || options.jobs < 1)
+		return PyErr_Format(PyExc_ValueError, "tolerance, max_iterations and jobs must be positive");
+
+	if(PyObject_GetBuffer(a_object, &a, PyBUF_STRIDES | PyBUF_FORMAT) != 0)
+		return NULL;
+	if(a.ndim != 2 || a.itemsize != 8 || a.format == NULL || strcmp(a.format + (strchr("<@=", a.format[0]) != NULL), "d") != 0) {
+		PyBuffer_Release(&a);
+		return PyErr_Format(PyExc_TypeError, "a must be a two dimensional float64 array");
+	}
+
+	const Py_ssize_t m = a.shape[0];
+	const Py_ssize_t n = a.shape[1];
+
+	if(get_vector(b_object, &b, "d", m, "b") != 0) {
+		PyBuffer_Release(&a);
+		return NULL;
+	}
+	if(start_object != Py_None) {
+		if(get_vector(start_object, &start, "d", n, "start") != 0) {
+			PyBuffer_Release(&a);
+			PyBuffer_Release(&b);
+			return NULL;
+		}
+		options.start = start.buf;
+	}
+
+	double *x = malloc((n > 0 ? n : 1) * sizeof(double));
+	double *columns = NULL;
+
+	// the solvers take A a column at a time, which a Fortran ordered array
+	// already is
+	const double *a_columns = a.buf;
+	if(a.strides[0] != 8 || (n > 1 && a.strides[1] != m * 8)) {
+		columns = malloc((m * n > 0 ? m * n : 1) * sizeof(double));
+		if(columns != NULL)
+			for(j = 0; j < n; j++)
+				for(i = 0; i < m; i++)
+					columns[j * m + i] = *(const double *)((const char *)a.buf + i * a.strides[0] + j * a.strides[1]);
+		a_columns = columns;
+	}
+
+	if(x == NULL || a_columns == NULL) {
+		free(x);
+		free(columns);
+		PyBuffer_Release(&a);
+		PyBuffer_Release(&b);
+		if(start_object != Py_None)
+			PyBuffer_Release(&start);
+		return PyErr_NoMemory();
+	}
+
+	options.solution = x;
+	options.quiet = 1;
+
+	double *solution = NULL;
+
+	Py_BEGIN_ALLOW_THREADS
+	solution = nnls_dense(a_columns, b.buf, n, m, &options);
+	Py_END_ALLOW_THREADS
+
+	free(columns);
+	PyBuffer_Release(&a);
+	PyBuffer_Release(&b);
+	if(start_object != Py_None)
+		PyBuffer_Release(&start);
+
+	if(solution == NULL) {
+		free(x);
+		return PyErr_NoMemory();
+	}
+
+	if(options.status == 1 && PyErr_WarnEx(PyExc_RuntimeWarning, quikr_strerror(QUIKR_MAX_ITERATIONS), 1) != 0) {
+		free(x);
+		return NULL;
+	}
+
+	return array_new(x, 1, NULL, "d", 8, 1, n, 0, 0);
+}
+
+static PyMethodDef libquikr_methods[] = {
+	{"count", (PyCFunction)(void(*)(void))libquikr_count, METH_VARARGS | METH_KEYWORDS,
+		"count(path, kmer=6, jobs=1) -> (counts, sequences, bases)\n\n"
+		"Count the kmers of a fasta or fastq file, gzip'd or not, on jobs threads.\n"
+		"counts holds 4^kmer uint64 counts and then the kmers skipped for having an\n"
+		"ambiguous base."},
+	{"nnls", (PyCFunction)(void(*)(void))libquikr_nnls, METH_VARARGS | METH_KEYWORDS,
+		"nnls(a, b, solver='lawson-hanson', tolerance=1e-6, max_iterations=10000, start=None, jobs=1)\n\n"
+		"The x >= 0 minimizing |a x - b|, with the lawson-hanson or apg solver. A\n"
+		"Fortran ordered a is used without a copy."},
+	{NULL}
+};
+
+static struct PyModuleDef libquikr_module = {
+	PyModuleDef_HEAD_INIT,
+	"libquikr",
+	"Quikr's C engine: sensing matrices, kmer counting and the nnls solvers.\n"
+	"Arrays are NumPy arrays sharing libquikr's memory, or memoryviews if NumPy\n"
+	"isn't installed.",
+	-1,
+	libquikr_methods,
+};
+
+PyMODINIT_FUNC PyInit_libquikr(void) {
+	if(PyType_Ready(&BufferType) < 0 || PyType_Ready(&DatabaseType) < 0)
+		return NULL;
+
+	PyObject *module = PyModule_Create(&libquikr_module);
+	if(module == NULL)
+		return NULL;
+
+	Py_INCREF(&DatabaseType);
+	if(PyModule_AddObject(module, "Database", (PyObject *)&DatabaseType) < 0) {
+		Py_DECREF(&DatabaseType);
+		Py_DECREF(module);
+		return NULL;
+	}
+
+	PyObject *numpy = PyImport_ImportModule("numpy");
+	if(numpy != NULL) {
+		asarray = PyObject_GetAttrString(numpy, "asarray");
+		Py_DECREF(numpy);
+	}
+	PyErr_Clear();
+
+	return module;
+}
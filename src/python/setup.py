@@ -1,5 +1,17 @@
-from distutils.core import setup
+from setuptools import setup, Extension
+
+# the C engine, built by make in src/c
+libquikr = Extension('libquikr',
+                     sources=['libquikrmodule.c'],
+                     include_dirs=['../c'],
+                     extra_objects=['../c/libquikr.a'],
+                     libraries=['z', 'm'],
+                     extra_compile_args=['-std=gnu99', '-fopenmp', '-pthread'],
+                     extra_link_args=['-fopenmp', '-pthread'],
+                     )
+
 setup(name='quikr',
       version='1.0',
       py_modules=['quikr'],
+      ext_modules=[libquikr],
       )
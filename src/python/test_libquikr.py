@@ -0,0 +1,159 @@
+#!/usr/bin/env python3
+# smoke test of the libquikr extension: a database trained by quikr_train in
+# every layout, a sample counted, classified with every solver and the sensing
+# matrix viewed without a copy. Build the extension in place first with
+#   python3 setup.py build_ext --inplace
+import os
+import random
+import shutil
+import subprocess
+import sys
+import tempfile
+import threading
+import unittest
+
+here = os.path.dirname(os.path.abspath(__file__))
+sys.path.insert(0, here)
+
+import libquikr
+
+try:
+    import numpy
+except ImportError:
+    numpy = None
+
+QUIKR_TRAIN = os.path.join(here, '..', 'c', 'quikr_train')
+KMER = 4
+SEQUENCES = 12
+PRESENT = 5
+
+
+def random_sequence(rng, length):
+    return ''.join(rng.choice('ACGT') for _ in range(length))
+
+
+@unittest.skipIf(numpy is None, 'needs numpy')
+class TestLibquikr(unittest.TestCase):
+
+    @classmethod
+    def setUpClass(cls):
+        cls.directory = tempfile.mkdtemp()
+        rng = random.Random(1)
+
+        references = [random_sequence(rng, 600) for _ in range(SEQUENCES)]
+        reference = os.path.join(cls.directory, 'reference.fa')
+        with open(reference, 'w') as fh:
+            for i, sequence in enumerate(references):
+                fh.write('>sequence_%d\n%s\n' % (i, sequence))
+
+        # every read comes from one sequence
+        cls.sample = os.path.join(cls.directory, 'sample.fa')
+        with open(cls.sample, 'w') as fh:
+            for i in range(200):
+                start = rng.randrange(0, 600 - 100)
+                fh.write('>read_%d\n%s\n' % (i, references[PRESENT][start:start + 100]))
+
+        cls.databases = {}
+        for layout, flags, name in [('text', [], 'reference.gz'),
+                                    ('dense', ['-b'], 'reference.bin'),
+                                    ('kmer-major', ['-m'], 'reference.km'),
+                                    ('sparse', ['-S'], 'reference.sp')]:
+            path = os.path.join(cls.directory, name)
+            subprocess.check_call([QUIKR_TRAIN, '-i', reference, '-k', str(KMER), '-o', path] + flags,
+                                  stdout=subprocess.DEVNULL)
+            cls.databases[layout] = path
+
+    @classmethod
+    def tearDownClass(cls):
+        shutil.rmtree(cls.directory)
+
+    def dense(self, database):
+        matrix = database.matrix
+        if database.layout == 'sparse':
+            values, columns, row_ptr = matrix
+            dense = numpy.zeros((database.sequences, 4 ** KMER))
+            for row in range(database.sequences):
+                dense[row, columns[row_ptr[row]:row_ptr[row + 1]]] = values[row_ptr[row]:row_ptr[row + 1]]
+            return dense
+        if database.layout == 'kmer-major':
+            return matrix.T
+        return matrix
+
+    def test_count(self):
+        counts, sequences, bases = libquikr.count(self.sample, KMER)
+        self.assertEqual(counts.dtype, numpy.uint64)
+        self.assertEqual(counts.shape, (4 ** KMER + 1,))
+        self.assertEqual(sequences, 200)
+        self.assertEqual(bases, 200 * 100)
+        self.assertEqual(counts[:-1].sum(), 200 * (100 - KMER + 1))
+
+    def test_matrix(self):
+        expected = None
+        for layout, path in self.databases.items():
+            database = libquikr.Database(path, KMER)
+            self.assertEqual(database.layout, 'dense' if layout == 'text' else layout)
+            self.assertEqual(database.kmer, KMER)
+            self.assertEqual(database.sequences, SEQUENCES)
+            self.assertEqual(database.headers[PRESENT], 'sequence_%d' % PRESENT)
+
+            # a read only view of the database's own memory
+            matrix = database.matrix
+            for array in (matrix if layout == 'sparse' else [matrix]):
+                self.assertIsNotNone(array.base)
+                self.assertFalse(array.flags.writeable)
+
+            dense = self.dense(database)
+            if expected is None:
+                expected = numpy.array(dense)
+            self.assertTrue(numpy.allclose(dense, expected))
+
+    def test_classify(self):
+        counts, _, _ = libquikr.count(self.sample, KMER)
+        for layout, path in self.databases.items():
+            database = libquikr.Database(path, KMER)
+            for solver in ['lawson-hanson', 'gram', 'apg', 'cd']:
+                out = database.classify(counts, solver=solver, jobs=2)
+                self.assertEqual(out.shape, (SEQUENCES,))
+                self.assertAlmostEqual(out.sum(), 1.0)
+                self.assertEqual(out.argmax(), PRESENT, '%s %s' % (layout, solver))
+
+    def test_threads(self):
+        counts, _, _ = libquikr.count(self.sample, KMER)
+        database = libquikr.Database(self.databases['dense'], KMER)
+        results = [None] * 4
+
+        def classify(i):
+            results[i] = database.classify(counts)
+
+        threads = [threading.Thread(target=classify, args=(i,)) for i in range(4)]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+
+        for result in results:
+            self.assertTrue((result == results[0]).all())
+
+    def test_nnls(self):
+        rng = numpy.random.RandomState(1)
+        a = rng.rand(20, 6)
+        x = rng.rand(6)
+        for matrix in (a, numpy.asfortranarray(a)):
+            self.assertTrue(numpy.allclose(libquikr.nnls(matrix, a @ x), x))
+
+    def test_errors(self):
+        database = libquikr.Database(self.databases['dense'], KMER)
+        with self.assertRaises(RuntimeError):
+            database.__init__(self.databases['sparse'], KMER)
+        with self.assertRaises(ValueError):
+            libquikr.Database(self.databases['dense'], KMER + 1)
+        with self.assertRaises(OSError):
+            libquikr.Database(os.path.join(self.directory, 'missing.bin'))
+        with self.assertRaises(TypeError):
+            database.classify(numpy.zeros(4 ** KMER))
+        with self.assertRaises(ValueError):
+            database.classify(numpy.zeros(10, dtype=numpy.uint64))
+
+
+if __name__ == '__main__':
+    unittest.main()